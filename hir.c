@@ -0,0 +1,1596 @@
+#include "hotaru.h"
+#include "hvm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// SSA form is built straight from the AST with the algorithm from "Simple and Efficient Construction
+// of Static Single Assignment Form" by Braun et al. Variables are never stored anywhere, every read
+// looks up the value that reaches the current block and places phis where control flow merges.
+
+#define HIR_MAX_INLINE_DEPTH 32
+
+void hir_init(hIrFunc *fn)
+{
+    UT_ASSERT(fn);
+    ut_memset(fn, 0, sizeof(*fn));
+    fn->unroll_factor = HIR_DEFAULT_UNROLL_FACTOR;
+}
+
+void hir_deinit(hIrFunc *fn)
+{
+    UT_ASSERT(fn);
+    arena_free(&fn->arena);
+    ut_memset(fn, 0, sizeof(*fn));
+}
+
+static uint32_t hir_arg_count(hIrOp op)
+{
+    switch(op) {
+        case HIR_BINOP: return 2;
+        case HIR_COPY:
+        case HIR_DUMP:
+        case HIR_BRANCH:
+            return 1;
+        default: return 0;
+    }
+}
+
+static uint32_t hir_new_block(hIrFunc *fn)
+{
+    hIrBlock block;
+    ut_memset(&block, 0, sizeof(block));
+    block.term = HIR_NO_VALUE;
+    arena_da_append(&fn->arena, &fn->blocks, block);
+    return fn->blocks.count - 1;
+}
+
+static uint32_t hir_new_inst(hIrFunc *fn, uint32_t block, hIrInst inst)
+{
+    inst.block = block;
+    arena_da_append(&fn->arena, &fn->insts, inst);
+    return fn->insts.count - 1;
+}
+
+static uint32_t hir_append(hIrFunc *fn, uint32_t block, hIrInst inst)
+{
+    uint32_t id = hir_new_inst(fn, block, inst);
+    arena_da_append(&fn->arena, &fn->blocks.items[block].insts, id);
+    return id;
+}
+
+static uint32_t hir_append_op(hIrFunc *fn, uint32_t block, hIrOp op, uint32_t a, uint32_t b)
+{
+    hIrInst inst;
+    ut_memset(&inst, 0, sizeof(inst));
+    inst.op = op;
+    inst.args[0] = a;
+    inst.args[1] = b;
+    return hir_append(fn, block, inst);
+}
+
+static uint32_t hir_append_const(hIrFunc *fn, uint32_t block, int64_t value)
+{
+    hIrInst inst;
+    ut_memset(&inst, 0, sizeof(inst));
+    inst.op = HIR_CONST;
+    inst.value = value;
+    return hir_append(fn, block, inst);
+}
+
+static void hir_add_edge(hIrFunc *fn, uint32_t from, uint32_t to)
+{
+    hIrBlock *block = &fn->blocks.items[from];
+    UT_ASSERT(block->succ_count < 2);
+    block->succs[block->succ_count++] = to;
+    arena_da_append(&fn->arena, &fn->blocks.items[to].preds, from);
+}
+
+static void hir_terminate(hIrFunc *fn, uint32_t block, hIrOp op, uint32_t cond)
+{
+    UT_ASSERT(fn->blocks.items[block].term == HIR_NO_VALUE);
+    hIrInst inst;
+    ut_memset(&inst, 0, sizeof(inst));
+    inst.op = op;
+    inst.args[0] = cond;
+    fn->blocks.items[block].term = hir_new_inst(fn, block, inst);
+}
+
+static void hir_jump(hIrFunc *fn, uint32_t from, uint32_t to)
+{
+    hir_add_edge(fn, from, to);
+    hir_terminate(fn, from, HIR_JMP, 0);
+}
+
+static uint32_t hir_def_slot(const hIrBuilder *builder, uint32_t var, uint32_t block)
+{
+    uint32_t mask = builder->def_capacity - 1;
+    uint32_t hash = ((var*2654435761u) ^ block)*2246822519u;
+    uint32_t slot = (hash ^ (hash >> 15)) & mask;
+    while(builder->defs[slot].value != HIR_NO_VALUE
+            && (builder->defs[slot].var != var || builder->defs[slot].block != block)) slot = (slot + 1) & mask;
+    return slot;
+}
+
+static void hir_write_var(hIrBuilder *builder, uint32_t var, uint32_t block, uint32_t value)
+{
+    if((builder->def_count + 1)*2 > builder->def_capacity) {
+        hIrDef *old = builder->defs;
+        uint32_t old_capacity = builder->def_capacity;
+        builder->def_capacity = old_capacity == 0 ? 64 : old_capacity*2;
+        builder->defs = arena_malloc(&builder->fn->arena, sizeof(hIrDef)*builder->def_capacity);
+        for(uint32_t i = 0; i < builder->def_capacity; ++i) builder->defs[i].value = HIR_NO_VALUE;
+        // No need to deallocate the old table since this is in arena
+        for(uint32_t i = 0; i < old_capacity; ++i) {
+            if(old[i].value != HIR_NO_VALUE) builder->defs[hir_def_slot(builder, old[i].var, old[i].block)] = old[i];
+        }
+    }
+    hIrDef *def = &builder->defs[hir_def_slot(builder, var, block)];
+    if(def->value == HIR_NO_VALUE) builder->def_count += 1;
+    def->var = var;
+    def->block = block;
+    def->value = value;
+}
+
+static uint32_t hir_read_var(hIrBuilder *builder, uint32_t var, uint32_t block);
+
+static void hir_add_phi_operands(hIrBuilder *builder, uint32_t var, uint32_t phi)
+{
+    hIrFunc *fn = builder->fn;
+    uint32_t block = fn->insts.items[phi].block;
+    for(uint32_t i = 0; i < fn->blocks.items[block].preds.count; ++i) {
+        uint32_t value = hir_read_var(builder, var, fn->blocks.items[block].preds.items[i]);
+        arena_da_append(&fn->arena, &fn->insts.items[phi].phi, value);
+    }
+}
+
+static uint32_t hir_read_var(hIrBuilder *builder, uint32_t var, uint32_t block)
+{
+    hIrFunc *fn = builder->fn;
+    if(builder->def_count > 0) {
+        const hIrDef *def = &builder->defs[hir_def_slot(builder, var, block)];
+        if(def->value != HIR_NO_VALUE) return def->value;
+    }
+
+    uint32_t value;
+    hIrBlock *b = &fn->blocks.items[block];
+    if(!b->sealed) {
+        // Not all predecessors are known yet, the operands are added when the block is sealed
+        value = hir_append_op(fn, block, HIR_PHI, 0, 0);
+        hIrIncompletePhi incomplete = { .var = var, .phi = value };
+        arena_da_append(&fn->arena, &fn->blocks.items[block].incomplete, incomplete);
+    } else if(b->preds.count == 1) {
+        value = hir_read_var(builder, var, b->preds.items[0]);
+    } else if(b->preds.count == 0) {
+        // Nothing reaches this block
+        value = hir_append_const(fn, block, 0);
+    } else {
+        // Written before the operands are read to break the cycles through loops
+        value = hir_append_op(fn, block, HIR_PHI, 0, 0);
+        hir_write_var(builder, var, block, value);
+        hir_add_phi_operands(builder, var, value);
+    }
+    hir_write_var(builder, var, block, value);
+    return value;
+}
+
+static void hir_seal_block(hIrBuilder *builder, uint32_t block)
+{
+    hIrFunc *fn = builder->fn;
+    UT_ASSERT(!fn->blocks.items[block].sealed);
+    for(uint32_t i = 0; i < fn->blocks.items[block].incomplete.count; ++i) {
+        hIrIncompletePhi incomplete = fn->blocks.items[block].incomplete.items[i];
+        hir_add_phi_operands(builder, incomplete.var, incomplete.phi);
+    }
+    fn->blocks.items[block].incomplete.count = 0;
+    fn->blocks.items[block].sealed = ut_true;
+}
+
+static uint32_t hir_new_sealed_block(hIrBuilder *builder, uint32_t pred)
+{
+    uint32_t block = hir_new_block(builder->fn);
+    hir_add_edge(builder->fn, pred, block);
+    hir_seal_block(builder, block);
+    return block;
+}
+
+void hir_builder_init(hIrBuilder *builder, hIrFunc *fn, const hAst *ast)
+{
+    UT_ASSERT(builder);
+    UT_ASSERT(fn);
+    UT_ASSERT(ast);
+    ut_memset(builder, 0, sizeof(*builder));
+    builder->fn = fn;
+    builder->ast = ast;
+    builder->current = &builder->global;
+    builder->block = hir_new_block(fn);
+    fn->blocks.items[builder->block].sealed = ut_true;
+}
+
+void hir_builder_finish(hIrBuilder *builder)
+{
+    UT_ASSERT(builder);
+    hir_terminate(builder->fn, builder->block, HIR_HALT, 0);
+}
+
+static uint32_t hir_symbol(hIrBuilder *builder, StringView name)
+{
+    return hinterner_intern(&builder->symbols, name, &builder->fn->arena);
+}
+
+static hResult hir_build_expr(hIrBuilder *builder, hExprId id, uint32_t *value)
+{
+    const hExpr *expr = HAST_EXPR(builder->ast, id);
+    switch(expr->type) {
+        case HEXPR_INT_LITERAL:
+            {
+                *value = hir_append_const(builder->fn, builder->block, expr->as.int_literal);
+            } break;
+        case HEXPR_BINOP:
+            {
+                uint32_t a, b;
+                hResult res = hir_build_expr(builder, expr->as.binop.left, &a);
+                if(res != HRES_OK) return res;
+                res = hir_build_expr(builder, expr->as.binop.right, &b);
+                if(res != HRES_OK) return res;
+                *value = hir_append_op(builder->fn, builder->block, HIR_BINOP, a, b);
+                builder->fn->insts.items[*value].binop = expr->as.binop.type;
+            } break;
+        case HEXPR_VAR_READ:
+            {
+                hVarBinding *var = hscope_find(builder->current, hir_symbol(builder, expr->as.var_read.name));
+                if(!var) return HRES_INVALID_VARIABLE;
+                *value = hir_read_var(builder, var->pos, builder->block);
+            } break;
+        default:
+            UT_ASSERT(0 && "Unreachable expr in hir_build_expr()");
+            break;
+    }
+    return HRES_OK;
+}
+
+static hResult hir_build_block(hIrBuilder *builder, const hBlock block)
+{
+    hScope scope;
+    ut_memset(&scope, 0, sizeof(scope));
+    scope.prev = builder->current;
+    builder->current = &scope;
+
+    hResult res = HRES_OK;
+    for(uint32_t i = 0; i < block.count && res == HRES_OK; ++i) {
+        res = hir_build_stmt(builder, &block.items[i]);
+    }
+
+    builder->current = scope.prev;
+    return res;
+}
+
+hResult hir_build_stmt(hIrBuilder *builder, const hStmt *stmt)
+{
+    UT_ASSERT(builder);
+    UT_ASSERT(stmt);
+
+    hIrFunc *fn = builder->fn;
+    hResult res = HRES_OK;
+    switch(stmt->type) {
+        case HSTMT_VAR_INIT:
+            {
+                uint32_t value;
+                res = hir_build_expr(builder, stmt->as.var_init.value, &value);
+                if(res != HRES_OK) return res;
+                hVarBinding binding;
+                binding.name = stmt->as.var_init.name;
+                binding.symbol = hir_symbol(builder, binding.name);
+                binding.pos = builder->var_count++;
+                hscope_append(builder->current, binding, &fn->arena);
+                hir_write_var(builder, binding.pos, builder->block, value);
+            } break;
+        case HSTMT_VAR_ASSIGN:
+            {
+                hVarBinding *var = hscope_find(builder->current, hir_symbol(builder, stmt->as.var_assign.name));
+                if(!var) return HRES_INVALID_VARIABLE;
+                uint32_t value;
+                res = hir_build_expr(builder, stmt->as.var_assign.value, &value);
+                if(res != HRES_OK) return res;
+                hir_write_var(builder, var->pos, builder->block, value);
+            } break;
+        case HSTMT_WHILE:
+            {
+                // The header is sealed after the body since the body jumps back to it
+                uint32_t header = hir_new_block(fn);
+                hir_jump(fn, builder->block, header);
+                builder->block = header;
+                uint32_t cond;
+                res = hir_build_expr(builder, stmt->as._while.condition, &cond);
+                if(res != HRES_OK) return res;
+
+                builder->block = hir_new_sealed_block(builder, header);
+                res = hir_build_block(builder, stmt->as._while.body);
+                if(res != HRES_OK) return res;
+                hir_jump(fn, builder->block, header);
+                hIrLoop loop = { .header = header, .last = fn->blocks.count - 1 };
+                arena_da_append(&fn->arena, &fn->loops, loop);
+
+                builder->block = hir_new_sealed_block(builder, header);
+                hir_terminate(fn, header, HIR_BRANCH, cond);
+                hir_seal_block(builder, header);
+            } break;
+        case HSTMT_IF:
+            {
+                struct { uint32_t *items; uint32_t count; uint32_t capacity; } ends = {0};
+                hExprId condition = stmt->as._if.condition;
+                hBlock body = stmt->as._if.body;
+                for(uint32_t i = 0; i <= stmt->as._if._elif.count; ++i) {
+                    if(i > 0) {
+                        condition = stmt->as._if._elif.items[i - 1].condition;
+                        body = stmt->as._if._elif.items[i - 1].body;
+                    }
+                    uint32_t branch = builder->block;
+                    uint32_t cond;
+                    res = hir_build_expr(builder, condition, &cond);
+                    if(res != HRES_OK) return res;
+
+                    builder->block = hir_new_sealed_block(builder, branch);
+                    res = hir_build_block(builder, body);
+                    if(res != HRES_OK) return res;
+                    arena_da_append(&fn->arena, &ends, builder->block);
+
+                    builder->block = hir_new_sealed_block(builder, branch);
+                    hir_terminate(fn, branch, HIR_BRANCH, cond);
+                }
+                res = hir_build_block(builder, stmt->as._if._else);
+                if(res != HRES_OK) return res;
+                arena_da_append(&fn->arena, &ends, builder->block);
+
+                uint32_t join = hir_new_block(fn);
+                for(uint32_t i = 0; i < ends.count; ++i) hir_jump(fn, ends.items[i], join);
+                hir_seal_block(builder, join);
+                builder->block = join;
+            } break;
+        case HSTMT_BLOCK:
+            {
+                res = hir_build_block(builder, stmt->as.block);
+            } break;
+        case HSTMT_DUMP:
+            {
+                uint32_t value;
+                res = hir_build_expr(builder, stmt->as.dump, &value);
+                if(res != HRES_OK) return res;
+                hir_append_op(fn, builder->block, HIR_DUMP, value, 0);
+            } break;
+        default:
+            {
+                UT_ASSERT(0 && "Unreachable stmt in hir_build_stmt()");
+            } break;
+    }
+
+    return res;
+}
+
+static uint32_t hir_resolve(const hIrFunc *fn, uint32_t value)
+{
+    while(fn->insts.items[value].op == HIR_COPY) value = fn->insts.items[value].args[0];
+    return value;
+}
+
+// Every use of a copy is replaced by its source and phis that merge a single value become copies.
+// Copies themselves are left for hir_dce().
+void hir_copy_propagate(hIrFunc *fn)
+{
+    UT_ASSERT(fn);
+    ut_bool changed = ut_true;
+    while(changed) {
+        changed = ut_false;
+        for(uint32_t i = 0; i < fn->insts.count; ++i) {
+            hIrInst *inst = &fn->insts.items[i];
+            if(inst->op == HIR_NONE || inst->op == HIR_COPY) continue;
+            for(uint32_t j = 0; j < hir_arg_count(inst->op); ++j) inst->args[j] = hir_resolve(fn, inst->args[j]);
+            if(inst->op != HIR_PHI) continue;
+
+            uint32_t same = HIR_NO_VALUE;
+            ut_bool trivial = ut_true;
+            for(uint32_t j = 0; j < inst->phi.count; ++j) {
+                uint32_t value = hir_resolve(fn, inst->phi.items[j]);
+                inst->phi.items[j] = value;
+                if(value == i || value == same) continue;
+                if(same != HIR_NO_VALUE) trivial = ut_false;
+                same = value;
+            }
+            if(!trivial) continue;
+            if(same == HIR_NO_VALUE) {
+                // Only refers to itself so it's never reached
+                inst->op = HIR_CONST;
+                inst->value = 0;
+            } else {
+                inst->op = HIR_COPY;
+                inst->args[0] = same;
+            }
+            inst->phi.count = 0;
+            changed = ut_true;
+        }
+    }
+}
+
+typedef enum hIrLattice {
+    HIR_LATTICE_UNKNOWN = 0,
+    HIR_LATTICE_CONST,
+    HIR_LATTICE_VARYING,
+} hIrLattice;
+
+typedef struct hIrSccp {
+    hIrFunc *fn;
+    Arena arena;
+    uint8_t *lattice;
+    int64_t *values;
+    uint8_t *executable;
+    // Whether the edge from the i-th predecessor is executable, starting at edge_start[block]
+    uint8_t *edges;
+    uint32_t *edge_start;
+    // Instructions using every value, starting at user_start[value]
+    uint32_t *users;
+    uint32_t *user_start;
+    struct { uint32_t *items; uint32_t count; uint32_t capacity; } work;
+} hIrSccp;
+
+// Values only ever move down the lattice, unknown -> constant -> varying
+static void hir_sccp_set(hIrSccp *sccp, uint32_t value, hIrLattice lattice, int64_t constant)
+{
+    hIrLattice old = sccp->lattice[value];
+    if(old == HIR_LATTICE_CONST && lattice == HIR_LATTICE_CONST) {
+        if(sccp->values[value] == constant) return;
+        lattice = HIR_LATTICE_VARYING;
+    } else if(lattice <= old) {
+        return;
+    }
+    sccp->lattice[value] = (uint8_t)lattice;
+    sccp->values[value] = constant;
+    for(uint32_t i = sccp->user_start[value]; i < sccp->user_start[value + 1]; ++i) {
+        arena_da_append(&sccp->arena, &sccp->work, sccp->users[i]);
+    }
+}
+
+static void hir_sccp_visit(hIrSccp *sccp, uint32_t id);
+
+static void hir_sccp_mark_edge(hIrSccp *sccp, uint32_t from, uint32_t to)
+{
+    hIrFunc *fn = sccp->fn;
+    hIrBlock *block = &fn->blocks.items[to];
+    ut_bool marked = ut_false;
+    for(uint32_t i = 0; i < block->preds.count; ++i) {
+        uint8_t *edge = &sccp->edges[sccp->edge_start[to] + i];
+        if(block->preds.items[i] != from || *edge) continue;
+        *edge = 1;
+        marked = ut_true;
+    }
+    if(!marked) return;
+
+    if(!sccp->executable[to]) {
+        sccp->executable[to] = 1;
+        for(uint32_t i = 0; i < block->insts.count; ++i) hir_sccp_visit(sccp, block->insts.items[i]);
+        if(block->term != HIR_NO_VALUE) hir_sccp_visit(sccp, block->term);
+        return;
+    }
+    // Only the phis can change by another incoming edge
+    for(uint32_t i = 0; i < block->insts.count; ++i) {
+        if(fn->insts.items[block->insts.items[i]].op == HIR_PHI) hir_sccp_visit(sccp, block->insts.items[i]);
+    }
+}
+
+static void hir_sccp_visit(hIrSccp *sccp, uint32_t id)
+{
+    hIrFunc *fn = sccp->fn;
+    hIrInst inst = fn->insts.items[id];
+    if(!sccp->executable[inst.block]) return;
+
+    switch(inst.op) {
+        case HIR_CONST:
+            {
+                hir_sccp_set(sccp, id, HIR_LATTICE_CONST, inst.value);
+            } break;
+        case HIR_COPY:
+            {
+                hir_sccp_set(sccp, id, sccp->lattice[inst.args[0]], sccp->values[inst.args[0]]);
+            } break;
+        case HIR_BINOP:
+            {
+                hIrLattice a = sccp->lattice[inst.args[0]];
+                hIrLattice b = sccp->lattice[inst.args[1]];
+                if(a == HIR_LATTICE_VARYING || b == HIR_LATTICE_VARYING) {
+                    hir_sccp_set(sccp, id, HIR_LATTICE_VARYING, 0);
+                } else if(a == HIR_LATTICE_CONST && b == HIR_LATTICE_CONST) {
+                    hir_sccp_set(sccp, id, HIR_LATTICE_CONST,
+                            hbinop_eval(inst.binop, sccp->values[inst.args[0]], sccp->values[inst.args[1]]));
+                }
+            } break;
+        case HIR_PHI:
+            {
+                for(uint32_t i = 0; i < inst.phi.count; ++i) {
+                    if(!sccp->edges[sccp->edge_start[inst.block] + i]) continue;
+                    uint32_t value = inst.phi.items[i];
+                    if(sccp->lattice[value] == HIR_LATTICE_UNKNOWN) continue;
+                    hir_sccp_set(sccp, id, sccp->lattice[value], sccp->values[value]);
+                }
+            } break;
+        case HIR_JMP:
+            {
+                hir_sccp_mark_edge(sccp, inst.block, fn->blocks.items[inst.block].succs[0]);
+            } break;
+        case HIR_BRANCH:
+            {
+                const hIrBlock *block = &fn->blocks.items[inst.block];
+                uint32_t succs[2] = { block->succs[0], block->succs[1] };
+                hIrLattice cond = sccp->lattice[inst.args[0]];
+                if(cond == HIR_LATTICE_CONST) {
+                    hir_sccp_mark_edge(sccp, inst.block, succs[sccp->values[inst.args[0]] != 0 ? 0 : 1]);
+                } else if(cond == HIR_LATTICE_VARYING) {
+                    hir_sccp_mark_edge(sccp, inst.block, succs[0]);
+                    hir_sccp_mark_edge(sccp, inst.block, succs[1]);
+                }
+            } break;
+        default:
+            break;
+    }
+}
+
+// Sparse conditional constant propagation (Wegman and Zadeck). Values that are constant on every
+// path that can run become constants, branches on them become jumps and the blocks that are never
+// reached are removed.
+void hir_sccp(hIrFunc *fn)
+{
+    UT_ASSERT(fn);
+    if(fn->blocks.count == 0) return;
+
+    hIrSccp sccp;
+    ut_memset(&sccp, 0, sizeof(sccp));
+    sccp.fn = fn;
+    uint32_t count = fn->insts.count;
+    sccp.lattice = arena_malloc(&sccp.arena, count);
+    sccp.values = arena_malloc(&sccp.arena, sizeof(int64_t)*count);
+    sccp.executable = arena_malloc(&sccp.arena, fn->blocks.count);
+    sccp.edge_start = arena_malloc(&sccp.arena, sizeof(uint32_t)*(fn->blocks.count + 1));
+    sccp.user_start = arena_malloc(&sccp.arena, sizeof(uint32_t)*(count + 1));
+    ut_memset(sccp.lattice, 0, count);
+    ut_memset(sccp.values, 0, sizeof(int64_t)*count);
+    ut_memset(sccp.executable, 0, fn->blocks.count);
+    ut_memset(sccp.user_start, 0, sizeof(uint32_t)*(count + 1));
+
+    uint32_t edge_count = 0;
+    for(uint32_t i = 0; i < fn->blocks.count; ++i) {
+        sccp.edge_start[i] = edge_count;
+        edge_count += fn->blocks.items[i].preds.count;
+    }
+    sccp.edge_start[fn->blocks.count] = edge_count;
+    sccp.edges = arena_malloc(&sccp.arena, edge_count + 1);
+    ut_memset(sccp.edges, 0, edge_count + 1);
+
+    // Users are counted first and filled in afterwards so they're stored contiguously
+    for(uint32_t i = 0; i < count; ++i) {
+        const hIrInst *inst = &fn->insts.items[i];
+        if(inst->op == HIR_NONE) continue;
+        for(uint32_t j = 0; j < hir_arg_count(inst->op); ++j) sccp.user_start[inst->args[j] + 1] += 1;
+        for(uint32_t j = 0; j < inst->phi.count; ++j) sccp.user_start[inst->phi.items[j] + 1] += 1;
+    }
+    for(uint32_t i = 0; i < count; ++i) sccp.user_start[i + 1] += sccp.user_start[i];
+    sccp.users = arena_malloc(&sccp.arena, sizeof(uint32_t)*(sccp.user_start[count] + 1));
+    uint32_t *fill = arena_malloc(&sccp.arena, sizeof(uint32_t)*(count + 1));
+    ut_memcpy(fill, sccp.user_start, sizeof(uint32_t)*(count + 1));
+    for(uint32_t i = 0; i < count; ++i) {
+        const hIrInst *inst = &fn->insts.items[i];
+        if(inst->op == HIR_NONE) continue;
+        for(uint32_t j = 0; j < hir_arg_count(inst->op); ++j) sccp.users[fill[inst->args[j]]++] = i;
+        for(uint32_t j = 0; j < inst->phi.count; ++j) sccp.users[fill[inst->phi.items[j]]++] = i;
+    }
+
+    // The entry block has no predecessors so it's entered by hand
+    sccp.executable[0] = 1;
+    for(uint32_t i = 0; i < fn->blocks.items[0].insts.count; ++i) hir_sccp_visit(&sccp, fn->blocks.items[0].insts.items[i]);
+    if(fn->blocks.items[0].term != HIR_NO_VALUE) hir_sccp_visit(&sccp, fn->blocks.items[0].term);
+    while(sccp.work.count > 0) {
+        uint32_t id = sccp.work.items[--sccp.work.count];
+        hir_sccp_visit(&sccp, id);
+    }
+
+    for(uint32_t b = 0; b < fn->blocks.count; ++b) {
+        hIrBlock *block = &fn->blocks.items[b];
+        if(!sccp.executable[b]) {
+            for(uint32_t i = 0; i < block->insts.count; ++i) fn->insts.items[block->insts.items[i]].op = HIR_NONE;
+            if(block->term != HIR_NO_VALUE) fn->insts.items[block->term].op = HIR_NONE;
+            block->insts.count = 0;
+            block->preds.count = 0;
+            block->succ_count = 0;
+            block->term = HIR_NO_VALUE;
+            block->dead = ut_true;
+            continue;
+        }
+
+        for(uint32_t i = 0; i < block->insts.count; ++i) {
+            uint32_t id = block->insts.items[i];
+            hIrInst *inst = &fn->insts.items[id];
+            if(sccp.lattice[id] != HIR_LATTICE_CONST) continue;
+            if(inst->op != HIR_BINOP && inst->op != HIR_PHI && inst->op != HIR_COPY) continue;
+            inst->op = HIR_CONST;
+            inst->value = sccp.values[id];
+            inst->phi.count = 0;
+        }
+
+        // Drop the incoming edges that never run, the phi operands go with them
+        uint32_t kept = 0;
+        for(uint32_t i = 0; i < block->preds.count; ++i) {
+            if(!sccp.edges[sccp.edge_start[b] + i]) continue;
+            for(uint32_t j = 0; j < block->insts.count; ++j) {
+                hIrInst *inst = &fn->insts.items[block->insts.items[j]];
+                if(inst->op == HIR_PHI) inst->phi.items[kept] = inst->phi.items[i];
+            }
+            block->preds.items[kept++] = block->preds.items[i];
+        }
+        for(uint32_t j = 0; j < block->insts.count; ++j) {
+            hIrInst *inst = &fn->insts.items[block->insts.items[j]];
+            if(inst->op == HIR_PHI) inst->phi.count = kept;
+        }
+        block->preds.count = kept;
+    }
+
+    // Branches keep only the successors that are still reached through them
+    for(uint32_t b = 0; b < fn->blocks.count; ++b) {
+        hIrBlock *block = &fn->blocks.items[b];
+        if(block->dead || block->term == HIR_NO_VALUE) continue;
+        hIrInst *term = &fn->insts.items[block->term];
+        uint32_t succs[2];
+        uint32_t succ_count = 0;
+        for(uint32_t i = 0; i < block->succ_count; ++i) {
+            const hIrBlock *succ = &fn->blocks.items[block->succs[i]];
+            for(uint32_t j = 0; j < succ->preds.count; ++j) {
+                if(succ->preds.items[j] == b) {
+                    succs[succ_count++] = block->succs[i];
+                    break;
+                }
+            }
+        }
+        if(term->op == HIR_BRANCH && succ_count == 1) {
+            term->op = HIR_JMP;
+        } else if(succ_count == 0) {
+            term->op = HIR_HALT;
+        }
+        for(uint32_t i = 0; i < succ_count; ++i) block->succs[i] = succs[i];
+        block->succ_count = succ_count;
+    }
+
+    arena_free(&sccp.arena);
+}
+
+// Removes everything that doesn't contribute to a dump or to the control flow
+void hir_dce(hIrFunc *fn)
+{
+    UT_ASSERT(fn);
+    Arena a;
+    ut_memset(&a, 0, sizeof(a));
+    uint32_t count = fn->insts.count;
+    uint8_t *live = arena_malloc(&a, count + 1);
+    ut_memset(live, 0, count + 1);
+    struct { uint32_t *items; uint32_t count; uint32_t capacity; } work = {0};
+
+    for(uint32_t i = 0; i < count; ++i) {
+        hIrOp op = fn->insts.items[i].op;
+        if(op == HIR_DUMP || op == HIR_JMP || op == HIR_BRANCH || op == HIR_HALT) {
+            live[i] = 1;
+            arena_da_append(&a, &work, i);
+        }
+    }
+    while(work.count > 0) {
+        const hIrInst *inst = &fn->insts.items[work.items[--work.count]];
+        uint32_t arg_count = hir_arg_count(inst->op);
+        for(uint32_t j = 0; j < arg_count + inst->phi.count; ++j) {
+            uint32_t value = j < arg_count ? inst->args[j] : inst->phi.items[j - arg_count];
+            if(live[value]) continue;
+            live[value] = 1;
+            arena_da_append(&a, &work, value);
+        }
+    }
+
+    for(uint32_t i = 0; i < count; ++i) {
+        if(!live[i]) fn->insts.items[i].op = HIR_NONE;
+    }
+    for(uint32_t b = 0; b < fn->blocks.count; ++b) {
+        hIrBlock *block = &fn->blocks.items[b];
+        uint32_t kept = 0;
+        for(uint32_t i = 0; i < block->insts.count; ++i) {
+            if(fn->insts.items[block->insts.items[i]].op != HIR_NONE) block->insts.items[kept++] = block->insts.items[i];
+        }
+        block->insts.count = kept;
+    }
+    arena_free(&a);
+}
+
+// The builder creates every block after the blocks that dominate it, so the index of a block is used
+// as its position in the order from "A Simple, Fast Dominance Algorithm" by Cooper et al.
+static void hir_dominators(const hIrFunc *fn, uint32_t *idom)
+{
+    for(uint32_t b = 0; b < fn->blocks.count; ++b) idom[b] = HIR_NO_VALUE;
+    idom[0] = 0;
+    ut_bool changed = ut_true;
+    while(changed) {
+        changed = ut_false;
+        for(uint32_t b = 1; b < fn->blocks.count; ++b) {
+            const hIrBlock *block = &fn->blocks.items[b];
+            if(block->dead) continue;
+            uint32_t dom = HIR_NO_VALUE;
+            for(uint32_t i = 0; i < block->preds.count; ++i) {
+                uint32_t pred = block->preds.items[i];
+                if(idom[pred] == HIR_NO_VALUE) continue;
+                if(dom == HIR_NO_VALUE) {
+                    dom = pred;
+                    continue;
+                }
+                while(dom != pred) {
+                    while(dom > pred) dom = idom[dom];
+                    while(pred > dom) pred = idom[pred];
+                }
+            }
+            if(dom != idom[b]) {
+                idom[b] = dom;
+                changed = ut_true;
+            }
+        }
+    }
+}
+
+static ut_bool hir_dominates(const uint32_t *idom, uint32_t a, uint32_t b)
+{
+    while(b > a) b = idom[b];
+    return a == b;
+}
+
+static ut_bool hir_is_commutative(hBinOpType type)
+{
+    return type == HBINOP_ADD || type == HBINOP_MUL || type == HBINOP_EQ || type == HBINOP_NE;
+}
+
+static uint32_t hir_value_hash(const hIrInst *inst)
+{
+    uint64_t hash = 14695981039346656037ull;
+    hash = (hash ^ inst->binop)*1099511628211ull;
+    hash = (hash ^ inst->args[0])*1099511628211ull;
+    hash = (hash ^ inst->args[1])*1099511628211ull;
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// Global value numbering. A binop that computes the same thing as one in a block dominating it
+// becomes a copy of that one, which hir_copy_propagate() then removes.
+void hir_gvn(hIrFunc *fn)
+{
+    UT_ASSERT(fn);
+    Arena a;
+    ut_memset(&a, 0, sizeof(a));
+    uint32_t *idom = arena_malloc(&a, sizeof(uint32_t)*(fn->blocks.count + 1));
+    hir_dominators(fn, idom);
+
+    // Open addressing, a value can have a leader in more than one block that don't dominate each other
+    uint32_t capacity = 16;
+    while(capacity < fn->insts.count*2) capacity *= 2;
+    uint32_t *table = arena_malloc(&a, sizeof(uint32_t)*capacity);
+    for(uint32_t i = 0; i < capacity; ++i) table[i] = HIR_NO_VALUE;
+
+    for(uint32_t b = 0; b < fn->blocks.count; ++b) {
+        const hIrBlock *block = &fn->blocks.items[b];
+        if(block->dead || idom[b] == HIR_NO_VALUE) continue;
+        for(uint32_t i = 0; i < block->insts.count; ++i) {
+            uint32_t id = block->insts.items[i];
+            hIrInst *inst = &fn->insts.items[id];
+            if(inst->op != HIR_BINOP) continue;
+            inst->args[0] = hir_resolve(fn, inst->args[0]);
+            inst->args[1] = hir_resolve(fn, inst->args[1]);
+            if(hir_is_commutative(inst->binop) && inst->args[0] > inst->args[1]) {
+                uint32_t tmp = inst->args[0];
+                inst->args[0] = inst->args[1];
+                inst->args[1] = tmp;
+            }
+
+            uint32_t slot = hir_value_hash(inst) & (capacity - 1);
+            uint32_t leader = HIR_NO_VALUE;
+            for(; table[slot] != HIR_NO_VALUE; slot = (slot + 1) & (capacity - 1)) {
+                const hIrInst *other = &fn->insts.items[table[slot]];
+                if(other->binop == inst->binop && other->args[0] == inst->args[0] && other->args[1] == inst->args[1]
+                        && hir_dominates(idom, other->block, b)) {
+                    leader = table[slot];
+                    break;
+                }
+            }
+            if(leader == HIR_NO_VALUE) {
+                table[slot] = id;
+            } else {
+                inst->op = HIR_COPY;
+                inst->args[0] = leader;
+            }
+        }
+    }
+    arena_free(&a);
+}
+
+// Loop optimizations. Inner loops are listed before the loops around them so code hoisted out of
+// an inner loop can keep moving out of the outer one.
+#define HIR_MAX_UNROLL_INSTS 64
+#define HIR_MAX_TRIP_COUNT (1u << 20)
+
+static ut_bool hir_in_loop(hIrLoop loop, uint32_t block)
+{
+    return block >= loop.header && block <= loop.last;
+}
+
+// Finds the only edge into the loop and the only edge back to its header, as indices in the
+// predecessors of the header
+static ut_bool hir_loop_edges(const hIrFunc *fn, hIrLoop loop, uint32_t *entry, uint32_t *latch)
+{
+    const hIrBlock *header = &fn->blocks.items[loop.header];
+    if(header->dead || header->preds.count != 2) return ut_false;
+    uint32_t outside = hir_in_loop(loop, header->preds.items[0]) ? 1 : 0;
+    if(hir_in_loop(loop, header->preds.items[outside]) || !hir_in_loop(loop, header->preds.items[1 - outside])) return ut_false;
+    // Code can only be moved to the block before the loop when it always continues into the loop
+    if(fn->blocks.items[header->preds.items[outside]].succ_count != 1) return ut_false;
+    *entry = outside;
+    *latch = 1 - outside;
+    return ut_true;
+}
+
+// Moves the computations that give the same result in every iteration in front of the loop. They
+// can't fail so it doesn't matter when the loop doesn't run at all.
+void hir_licm(hIrFunc *fn)
+{
+    UT_ASSERT(fn);
+    for(uint32_t l = 0; l < fn->loops.count; ++l) {
+        hIrLoop loop = fn->loops.items[l];
+        uint32_t entry, latch;
+        if(!hir_loop_edges(fn, loop, &entry, &latch)) continue;
+        uint32_t preheader = fn->blocks.items[loop.header].preds.items[entry];
+
+        for(uint32_t b = loop.header; b <= loop.last; ++b) {
+            hIrBlock *block = &fn->blocks.items[b];
+            if(block->dead) continue;
+            uint32_t kept = 0;
+            for(uint32_t i = 0; i < block->insts.count; ++i) {
+                uint32_t id = block->insts.items[i];
+                hIrInst *inst = &fn->insts.items[id];
+                ut_bool invariant = inst->op == HIR_CONST || (inst->op == HIR_BINOP
+                        && !hir_in_loop(loop, fn->insts.items[inst->args[0]].block)
+                        && !hir_in_loop(loop, fn->insts.items[inst->args[1]].block));
+                if(!invariant) {
+                    block->insts.items[kept++] = id;
+                    continue;
+                }
+                inst->block = preheader;
+                arena_da_append(&fn->arena, &fn->blocks.items[preheader].insts, id);
+            }
+            block->insts.count = kept;
+        }
+    }
+}
+
+static ut_bool hir_is_const(const hIrFunc *fn, uint32_t value, int64_t *constant)
+{
+    if(fn->insts.items[value].op != HIR_CONST) return ut_false;
+    *constant = fn->insts.items[value].value;
+    return ut_true;
+}
+
+// Matches `base + offset`, `offset + base` and `base - offset` where offset is a constant
+static ut_bool hir_offset(const hIrFunc *fn, const hIrInst *inst, uint32_t *base, int64_t *offset)
+{
+    if(inst->op != HIR_BINOP) return ut_false;
+    if(inst->binop == HBINOP_ADD && hir_is_const(fn, inst->args[1], offset)) {
+        *base = inst->args[0];
+        return ut_true;
+    }
+    if(inst->binop == HBINOP_ADD && hir_is_const(fn, inst->args[0], offset)) {
+        *base = inst->args[1];
+        return ut_true;
+    }
+    if(inst->binop == HBINOP_SUB && hir_is_const(fn, inst->args[1], offset)) {
+        *base = inst->args[0];
+        *offset = hbinop_eval(HBINOP_SUB, 0, *offset);
+        return ut_true;
+    }
+    return ut_false;
+}
+
+// A phi in the header that goes up by a constant in every iteration
+static ut_bool hir_induction_step(const hIrFunc *fn, uint32_t phi, uint32_t latch, int64_t *step)
+{
+    const hIrInst *inst = &fn->insts.items[phi];
+    if(inst->op != HIR_PHI || inst->phi.count != 2) return ut_false;
+    uint32_t base;
+    return hir_offset(fn, &fn->insts.items[inst->phi.items[latch]], &base, step) && base == phi;
+}
+
+// Every `i * k` where i is an induction variable and k a constant becomes a new induction variable
+// that goes up by the step of i times k, so the multiplication turns into an addition.
+void hir_strength_reduce(hIrFunc *fn)
+{
+    UT_ASSERT(fn);
+    for(uint32_t l = 0; l < fn->loops.count; ++l) {
+        hIrLoop loop = fn->loops.items[l];
+        uint32_t entry, latch;
+        if(!hir_loop_edges(fn, loop, &entry, &latch)) continue;
+        uint32_t preheader = fn->blocks.items[loop.header].preds.items[entry];
+        uint32_t back = fn->blocks.items[loop.header].preds.items[latch];
+
+        for(uint32_t h = 0; h < fn->blocks.items[loop.header].insts.count; ++h) {
+            uint32_t phi = fn->blocks.items[loop.header].insts.items[h];
+            int64_t step;
+            if(!hir_induction_step(fn, phi, latch, &step)) continue;
+
+            for(uint32_t b = loop.header; b <= loop.last; ++b) {
+                // The blocks grow while the new variables are added, nothing in there is a multiplication
+                for(uint32_t i = 0; i < fn->blocks.items[b].insts.count; ++i) {
+                    uint32_t id = fn->blocks.items[b].insts.items[i];
+                    hIrInst inst = fn->insts.items[id];
+                    int64_t k;
+                    if(inst.op != HIR_BINOP || inst.binop != HBINOP_MUL) continue;
+                    if(!(inst.args[0] == phi && hir_is_const(fn, inst.args[1], &k))
+                            && !(inst.args[1] == phi && hir_is_const(fn, inst.args[0], &k))) continue;
+
+                    int64_t init;
+                    uint32_t start;
+                    uint32_t first = fn->insts.items[phi].phi.items[entry];
+                    if(hir_is_const(fn, first, &init)) {
+                        start = hir_append_const(fn, preheader, hbinop_eval(HBINOP_MUL, init, k));
+                    } else {
+                        uint32_t factor = hir_append_const(fn, preheader, k);
+                        start = hir_append_op(fn, preheader, HIR_BINOP, first, factor);
+                        fn->insts.items[start].binop = HBINOP_MUL;
+                    }
+                    uint32_t reduced = hir_append_op(fn, loop.header, HIR_PHI, 0, 0);
+                    uint32_t increment = hir_append_const(fn, back, hbinop_eval(HBINOP_MUL, step, k));
+                    uint32_t next = hir_append_op(fn, back, HIR_BINOP, reduced, increment);
+                    fn->insts.items[next].binop = HBINOP_ADD;
+                    arena_da_append(&fn->arena, &fn->insts.items[reduced].phi, entry == 0 ? start : next);
+                    arena_da_append(&fn->arena, &fn->insts.items[reduced].phi, entry == 0 ? next : start);
+
+                    fn->insts.items[id].op = HIR_COPY;
+                    fn->insts.items[id].args[0] = reduced;
+                }
+            }
+        }
+    }
+}
+
+// Evaluates a value of the loop header given the value of one of its phis
+static ut_bool hir_eval_in_header(const hIrFunc *fn, uint32_t header, uint32_t value, uint32_t phi, int64_t phi_value, int64_t *out)
+{
+    const hIrInst *inst = &fn->insts.items[value];
+    if(value == phi) {
+        *out = phi_value;
+        return ut_true;
+    }
+    if(inst->op == HIR_CONST) {
+        *out = inst->value;
+        return ut_true;
+    }
+    if(inst->op != HIR_BINOP || inst->block != header) return ut_false;
+    int64_t a, b;
+    if(!hir_eval_in_header(fn, header, inst->args[0], phi, phi_value, &a)) return ut_false;
+    if(!hir_eval_in_header(fn, header, inst->args[1], phi, phi_value, &b)) return ut_false;
+    *out = hbinop_eval(inst->binop, a, b);
+    return ut_true;
+}
+
+// Iterations of `phi < limit` where phi starts at init and goes up by step, without the last value
+// wrapping around
+static ut_bool hir_count_up(int64_t init, int64_t step, int64_t limit, uint64_t *trips)
+{
+    if(step <= 0 || limit > INT64_MAX - step) return ut_false;
+    if(init >= limit) {
+        *trips = 0;
+        return ut_true;
+    }
+    uint64_t distance = (uint64_t)limit - (uint64_t)init;
+    *trips = distance/(uint64_t)step + (distance%(uint64_t)step != 0);
+    return ut_true;
+}
+
+// The amount of times the body of the loop runs, when the header compares an induction variable
+// with a constant start against a constant. Conditions that aren't a plain comparison are
+// simulated for a limited amount of iterations.
+static ut_bool hir_trip_count(const hIrFunc *fn, hIrLoop loop, uint32_t entry, uint32_t latch, uint64_t *trips)
+{
+    const hIrBlock *header = &fn->blocks.items[loop.header];
+    uint32_t cond = fn->insts.items[header->term].args[0];
+    const hIrInst *compare = &fn->insts.items[cond];
+    for(uint32_t h = 0; h < header->insts.count; ++h) {
+        uint32_t phi = header->insts.items[h];
+        int64_t step = 0, init = 0, limit = 0, taken = 0;
+        if(!hir_induction_step(fn, phi, latch, &step)) continue;
+        if(!hir_is_const(fn, fn->insts.items[phi].phi.items[entry], &init)) continue;
+
+        if(compare->op == HIR_BINOP && (compare->args[0] == phi || compare->args[1] == phi)) {
+            hBinOpType type = compare->binop;
+            ut_bool limited = hir_is_const(fn, compare->args[compare->args[0] == phi ? 1 : 0], &limit);
+            if(compare->args[1] == phi) {
+                // `limit > phi` is `phi < limit`
+                if(type == HBINOP_GT) type = HBINOP_LT;
+                else if(type == HBINOP_GE) type = HBINOP_LE;
+                else if(type == HBINOP_LT) type = HBINOP_GT;
+                else if(type == HBINOP_LE) type = HBINOP_GE;
+            }
+            if(limited && type == HBINOP_LE && limit < INT64_MAX) {
+                type = HBINOP_LT;
+                limit += 1;
+            } else if(limited && type == HBINOP_GE && limit > INT64_MIN) {
+                type = HBINOP_GT;
+                limit -= 1;
+            }
+            // Counting down is counting up with everything negated
+            if(limited && type == HBINOP_LT && hir_count_up(init, step, limit, trips)) return ut_true;
+            if(limited && type == HBINOP_GT && init > INT64_MIN && step > INT64_MIN && limit > INT64_MIN
+                    && hir_count_up(-init, -step, -limit, trips)) return ut_true;
+        }
+
+        for(uint64_t count = 0; count <= HIR_MAX_TRIP_COUNT; ++count) {
+            if(!hir_eval_in_header(fn, loop.header, cond, phi, init, &taken)) break;
+            if(!taken) {
+                *trips = count;
+                return ut_true;
+            }
+            init = hbinop_eval(HBINOP_ADD, init, step);
+        }
+    }
+    return ut_false;
+}
+
+typedef struct hIrMapping {
+    uint32_t from;
+    uint32_t to;
+} hIrMapping;
+
+typedef struct hIrValueMap {
+    hIrMapping *items;
+    uint32_t count;
+    uint32_t capacity;
+} hIrValueMap;
+
+static uint32_t hir_map_value(const hIrValueMap *map, uint32_t value)
+{
+    for(uint32_t i = map->count; i > 0; --i) {
+        if(map->items[i - 1].from == value) return map->items[i - 1].to;
+    }
+    return value;
+}
+
+// `(x + c) + d` becomes `x + (c + d)` so the counters in the copies of an unrolled loop don't depend
+// on each other
+static void hir_combine_offsets(hIrFunc *fn, uint32_t block, hIrInst *inst)
+{
+    uint32_t value, base;
+    int64_t outer, inner;
+    if(!hir_offset(fn, inst, &value, &outer) || !hir_offset(fn, &fn->insts.items[value], &base, &inner)) return;
+    inst->binop = HBINOP_ADD;
+    inst->args[0] = base;
+    inst->args[1] = hir_append_const(fn, block, hbinop_eval(HBINOP_ADD, inner, outer));
+}
+
+// Loops made of a header and a single block whose amount of iterations is known are unrolled by the
+// largest factor up to `factor` that divides it, so the condition is still checked at the right time.
+void hir_unroll(hIrFunc *fn, uint32_t factor)
+{
+    UT_ASSERT(fn);
+    if(factor < 2) return;
+    Arena a;
+    ut_memset(&a, 0, sizeof(a));
+
+    for(uint32_t l = 0; l < fn->loops.count; ++l) {
+        hIrLoop loop = fn->loops.items[l];
+        uint32_t entry, latch;
+        if(loop.last != loop.header + 1 || !hir_loop_edges(fn, loop, &entry, &latch)) continue;
+        uint32_t body = loop.last;
+        const hIrBlock *header = &fn->blocks.items[loop.header];
+        if(fn->insts.items[header->term].op != HIR_BRANCH || header->succs[0] != body) continue;
+        if(fn->blocks.items[body].preds.count != 1 || fn->insts.items[fn->blocks.items[body].term].op != HIR_JMP) continue;
+
+        uint64_t trips;
+        if(!hir_trip_count(fn, loop, entry, latch, &trips) || trips < 2) continue;
+
+        struct { uint32_t *items; uint32_t count; uint32_t capacity; } phis = {0}, code = {0}, nexts = {0};
+        for(uint32_t h = 0; h < header->insts.count; ++h) {
+            uint32_t id = header->insts.items[h];
+            if(fn->insts.items[id].op == HIR_PHI) {
+                arena_da_append(&a, &phis, id);
+                arena_da_append(&a, &nexts, fn->insts.items[id].phi.items[latch]);
+            } else {
+                arena_da_append(&a, &code, id);
+            }
+        }
+        for(uint32_t i = 0; i < fn->blocks.items[body].insts.count; ++i) {
+            arena_da_append(&a, &code, fn->blocks.items[body].insts.items[i]);
+        }
+
+        uint32_t unroll = 0;
+        for(uint32_t f = (uint32_t)UT_MIN((uint64_t)factor, trips); f >= 2 && unroll == 0; --f) {
+            if(trips % f == 0 && code.count*f <= HIR_MAX_UNROLL_INSTS) unroll = f;
+        }
+        if(unroll == 0) continue;
+
+        // Every copy starts from the values the previous one passes to the header
+        uint32_t *current = arena_malloc(&a, sizeof(uint32_t)*(nexts.count + 1));
+        for(uint32_t i = 0; i < nexts.count; ++i) current[i] = nexts.items[i];
+        hIrValueMap map = {0};
+        for(uint32_t copy = 1; copy < unroll; ++copy) {
+            map.count = 0;
+            for(uint32_t i = 0; i < phis.count; ++i) {
+                hIrMapping mapping = { .from = phis.items[i], .to = current[i] };
+                arena_da_append(&a, &map, mapping);
+            }
+            for(uint32_t i = 0; i < code.count; ++i) {
+                hIrInst inst = fn->insts.items[code.items[i]];
+                ut_memset(&inst.phi, 0, sizeof(inst.phi));
+                for(uint32_t j = 0; j < hir_arg_count(inst.op); ++j) inst.args[j] = hir_map_value(&map, inst.args[j]);
+                hir_combine_offsets(fn, body, &inst);
+                hIrMapping mapping = { .from = code.items[i], .to = hir_append(fn, body, inst) };
+                arena_da_append(&a, &map, mapping);
+            }
+            for(uint32_t i = 0; i < nexts.count; ++i) current[i] = hir_map_value(&map, nexts.items[i]);
+        }
+        for(uint32_t i = 0; i < phis.count; ++i) fn->insts.items[phis.items[i]].phi.items[latch] = current[i];
+    }
+    arena_free(&a);
+}
+
+void hir_optimize(hIrFunc *fn)
+{
+    hir_copy_propagate(fn);
+    hir_sccp(fn);
+    hir_gvn(fn);
+    hir_copy_propagate(fn);
+    hir_dce(fn);
+
+    hir_licm(fn);
+    hir_strength_reduce(fn);
+    hir_unroll(fn, fn->unroll_factor);
+    hir_copy_propagate(fn);
+    hir_sccp(fn);
+    hir_gvn(fn);
+    hir_copy_propagate(fn);
+    hir_dce(fn);
+}
+
+void hir_dump(const hIrFunc *fn)
+{
+    static const char *op_names[] = {
+        [HIR_NONE] = "none", [HIR_CONST] = "const", [HIR_BINOP] = "binop", [HIR_PHI] = "phi",
+        [HIR_COPY] = "copy", [HIR_DUMP] = "dump", [HIR_JMP] = "jmp", [HIR_BRANCH] = "branch", [HIR_HALT] = "halt",
+    };
+    for(uint32_t b = 0; b < fn->blocks.count; ++b) {
+        const hIrBlock *block = &fn->blocks.items[b];
+        if(block->dead) continue;
+        printf("block%u: preds", b);
+        for(uint32_t i = 0; i < block->preds.count; ++i) printf(" %u", block->preds.items[i]);
+        printf("\n");
+        for(uint32_t i = 0; i <= block->insts.count; ++i) {
+            uint32_t id = i < block->insts.count ? block->insts.items[i] : block->term;
+            if(id == HIR_NO_VALUE) continue;
+            const hIrInst *inst = &fn->insts.items[id];
+            printf("    %%%u = %s", id, op_names[inst->op]);
+            if(inst->op == HIR_CONST) printf(" %ld", inst->value);
+            if(inst->op == HIR_BINOP) printf(" %u", inst->binop);
+            for(uint32_t j = 0; j < hir_arg_count(inst->op); ++j) printf(" %%%u", inst->args[j]);
+            for(uint32_t j = 0; j < inst->phi.count; ++j) printf(" [%u: %%%u]", block->preds.items[j], inst->phi.items[j]);
+            for(uint32_t j = 0; id == block->term && j < block->succ_count; ++j) printf(" -> block%u", block->succs[j]);
+            printf("\n");
+        }
+    }
+}
+
+// Lowering to the stack machine. Values used once in the block that defines them are computed right
+// where they're used, everything else lives in a stack slot at the bottom of the stack. Slots are
+// shared by values whose live ranges, taken over the blocks in order, don't overlap.
+typedef struct hIrLower {
+    const hIrFunc *fn;
+    HVM_Module *mod;
+    Arena arena;
+    uint8_t *inlined;
+    uint32_t *slots;
+    uint32_t *block_pc;
+    struct { uint32_t *items; uint32_t count; uint32_t capacity; } fixups; // jumps to block_pc[mod->items[i].op]
+} hIrLower;
+
+typedef struct hIrInterval {
+    uint32_t value;
+    uint32_t start;
+    uint32_t end;
+} hIrInterval;
+
+typedef struct hIrCopy {
+    uint32_t slot;
+    uint32_t value;
+} hIrCopy;
+
+static int hir_interval_compare(const void *a, const void *b)
+{
+    const hIrInterval *x = a;
+    const hIrInterval *y = b;
+    if(x->start != y->start) return x->start < y->start ? -1 : 1;
+    if(x->value != y->value) return x->value < y->value ? -1 : 1;
+    return 0;
+}
+
+typedef struct hIrSpan {
+    uint32_t start;
+    uint32_t end;
+} hIrSpan;
+
+static int hir_span_compare(const void *a, const void *b)
+{
+    const hIrSpan *x = a;
+    const hIrSpan *y = b;
+    if(x->start != y->start) return x->start < y->start ? -1 : 1;
+    if(x->end != y->end) return x->end < y->end ? -1 : 1;
+    return 0;
+}
+
+// Min heap of groups of intervals on where they end
+static void hir_group_push(uint32_t *heap, uint32_t *count, const uint32_t *group_end, uint32_t group)
+{
+    uint32_t i = (*count)++;
+    while(i > 0 && group_end[heap[(i - 1)/2]] > group_end[group]) {
+        heap[i] = heap[(i - 1)/2];
+        i = (i - 1)/2;
+    }
+    heap[i] = group;
+}
+
+static uint32_t hir_group_pop(uint32_t *heap, uint32_t *count, const uint32_t *group_end)
+{
+    uint32_t top = heap[0];
+    uint32_t last = heap[--(*count)];
+    uint32_t i = 0;
+    for(;;) {
+        uint32_t child = 2*i + 1;
+        if(child >= *count) break;
+        if(child + 1 < *count && group_end[heap[child + 1]] < group_end[heap[child]]) child += 1;
+        if(group_end[heap[child]] >= group_end[last]) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if(*count > 0) heap[i] = last;
+    return top;
+}
+
+static uint32_t hir_group_find(uint32_t *parent, uint32_t i)
+{
+    while(parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+// A value that's live when a loop starts is needed in every iteration, it has to live until the loop
+// ends. `intervals` are sorted on their start and the loops are swept in the order they start. Values
+// that are still live sit in a heap on their end, the ones ending inside a loop are merged into a group
+// that ends with it so every loop costs a few heap operations instead of a pass over every value.
+static void hir_lower_extend_loops(const hIrFunc *fn, const uint32_t *block_start, const uint32_t *block_end,
+        hIrInterval *intervals, uint32_t interval_count, Arena *a)
+{
+    hIrSpan *loops = arena_malloc(a, sizeof(hIrSpan)*(fn->loops.count + 1));
+    uint32_t loop_count = 0;
+    for(uint32_t l = 0; l < fn->loops.count; ++l) {
+        hIrLoop loop = fn->loops.items[l];
+        if(fn->blocks.items[loop.header].dead) continue;
+        hIrSpan span = { .start = block_start[loop.header], .end = block_start[loop.header] };
+        for(uint32_t b = loop.header; b <= loop.last; ++b) {
+            if(!fn->blocks.items[b].dead) span.end = block_end[b];
+        }
+        loops[loop_count++] = span;
+    }
+    qsort(loops, loop_count, sizeof(hIrSpan), hir_span_compare);
+
+    uint32_t *parent = arena_malloc(a, sizeof(uint32_t)*(interval_count + 1));
+    uint32_t *group_end = arena_malloc(a, sizeof(uint32_t)*(interval_count + 1));
+    uint32_t *heap = arena_malloc(a, sizeof(uint32_t)*(interval_count + 1));
+    uint32_t heap_count = 0;
+    uint32_t next = 0;
+    for(uint32_t l = 0; l < loop_count; ++l) {
+        hIrSpan loop = loops[l];
+        while(next < interval_count && intervals[next].start < loop.start) {
+            parent[next] = next;
+            group_end[next] = intervals[next].end;
+            hir_group_push(heap, &heap_count, group_end, next);
+            next += 1;
+        }
+        // Nothing that ended before this loop is live at a later one
+        while(heap_count > 0 && group_end[heap[0]] < loop.start) hir_group_pop(heap, &heap_count, group_end);
+        if(heap_count == 0 || group_end[heap[0]] > loop.end) continue;
+        uint32_t group = hir_group_pop(heap, &heap_count, group_end);
+        while(heap_count > 0 && group_end[heap[0]] <= loop.end) {
+            parent[hir_group_pop(heap, &heap_count, group_end)] = group;
+        }
+        group_end[group] = loop.end;
+        hir_group_push(heap, &heap_count, group_end, group);
+    }
+    for(uint32_t i = 0; i < next; ++i) intervals[i].end = group_end[hir_group_find(parent, i)];
+}
+
+static void hir_lower_value(hIrLower *lower, uint32_t value);
+
+// Computes the value itself, its operands are read from their slots or computed in place
+static void hir_lower_op(hIrLower *lower, uint32_t value)
+{
+    const hIrInst *inst = &lower->fn->insts.items[value];
+    if(inst->op == HIR_CONST) {
+        hvm_module_append(lower->mod, HVM_MAKE_INST(HVM_INST_PUSH, HVM_WORD_I64(inst->value)));
+        return;
+    }
+    UT_ASSERT(inst->op == HIR_BINOP);
+    hir_lower_value(lower, inst->args[0]);
+    hir_lower_value(lower, inst->args[1]);
+    hvm_module_append(lower->mod, HVM_MAKE_INST(hbinop_inst(inst->binop), HVM_NULL_WORD));
+}
+
+static void hir_lower_value(hIrLower *lower, uint32_t value)
+{
+    if(lower->inlined[value]) {
+        hir_lower_op(lower, value);
+        return;
+    }
+    hvm_module_append(lower->mod, HVM_MAKE_INST(HVM_INST_COPYABS, HVM_WORD_U64(lower->slots[value])));
+}
+
+static ut_bool hir_lower_reads(const hIrLower *lower, uint32_t value, uint32_t slot)
+{
+    const hIrInst *inst = &lower->fn->insts.items[value];
+    if(!lower->inlined[value]) return lower->slots[value] == slot;
+    if(inst->op != HIR_BINOP) return ut_false;
+    return hir_lower_reads(lower, inst->args[0], slot) || hir_lower_reads(lower, inst->args[1], slot);
+}
+
+static void hir_lower_store(hIrLower *lower, uint32_t slot)
+{
+    hvm_module_append(lower->mod, HVM_MAKE_INST(HVM_INST_SWAPABS, HVM_WORD_U64(slot)));
+    hvm_module_append(lower->mod, HVM_MAKE_INST(HVM_INST_POP, HVM_NULL_WORD));
+}
+
+static void hir_lower_jump(hIrLower *lower, HVM_InstType type, uint32_t block)
+{
+    arena_da_append(&lower->arena, &lower->fixups, lower->mod->count);
+    hvm_module_append(lower->mod, HVM_MAKE_INST(type, HVM_WORD_U64(block)));
+}
+
+// The phis of `to` take their values from `from` all at once. The copies are ordered so nothing
+// is overwritten before it's read, a cycle goes through the operand stack.
+static void hir_lower_phi_copies(hIrLower *lower, uint32_t from, uint32_t to)
+{
+    const hIrFunc *fn = lower->fn;
+    const hIrBlock *block = &fn->blocks.items[to];
+    uint32_t pred = 0;
+    while(block->preds.items[pred] != from) pred += 1;
+
+    struct { hIrCopy *items; uint32_t count; uint32_t capacity; } copies = {0};
+    for(uint32_t i = 0; i < block->insts.count; ++i) {
+        const hIrInst *phi = &fn->insts.items[block->insts.items[i]];
+        if(phi->op != HIR_PHI) continue;
+        uint32_t slot = lower->slots[block->insts.items[i]];
+        uint32_t value = phi->phi.items[pred];
+        if(!lower->inlined[value] && lower->slots[value] == slot) continue;
+        hIrCopy copy = { .slot = slot, .value = value };
+        arena_da_append(&lower->arena, &copies, copy);
+    }
+
+    while(copies.count > 0) {
+        uint32_t ready = copies.count;
+        for(uint32_t i = 0; i < copies.count && ready == copies.count; ++i) {
+            ut_bool read = ut_false;
+            for(uint32_t j = 0; j < copies.count && !read; ++j) {
+                read = j != i && hir_lower_reads(lower, copies.items[j].value, copies.items[i].slot);
+            }
+            if(!read) ready = i;
+        }
+        if(ready == copies.count) {
+            for(uint32_t i = 0; i < copies.count; ++i) hir_lower_value(lower, copies.items[i].value);
+            for(uint32_t i = copies.count; i > 0; --i) hir_lower_store(lower, copies.items[i - 1].slot);
+            copies.count = 0;
+            break;
+        }
+        hir_lower_value(lower, copies.items[ready].value);
+        hir_lower_store(lower, copies.items[ready].slot);
+        copies.items[ready] = copies.items[--copies.count];
+    }
+}
+
+void hir_lower(const hIrFunc *fn, HVM_Module *mod)
+{
+    UT_ASSERT(fn);
+    UT_ASSERT(mod);
+
+    hIrLower lower;
+    ut_memset(&lower, 0, sizeof(lower));
+    lower.fn = fn;
+    lower.mod = mod;
+    Arena *a = &lower.arena;
+    uint32_t count = fn->insts.count;
+    uint32_t block_count = fn->blocks.count;
+    uint32_t *pos = arena_malloc(a, sizeof(uint32_t)*(count + 1));
+    uint32_t *block_start = arena_malloc(a, sizeof(uint32_t)*(block_count + 1));
+    uint32_t *block_end = arena_malloc(a, sizeof(uint32_t)*(block_count + 1));
+    uint32_t *uses = arena_malloc(a, sizeof(uint32_t)*(count + 1));
+    uint32_t *use_pos = arena_malloc(a, sizeof(uint32_t)*(count + 1));
+    uint32_t *use_block = arena_malloc(a, sizeof(uint32_t)*(count + 1));
+    uint32_t *user = arena_malloc(a, sizeof(uint32_t)*(count + 1));
+    uint32_t *depth = arena_malloc(a, sizeof(uint32_t)*(count + 1));
+    uint32_t *order = arena_malloc(a, sizeof(uint32_t)*(count + 1));
+    lower.inlined = arena_malloc(a, count + 1);
+    lower.slots = arena_malloc(a, sizeof(uint32_t)*(count + 1));
+    lower.block_pc = arena_malloc(a, sizeof(uint32_t)*(block_count + 1));
+    ut_memset(uses, 0, sizeof(uint32_t)*(count + 1));
+    ut_memset(lower.inlined, 0, count + 1);
+    ut_memset(lower.slots, 0, sizeof(uint32_t)*(count + 1));
+
+    // Positions follow the order the code is emitted in, phis are at the start of their block
+    uint32_t p = 0;
+    uint32_t ordered = 0;
+    for(uint32_t b = 0; b < block_count; ++b) {
+        const hIrBlock *block = &fn->blocks.items[b];
+        if(block->dead) continue;
+        block_start[b] = p;
+        for(uint32_t i = 0; i < block->insts.count; ++i) {
+            uint32_t id = block->insts.items[i];
+            pos[id] = fn->insts.items[id].op == HIR_PHI ? block_start[b] : p++;
+            order[ordered++] = id;
+        }
+        UT_ASSERT(block->term != HIR_NO_VALUE);
+        pos[block->term] = p;
+        block_end[b] = p++;
+        order[ordered++] = block->term;
+    }
+
+    for(uint32_t i = 0; i < ordered; ++i) {
+        uint32_t id = order[i];
+        const hIrInst *inst = &fn->insts.items[id];
+        for(uint32_t j = 0; j < hir_arg_count(inst->op); ++j) {
+            uint32_t value = inst->args[j];
+            uses[value] += 1;
+            use_pos[value] = pos[id];
+            use_block[value] = inst->block;
+            user[value] = id;
+        }
+        for(uint32_t j = 0; j < inst->phi.count; ++j) {
+            // Phi operands are read at the end of the predecessor
+            uint32_t pred = fn->blocks.items[inst->block].preds.items[j];
+            uint32_t value = inst->phi.items[j];
+            uses[value] += 1;
+            use_pos[value] = block_end[pred];
+            use_block[value] = pred;
+            user[value] = id;
+        }
+    }
+
+    for(uint32_t i = 0; i < ordered; ++i) {
+        uint32_t id = order[i];
+        const hIrInst *inst = &fn->insts.items[id];
+        UT_ASSERT(inst->op != HIR_COPY && "Copies must be propagated before lowering");
+        depth[id] = 0;
+        if(inst->op == HIR_CONST) {
+            lower.inlined[id] = 1;
+            depth[id] = 1;
+        } else if(inst->op == HIR_BINOP && uses[id] == 1 && use_block[id] == inst->block) {
+            // When the user is a phi it's computed while copying into it at the end of the block
+            uint32_t d = 1 + UT_MAX(depth[inst->args[0]], depth[inst->args[1]]);
+            if(d <= HIR_MAX_INLINE_DEPTH) {
+                lower.inlined[id] = 1;
+                depth[id] = d;
+            }
+        }
+    }
+
+    // An inlined value reads its operands where it's used
+    uint32_t *read_pos = arena_malloc(a, sizeof(uint32_t)*(count + 1));
+    for(uint32_t i = ordered; i > 0; --i) {
+        uint32_t id = order[i - 1];
+        read_pos[id] = pos[id];
+        if(!lower.inlined[id] || uses[id] == 0) continue;
+        read_pos[id] = lower.inlined[user[id]] ? read_pos[user[id]] : use_pos[id];
+    }
+
+    hIrInterval *intervals = arena_malloc(a, sizeof(hIrInterval)*(count + 1));
+    uint32_t *interval_of = arena_malloc(a, sizeof(uint32_t)*(count + 1));
+    uint32_t interval_count = 0;
+    for(uint32_t i = 0; i < ordered; ++i) {
+        uint32_t id = order[i];
+        hIrOp op = fn->insts.items[id].op;
+        interval_of[id] = HIR_NO_VALUE;
+        if(lower.inlined[id] || (op != HIR_BINOP && op != HIR_PHI)) continue;
+        hIrInterval interval = { .value = id, .start = pos[id], .end = pos[id] };
+        interval_of[id] = interval_count;
+        intervals[interval_count++] = interval;
+    }
+    for(uint32_t i = 0; i < ordered; ++i) {
+        uint32_t id = order[i];
+        const hIrInst *inst = &fn->insts.items[id];
+        uint32_t at = lower.inlined[id] ? read_pos[id] : pos[id];
+        for(uint32_t j = 0; j < hir_arg_count(inst->op); ++j) {
+            uint32_t k = interval_of[inst->args[j]];
+            if(lower.inlined[inst->args[j]] || k == HIR_NO_VALUE) continue;
+            intervals[k].end = UT_MAX(intervals[k].end, at);
+        }
+        for(uint32_t j = 0; j < inst->phi.count; ++j) {
+            uint32_t end = block_end[fn->blocks.items[inst->block].preds.items[j]];
+            uint32_t value = inst->phi.items[j];
+            // The phi itself is written at the end of every predecessor
+            hIrInterval *phi = &intervals[interval_of[id]];
+            phi->start = UT_MIN(phi->start, end);
+            phi->end = UT_MAX(phi->end, end);
+            if(lower.inlined[value] || interval_of[value] == HIR_NO_VALUE) continue;
+            intervals[interval_of[value]].end = UT_MAX(intervals[interval_of[value]].end, end);
+        }
+    }
+
+    // Linear scan, a slot is free again once the last read of its value is done
+    qsort(intervals, interval_count, sizeof(hIrInterval), hir_interval_compare);
+    hir_lower_extend_loops(fn, block_start, block_end, intervals, interval_count, a);
+    uint32_t *slot_end = arena_malloc(a, sizeof(uint32_t)*(interval_count + 1));
+    uint32_t slot_count = 0;
+    for(uint32_t i = 0; i < interval_count; ++i) {
+        uint32_t slot = slot_count;
+        for(uint32_t s = 0; s < slot_count; ++s) {
+            if(slot_end[s] <= intervals[i].start) {
+                slot = s;
+                break;
+            }
+        }
+        if(slot == slot_count) slot_count += 1;
+        if(slot_count >= HVM_STACK_CAPACITY) {
+            hlog_message(HLOG_FATAL, "Ran out of stack slots, the program needs more than %u", slot_count);
+        }
+        slot_end[slot] = intervals[i].end;
+        lower.slots[intervals[i].value] = slot;
+    }
+
+    for(uint32_t s = 0; s < slot_count; ++s) {
+        hvm_module_append(mod, HVM_MAKE_INST(HVM_INST_PUSH, HVM_WORD_I64(0)));
+    }
+    for(uint32_t b = 0; b < block_count; ++b) {
+        const hIrBlock *block = &fn->blocks.items[b];
+        if(block->dead) continue;
+        lower.block_pc[b] = mod->count;
+        for(uint32_t i = 0; i < block->insts.count; ++i) {
+            uint32_t id = block->insts.items[i];
+            const hIrInst *inst = &fn->insts.items[id];
+            if(inst->op == HIR_DUMP) {
+                hir_lower_value(&lower, inst->args[0]);
+                hvm_module_append(mod, HVM_MAKE_INST(HVM_INST_DUMP, HVM_NULL_WORD));
+            } else if(inst->op == HIR_BINOP && !lower.inlined[id]) {
+                hir_lower_op(&lower, id);
+                hir_lower_store(&lower, lower.slots[id]);
+            }
+        }
+
+        const hIrInst *term = &fn->insts.items[block->term];
+        switch(term->op) {
+            case HIR_JMP:
+                {
+                    hir_lower_phi_copies(&lower, b, block->succs[0]);
+                    hir_lower_jump(&lower, HVM_INST_JMP, block->succs[0]);
+                } break;
+            case HIR_BRANCH:
+                {
+                    hir_lower_value(&lower, term->args[0]);
+                    uint32_t jz = mod->count;
+                    hvm_module_append(mod, HVM_MAKE_INST(HVM_INST_JZ, HVM_NULL_WORD));
+                    hir_lower_phi_copies(&lower, b, block->succs[0]);
+                    hir_lower_jump(&lower, HVM_INST_JMP, block->succs[0]);
+                    mod->items[jz].op = HVM_WORD_U64(mod->count);
+                    hir_lower_phi_copies(&lower, b, block->succs[1]);
+                    hir_lower_jump(&lower, HVM_INST_JMP, block->succs[1]);
+                } break;
+            case HIR_HALT:
+                {
+                    hvm_module_append(mod, HVM_MAKE_INST(HVM_INST_HALT, HVM_WORD_U64(0)));
+                } break;
+            default:
+                UT_ASSERT(0 && "Unreachable terminator in hir_lower()");
+                break;
+        }
+    }
+
+    for(uint32_t i = 0; i < lower.fixups.count; ++i) {
+        HVM_Inst *inst = &mod->items[lower.fixups.items[i]];
+        inst->op = HVM_WORD_U64(lower.block_pc[inst->op.as_u64]);
+    }
+    arena_free(a);
+}
@@ -0,0 +1,155 @@
+#include "hotaru.h"
+
+// Optimizations done on the AST right after a statement is parsed and before it's compiled or executed.
+// Nothing in here may change what a program prints, only how much code is generated for it.
+
+static ut_bool hopt_is_int(const hAst *ast, hExprId id, int64_t value)
+{
+    const hExpr *expr = HAST_EXPR(ast, id);
+    return expr->type == HEXPR_INT_LITERAL && expr->as.int_literal == value;
+}
+
+void hopt_fold_expr(hAst *ast, hExprId id)
+{
+    UT_ASSERT(ast);
+    // Folding never adds to the pool so the pointers stay valid
+    hExpr *expr = HAST_EXPR(ast, id);
+    if(expr->type != HEXPR_BINOP) return;
+
+    hBinOpType type = expr->as.binop.type;
+    hExprId left = expr->as.binop.left;
+    hExprId right = expr->as.binop.right;
+    hopt_fold_expr(ast, left);
+    hopt_fold_expr(ast, right);
+
+    if(HAST_EXPR(ast, left)->type == HEXPR_INT_LITERAL && HAST_EXPR(ast, right)->type == HEXPR_INT_LITERAL) {
+        expr->type = HEXPR_INT_LITERAL;
+        expr->as.int_literal = hbinop_eval(type, HAST_EXPR(ast, left)->as.int_literal, HAST_EXPR(ast, right)->as.int_literal);
+        return;
+    }
+
+    // x + 0, 0 + x, x - 0, x * 1 and 1 * x are just x. `x * 0` is left alone since dropping
+    // x would also drop the error when it reads a variable that doesn't exist.
+    const hExpr *keep = UT_NULL;
+    switch(type) {
+        case HBINOP_ADD:
+            {
+                if(hopt_is_int(ast, right, 0)) keep = HAST_EXPR(ast, left);
+                else if(hopt_is_int(ast, left, 0)) keep = HAST_EXPR(ast, right);
+            } break;
+        case HBINOP_SUB:
+            {
+                if(hopt_is_int(ast, right, 0)) keep = HAST_EXPR(ast, left);
+            } break;
+        case HBINOP_MUL:
+            {
+                if(hopt_is_int(ast, right, 1)) keep = HAST_EXPR(ast, left);
+                else if(hopt_is_int(ast, left, 1)) keep = HAST_EXPR(ast, right);
+            } break;
+        default:
+            break;
+    }
+    if(keep) {
+        hPosition pos = expr->pos;
+        *expr = *keep;
+        expr->pos = pos;
+    }
+}
+
+void hopt_fold_block(hAst *ast, hBlock *block)
+{
+    UT_ASSERT(block);
+    // Statements that fold away are removed so they don't count as a declaration in the block either
+    uint32_t count = 0;
+    for(uint32_t i = 0; i < block->count; ++i) {
+        hopt_fold_stmt(ast, &block->items[i]);
+        if(block->items[i].type == HSTMT_NONE) continue;
+        block->items[count++] = block->items[i];
+    }
+    block->count = count;
+}
+
+// Drop the branches of an if whose condition is known. The chain is checked in order so the first
+// branch that is always taken becomes the else and everything after it is dead.
+static void hopt_fold_if(hAst *ast, hStmt *stmt)
+{
+    hIfStmt *_if = &stmt->as._if;
+    hopt_fold_expr(ast, _if->condition);
+    hopt_fold_block(ast, &_if->body);
+
+    uint32_t count = 0;
+    for(uint32_t i = 0; i < _if->_elif.count; ++i) {
+        hElifBlock *elif = &_if->_elif.items[i];
+        hopt_fold_expr(ast, elif->condition);
+        hopt_fold_block(ast, &elif->body);
+        if(hopt_is_int(ast, elif->condition, 0)) continue;
+        if(HAST_EXPR(ast, elif->condition)->type == HEXPR_INT_LITERAL) {
+            _if->_else = elif->body;
+            break;
+        }
+        _if->_elif.items[count++] = *elif;
+    }
+    _if->_elif.count = count;
+    hopt_fold_block(ast, &_if->_else);
+
+    while(HAST_EXPR(ast, _if->condition)->type == HEXPR_INT_LITERAL) {
+        if(HAST_EXPR(ast, _if->condition)->as.int_literal != 0) {
+            hBlock body = _if->body;
+            stmt->type = HSTMT_BLOCK;
+            stmt->as.block = body;
+            return;
+        }
+        if(_if->_elif.count == 0) {
+            hBlock body = _if->_else;
+            stmt->type = body.count > 0 ? HSTMT_BLOCK : HSTMT_NONE;
+            stmt->as.block = body;
+            return;
+        }
+        // The first elif takes the place of the condition that is never true
+        _if->condition = _if->_elif.items[0].condition;
+        _if->body = _if->_elif.items[0].body;
+        _if->_elif.items += 1;
+        _if->_elif.count -= 1;
+        _if->_elif.capacity -= 1;
+    }
+}
+
+void hopt_fold_stmt(hAst *ast, hStmt *stmt)
+{
+    UT_ASSERT(ast);
+    UT_ASSERT(stmt);
+
+    switch(stmt->type) {
+        case HSTMT_VAR_INIT:
+            {
+                hopt_fold_expr(ast, stmt->as.var_init.value);
+            } break;
+        case HSTMT_VAR_ASSIGN:
+            {
+                hopt_fold_expr(ast, stmt->as.var_assign.value);
+            } break;
+        case HSTMT_WHILE:
+            {
+                hopt_fold_expr(ast, stmt->as._while.condition);
+                if(hopt_is_int(ast, stmt->as._while.condition, 0)) {
+                    stmt->type = HSTMT_NONE;
+                    return;
+                }
+                hopt_fold_block(ast, &stmt->as._while.body);
+            } break;
+        case HSTMT_IF:
+            {
+                hopt_fold_if(ast, stmt);
+            } break;
+        case HSTMT_BLOCK:
+            {
+                hopt_fold_block(ast, &stmt->as.block);
+            } break;
+        case HSTMT_DUMP:
+            {
+                hopt_fold_expr(ast, stmt->as.dump);
+            } break;
+        default:
+            break;
+    }
+}
@@ -11,21 +11,50 @@ static char format_buf[32*1024];
 typedef struct hBinOpInfo {
     hBinOpType type;
     HVM_InstType inst;
+    HVM_RegInstType rinst;
+    HVM_RegInstType rinsti;
+    hBinOpType swapped; // same operation with the operands swapped, if there's one
 } hBinOpInfo;
 
 static const hBinOpInfo _binops_info[COUNT_HBINOP_TYPES] = {
-[HBINOP_NONE] = { .type = HBINOP_NONE, .inst = HVM_INST_NONE, },
-[HBINOP_ADD] = { .type = HBINOP_ADD, .inst = HVM_INST_ADD, },
-[HBINOP_SUB] = { .type = HBINOP_SUB, .inst = HVM_INST_SUB, },
-[HBINOP_MUL] = { .type = HBINOP_MUL, .inst = HVM_INST_MUL, },
-[HBINOP_EQ] = { .type = HBINOP_EQ, .inst = HVM_INST_EQ, },
-[HBINOP_NE] = { .type = HBINOP_NE, .inst = HVM_INST_NE, },
-[HBINOP_LT] = { .type = HBINOP_LT, .inst = HVM_INST_LT, },
-[HBINOP_LE] = { .type = HBINOP_LE, .inst = HVM_INST_LE, },
-[HBINOP_GT] = { .type = HBINOP_GT, .inst = HVM_INST_GT, },
-[HBINOP_GE] = { .type = HBINOP_GE, .inst = HVM_INST_GE, },
+[HBINOP_NONE] = { .type = HBINOP_NONE, .inst = HVM_INST_NONE, .rinst = HVM_RINST_NONE, .rinsti = HVM_RINST_NONE, .swapped = HBINOP_NONE, },
+[HBINOP_ADD] = { .type = HBINOP_ADD, .inst = HVM_INST_ADD, .rinst = HVM_RINST_ADD, .rinsti = HVM_RINST_ADDI, .swapped = HBINOP_ADD, },
+[HBINOP_SUB] = { .type = HBINOP_SUB, .inst = HVM_INST_SUB, .rinst = HVM_RINST_SUB, .rinsti = HVM_RINST_SUBI, .swapped = HBINOP_NONE, },
+[HBINOP_MUL] = { .type = HBINOP_MUL, .inst = HVM_INST_MUL, .rinst = HVM_RINST_MUL, .rinsti = HVM_RINST_MULI, .swapped = HBINOP_MUL, },
+[HBINOP_EQ] = { .type = HBINOP_EQ, .inst = HVM_INST_EQ, .rinst = HVM_RINST_EQ, .rinsti = HVM_RINST_EQI, .swapped = HBINOP_EQ, },
+[HBINOP_NE] = { .type = HBINOP_NE, .inst = HVM_INST_NE, .rinst = HVM_RINST_NE, .rinsti = HVM_RINST_NEI, .swapped = HBINOP_NE, },
+[HBINOP_LT] = { .type = HBINOP_LT, .inst = HVM_INST_LT, .rinst = HVM_RINST_LT, .rinsti = HVM_RINST_LTI, .swapped = HBINOP_GT, },
+[HBINOP_LE] = { .type = HBINOP_LE, .inst = HVM_INST_LE, .rinst = HVM_RINST_LE, .rinsti = HVM_RINST_LEI, .swapped = HBINOP_GE, },
+[HBINOP_GT] = { .type = HBINOP_GT, .inst = HVM_INST_GT, .rinst = HVM_RINST_GT, .rinsti = HVM_RINST_GTI, .swapped = HBINOP_LT, },
+[HBINOP_GE] = { .type = HBINOP_GE, .inst = HVM_INST_GE, .rinst = HVM_RINST_GE, .rinsti = HVM_RINST_GEI, .swapped = HBINOP_LE, },
 };
 
+HVM_InstType hbinop_inst(hBinOpType type)
+{
+    UT_ASSERT(type < COUNT_HBINOP_TYPES);
+    return _binops_info[type].inst;
+}
+
+// Same semantics as the VM, overflow wraps around
+int64_t hbinop_eval(hBinOpType type, int64_t a, int64_t b)
+{
+    switch(type) {
+        case HBINOP_ADD: return (int64_t)((uint64_t)a + (uint64_t)b);
+        case HBINOP_SUB: return (int64_t)((uint64_t)a - (uint64_t)b);
+        case HBINOP_MUL: return (int64_t)((uint64_t)a * (uint64_t)b);
+        case HBINOP_EQ:  return a == b;
+        case HBINOP_NE:  return a != b;
+        case HBINOP_GT:  return a > b;
+        case HBINOP_GE:  return a >= b;
+        case HBINOP_LT:  return a < b;
+        case HBINOP_LE:  return a <= b;
+        default:
+            UT_ASSERT(0 && "Unreachable binop in hbinop_eval()");
+            break;
+    }
+    return 0;
+}
+
 void hlog_message(hLogLevel level, const char *fmt, ...)
 {
     FILE *f[COUNT_HLOG_LEVELS] = { stderr, stderr, stdout, stdout, };
@@ -40,6 +69,64 @@ void hlog_message(hLogLevel level, const char *fmt, ...)
     }
 }
 
+static uint32_t hinterner_hash(StringView name)
+{
+    uint32_t hash = 2166136261u;
+    for(ut_size i = 0; i < name.count; ++i) hash = (hash ^ (uint8_t)name.data[i])*16777619u;
+    return hash;
+}
+
+static void hinterner_place(hInterner *interner, uint32_t id)
+{
+    uint32_t mask = interner->table_capacity - 1;
+    uint32_t slot = interner->hashes[id] & mask;
+    while(interner->table[slot] != 0) slot = (slot + 1) & mask;
+    interner->table[slot] = id + 1;
+}
+
+uint32_t hinterner_intern(hInterner *interner, StringView name, Arena *arena)
+{
+    UT_ASSERT(interner);
+    UT_ASSERT(arena);
+
+    uint32_t hash = hinterner_hash(name);
+    if(interner->table_capacity > 0) {
+        uint32_t mask = interner->table_capacity - 1;
+        for(uint32_t slot = hash & mask; interner->table[slot] != 0; slot = (slot + 1) & mask) {
+            uint32_t id = interner->table[slot] - 1;
+            if(interner->hashes[id] == hash && sv_eq(interner->names.items[id], name)) return id;
+        }
+    }
+
+    uint32_t id = interner->names.count;
+    uint32_t old_capacity = interner->names.capacity;
+    arena_da_append(arena, &interner->names, name);
+    if(interner->names.capacity != old_capacity) {
+        uint32_t *new_hashes = arena_malloc(arena, sizeof(uint32_t)*interner->names.capacity);
+        if(id > 0) ut_memcpy(new_hashes, interner->hashes, sizeof(uint32_t)*id);
+        interner->hashes = new_hashes;
+    }
+    interner->hashes[id] = hash;
+
+    // Kept at most half full, rebuilding is cheap since the hashes are saved
+    if((id + 1)*2 > interner->table_capacity) {
+        interner->table_capacity = interner->table_capacity == 0 ? 64 : interner->table_capacity*2;
+        interner->table = arena_malloc(arena, sizeof(uint32_t)*interner->table_capacity);
+        ut_memset(interner->table, 0, sizeof(uint32_t)*interner->table_capacity);
+        for(uint32_t i = 0; i < id; ++i) hinterner_place(interner, i);
+    }
+    hinterner_place(interner, id);
+    return id;
+}
+
+static uint32_t hscope_slot(const hScope *scope, uint32_t symbol)
+{
+    uint32_t mask = scope->table_capacity - 1;
+    uint32_t slot = (symbol*2654435761u) & mask;
+    while(scope->table[slot] != 0 && scope->items[scope->table[slot] - 1].symbol != symbol) slot = (slot + 1) & mask;
+    return slot;
+}
+
 hVarBinding *hscope_append(hScope *scope, hVarBinding binding, Arena *arena)
 {
     UT_ASSERT(scope);
@@ -58,21 +145,32 @@ hVarBinding *hscope_append(hScope *scope, hVarBinding binding, Arena *arena)
     hVarBinding *res = &scope->items[scope->count];
     *res = binding;
     scope->count += 1;
+
+    if(scope->count*2 > scope->table_capacity) {
+        scope->table_capacity = scope->table_capacity == 0 ? 16 : scope->table_capacity*2;
+        scope->table = arena_malloc(arena, sizeof(uint32_t)*scope->table_capacity);
+        ut_memset(scope->table, 0, sizeof(uint32_t)*scope->table_capacity);
+        // Rebuilt in declaration order so a name declared twice still finds the latest one
+        for(uint32_t i = 0; i < scope->count; ++i) scope->table[hscope_slot(scope, scope->items[i].symbol)] = i + 1;
+    } else {
+        scope->table[hscope_slot(scope, binding.symbol)] = (uint32_t)scope->count;
+    }
     return res;
 }
 
-hVarBinding *hscope_find(const hScope *scope, StringView name)
+hVarBinding *hscope_find(const hScope *scope, uint32_t symbol)
 {
-    hVarBinding *res = UT_NULL;
-    while(scope != UT_NULL && res == UT_NULL) {
-        for(ut_size i = 0; i < scope->count; ++i) {
-            hVarBinding *cur = &scope->items[i];
-            if(sv_eq(cur->name, name)) 
-                res = cur;
-        }
-        scope = scope->prev;
+    for(; scope != UT_NULL; scope = scope->prev) {
+        if(scope->count == 0) continue;
+        uint32_t index = scope->table[hscope_slot(scope, symbol)];
+        if(index != 0) return &scope->items[index - 1];
     }
-    return res;
+    return UT_NULL;
+}
+
+static uint32_t hstate_symbol(hState *state, StringView name)
+{
+    return hinterner_intern(&state->symbols, name, &state->arena);
 }
 
 void hstate_init(hState *state)
@@ -81,13 +179,26 @@ void hstate_init(hState *state)
 
     hvm_init(&state->vm);
     hvm_module_init(&state->mod);
+    hvm_reg_module_init(&state->rmod);
     state->arena.begin = 0;
     state->arena.end = 0;
+    state->scratch.begin = 0;
+    state->scratch.end = 0;
     state->global.prev = UT_NULL;
     state->global.count = 0;
     state->global.capacity = 0;
     state->global.items = 0;
+    state->global.table = UT_NULL;
+    state->global.table_capacity = 0;
+    state->ast = UT_NULL;
+    ut_memset(&state->symbols, 0, sizeof(state->symbols));
     state->current = &state->global;
+    state->tier_threshold = HVM_TIER_THRESHOLD;
+    state->unroll_factor = HIR_DEFAULT_UNROLL_FACTOR;
+    state->lex_threads = 0;
+    state->lines.items = UT_NULL;
+    state->lines.count = 0;
+    state->lines.capacity = 0;
 
     state->vsp = 0;
     state->vss = 0;
@@ -96,13 +207,15 @@ void hstate_init(hState *state)
 void hstate_deinit(hState *state)
 {
     arena_free(&state->arena);
+    arena_free(&state->scratch);
     hvm_module_deinit(&state->mod);
+    hvm_reg_module_deinit(&state->rmod);
 }
 
-hResult hstate_compile_expr(hState *state, const hExpr *expr)
+hResult hstate_compile_expr(hState *state, hExprId id)
 {
     UT_ASSERT(state);
-    UT_ASSERT(expr);
+    const hExpr *expr = HAST_EXPR(state->ast, id);
 
     switch(expr->type) {
         case HEXPR_INT_LITERAL:
@@ -124,7 +237,7 @@ hResult hstate_compile_expr(hState *state, const hExpr *expr)
             } break;
         case HEXPR_VAR_READ:
             {
-                hVarBinding *var = hscope_find(state->current, expr->as.var_read.name);
+                hVarBinding *var = hscope_find(state->current, hstate_symbol(state, expr->as.var_read.name));
                 if(!var) return HRES_INVALID_VARIABLE;
                 hvm_module_append(&state->mod, HVM_MAKE_INST(
                             HVM_INST_COPYABS, 
@@ -139,10 +252,10 @@ hResult hstate_compile_expr(hState *state, const hExpr *expr)
     return 0;
 }
 
-hResult hstate_exec_expr(hState *state, const hExpr *expr)
+hResult hstate_exec_expr(hState *state, hExprId id)
 {
     UT_ASSERT(state);
-    UT_ASSERT(expr);
+    const hExpr *expr = HAST_EXPR(state->ast, id);
 
     HVM_Inst inst;
     switch(expr->type) {
@@ -163,7 +276,7 @@ hResult hstate_exec_expr(hState *state, const hExpr *expr)
             } break;
         case HEXPR_VAR_READ:
             {
-                hVarBinding *var = hscope_find(state->current, expr->as.var_read.name);
+                hVarBinding *var = hscope_find(state->current, hstate_symbol(state, expr->as.var_read.name));
                 if(!var) return HRES_INVALID_VARIABLE;
                 inst.type = HVM_INST_COPYABS;
                 inst.op.as_u64 = var->pos;
@@ -177,19 +290,60 @@ hResult hstate_exec_expr(hState *state, const hExpr *expr)
     return HRES_OK;
 }
 
-hResult hstate_compile_block(hState *state, const hBlock block)
+// Global bindings are used by the statements that follow, the ones of a block go away with it
+static Arena *hstate_scope_arena(hState *state)
 {
-    hvm_module_append(&state->mod, HVM_MAKE_INST(
-                HVM_INST_BEGIN_SCOPE,
-                HVM_NULL_WORD));
+    return state->current == &state->global ? &state->arena : &state->scratch;
+}
 
+hResult hstate_compile_block(hState *state, const hBlock block)
+{
+    hScope scope;
+    ut_memset(&scope, 0, sizeof(scope));
+    scope.prev = state->current;
+    state->current = &scope;
+    uint32_t base = state->vsp;
+
+    // A block that declares nothing leaves the stack as it found it so it doesn't need a VM scope
+    ut_bool has_vars = ut_false;
     for(uint32_t i = 0; i < block.count; ++i) {
-        hstate_compile_stmt(state, &block.items[i]);
+        if(block.items[i].type == HSTMT_VAR_INIT) has_vars = ut_true;
+    }
+
+    if(has_vars) {
+        hvm_module_append(&state->mod, HVM_MAKE_INST(
+                    HVM_INST_BEGIN_SCOPE,
+                    HVM_NULL_WORD));
+        // BEGIN_SCOPE saves the previous stack start right below the new scope
+        state->vsp += 1;
+    }
+
+    hResult res = HRES_OK;
+    for(uint32_t i = 0; i < block.count && res == HRES_OK; ++i) {
+        res = hstate_compile_stmt(state, &block.items[i]);
     }
 
+    if(has_vars) {
+        hvm_module_append(&state->mod, HVM_MAKE_INST(
+                    HVM_INST_END_SCOPE,
+                    HVM_NULL_WORD));
+    }
+    state->vsp = base;
+    state->current = scope.prev;
+    return res;
+}
+
+// Compile the condition and emit a jump that's taken when it's false, returns the index of the jump to be patched.
+// Jumps are always emitted straight into state->mod and patched once their target is known.
+static hResult hstate_compile_branch(hState *state, hExprId condition, uint32_t *jump)
+{
+    hResult res = hstate_compile_expr(state, condition);
+    if(res != HRES_OK) return res;
+    *jump = state->mod.count;
     hvm_module_append(&state->mod, HVM_MAKE_INST(
-                HVM_INST_END_SCOPE,
+                HVM_INST_JZ,
                 HVM_NULL_WORD));
+    state->vsp -= 1;
     return HRES_OK;
 }
 
@@ -202,19 +356,20 @@ hResult hstate_compile_stmt(hState *state, const hStmt *stmt)
         case HSTMT_VAR_INIT:
             {
                 uint32_t last_sp = state->vsp;
-                hResult res = hstate_compile_expr(state, &stmt->as.var_init.value);
+                hResult res = hstate_compile_expr(state, stmt->as.var_init.value);
                 if(res != HRES_OK) return res;
                 hVarBinding var;
                 var.name = stmt->as.var_init.name;
+                var.symbol = hstate_symbol(state, var.name);
                 var.pos = last_sp;
-                hscope_append(state->current, var, &state->arena);
+                hscope_append(state->current, var, hstate_scope_arena(state));
             } break;
         case HSTMT_VAR_ASSIGN:
             {
-                hVarBinding *var = hscope_find(state->current, stmt->as.var_assign.name);
+                hVarBinding *var = hscope_find(state->current, hstate_symbol(state, stmt->as.var_assign.name));
                 if(!var) return HRES_INVALID_VARIABLE;
 
-                hResult res = hstate_compile_expr(state, &stmt->as.var_init.value);
+                hResult res = hstate_compile_expr(state, stmt->as.var_init.value);
                 if(res != HRES_OK) return res;
 
                 hvm_module_append(&state->mod, HVM_MAKE_INST(
@@ -223,89 +378,73 @@ hResult hstate_compile_stmt(hState *state, const hStmt *stmt)
                 hvm_module_append(&state->mod, HVM_MAKE_INST(
                             HVM_INST_POP,
                             HVM_NULL_WORD));
+                state->vsp -= 1;
             } break;
         case HSTMT_IF:
             {
-                // HACK: (1) first we jump to the start of if's condition
-                hvm_module_append(&state->mod, HVM_MAKE_INST(
-                            HVM_INST_JMP,
-                            HVM_WORD_U64(state->mod.count + 2)));
-                // HACK: (2) we will jump here if body of a condition is done
-                uint32_t body_completed_jump_target = state->mod.count;
+                struct { uint32_t *items; uint32_t count; uint32_t capacity; } done = {0};
+                uint32_t next_jump;
+                hResult res = hstate_compile_branch(state, stmt->as._if.condition, &next_jump);
+                if(res != HRES_OK) return res;
+                res = hstate_compile_block(state, stmt->as._if.body);
+                if(res != HRES_OK) return res;
+                arena_da_append(&state->scratch, &done, state->mod.count);
                 hvm_module_append(&state->mod, HVM_MAKE_INST(
                             HVM_INST_JMP,
                             HVM_NULL_WORD));
-                HVM_Inst *inst = &state->mod.items[body_completed_jump_target];
 
-                HVM_Module prev_mod = state->mod;
-                hvm_module_init(&state->mod);
-                hstate_compile_expr(state, &stmt->as._if.condition);
-                hstate_compile_block(state, stmt->as._if.body);
-                hvm_module_append(&state->mod, HVM_MAKE_INST(
-                            HVM_INST_JMP,
-                            HVM_WORD_U64(body_completed_jump_target)));
-                for(uint32_t i =  0; i < stmt->as._if._elif.count; ++i) {
-                    hElifBlock elif = stmt->as._if._elif.items[i];
-                    hstate_compile_expr(state, &elif.condition);
-                    hstate_compile_block(state, elif.body);
+                for(uint32_t i = 0; i < stmt->as._if._elif.count; ++i) {
+                    const hElifBlock *elif = &stmt->as._if._elif.items[i];
+                    state->mod.items[next_jump].op = HVM_WORD_U64(state->mod.count);
+                    res = hstate_compile_branch(state, elif->condition, &next_jump);
+                    if(res != HRES_OK) return res;
+                    res = hstate_compile_block(state, elif->body);
+                    if(res != HRES_OK) return res;
+                    arena_da_append(&state->scratch, &done, state->mod.count);
                     hvm_module_append(&state->mod, HVM_MAKE_INST(
                                 HVM_INST_JMP,
-                                HVM_WORD_U64(body_completed_jump_target)));
+                                HVM_NULL_WORD));
+                }
+
+                state->mod.items[next_jump].op = HVM_WORD_U64(state->mod.count);
+                res = hstate_compile_block(state, stmt->as._if._else);
+                if(res != HRES_OK) return res;
+                for(uint32_t i = 0; i < done.count; ++i) {
+                    state->mod.items[done.items[i]].op = HVM_WORD_U64(state->mod.count);
                 }
-                hstate_compile_block(state, stmt->as._if._else);
-                for(uint32_t i = 0; i < state->mod.count; ++i) 
-                    hvm_module_append(&prev_mod, state->mod.items[i]);
-                inst->op = HVM_WORD_U64(prev_mod.count);
-                hvm_module_deinit(&state->mod);
-                state->mod = prev_mod;
             } break;
         case HSTMT_WHILE:
             {
-                HVM_Module body_mod;
-                hvm_module_init(&body_mod);
-                HVM_Module prev_mod = state->mod;
-                state->mod = body_mod;
-                hBlock body = stmt->as._while.body;
-                for(uint32_t i = 0; i < body.count; ++i) {
-                    hstate_compile_stmt(state, &body.items[i]);
-                }
-                body_mod = state->mod;
-                state->mod = prev_mod;
-
-                {
-                    hvm_module_append(&state->mod, HVM_MAKE_INST(
-                                HVM_INST_BEGIN_SCOPE,
-                                HVM_NULL_WORD));
-                    uint32_t while_loop_start_pc = state->mod.count;
-                    hstate_compile_expr(state, &stmt->as._while.condition);
-
-                    uint32_t count_insts_before_end_scope = body_mod.count + 2;
-                    uint32_t while_loop_finish_pc = state->mod.count + count_insts_before_end_scope; 
-                    hvm_module_append(&state->mod, HVM_MAKE_INST(
-                                HVM_INST_JZ,
-                                HVM_WORD_U64(while_loop_finish_pc)));
-
-                    for(uint32_t i = 0; i < body_mod.count; ++i) 
-                        hvm_module_append(&state->mod, body_mod.items[i]);
-
-                    hvm_module_append(&state->mod, HVM_MAKE_INST(
-                                HVM_INST_JMP,
-                                HVM_WORD_U64(while_loop_start_pc)));
-                    hvm_module_append(&state->mod, HVM_MAKE_INST(
-                                HVM_INST_END_SCOPE,
-                                HVM_NULL_WORD));
-                }
-                hvm_module_deinit(&body_mod);
+                // Every iteration runs the body in its own scope so the variables declared
+                // in it are dropped before the condition is checked again
+                uint32_t base = state->vsp;
+                uint32_t start = state->mod.count;
+                uint32_t exit_jump;
+                hResult res = hstate_compile_branch(state, stmt->as._while.condition, &exit_jump);
+                if(res != HRES_OK) return res;
+                res = hstate_compile_block(state, stmt->as._while.body);
+                if(res != HRES_OK) return res;
+                hvm_module_append(&state->mod, HVM_MAKE_INST(
+                            HVM_INST_JMP,
+                            HVM_WORD_U64(start)));
+                state->mod.items[exit_jump].op = HVM_WORD_U64(state->mod.count);
+                UT_ASSERT(state->vsp == base);
+            } break;
+        case HSTMT_BLOCK:
+            {
+                hResult res = hstate_compile_block(state, stmt->as.block);
+                if(res != HRES_OK) return res;
             } break;
 
         case HSTMT_DUMP:
             {
-                hResult res = hstate_compile_expr(state, &stmt->as.dump);
+                hResult res = hstate_compile_expr(state, stmt->as.dump);
                 if(res != HRES_OK) return res;
 
                 hvm_module_append(&state->mod, HVM_MAKE_INST(
                             HVM_INST_DUMP,
                             HVM_NULL_WORD));
+                state->vsp -= 1;
             } break;
         default:
             {
@@ -325,21 +464,22 @@ hResult hstate_exec_stmt(hState *state, const hStmt *stmt)
         case HSTMT_VAR_INIT:
             {
                 uint32_t last_sp = state->vm.sp;
-                hResult res = hstate_exec_expr(state, &stmt->as.var_init.value);
+                hResult res = hstate_exec_expr(state, stmt->as.var_init.value);
                 if(res != HRES_OK) return res;
                 hVarBinding var;
                 var.name = stmt->as.var_init.name;
+                var.symbol = hstate_symbol(state, var.name);
                 var.pos = last_sp;
-                hscope_append(state->current, var, &state->arena);
+                hscope_append(state->current, var, hstate_scope_arena(state));
             } break;
         case HSTMT_VAR_ASSIGN:
             {
                 HVM_Inst inst;
 
-                hVarBinding *var = hscope_find(state->current, stmt->as.var_assign.name);
+                hVarBinding *var = hscope_find(state->current, hstate_symbol(state, stmt->as.var_assign.name));
                 if(!var) return HRES_INVALID_VARIABLE;
 
-                hResult res = hstate_exec_expr(state, &stmt->as.var_assign.value);
+                hResult res = hstate_exec_expr(state, stmt->as.var_assign.value);
                 if(res != HRES_OK) return res;
 
                 inst.type = HVM_INST_SWAPABS;
@@ -352,24 +492,35 @@ hResult hstate_exec_stmt(hState *state, const hStmt *stmt)
 
         case HSTMT_WHILE:
         case HSTMT_IF:
+        case HSTMT_BLOCK:
             {
                 hvm_module_init(&state->mod);
                 state->mod.count = 0;
+                // The module runs on top of what the statements before it left on the stack
+                state->vsp = state->vm.sp;
                 hstate_compile_stmt(state, stmt);
                 hvm_module_append(&state->mod, HVM_MAKE_INST(
                             HVM_INST_HALT,
                             HVM_NULL_WORD));
+                // Most statements run once, only the loops that get hot are worth optimizing. The module
+                // starts on top of the variables so it's verified with them on the stack.
+                HVM_Tiering tiering;
+                if(state->tier_threshold > 0 && state->vm.ss == 0 && hvm_module_verify_from(&state->mod, state->vm.sp)) {
+                    hvm_tiering_init(&tiering, state->mod, state->tier_threshold);
+                    state->mod.tiering = &tiering;
+                }
                 uint32_t last_pc = state->vm.pc;
                 state->vm.pc = 0;
                 hvm_exec_module(&state->vm, state->mod);
                 state->vm.halt = ut_false;
                 state->vm.pc = last_pc;
+                if(state->mod.tiering) hvm_tiering_deinit(&tiering);
                 hvm_module_deinit(&state->mod);
             } break;
 
         case HSTMT_DUMP:
             {
-                hResult res = hstate_exec_expr(state, &stmt->as.dump);
+                hResult res = hstate_exec_expr(state, stmt->as.dump);
                 if(res != HRES_OK) return res;
 
                 hvm_exec(&state->vm, HVM_MAKE_INST(
@@ -385,3 +536,245 @@ hResult hstate_exec_stmt(hState *state, const hStmt *stmt)
     return HRES_OK;
 }
 
+
+static uint32_t hstate_alloc_reg(hState *state)
+{
+    uint32_t reg = state->vsp;
+    if(reg >= HVM_STACK_CAPACITY || reg >= UINT16_MAX) {
+        hlog_message(HLOG_FATAL, "Ran out of registers, the program needs more than %u", reg);
+    }
+    state->vsp += 1;
+    if(state->vsp > state->rmod.reg_count) state->rmod.reg_count = state->vsp;
+    return reg;
+}
+
+// Get a register holding the value of `expr`. Variables are read in place, anything
+// else is computed into a new temporary register.
+static hResult hstate_compile_reg_operand(hState *state, hExprId id, uint32_t *reg)
+{
+    const hExpr *expr = HAST_EXPR(state->ast, id);
+    if(expr->type == HEXPR_VAR_READ) {
+        hVarBinding *var = hscope_find(state->current, hstate_symbol(state, expr->as.var_read.name));
+        if(!var) return HRES_INVALID_VARIABLE;
+        *reg = var->pos;
+        return HRES_OK;
+    }
+    *reg = hstate_alloc_reg(state);
+    return hstate_compile_reg_expr(state, id, *reg);
+}
+
+hResult hstate_compile_reg_expr(hState *state, hExprId id, uint32_t dst)
+{
+    UT_ASSERT(state);
+    const hExpr *expr = HAST_EXPR(state->ast, id);
+
+    switch(expr->type) {
+        case HEXPR_INT_LITERAL:
+            {
+                hvm_reg_module_append(&state->rmod, HVM_MAKE_RINST(
+                            HVM_RINST_LOADI, dst, 0, 0,
+                            HVM_WORD_I64(expr->as.int_literal)));
+            } break;
+        case HEXPR_VAR_READ:
+            {
+                hVarBinding *var = hscope_find(state->current, hstate_symbol(state, expr->as.var_read.name));
+                if(!var) return HRES_INVALID_VARIABLE;
+                if(var->pos != dst) {
+                    hvm_reg_module_append(&state->rmod, HVM_MAKE_RINST(
+                                HVM_RINST_MOV, dst, var->pos, 0, HVM_NULL_WORD));
+                }
+            } break;
+        case HEXPR_BINOP:
+            {
+                hBinOpType type = expr->as.binop.type;
+                hExprId left = expr->as.binop.left;
+                hExprId right = expr->as.binop.right;
+                if(HAST_EXPR(state->ast, left)->type == HEXPR_INT_LITERAL && HAST_EXPR(state->ast, right)->type != HEXPR_INT_LITERAL
+                        && _binops_info[type].swapped != HBINOP_NONE) {
+                    type = _binops_info[type].swapped;
+                    UT_SWAP(hExprId, left, right);
+                }
+                hBinOpInfo info = _binops_info[type];
+
+                // Temporaries are dead once the result is written so they're released right away
+                uint32_t base = state->vsp;
+                uint32_t a, b;
+                hResult res = hstate_compile_reg_operand(state, left, &a);
+                if(res != HRES_OK) return res;
+                if(HAST_EXPR(state->ast, right)->type == HEXPR_INT_LITERAL) {
+                    hvm_reg_module_append(&state->rmod, HVM_MAKE_RINST(
+                                info.rinsti, dst, a, 0, 
+                                HVM_WORD_I64(HAST_EXPR(state->ast, right)->as.int_literal)));
+                } else {
+                    res = hstate_compile_reg_operand(state, right, &b);
+                    if(res != HRES_OK) return res;
+                    hvm_reg_module_append(&state->rmod, HVM_MAKE_RINST(
+                                info.rinst, dst, a, b, HVM_NULL_WORD));
+                }
+                state->vsp = base;
+            } break;
+        default:
+            UT_ASSERT(0 && "Unreachable expr in hstate_compile_reg_expr()");
+            break;
+    }
+
+    return HRES_OK;
+}
+
+static hResult hstate_compile_reg_block(hState *state, const hBlock block)
+{
+    hScope scope;
+    ut_memset(&scope, 0, sizeof(scope));
+    scope.prev = state->current;
+    state->current = &scope;
+    uint32_t base = state->vsp;
+
+    hResult res = HRES_OK;
+    for(uint32_t i = 0; i < block.count && res == HRES_OK; ++i) {
+        res = hstate_compile_reg_stmt(state, &block.items[i]);
+    }
+
+    state->vsp = base;
+    state->current = scope.prev;
+    return res;
+}
+
+// Compile the condition and emit a jump that's taken when it's false, returns the index of the jump to be patched
+static hResult hstate_compile_reg_branch(hState *state, hExprId condition, uint32_t *jump)
+{
+    uint32_t base = state->vsp;
+    uint32_t reg;
+    hResult res = hstate_compile_reg_operand(state, condition, &reg);
+    if(res != HRES_OK) return res;
+    state->vsp = base;
+    *jump = state->rmod.count;
+    hvm_reg_module_append(&state->rmod, HVM_MAKE_RINST(
+                HVM_RINST_JZ, 0, reg, 0, HVM_NULL_WORD));
+    return HRES_OK;
+}
+
+hResult hstate_compile_reg_stmt(hState *state, const hStmt *stmt)
+{
+    UT_ASSERT(state);
+    UT_ASSERT(stmt);
+
+    hResult res = HRES_OK;
+    switch(stmt->type) {
+        case HSTMT_VAR_INIT:
+            {
+                uint32_t reg = hstate_alloc_reg(state);
+                res = hstate_compile_reg_expr(state, stmt->as.var_init.value, reg);
+                if(res != HRES_OK) return res;
+                hVarBinding var;
+                var.name = stmt->as.var_init.name;
+                var.symbol = hstate_symbol(state, var.name);
+                var.pos = reg;
+                hscope_append(state->current, var, hstate_scope_arena(state));
+            } break;
+        case HSTMT_VAR_ASSIGN:
+            {
+                hVarBinding *var = hscope_find(state->current, hstate_symbol(state, stmt->as.var_assign.name));
+                if(!var) return HRES_INVALID_VARIABLE;
+                res = hstate_compile_reg_expr(state, stmt->as.var_assign.value, var->pos);
+            } break;
+        case HSTMT_WHILE:
+            {
+                uint32_t start = state->rmod.count;
+                uint32_t exit_jump;
+                res = hstate_compile_reg_branch(state, stmt->as._while.condition, &exit_jump);
+                if(res != HRES_OK) return res;
+                res = hstate_compile_reg_block(state, stmt->as._while.body);
+                if(res != HRES_OK) return res;
+                hvm_reg_module_append(&state->rmod, HVM_MAKE_RINST(
+                            HVM_RINST_JMP, 0, 0, 0, HVM_WORD_U64(start)));
+                state->rmod.items[exit_jump].imm = HVM_WORD_U64(state->rmod.count);
+            } break;
+        case HSTMT_IF:
+            {
+                struct { uint32_t *items; uint32_t count; uint32_t capacity; } done = {0};
+                uint32_t next_jump;
+                res = hstate_compile_reg_branch(state, stmt->as._if.condition, &next_jump);
+                if(res != HRES_OK) return res;
+                res = hstate_compile_reg_block(state, stmt->as._if.body);
+                if(res != HRES_OK) return res;
+                arena_da_append(&state->scratch, &done, state->rmod.count);
+                hvm_reg_module_append(&state->rmod, HVM_MAKE_RINST(
+                            HVM_RINST_JMP, 0, 0, 0, HVM_NULL_WORD));
+
+                for(uint32_t i = 0; i < stmt->as._if._elif.count; ++i) {
+                    const hElifBlock *elif = &stmt->as._if._elif.items[i];
+                    state->rmod.items[next_jump].imm = HVM_WORD_U64(state->rmod.count);
+                    res = hstate_compile_reg_branch(state, elif->condition, &next_jump);
+                    if(res != HRES_OK) return res;
+                    res = hstate_compile_reg_block(state, elif->body);
+                    if(res != HRES_OK) return res;
+                    arena_da_append(&state->scratch, &done, state->rmod.count);
+                    hvm_reg_module_append(&state->rmod, HVM_MAKE_RINST(
+                                HVM_RINST_JMP, 0, 0, 0, HVM_NULL_WORD));
+                }
+
+                state->rmod.items[next_jump].imm = HVM_WORD_U64(state->rmod.count);
+                res = hstate_compile_reg_block(state, stmt->as._if._else);
+                if(res != HRES_OK) return res;
+                for(uint32_t i = 0; i < done.count; ++i) {
+                    state->rmod.items[done.items[i]].imm = HVM_WORD_U64(state->rmod.count);
+                }
+            } break;
+        case HSTMT_BLOCK:
+            {
+                res = hstate_compile_reg_block(state, stmt->as.block);
+            } break;
+        case HSTMT_DUMP:
+            {
+                uint32_t base = state->vsp;
+                uint32_t reg;
+                res = hstate_compile_reg_operand(state, stmt->as.dump, &reg);
+                if(res != HRES_OK) return res;
+                state->vsp = base;
+                hvm_reg_module_append(&state->rmod, HVM_MAKE_RINST(
+                            HVM_RINST_DUMP, 0, reg, 0, HVM_NULL_WORD));
+            } break;
+        default:
+            {
+                UT_ASSERT(0 && "Unreachable stmt in hstate_compile_reg_stmt()");
+            } break;
+    }
+
+    return res;
+}
+
+ut_bool hstate_save_module(hState *state, const char *file_path, const uint32_t *fuse_map)
+{
+    UT_ASSERT(state);
+    Arena a;
+    ut_memset(&a, 0, sizeof(a));
+
+    Buffer symbols;
+    buffer_init(&symbols);
+    for(ut_size i = 0; i < state->global.count; ++i) {
+        hVarBinding binding = state->global.items[i];
+        HVM_SymbolEntry symbol = { .kind = HVM_SYMBOL_VARIABLE, .value = binding.pos, .name_size = (uint32_t)binding.name.count };
+        buffer_append_with_arena(&symbols, &symbol, sizeof(symbol), &a);
+        if(binding.name.count > 0) buffer_append_with_arena(&symbols, (void *)binding.name.data, binding.name.count, &a);
+    }
+
+    Buffer lines;
+    buffer_init(&lines);
+    uint32_t last_pc = UINT32_MAX;
+    for(uint32_t i = 0; i < state->lines.count; ++i) {
+        HVM_LineEntry line = state->lines.items[i];
+        if(fuse_map) line.pc = fuse_map[line.pc];
+        // A statement fused entirely into the next one has no code of its own
+        if(line.pc == last_pc) continue;
+        last_pc = line.pc;
+        buffer_append_with_arena(&lines, &line, sizeof(line), &a);
+    }
+
+    HVM_Section sections[] = {
+        { .kind = HVM_SECTION_SYMBOLS, .data = symbols.data, .size = symbols.count },
+        { .kind = HVM_SECTION_DEBUG_LINES, .data = lines.data, .size = lines.count },
+    };
+    ut_bool res = hvm_module_save_to_file_with_sections(state->mod, file_path, sections, UT_ARRAY_LEN(sections));
+    arena_free(&a);
+    return res;
+}
@@ -2,10 +2,14 @@
 #define HOTARU_H_
 
 #include <stdint.h>
+#include <stdio.h>
 
 #include "hvm.h"
 #include "utils.h"
 
+// Bump it whenever the generated code changes, cached modules from other versions are recompiled
+#define HOTARU_VERSION UT_MAKE_VERSION(0, 2, 0)
+
 typedef enum hResult {
     HRES_OK = 0,
     HRES_INVALID_VARIABLE,
@@ -48,11 +52,13 @@ typedef enum hExprType {
     HEXPR_VAR_READ,
 } hExprType;
 
+// Expressions of a source live in a single pool and refer to each other by their index in it
+typedef uint32_t hExprId;
+
 typedef struct hBinOpExpr {
-    hPosition pos;
     hBinOpType type;
-    hExpr *left;
-    hExpr *right;
+    hExprId left;
+    hExprId right;
 } hBinOpExpr;
 
 struct hExpr {
@@ -69,6 +75,17 @@ struct hExpr {
     } as;
 };
 
+typedef struct hAst {
+    Arena arena; // the pool and every block of statements
+    struct {
+        hExpr *items;
+        uint32_t count;
+        uint32_t capacity;
+    } exprs;
+} hAst;
+
+#define HAST_EXPR(ast, id) (&(ast)->exprs.items[(id)])
+
 typedef struct hStmt hStmt;
 
 typedef struct hBlock {
@@ -85,6 +102,7 @@ typedef enum hStmtType {
     HSTMT_WHILE,
     HSTMT_IF,
     HSTMT_FUNC_DEF,
+    HSTMT_BLOCK, // never parsed, left behind when an if is folded into the only branch that runs
 
     HSTMT_DUMP,
 } hStmtType;
@@ -92,18 +110,18 @@ typedef enum hStmtType {
 typedef struct hVarInitAndAssignStmt {
     hPosition pos;
     StringView name;
-    hExpr value;
+    hExprId value;
 } hVarInitAndAssignStmt;
 
 typedef struct hWhileStmt {
     hPosition pos;
-    hExpr condition;
+    hExprId condition;
     hBlock body;
 } hWhileStmt;
 
 typedef struct hElifBlock {
     hPosition pos;
-    hExpr condition;
+    hExprId condition;
     hBlock body;
 } hElifBlock;
 
@@ -113,7 +131,7 @@ typedef struct hFuncDef {
 
 typedef struct hIfStmt {
     hPosition pos;
-    hExpr condition;
+    hExprId condition;
     hBlock body;
     // TODO: maybe linked list will be more efficient
     struct {
@@ -132,14 +150,28 @@ struct hStmt {
         hVarInitAndAssignStmt var_assign;
         hWhileStmt _while;
         hIfStmt _if;
+        hBlock block;
 
-        hExpr dump;
-        hExpr expr;
+        hExprId dump;
+        hExprId expr;
     } as;
 };
 
+// Gives every distinct identifier an id so names are compared as integers after they're looked up once
+typedef struct hInterner {
+    struct {
+        StringView *items;
+        uint32_t count;
+        uint32_t capacity;
+    } names; // indexed by id
+    uint32_t *hashes;
+    uint32_t *table; // open addressing, holds id + 1 and 0 when empty
+    uint32_t table_capacity;
+} hInterner;
+
 typedef struct hVarBinding {
     StringView name;
+    uint32_t symbol; // id of the name in the interner
     uint32_t pos; // addr or absolute index in stack
 } hVarBinding;
 
@@ -150,33 +182,196 @@ struct hScope {
     hVarBinding *items;
     ut_size count;
     ut_size capacity;
+    // Open addressing on the symbol, holds the index of the latest binding + 1 and 0 when empty
+    uint32_t *table;
+    uint32_t table_capacity;
 };
 
 typedef struct hState {
     HVM vm;
     Arena arena;
+    Arena scratch; // block scopes and jump lists of the statement being compiled, rewound after it
+    hInterner symbols;
     hScope global;
+    const hAst *ast; // expressions of the source being compiled
 
     HVM_Module mod;
-    uint32_t vsp; // virtual stack pointer
+    HVM_RegModule rmod;
+    uint32_t vsp; // virtual stack pointer, or the next free register when compiling for the register VM
     uint32_t vss; // virtual stack scope
+    uint32_t tier_threshold; // backward jumps before a loop is promoted when running, 0 disables tiering
+    uint32_t unroll_factor; // how many times small counted loops are unrolled when compiling through the IR
+    uint32_t lex_threads; // tokenize the whole source up front on up to this many threads, 0 lexes while parsing
+
+    // Where the code of every top level statement starts in `mod`, saved as the debug line section
+    struct {
+        HVM_LineEntry *items;
+        uint32_t count;
+        uint32_t capacity;
+    } lines;
 
     hScope *current;
 } hState;
 
+// Mid-level IR: SSA values over basic blocks. Every instruction is a value, its index in
+// hIrFunc.insts is how it's referred to.
+#define HIR_NO_VALUE UINT32_MAX
+#define HIR_DEFAULT_UNROLL_FACTOR 4
+
+typedef enum hIrOp {
+    HIR_NONE = 0, // removed by a pass
+    HIR_CONST,
+    HIR_BINOP,
+    HIR_PHI,
+    HIR_COPY,
+    HIR_DUMP,
+
+    // Terminators, the targets are the successors of the block
+    HIR_JMP,
+    HIR_BRANCH, // to succs[0] when args[0] is not zero, otherwise to succs[1]
+    HIR_HALT,
+} hIrOp;
+
+typedef struct hIrInst {
+    hIrOp op;
+    hBinOpType binop;
+    uint32_t block;
+    uint32_t args[2];
+    int64_t value;
+    // The incoming value of a phi from every predecessor, in the same order as hIrBlock.preds
+    struct {
+        uint32_t *items;
+        uint32_t count;
+        uint32_t capacity;
+    } phi;
+} hIrInst;
+
+typedef struct hIrIncompletePhi {
+    uint32_t var;
+    uint32_t phi;
+} hIrIncompletePhi;
+
+typedef struct hIrBlock {
+    struct {
+        uint32_t *items;
+        uint32_t count;
+        uint32_t capacity;
+    } insts;
+    struct {
+        uint32_t *items;
+        uint32_t count;
+        uint32_t capacity;
+    } preds;
+    uint32_t succs[2];
+    uint32_t succ_count;
+    uint32_t term;
+    ut_bool dead;
+
+    // Only used while building, a block is sealed once all of its predecessors are known
+    ut_bool sealed;
+    struct {
+        hIrIncompletePhi *items;
+        uint32_t count;
+        uint32_t capacity;
+    } incomplete;
+} hIrBlock;
+
+// Blocks [header, last] are the body of a loop, the builder creates them in order
+typedef struct hIrLoop {
+    uint32_t header;
+    uint32_t last;
+} hIrLoop;
+
+typedef struct hIrFunc {
+    Arena arena;
+    struct {
+        hIrInst *items;
+        uint32_t count;
+        uint32_t capacity;
+    } insts;
+    struct {
+        hIrBlock *items;
+        uint32_t count;
+        uint32_t capacity;
+    } blocks;
+    struct {
+        hIrLoop *items;
+        uint32_t count;
+        uint32_t capacity;
+    } loops;
+    uint32_t unroll_factor; // 0 or 1 disables unrolling
+} hIrFunc;
+
+// The value a variable has at the end of a block so far
+typedef struct hIrDef {
+    uint32_t var;
+    uint32_t block;
+    uint32_t value; // HIR_NO_VALUE when the slot is empty
+} hIrDef;
+
+typedef struct hIrBuilder {
+    hIrFunc *fn;
+    uint32_t block;
+    const hAst *ast;
+    hInterner symbols;
+    hScope global;
+    hScope *current;
+    uint32_t var_count; // hVarBinding.pos numbers the variables
+    // Open addressing on (var, block) so a lookup doesn't depend on how many blocks wrote the variable
+    hIrDef *defs;
+    uint32_t def_count;
+    uint32_t def_capacity;
+} hIrBuilder;
+
 void hlog_message(hLogLevel level, const char *fmt, ...);
 
-hVarBinding *hscope_find(const hScope *scope, StringView name);
+uint32_t hinterner_intern(hInterner *interner, StringView name, Arena *arena);
+hVarBinding *hscope_find(const hScope *scope, uint32_t symbol);
 hVarBinding *hscope_append(hScope *scope, hVarBinding binding, Arena *arena);
 
 void hstate_init(hState *state);
 void hstate_deinit(hState *state);
-hResult hstate_exec_expr(hState *state, const hExpr *expr);
+hResult hstate_exec_expr(hState *state, hExprId expr);
 hResult hstate_exec_stmt(hState *state, const hStmt *stmt);
 hResult hstate_exec_source(hState *state, const char *source);
+hResult hstate_exec_stream(hState *state, FILE *stream);
 
-hResult hstate_compile_expr(hState *state, const hExpr *expr);
+hResult hstate_compile_expr(hState *state, hExprId expr);
 hResult hstate_compile_stmt(hState *state, const hStmt *stmt);
 hResult hstate_compile_source(hState *state, const char *source);
+hResult hstate_compile_stream(hState *state, FILE *stream);
+ut_bool hstate_save_module(hState *state, const char *file_path, const uint32_t *fuse_map);
+
+hResult hstate_compile_reg_expr(hState *state, hExprId expr, uint32_t dst);
+hResult hstate_compile_reg_stmt(hState *state, const hStmt *stmt);
+hResult hstate_compile_reg_source(hState *state, const char *source);
+hResult hstate_compile_reg_stream(hState *state, FILE *stream);
+
+HVM_InstType hbinop_inst(hBinOpType type);
+int64_t hbinop_eval(hBinOpType type, int64_t a, int64_t b);
+
+ut_size hlexer_count_tokens(const char *source, ut_uint32 threads);
+hResult hstate_compile_ir_source(hState *state, const char *source);
+hResult hstate_compile_ir_stream(hState *state, FILE *stream);
+
+void hir_init(hIrFunc *fn);
+void hir_deinit(hIrFunc *fn);
+void hir_dump(const hIrFunc *fn);
+void hir_builder_init(hIrBuilder *builder, hIrFunc *fn, const hAst *ast);
+hResult hir_build_stmt(hIrBuilder *builder, const hStmt *stmt);
+void hir_builder_finish(hIrBuilder *builder);
+void hir_copy_propagate(hIrFunc *fn);
+void hir_sccp(hIrFunc *fn);
+void hir_dce(hIrFunc *fn);
+void hir_gvn(hIrFunc *fn);
+void hir_licm(hIrFunc *fn);
+void hir_strength_reduce(hIrFunc *fn);
+void hir_unroll(hIrFunc *fn, uint32_t factor);
+void hir_optimize(hIrFunc *fn);
+void hir_lower(const hIrFunc *fn, HVM_Module *mod);
+
+void hopt_fold_expr(hAst *ast, hExprId expr);
+void hopt_fold_stmt(hAst *ast, hStmt *stmt);
+void hopt_fold_block(hAst *ast, hBlock *block);
 
 #endif // HOTARU_H_
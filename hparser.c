@@ -2,8 +2,18 @@
 #include "hvm.h"
 #include "utils.h"
 #include <stdio.h>
+#include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+#define HLEXER_HAS_THREADS
+#define HLEXER_HAS_READ
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 #define HLEXER_CACHE_CAPACITY 32
+#define HLEXER_MAX_THREADS 64
+#define HLEXER_MIN_CHUNK_SIZE (256*1024) // smaller pieces of source aren't worth a thread
+#define HLEXER_STREAM_CHUNK_SIZE (64*1024) // most that's read from a stream at once
 
 typedef enum hTokenType {
     HTOKEN_NONE = 0,
@@ -86,11 +96,16 @@ typedef struct hToken {
     hPosition pos;
 } hToken;
 
+typedef struct hTokens {
+    hToken *items;
+    ut_size count;
+    ut_size capacity;
+} hTokens;
+
 typedef struct hLexer {
     StringView source;
     ut_size i;
-    char cc;
-    char pc;
+    ut_size line_start; // index of the first character in the current row
 
     hPosition cpos;
     struct {
@@ -98,8 +113,85 @@ typedef struct hLexer {
         ut_uint32 head, tail;
         ut_bool carry;
     } cache;
+
+    // Set by hlexer_tokenize(), the tokens are then read from here instead of being scanned one at a time.
+    // The last one is always HTOKEN_EOF.
+    hTokens tokens;
+    ut_size token_index;
+
+    // Set when the source is read from a stream. `source` is then a window over the whole rows read so
+    // far, the partial row after them waits behind the NUL that ends the window.
+    FILE *stream;
+    ut_bool stream_done;
+    Arena window_arena;
+    char *window;
+    ut_size window_capacity;
+    ut_size window_filled;
+    char window_saved; // the byte under the NUL
+    // The window moves under the tokens, so every name is copied once into an arena that outlives the lexer
+    Arena *names_arena;
+    hInterner names;
 } hLexer;
 
+// Classes of every byte, a byte can be in more than one
+enum {
+    HCHAR_SPACE = 1,
+    HCHAR_ALPHA = 2, // starts an identifier
+    HCHAR_DIGIT = 4,
+    HCHAR_IDENT = 8, // continues an identifier
+};
+
+static const uint8_t _char_classes[256] = {
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  1,  1,  0,  0,  1,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     1,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    12, 12, 12, 12, 12, 12, 12, 12, 12, 12,  0,  0,  0,  0,  0,  0,
+     0, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,
+    10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,  0,  0,  0,  0,  8,
+     0, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,
+    10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+};
+
+// Tokens made of a single character, and the ones made of that character followed by `=`
+static const hTokenType _char_tokens[256] = {
+    ['{'] = HTOKEN_LCURLY, ['}'] = HTOKEN_RCURLY, ['('] = HTOKEN_LPAREN, [')'] = HTOKEN_RPAREN,
+    [';'] = HTOKEN_SEMICOLON, ['+'] = HTOKEN_PLUS, ['-'] = HTOKEN_MINUS, ['*'] = HTOKEN_ASTERISK,
+    ['='] = HTOKEN_ASSIGN, ['>'] = HTOKEN_GT, ['<'] = HTOKEN_LT,
+};
+
+static const hTokenType _char_eq_tokens[256] = {
+    ['='] = HTOKEN_EQ, ['!'] = HTOKEN_NE, ['>'] = HTOKEN_GE, ['<'] = HTOKEN_LE,
+};
+
+typedef struct hKeyword {
+    const char *text;
+    ut_size length;
+    hTokenType type;
+} hKeyword;
+
+// Perfect hash of the keywords, every keyword lands on its own slot so a single compare tells
+// whether an identifier is a keyword. Has to be updated together with _keywords.
+#define HKEYWORD_HASH(name, length) (((uint8_t)(name)[0] + (uint8_t)(name)[(length) - 1]*5 + (length)) & 7)
+
+static const hKeyword _keywords[8] = {
+    [0] = { "dump", 4, HTOKEN_DUMP },
+    [1] = { "if", 2, HTOKEN_IF },
+    [2] = { "else", 4, HTOKEN_ELSE },
+    [3] = { "var", 3, HTOKEN_VAR },
+    [4] = { "continue", 8, HTOKEN_CONTINUE },
+    [5] = { "while", 5, HTOKEN_WHILE },
+    [6] = { "break", 5, HTOKEN_BREAK },
+    [7] = { "elif", 4, HTOKEN_ELIF },
+};
+
 static inline ut_uint32 hlexer_cache_count(hLexer *lex)
 {
     return (lex->cache.head + HLEXER_CACHE_CAPACITY - lex->cache.tail) % HLEXER_CACHE_CAPACITY;
@@ -141,173 +233,185 @@ ut_bool hlexer_cache_shift(hLexer *lex, hToken *item)
     return ut_true;
 }
 
-ut_bool hlexer_cache_extend(hLexer *lex, hTokenType type, StringView literal)
+static hTokenType hlexer_keyword(const char *name, ut_size length)
 {
-    hToken tok;
-    tok.type = type;
-    tok.literal = literal;
-    tok.pos = lex->cpos;
-    return hlexer_cache_push(lex, tok);
+    const hKeyword *keyword = &_keywords[HKEYWORD_HASH(name, length)];
+    if(keyword->length != length) return HTOKEN_IDENTIFIER;
+    for(ut_size i = 0; i < length; ++i) {
+        if(keyword->text[i] != name[i]) return HTOKEN_IDENTIFIER;
+    }
+    return keyword->type;
 }
 
-void hlexer_advance(hLexer *lex)
+static StringView hlexer_stream_name(hLexer *lex, StringView name)
 {
-    lex->i += 1;
-    lex->cc = lex->source.data[lex->i];
-    lex->pc = lex->i + 1 < lex->source.count ? lex->source.data[lex->i + 1] : 0;
-    lex->cpos.col += 1;
+    uint32_t count = lex->names.names.count;
+    uint32_t id = hinterner_intern(&lex->names, name, lex->names_arena);
+    if(id == count) {
+        char *copy = arena_malloc(lex->names_arena, name.count + 1);
+        UT_ASSERT(copy);
+        ut_memcpy(copy, name.data, name.count);
+        copy[name.count] = '\0';
+        lex->names.names.items[id] = sv_from(copy, name.count);
+    }
+    return lex->names.names.items[id];
 }
 
-ut_bool hlexer_cache_next(hLexer *lex)
+// Drops what the lexer is done with from the front of the window and reads until there's at least
+// one more whole row in it, so a token never runs past the end of the window. Returns false when
+// the stream has nothing left.
+static ut_bool hlexer_refill(hLexer *lex)
 {
-    while(ut_isspace(lex->cc)) {
-        if(lex->cc == '\n') {
-            lex->cpos.row += 1;
-            lex->cpos.col = 0;
+    ut_size count = lex->source.count;
+    if(lex->stream_done && count == lex->window_filled) return ut_false;
+    lex->window[count] = lex->window_saved;
+
+    // The current row stays for the columns, and so does every token still waiting in the cache
+    ut_size keep = UT_MIN(lex->line_start, lex->i);
+    ut_uint32 cached = hlexer_cache_count(lex);
+    for(ut_uint32 k = 0; k < cached; ++k) {
+        const hToken *tok = &lex->cache.items[(lex->cache.tail + k) % HLEXER_CACHE_CAPACITY];
+        if(tok->literal.data >= lex->window && tok->literal.data <= lex->window + count) {
+            keep = UT_MIN(keep, (ut_size)(tok->literal.data - lex->window));
         }
-        hlexer_advance(lex);
+    }
+    if(keep > 0) {
+        memmove(lex->window, lex->window + keep, lex->window_filled - keep);
+        for(ut_uint32 k = 0; k < cached; ++k) {
+            hToken *tok = &lex->cache.items[(lex->cache.tail + k) % HLEXER_CACHE_CAPACITY];
+            if(tok->literal.data >= lex->window + keep && tok->literal.data <= lex->window + count) tok->literal.data -= keep;
+        }
+        lex->i -= keep;
+        lex->line_start -= keep;
+        lex->window_filled -= keep;
+        count -= keep;
     }
 
-    switch(lex->cc) {
-        case '\0':
-            {
-                hlexer_cache_extend(lex, HTOKEN_EOF, sv_slice(lex->source, lex->i, lex->i + 1));
-                hlexer_advance(lex);
-                return ut_false;
-            } break;
-        case '{':
-            {
-                hlexer_cache_extend(lex, HTOKEN_LCURLY, sv_slice(lex->source, lex->i, lex->i + 1));
-                hlexer_advance(lex);
-            } break;
-        case '}':
-            {
-                hlexer_cache_extend(lex, HTOKEN_RCURLY, sv_slice(lex->source, lex->i, lex->i + 1));
-                hlexer_advance(lex);
-            } break;
-        case '(':
-            {
-                hlexer_cache_extend(lex, HTOKEN_LPAREN, sv_slice(lex->source, lex->i, lex->i + 1));
-                hlexer_advance(lex);
-            } break;
-        case ')':
-            {
-                hlexer_cache_extend(lex, HTOKEN_RPAREN, sv_slice(lex->source, lex->i, lex->i + 1));
-                hlexer_advance(lex);
-            } break;
-        case ';':
-            {
-                hlexer_cache_extend(lex, HTOKEN_SEMICOLON, sv_slice(lex->source, lex->i, lex->i + 1));
-                hlexer_advance(lex);
-            } break;
-        case '+':
-            {
-                hlexer_cache_extend(lex, HTOKEN_PLUS, sv_slice(lex->source, lex->i, lex->i + 1));
-                hlexer_advance(lex);
-            } break;
-        case '-':
-            {
-                hlexer_cache_extend(lex, HTOKEN_MINUS, sv_slice(lex->source, lex->i, lex->i + 1));
-                hlexer_advance(lex);
-            } break;
-        case '*':
-            {
-                hlexer_cache_extend(lex, HTOKEN_ASTERISK, sv_slice(lex->source, lex->i, lex->i + 1));
-                hlexer_advance(lex);
-            } break;
-        case '!':
-            {
-                ut_size start = lex->i;
-                hlexer_advance(lex);
-                if(lex->cc == '=') {
-                    hlexer_cache_extend(lex, HTOKEN_NE, sv_slice(lex->source, start, lex->i));
-                    hlexer_advance(lex);
-                } else {
-                    hlog_message(HLOG_FATAL, "Invalid syntax `!%c`", lex->cc);
-                }
-            } break;
-        case '>':
-            {
-                ut_size start = lex->i;
-                hlexer_advance(lex);
-                if(lex->cc == '=') {
-                    hlexer_cache_extend(lex, HTOKEN_GE, sv_slice(lex->source, start, lex->i));
-                } else {
-                    hlexer_cache_extend(lex, HTOKEN_GT, sv_slice(lex->source, start, lex->i));
-                    hlexer_advance(lex);
-                }
-            } break;
-        case '<':
-            {
-                ut_size start = lex->i;
-                hlexer_advance(lex);
-                if(lex->cc == '=') {
-                    hlexer_cache_extend(lex, HTOKEN_LE, sv_slice(lex->source, start, lex->i));
-                } else {
-                    hlexer_cache_extend(lex, HTOKEN_LT, sv_slice(lex->source, start, lex->i));
-                    hlexer_advance(lex);
-                }
-            } break;
-        case '=':
-            {
-                ut_size start = lex->i;
-                hlexer_advance(lex);
-                if(lex->cc == '=') {
-                    hlexer_cache_extend(lex, HTOKEN_EQ, sv_slice(lex->source, start, lex->i));
-                    hlexer_advance(lex);
-                } else {
-                    hlexer_cache_extend(lex, HTOKEN_ASSIGN, sv_slice(lex->source, start, lex->i));
+    ut_size end = count;
+    while(end == count) {
+        for(ut_size i = lex->window_filled; i > count; --i) {
+            if(lex->window[i - 1] == '\n') {
+                end = i;
+                break;
+            }
+        }
+        if(end > count) break;
+        if(lex->stream_done) {
+            end = lex->window_filled;
+            break;
+        }
+
+        // Only a row longer than everything read so far makes the window grow
+        if(lex->window_filled + HLEXER_STREAM_CHUNK_SIZE + 1 > lex->window_capacity) {
+            ut_size capacity = UT_MAX(lex->window_capacity*2, lex->window_filled + HLEXER_STREAM_CHUNK_SIZE + 1);
+            char *window = arena_malloc(&lex->window_arena, capacity);
+            UT_ASSERT(window);
+            ut_memcpy(window, lex->window, lex->window_filled);
+            for(ut_uint32 k = 0; k < cached; ++k) {
+                hToken *tok = &lex->cache.items[(lex->cache.tail + k) % HLEXER_CACHE_CAPACITY];
+                if(tok->literal.data >= lex->window && tok->literal.data <= lex->window + count) {
+                    tok->literal.data = window + (tok->literal.data - lex->window);
                 }
-            } break;
-        default:
-            {
-                if(ut_isalpha(lex->cc)) {
-                    ut_size start = lex->i;
-                    while(ut_isalnum(lex->cc) || lex->cc== '_') {
-                        hlexer_advance(lex);
-                    }
+            }
+            lex->window = window;
+            lex->window_capacity = capacity;
+        }
+#ifdef HLEXER_HAS_READ
+        // Takes whatever a pipe has right now instead of waiting for the whole chunk
+        long n = (long)read(fileno(lex->stream), lex->window + lex->window_filled, HLEXER_STREAM_CHUNK_SIZE);
+#else
+        long n = (long)fread(lex->window + lex->window_filled, 1, HLEXER_STREAM_CHUNK_SIZE, lex->stream);
+#endif
+        if(n <= 0) lex->stream_done = ut_true;
+        else lex->window_filled += (ut_size)n;
+    }
 
-                    StringView name = sv_slice(lex->source, start, lex->i);
-                    if(sv_eq(name, SV("var"))) {
-                        hlexer_cache_extend(lex, HTOKEN_VAR, name);
-                    } else if(sv_eq(name, SV("while"))) {
-                        hlexer_cache_extend(lex, HTOKEN_WHILE, name);
-                    } else if(sv_eq(name, SV("break"))) {
-                        hlexer_cache_extend(lex, HTOKEN_BREAK, name);
-                    } else if(sv_eq(name, SV("continue"))) {
-                        hlexer_cache_extend(lex, HTOKEN_CONTINUE, name);
-                    } else if(sv_eq(name, SV("if"))) {
-                        hlexer_cache_extend(lex, HTOKEN_IF, name);
-                    } else if(sv_eq(name, SV("else"))) {
-                        hlexer_cache_extend(lex, HTOKEN_ELSE, name);
-                    } else if(sv_eq(name, SV("elif"))) {
-                        hlexer_cache_extend(lex, HTOKEN_ELIF, name);
-                    } else if(sv_eq(name, SV("dump"))) {
-                        hlexer_cache_extend(lex, HTOKEN_DUMP, name);
-                    } else {
-                        hlexer_cache_extend(lex, HTOKEN_IDENTIFIER, name);
-                    }
+    lex->source.data = lex->window;
+    lex->source.count = end;
+    lex->window_saved = lex->window[end];
+    lex->window[end] = '\0';
+    return end > count || lex->i < end;
+}
 
-                } else if(ut_isdigit(lex->cc)) {
-                    ut_size start = lex->i;
-                    ut_bool floating_point = ut_false;
-                    while(ut_isdigit(lex->cc) || lex->cc == '.') {
-                        if(lex->cc == '.') {
-                            if(floating_point) {
-                                hlog_message(HLOG_FATAL, "There's should not be another dot in already floating point token");
-                            }
-                            floating_point = ut_true;
-                        }
-                        hlexer_advance(lex);
-                    }
-                    hlexer_cache_extend(lex, floating_point ? HTOKEN_FLOAT_LITERAL : HTOKEN_INT_LITERAL, 
-                            sv_slice(lex->source, start, lex->i));
-                } else {
-                    hlexer_cache_extend(lex, HTOKEN_NONE, sv_slice(lex->source, lex->i, 1));
+// Scans the next token into the cache, the source is walked through a local index and the class
+// tables so nothing is called per character
+ut_bool hlexer_cache_next(hLexer *lex)
+{
+    const char *src = lex->source.data;
+    ut_size i = lex->i;
+
+    // A single space between tokens is handled here, longer runs like indentation are left to the
+    // SIMD scanner in utils
+    for(;;) {
+        if(_char_classes[(uint8_t)src[i]] & HCHAR_SPACE) {
+            if(src[i] == '\n') {
+                lex->cpos.row += 1;
+                lex->line_start = i + 1;
+            }
+            i += 1;
+            if(_char_classes[(uint8_t)src[i]] & HCHAR_SPACE) {
+                ut_size newlines = 0;
+                ut_size line_start = 0;
+                ut_size run = ut_span_space(src + i, lex->source.count - i, &newlines, &line_start);
+                if(newlines > 0) {
+                    lex->cpos.row += (uint32_t)newlines;
+                    lex->line_start = i + line_start;
                 }
-            } break;
+                i += run;
+            }
+        }
+        // The end of a stream's window only means the next rows have to be read
+        if(i < lex->source.count || !lex->stream) break;
+        lex->i = i;
+        if(!hlexer_refill(lex)) break;
+        src = lex->source.data;
+        i = lex->i;
+    }
+
+    ut_size start = i;
+    uint8_t c = (uint8_t)src[i];
+    uint8_t classes = _char_classes[c];
+    hTokenType type = HTOKEN_NONE;
+    lex->cpos.col = (uint32_t)(start - lex->line_start + 1);
+
+    if(i >= lex->source.count) {
+        // Stays on the end so asking again keeps returning EOF
+        hToken tok = { .type = HTOKEN_EOF, .literal = sv_slice(lex->source, lex->source.count, lex->source.count), .pos = lex->cpos };
+        hlexer_cache_push(lex, tok);
+        lex->i = i;
+        return ut_false;
+    } else if(classes & HCHAR_ALPHA) {
+        i += 1;
+        if(_char_classes[(uint8_t)src[i]] & HCHAR_IDENT) i += ut_span_ident(src + i, lex->source.count - i);
+        type = hlexer_keyword(src + start, i - start);
+    } else if(classes & HCHAR_DIGIT) {
+        ut_bool floating_point = ut_false;
+        i += ut_span_digit(src + i, lex->source.count - i);
+        while(src[i] == '.') {
+            if(floating_point) {
+                hlog_message(HLOG_FATAL, "There's should not be another dot in already floating point token");
+            }
+            floating_point = ut_true;
+            i += 1;
+            i += ut_span_digit(src + i, lex->source.count - i);
+        }
+        type = floating_point ? HTOKEN_FLOAT_LITERAL : HTOKEN_INT_LITERAL;
+    } else if(src[i + 1] == '=' && _char_eq_tokens[c] != HTOKEN_NONE) {
+        type = _char_eq_tokens[c];
+        i += 2;
+    } else if(_char_tokens[c] != HTOKEN_NONE) {
+        type = _char_tokens[c];
+        i += 1;
+    } else if(c == '!') {
+        hlog_message(HLOG_FATAL, "Invalid syntax `!%c`", src[i + 1]);
+    } else {
+        i += 1;
     }
 
+    hToken tok = { .type = type, .literal = sv_slice(lex->source, start, i), .pos = lex->cpos };
+    if(lex->stream && type == HTOKEN_IDENTIFIER) tok.literal = hlexer_stream_name(lex, tok.literal);
+    hlexer_cache_push(lex, tok);
+    lex->i = i;
     return ut_true;
 }
 
@@ -317,15 +421,60 @@ void hlexer_init(hLexer *lex, const char *source)
     UT_ASSERT(source);
     lex->source = sv_from_cstr(source);
     lex->i = 0;
-    lex->cc = lex->source.data[lex->i];
-    lex->pc = lex->i + 1 < lex->source.count ? lex->source.data[lex->i + 1] : 0;
+    lex->line_start = 0;
+    lex->cpos.row = 1;
+    lex->cpos.col = 1;
     lex->cache.carry = ut_false;
     lex->cache.head = 0;
     lex->cache.tail = 0;
+    lex->tokens.items = UT_NULL;
+    lex->tokens.count = 0;
+    lex->tokens.capacity = 0;
+    lex->token_index = 0;
+    lex->stream = UT_NULL;
+    lex->stream_done = ut_false;
+    ut_memset(&lex->window_arena, 0, sizeof(lex->window_arena));
+    lex->window = UT_NULL;
+    lex->window_capacity = 0;
+    lex->window_filled = 0;
+    lex->window_saved = '\0';
+    lex->names_arena = UT_NULL;
+    ut_memset(&lex->names, 0, sizeof(lex->names));
+}
+
+// Lexes `stream` a window at a time so the whole source is never in memory. Identifiers are copied
+// into `names`, which has to outlive whatever is built from the tokens.
+void hlexer_init_stream(hLexer *lex, FILE *stream, Arena *names)
+{
+    UT_ASSERT(lex);
+    UT_ASSERT(stream);
+    UT_ASSERT(names);
+    hlexer_init(lex, "");
+    lex->stream = stream;
+    lex->names_arena = names;
+    lex->window_capacity = HLEXER_STREAM_CHUNK_SIZE + 1;
+    lex->window = arena_malloc(&lex->window_arena, lex->window_capacity);
+    UT_ASSERT(lex->window);
+    lex->source = sv_from(lex->window, 0);
+    hlexer_refill(lex);
+}
+
+void hlexer_deinit(hLexer *lex)
+{
+    UT_ASSERT(lex);
+    arena_free(&lex->window_arena);
+    lex->window = UT_NULL;
 }
 
 ut_bool hlexer_next(hLexer *lex, hToken *token)
 {
+    if(lex->tokens.items) {
+        *token = lex->tokens.items[lex->token_index];
+        lex->cpos = token->pos;
+        if(token->type == HTOKEN_EOF) return ut_false;
+        lex->token_index += 1;
+        return ut_true;
+    }
     if(hlexer_cache_count(lex) == 0) {
         if(!hlexer_cache_next(lex)) {
             return ut_false;
@@ -336,6 +485,11 @@ ut_bool hlexer_next(hLexer *lex, hToken *token)
 
 ut_bool hlexer_peek(hLexer *lex, hToken *token, ut_size index)
 {
+    if(lex->tokens.items) {
+        index = UT_MIN(lex->token_index + index, lex->tokens.count - 1);
+        *token = lex->tokens.items[index];
+        return token->type != HTOKEN_EOF;
+    }
     while(hlexer_cache_count(lex) <= index) {
         if(!hlexer_cache_next(lex)) {
             return ut_false;
@@ -366,69 +520,211 @@ hToken hlexer_expect_token(hLexer *lex, hTokenType expected_type)
     return tok;
 }
 
-hExpr hparse_expr(Arena *a, hLexer *lex)
+typedef struct hLexChunk {
+    hLexer lex;
+    Arena *arena; // the chunk's own unless it's the only one
+    Arena own;
+    hTokens tokens; // ends with the EOF of the chunk
+} hLexChunk;
+
+static void *hlexer_lex_chunk(void *arg)
+{
+    hLexChunk *chunk = arg;
+    // Tokens are rarely shorter than 2 bytes with the space after them, sizing the array up
+    // front saves copying it over and over while it grows
+    ut_size estimate = (chunk->lex.source.count - chunk->lex.i)/2 + 16;
+    chunk->tokens.items = arena_malloc(chunk->arena, sizeof(hToken)*estimate);
+    UT_ASSERT(chunk->tokens.items);
+    chunk->tokens.capacity = estimate;
+
+    hToken token;
+    ut_bool more;
+    do {
+        more = hlexer_cache_next(&chunk->lex);
+        hlexer_cache_shift(&chunk->lex, &token);
+        arena_da_append(chunk->arena, &chunk->tokens, token);
+    } while(more);
+    return UT_NULL;
+}
+
+// Where the chunk after `from` may start: on the first non-space character of a row so no token
+// is cut in half and the whitespace before it stays in the previous chunk. Returns the length of
+// the source when there's no such place.
+static ut_size hlexer_chunk_boundary(StringView source, ut_size from, ut_size *line_start)
+{
+    const char *src = source.data;
+    ut_size i = from;
+    while(i < source.count && src[i] != '\n') i += 1;
+    while(i < source.count && (_char_classes[(uint8_t)src[i]] & HCHAR_SPACE)) {
+        if(src[i] == '\n') *line_start = i + 1;
+        i += 1;
+    }
+    return i;
+}
+
+// Scans the whole source into lex->tokens up front. A big source is split in chunks that are
+// lexed on their own threads, every chunk counts its rows from 1 so the rows are shifted by the
+// rows of the chunks before it when they are put back together.
+static void hlexer_tokenize(hLexer *lex, Arena *a, ut_uint32 threads)
+{
+    UT_ASSERT(lex);
+    UT_ASSERT(a);
+    UT_ASSERT(lex->i == 0 && "The source is tokenized before anything is read from the lexer");
+
+    StringView source = sv_slice(lex->source, 0, lex->source.count);
+    hLexChunk chunks[HLEXER_MAX_THREADS];
+    ut_size count = source.count/HLEXER_MIN_CHUNK_SIZE + 1;
+    count = UT_MIN(count, (ut_size)UT_MAX(threads, 1));
+    count = UT_MIN(count, (ut_size)HLEXER_MAX_THREADS);
+
+    ut_size begin = 0;
+    ut_size line_start = 0;
+    ut_size chunk_count = 0;
+    // The first chunk is there even on an empty source so the EOF is still produced
+    while(chunk_count == 0 || (chunk_count < count && begin < source.count)) {
+        hLexChunk *chunk = &chunks[chunk_count++];
+        ut_memset(chunk, 0, sizeof(*chunk));
+        chunk->lex = *lex;
+        chunk->lex.i = begin;
+        chunk->lex.line_start = line_start;
+        ut_size end = source.count;
+        if(chunk_count < count) {
+            ut_size target = UT_MAX(begin + 1, source.count/count*chunk_count);
+            end = hlexer_chunk_boundary(source, target, &line_start);
+        }
+        chunk->lex.source.count = end;
+        chunk->arena = &chunk->own;
+        begin = end;
+    }
+    if(chunk_count == 1) chunks[0].arena = a;
+
+#ifdef HLEXER_HAS_THREADS
+    pthread_t handles[HLEXER_MAX_THREADS];
+    ut_bool started[HLEXER_MAX_THREADS] = {0};
+    for(ut_size i = 1; i < chunk_count; ++i) {
+        started[i] = pthread_create(&handles[i], UT_NULL, hlexer_lex_chunk, &chunks[i]) == 0;
+    }
+    hlexer_lex_chunk(&chunks[0]);
+    for(ut_size i = 1; i < chunk_count; ++i) {
+        if(started[i]) pthread_join(handles[i], UT_NULL);
+        else hlexer_lex_chunk(&chunks[i]);
+    }
+#else
+    for(ut_size i = 0; i < chunk_count; ++i) hlexer_lex_chunk(&chunks[i]);
+#endif
+
+    hToken *tokens = chunks[0].tokens.items;
+    ut_size total = chunks[0].tokens.count;
+    if(chunk_count > 1) {
+        // Every chunk but the last one drops its EOF
+        total = 1;
+        for(ut_size i = 0; i < chunk_count; ++i) total += chunks[i].tokens.count - 1;
+        tokens = arena_malloc(a, sizeof(hToken)*total);
+        UT_ASSERT(tokens);
+
+        ut_size index = 0;
+        uint32_t rows = 0;
+        for(ut_size i = 0; i < chunk_count; ++i) {
+            hLexChunk *chunk = &chunks[i];
+            ut_size n = chunk->tokens.count - (i + 1 < chunk_count ? 1 : 0);
+            for(ut_size j = 0; j < n; ++j) {
+                tokens[index] = chunk->tokens.items[j];
+                tokens[index].pos.row += rows;
+                index += 1;
+            }
+            rows += chunk->lex.cpos.row - 1;
+            arena_free(&chunk->own);
+        }
+    }
+
+    lex->i = source.count;
+    lex->cpos = tokens[total - 1].pos;
+    lex->tokens.items = tokens;
+    lex->tokens.count = total;
+    lex->tokens.capacity = total;
+    lex->token_index = 0;
+}
+
+ut_size hlexer_count_tokens(const char *source, ut_uint32 threads)
+{
+    UT_ASSERT(source);
+    hLexer lex;
+    hlexer_init(&lex, source);
+    if(threads > 0) {
+        Arena a;
+        ut_memset(&a, 0, sizeof(a));
+        hlexer_tokenize(&lex, &a, threads);
+        ut_size count = lex.tokens.count - 1;
+        arena_free(&a);
+        return count;
+    }
+    hToken token;
+    ut_size count = 0;
+    while(hlexer_next(&lex, &token) && token.type != HTOKEN_EOF) count += 1;
+    return count;
+}
+
+// How tightly each binary operator binds. Operators of the same precedence associate to the left.
+static const int _binop_precedence[COUNT_HBINOP_TYPES] = {
+    [HBINOP_EQ] = 1, [HBINOP_NE] = 1,
+    [HBINOP_GT] = 2, [HBINOP_GE] = 2, [HBINOP_LT] = 2, [HBINOP_LE] = 2,
+    [HBINOP_ADD] = 3, [HBINOP_SUB] = 3,
+    [HBINOP_MUL] = 4,
+};
+
+// Gives back everything parsed since `mark`, a statement is done with once it's been executed or
+// compiled so memory doesn't grow with the length of the source
+static void hast_rewind(hAst *ast, ArenaMark mark)
+{
+    arena_rewind(&ast->arena, mark);
+    ast->exprs.items = UT_NULL;
+    ast->exprs.count = 0;
+    ast->exprs.capacity = 0;
+}
+
+static hExprId hast_push(hAst *ast, hExpr expr)
+{
+    hExprId id = ast->exprs.count;
+    arena_da_append(&ast->arena, &ast->exprs, expr);
+    return id;
+}
+
+static hExprId hparse_binary(hAst *ast, hLexer *lex, int min_precedence);
+
+static hExprId hparse_primary(hAst *ast, hLexer *lex)
 {
     hToken token;
     hExpr res;
     ut_memset(&res, 0, sizeof(res));
 
-    if(!hlexer_peek(lex, &token, 0)) {
+    if(!hlexer_next(lex, &token)) {
         hlog_message(HLOG_FATAL, "There's no token to parse an expression on");
     }
+    res.pos = token.pos;
 
     switch(token.type) {
         case HTOKEN_IDENTIFIER:
             {
-                token = hlexer_expect_token(lex, HTOKEN_IDENTIFIER);
                 hToken ntok;
                 ntok.type = HTOKEN_NONE;
                 hlexer_peek(lex, &ntok, 0);
                 if(ntok.type == HTOKEN_LPAREN) {
                     // TODO: function
                     hlog_message(HLOG_FATAL, "Function call expression is not implemented yet");
-                } else {
-                    res.type = HEXPR_VAR_READ;
-                    res.as.var_read.name = token.literal;
-                }
-
-                hlexer_peek(lex, &ntok, 0);
-                if(_token_infos[ntok.type].is_binop) {
-                    hExpr left = res;
-                    res.type = HEXPR_BINOP;
-                    res.as.binop.type = _token_infos[ntok.type].binop;
-
-                    res.as.binop.left = arena_malloc(a, sizeof(hExpr));
-                    UT_ASSERT(res.as.binop.left);
-                    *res.as.binop.left = left;
-                    hlexer_next(lex, &ntok); // skip the binop token
-
-                    res.as.binop.right = arena_malloc(a, sizeof(hExpr));
-                    UT_ASSERT(res.as.binop.right);
-                    *res.as.binop.right = hparse_expr(a, lex);
                 }
+                res.type = HEXPR_VAR_READ;
+                res.as.var_read.name = token.literal;
             } break;
         case HTOKEN_INT_LITERAL:
             {
-                token = hlexer_expect_token(lex, HTOKEN_INT_LITERAL);
                 res.type = HEXPR_INT_LITERAL;
                 res.as.int_literal = sv_to_int(token.literal);
-
-                hToken ntok;
-                hlexer_peek(lex, &ntok, 0);
-                if(_token_infos[ntok.type].is_binop) {
-                    hExpr left = res;
-                    res.type = HEXPR_BINOP;
-                    res.as.binop.type = _token_infos[ntok.type].binop;
-
-                    res.as.binop.left = arena_malloc(a, sizeof(hExpr));
-                    UT_ASSERT(res.as.binop.left);
-                    *res.as.binop.left = left;
-                    hlexer_next(lex, &ntok); // skip the binop token
-
-                    res.as.binop.right = arena_malloc(a, sizeof(hExpr));
-                    UT_ASSERT(res.as.binop.right);
-                    *res.as.binop.right = hparse_expr(a, lex);
-                }
+            } break;
+        case HTOKEN_LPAREN:
+            {
+                hExprId inner = hparse_binary(ast, lex, 1);
+                hlexer_expect_token(lex, HTOKEN_RPAREN);
+                return inner;
             } break;
         default:
             {
@@ -436,12 +732,44 @@ hExpr hparse_expr(Arena *a, hLexer *lex)
             } break;
     }
 
-    return res;
+    return hast_push(ast, res);
+}
+
+// Precedence climbing: keep folding operators into `left` as long as they bind at least as tightly
+// as `min_precedence`, and parse the right side with a higher minimum so equal operators go left.
+static hExprId hparse_binary(hAst *ast, hLexer *lex, int min_precedence)
+{
+    hExprId left = hparse_primary(ast, lex);
+    hToken token;
+    while(hlexer_peek(lex, &token, 0) && _token_infos[token.type].is_binop) {
+        hBinOpType type = _token_infos[token.type].binop;
+        int precedence = _binop_precedence[type];
+        if(precedence < min_precedence) break;
+        hlexer_next(lex, &token); // skip the binop token
+
+        hExpr res;
+        ut_memset(&res, 0, sizeof(res));
+        hExprId right = hparse_binary(ast, lex, precedence + 1);
+        res.pos = HAST_EXPR(ast, left)->pos;
+        res.type = HEXPR_BINOP;
+        res.as.binop.type = type;
+        res.as.binop.left = left;
+        res.as.binop.right = right;
+        left = hast_push(ast, res);
+    }
+    return left;
 }
 
-hBlock hparse_block(Arena *a, hLexer *lex);
+hExprId hparse_expr(hAst *ast, hLexer *lex)
+{
+    UT_ASSERT(ast);
+    UT_ASSERT(lex);
+    return hparse_binary(ast, lex, 1);
+}
+
+hBlock hparse_block(hAst *ast, hLexer *lex);
 
-hStmt hparse_stmt(Arena *a, hLexer *lex)
+hStmt hparse_stmt(hAst *ast, hLexer *lex)
 {
     hToken token;
     hStmt res = {0};
@@ -451,6 +779,7 @@ hStmt hparse_stmt(Arena *a, hLexer *lex)
         res.type = HSTMT_NONE;
         return res;
     }
+    res.pos = token.pos;
 
     switch(token.type) {
         case HTOKEN_VAR:
@@ -460,7 +789,7 @@ hStmt hparse_stmt(Arena *a, hLexer *lex)
 
                 res.type = HSTMT_VAR_INIT;
                 res.as.var_init.name = name;
-                res.as.var_init.value = hparse_expr(a, lex);
+                res.as.var_init.value = hparse_expr(ast, lex);
                 hlexer_expect_token(lex, HTOKEN_SEMICOLON);
             } break;
         case HTOKEN_IDENTIFIER:
@@ -470,7 +799,7 @@ hStmt hparse_stmt(Arena *a, hLexer *lex)
                 if(ntok.type == HTOKEN_ASSIGN) {
                     res.type = HSTMT_VAR_ASSIGN;
                     res.as.var_assign.name = token.literal;
-                    res.as.var_assign.value = hparse_expr(a, lex);
+                    res.as.var_assign.value = hparse_expr(ast, lex);
                 }
                 hlexer_expect_token(lex, HTOKEN_SEMICOLON);
             } break;
@@ -478,17 +807,17 @@ hStmt hparse_stmt(Arena *a, hLexer *lex)
             {
                 res.type = HSTMT_WHILE;
                 hlexer_expect_token(lex, HTOKEN_LPAREN);
-                res.as._while.condition = hparse_expr(a, lex);
+                res.as._while.condition = hparse_expr(ast, lex);
                 hlexer_expect_token(lex, HTOKEN_RPAREN);
-                res.as._while.body = hparse_block(a, lex);
+                res.as._while.body = hparse_block(ast, lex);
             } break;
         case HTOKEN_IF:
             {
                 res.type = HSTMT_IF;
                 hlexer_expect_token(lex, HTOKEN_LPAREN);
-                res.as._if.condition = hparse_expr(a, lex);
+                res.as._if.condition = hparse_expr(ast, lex);
                 hlexer_expect_token(lex, HTOKEN_RPAREN);
-                res.as._if.body = hparse_block(a, lex);
+                res.as._if.body = hparse_block(ast, lex);
                 while(hlexer_peek(lex, &token, 0) && token.type == HTOKEN_ELSE) {
                     hlexer_next(lex, &token);
                     if(!hlexer_peek(lex, &token, 0)) {
@@ -497,12 +826,12 @@ hStmt hparse_stmt(Arena *a, hLexer *lex)
                     if(hlexer_peek(lex, &token, 0) && token.type == HTOKEN_IF) {
                         hElifBlock elif;
                         hlexer_expect_token(lex, HTOKEN_LPAREN);
-                        elif.condition = hparse_expr(a, lex);
+                        elif.condition = hparse_expr(ast, lex);
                         hlexer_expect_token(lex, HTOKEN_RPAREN);
-                        elif.body = hparse_block(a, lex);
-                        arena_da_append(a, &res.as._if._elif, elif);
+                        elif.body = hparse_block(ast, lex);
+                        arena_da_append(&ast->arena, &res.as._if._elif, elif);
                     } else {
-                        res.as._if._else = hparse_block(a, lex);
+                        res.as._if._else = hparse_block(ast, lex);
                         break;
                     }
                 }
@@ -510,7 +839,7 @@ hStmt hparse_stmt(Arena *a, hLexer *lex)
         case HTOKEN_DUMP:
             {
                 res.type = HSTMT_DUMP;
-                res.as.dump = hparse_expr(a, lex);
+                res.as.dump = hparse_expr(ast, lex);
                 hlexer_expect_token(lex, HTOKEN_SEMICOLON);
             } break;
         default:
@@ -541,16 +870,17 @@ void hblock_push_stmt(hBlock *block, Arena *a, hStmt stmt)
     block->count += 1;
 }
 
-hBlock hparse_block(Arena *a, hLexer *lex)
+hBlock hparse_block(hAst *ast, hLexer *lex)
 {
     hBlock res;
     res.count = 0;
     res.capacity = 0;
     hlexer_expect_token(lex, HTOKEN_LCURLY);
     hToken token;
+    token.type = HTOKEN_NONE;
     while(token.type != HTOKEN_RCURLY) {
-        hStmt stmt = hparse_stmt(a, lex);
-        hblock_push_stmt(&res, a, stmt);
+        hStmt stmt = hparse_stmt(ast, lex);
+        hblock_push_stmt(&res, &ast->arena, stmt);
         if(!hlexer_peek(lex, &token, 0)) {
             hlog_message(HLOG_FATAL, "Expected another statement or '}' token but reached end of file");
         }
@@ -559,40 +889,186 @@ hBlock hparse_block(Arena *a, hLexer *lex)
     return res;
 }
 
+static hResult hstate_exec_lexer(hState *state, hLexer *lex)
+{
+    hAst ast;
+    ut_memset(&ast, 0, sizeof(ast));
+    if(state->lex_threads > 0 && !lex->stream) hlexer_tokenize(lex, &ast.arena, state->lex_threads);
+    ArenaMark mark = arena_mark(&ast.arena); // the tokens stay
+    state->ast = &ast;
+    ArenaMark scratch_mark = arena_mark(&state->scratch);
+    hStmt stmt = hparse_stmt(&ast, lex);
+    while(stmt.type != HSTMT_NONE) {
+        hopt_fold_stmt(&ast, &stmt);
+        if(stmt.type != HSTMT_NONE) hstate_exec_stmt(state, &stmt);
+        hast_rewind(&ast, mark);
+        arena_rewind(&state->scratch, scratch_mark);
+        stmt = hparse_stmt(&ast, lex);
+    }
+    arena_free(&ast.arena);
+    state->ast = UT_NULL;
+    return HRES_OK;
+}
+
+static hResult hstate_compile_lexer(hState *state, hLexer *lex)
+{
+    hAst ast;
+    ut_memset(&ast, 0, sizeof(ast));
+    if(state->lex_threads > 0 && !lex->stream) hlexer_tokenize(lex, &ast.arena, state->lex_threads);
+    ArenaMark mark = arena_mark(&ast.arena); // the tokens stay
+    state->ast = &ast;
+    ArenaMark scratch_mark = arena_mark(&state->scratch);
+    hStmt stmt = hparse_stmt(&ast, lex);
+    while(stmt.type != HSTMT_NONE) {
+        HVM_LineEntry line = { .pc = state->mod.count, .row = stmt.pos.row, .col = stmt.pos.col };
+        arena_da_append(&state->arena, &state->lines, line);
+        hopt_fold_stmt(&ast, &stmt);
+        if(stmt.type != HSTMT_NONE) hstate_compile_stmt(state, &stmt);
+        hast_rewind(&ast, mark);
+        arena_rewind(&state->scratch, scratch_mark);
+        stmt = hparse_stmt(&ast, lex);
+    }
+    hvm_module_append(&state->mod, HVM_MAKE_INST(
+                HVM_INST_HALT, HVM_WORD_U64(0)));
+    arena_free(&ast.arena);
+    state->ast = UT_NULL;
+    return HRES_OK;
+}
+
+static hResult hstate_compile_reg_lexer(hState *state, hLexer *lex)
+{
+    hAst ast;
+    ut_memset(&ast, 0, sizeof(ast));
+    if(state->lex_threads > 0 && !lex->stream) hlexer_tokenize(lex, &ast.arena, state->lex_threads);
+    ArenaMark mark = arena_mark(&ast.arena); // the tokens stay
+    state->ast = &ast;
+    ArenaMark scratch_mark = arena_mark(&state->scratch);
+    hResult res = HRES_OK;
+    hStmt stmt = hparse_stmt(&ast, lex);
+    while(stmt.type != HSTMT_NONE && res == HRES_OK) {
+        hopt_fold_stmt(&ast, &stmt);
+        if(stmt.type != HSTMT_NONE) res = hstate_compile_reg_stmt(state, &stmt);
+        hast_rewind(&ast, mark);
+        arena_rewind(&state->scratch, scratch_mark);
+        stmt = hparse_stmt(&ast, lex);
+    }
+    hvm_reg_module_append(&state->rmod, HVM_MAKE_RINST(
+                HVM_RINST_HALT, 0, 0, 0, HVM_NULL_WORD));
+    arena_free(&ast.arena);
+    state->ast = UT_NULL;
+    if(res == HRES_OK && !hvm_reg_module_validate(&state->rmod)) {
+        hlog_message(HLOG_FATAL, "Register compiler produced an invalid module");
+    }
+    return res;
+}
+
+static hResult hstate_compile_ir_lexer(hState *state, hLexer *lex)
+{
+    hAst ast;
+    ut_memset(&ast, 0, sizeof(ast));
+    if(state->lex_threads > 0 && !lex->stream) hlexer_tokenize(lex, &ast.arena, state->lex_threads);
+    ArenaMark mark = arena_mark(&ast.arena); // the tokens stay
+    state->ast = &ast;
+    hIrFunc fn;
+    hir_init(&fn);
+    fn.unroll_factor = state->unroll_factor;
+    hIrBuilder builder;
+    hir_builder_init(&builder, &fn, &ast);
+    hResult res = HRES_OK;
+    hStmt stmt = hparse_stmt(&ast, lex);
+    while(stmt.type != HSTMT_NONE && res == HRES_OK) {
+        hopt_fold_stmt(&ast, &stmt);
+        if(stmt.type != HSTMT_NONE) res = hir_build_stmt(&builder, &stmt);
+        hast_rewind(&ast, mark);
+        stmt = hparse_stmt(&ast, lex);
+    }
+    if(res == HRES_OK) {
+        hir_builder_finish(&builder);
+        hir_optimize(&fn);
+        hir_lower(&fn, &state->mod);
+    }
+    hir_deinit(&fn);
+    arena_free(&ast.arena);
+    state->ast = UT_NULL;
+    return res;
+}
+
 hResult hstate_exec_source(hState *state, const char *source)
 {
     UT_ASSERT(state);
     UT_ASSERT(source);
-
     hLexer lex;
-    Arena a;
-    ut_memset(&a, 0, sizeof(a));
     hlexer_init(&lex, source);
-    hStmt stmt = hparse_stmt(&a, &lex);
-    while(stmt.type != HSTMT_NONE) {
-        hstate_exec_stmt(state, &stmt);
-        stmt = hparse_stmt(&a, &lex);
-    }
-    arena_free(&a);
-    return HRES_OK;
+    return hstate_exec_lexer(state, &lex);
+}
+
+hResult hstate_exec_stream(hState *state, FILE *stream)
+{
+    UT_ASSERT(state);
+    UT_ASSERT(stream);
+    hLexer lex;
+    hlexer_init_stream(&lex, stream, &state->arena);
+    hResult res = hstate_exec_lexer(state, &lex);
+    hlexer_deinit(&lex);
+    return res;
 }
 
 hResult hstate_compile_source(hState *state, const char *source)
 {
     UT_ASSERT(state);
     UT_ASSERT(source);
+    hLexer lex;
+    hlexer_init(&lex, source);
+    return hstate_compile_lexer(state, &lex);
+}
 
+hResult hstate_compile_stream(hState *state, FILE *stream)
+{
+    UT_ASSERT(state);
+    UT_ASSERT(stream);
+    hLexer lex;
+    hlexer_init_stream(&lex, stream, &state->arena);
+    hResult res = hstate_compile_lexer(state, &lex);
+    hlexer_deinit(&lex);
+    return res;
+}
+
+hResult hstate_compile_reg_source(hState *state, const char *source)
+{
+    UT_ASSERT(state);
+    UT_ASSERT(source);
     hLexer lex;
-    Arena a;
-    ut_memset(&a, 0, sizeof(a));
     hlexer_init(&lex, source);
-    hStmt stmt = hparse_stmt(&a, &lex);
-    while(stmt.type != HSTMT_NONE) {
-        hstate_compile_stmt(state, &stmt);
-        stmt = hparse_stmt(&a, &lex);
-    }
-    hvm_module_append(&state->mod, HVM_MAKE_INST(
-                HVM_INST_HALT, HVM_WORD_U64(0)));
-    arena_free(&a);
-    return HRES_OK;
+    return hstate_compile_reg_lexer(state, &lex);
+}
+
+hResult hstate_compile_reg_stream(hState *state, FILE *stream)
+{
+    UT_ASSERT(state);
+    UT_ASSERT(stream);
+    hLexer lex;
+    hlexer_init_stream(&lex, stream, &state->arena);
+    hResult res = hstate_compile_reg_lexer(state, &lex);
+    hlexer_deinit(&lex);
+    return res;
+}
+
+hResult hstate_compile_ir_source(hState *state, const char *source)
+{
+    UT_ASSERT(state);
+    UT_ASSERT(source);
+    hLexer lex;
+    hlexer_init(&lex, source);
+    return hstate_compile_ir_lexer(state, &lex);
+}
+
+hResult hstate_compile_ir_stream(hState *state, FILE *stream)
+{
+    UT_ASSERT(state);
+    UT_ASSERT(stream);
+    hLexer lex;
+    hlexer_init_stream(&lex, stream, &state->arena);
+    hResult res = hstate_compile_ir_lexer(state, &lex);
+    hlexer_deinit(&lex);
+    return res;
 }
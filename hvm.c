@@ -3,8 +3,17 @@
 #include "utils.h"
 
 #include <stdio.h>
+#include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+#define HVM_HAS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+// Traces go to stderr so they never mix with the output of the program
 #ifndef HVM_NO_TRACE 
-#define TRACE_PRINTF(...) printf(__VA_ARGS__)
+#define TRACE_PRINTF(...) fprintf(stderr, __VA_ARGS__)
 #else
 #define TRACE_PRINTF(...)
 #endif
@@ -46,11 +55,24 @@ static HVM_InstInfo _inst_infos[COUNT_HVM_INSTS] = {
     [HVM_INST_FLT] = { .type = HVM_INST_FLT, .name = "flt", .has_operand = ut_false, .min_sp = 2, },
     [HVM_INST_FLE] = { .type = HVM_INST_FLE, .name = "fle", .has_operand = ut_false, .min_sp = 2, },
 
-    [HVM_INST_JMP] = { .type = HVM_INST_JMP, .name = "jmp", .has_operand = ut_true, .min_sp = 0, },
-    [HVM_INST_JZ] = { .type = HVM_INST_JZ, .name = "jz", .has_operand = ut_true, .min_sp = 1, },
-    [HVM_INST_JN] = { .type = HVM_INST_JN, .name = "jn", .has_operand = ut_true, .min_sp = 1, },
+    [HVM_INST_JMP] = { .type = HVM_INST_JMP, .name = "jmp", .has_operand = ut_true, .is_jump = ut_true, .min_sp = 0, },
+    [HVM_INST_JZ] = { .type = HVM_INST_JZ, .name = "jz", .has_operand = ut_true, .is_jump = ut_true, .min_sp = 1, },
+    [HVM_INST_JN] = { .type = HVM_INST_JN, .name = "jn", .has_operand = ut_true, .is_jump = ut_true, .min_sp = 1, },
 
     [HVM_INST_DUMP] = { .type = HVM_INST_DUMP, .name = "dump", .has_operand = ut_false, .min_sp = 1, },
+
+    [HVM_INST_ADDABSI] = { .type = HVM_INST_ADDABSI, .name = "addabsi", .has_operand = ut_true, .has_arg = ut_true, .min_sp = 0, },
+    [HVM_INST_ADDABS] = { .type = HVM_INST_ADDABS, .name = "addabs", .has_operand = ut_true, .has_arg = ut_true, .min_sp = 0, },
+    [HVM_INST_SETABSI] = { .type = HVM_INST_SETABSI, .name = "setabsi", .has_operand = ut_true, .has_arg = ut_true, .min_sp = 0, },
+    [HVM_INST_MOVABS] = { .type = HVM_INST_MOVABS, .name = "movabs", .has_operand = ut_true, .has_arg = ut_true, .min_sp = 0, },
+    [HVM_INST_JEQABSI] = { .type = HVM_INST_JEQABSI, .name = "jeqabsi", .has_operand = ut_true, .has_arg = ut_true, .is_jump = ut_true, .min_sp = 0, },
+    [HVM_INST_JNEABSI] = { .type = HVM_INST_JNEABSI, .name = "jneabsi", .has_operand = ut_true, .has_arg = ut_true, .is_jump = ut_true, .min_sp = 0, },
+    [HVM_INST_JLTABSI] = { .type = HVM_INST_JLTABSI, .name = "jltabsi", .has_operand = ut_true, .has_arg = ut_true, .is_jump = ut_true, .min_sp = 0, },
+    [HVM_INST_JGTABSI] = { .type = HVM_INST_JGTABSI, .name = "jgtabsi", .has_operand = ut_true, .has_arg = ut_true, .is_jump = ut_true, .min_sp = 0, },
+    [HVM_INST_JLEABSI] = { .type = HVM_INST_JLEABSI, .name = "jleabsi", .has_operand = ut_true, .has_arg = ut_true, .is_jump = ut_true, .min_sp = 0, },
+    [HVM_INST_JGEABSI] = { .type = HVM_INST_JGEABSI, .name = "jgeabsi", .has_operand = ut_true, .has_arg = ut_true, .is_jump = ut_true, .min_sp = 0, },
+
+    [HVM_INST_EXIT] = { .type = HVM_INST_EXIT, .name = "exit", .has_operand = ut_true, .min_sp = 0, },
 };
 
 
@@ -149,8 +171,9 @@ HVM_Trap hvm_exec(HVM *vm, HVM_Inst inst)
 
         case HVM_INST_END_SCOPE:
             {
+                if(vm->ss == 0) return HVM_TRAP_STACK_UNDERFLOW;
                 uint32_t prev_ss = (uint32_t)vm->stack[vm->ss - 1].as_u64;
-                vm->sp = vm->ss - 1;
+                vm->sp = vm->ss - 1 - prev_ss;
                 vm->ss = prev_ss;
             } break;
 
@@ -178,17 +201,17 @@ HVM_Trap hvm_exec(HVM *vm, HVM_Inst inst)
 
         case HVM_INST_ADD:
             {
-                HVM_Y(vm).as_i64 = HVM_Y(vm).as_i64 + HVM_X(vm).as_i64;
+                HVM_Y(vm).as_u64 = HVM_Y(vm).as_u64 + HVM_X(vm).as_u64;
                 vm->sp -= 1;
             } break;
         case HVM_INST_SUB:
             {
-                HVM_Y(vm).as_i64 = HVM_Y(vm).as_i64 - HVM_X(vm).as_i64;
+                HVM_Y(vm).as_u64 = HVM_Y(vm).as_u64 - HVM_X(vm).as_u64;
                 vm->sp -= 1;
             } break;
         case HVM_INST_MUL:
             {
-                HVM_Y(vm).as_i64 = HVM_Y(vm).as_i64 * HVM_X(vm).as_i64;
+                HVM_Y(vm).as_u64 = HVM_Y(vm).as_u64 * HVM_X(vm).as_u64;
                 vm->sp -= 1;
             } break;
         case HVM_INST_EQ:
@@ -228,6 +251,47 @@ HVM_Trap hvm_exec(HVM *vm, HVM_Inst inst)
                 printf("HVM_Word{ .as_u64=%lu, .as_i64=%ld, .as_f64=%f }\n", val.as_u64, val.as_i64, val.as_f64);
                 vm->sp -= 1;
             } break;
+
+        case HVM_INST_ADDABSI:
+        case HVM_INST_ADDABS:
+        case HVM_INST_SETABSI:
+        case HVM_INST_MOVABS:
+            {
+                if(inst.arg >= vm->ss + vm->sp) 
+                    return HVM_TRAP_STACK_UNDERFLOW;
+                if(inst.type == HVM_INST_ADDABS || inst.type == HVM_INST_MOVABS) {
+                    if(inst.op.as_u64 >= vm->ss + vm->sp) 
+                        return HVM_TRAP_STACK_UNDERFLOW;
+                }
+                HVM_Word *dst = &vm->stack[inst.arg];
+                if(inst.type == HVM_INST_ADDABSI) dst->as_u64 += inst.op.as_u64;
+                else if(inst.type == HVM_INST_ADDABS) dst->as_u64 += vm->stack[inst.op.as_u64].as_u64;
+                else if(inst.type == HVM_INST_SETABSI) *dst = inst.op;
+                else *dst = vm->stack[inst.op.as_u64];
+            } break;
+
+        case HVM_INST_JEQABSI:
+        case HVM_INST_JNEABSI:
+        case HVM_INST_JLTABSI:
+        case HVM_INST_JGTABSI:
+        case HVM_INST_JLEABSI:
+        case HVM_INST_JGEABSI:
+            {
+                if(inst.arg >= vm->ss + vm->sp) 
+                    return HVM_TRAP_STACK_UNDERFLOW;
+                int64_t x = vm->stack[inst.arg].as_i64;
+                int64_t k = (int32_t)(inst.op.as_u64 >> 32);
+                ut_bool cond = ut_false;
+                switch(inst.type) {
+                    case HVM_INST_JEQABSI: cond = x == k; break;
+                    case HVM_INST_JNEABSI: cond = x != k; break;
+                    case HVM_INST_JLTABSI: cond = x < k; break;
+                    case HVM_INST_JGTABSI: cond = x > k; break;
+                    case HVM_INST_JLEABSI: cond = x <= k; break;
+                    default: cond = x >= k; break;
+                }
+                if(cond) vm->pc = (uint32_t)inst.op.as_u64;
+            } break;
         default:
             return HVM_TRAP_INVALID_INSTRUCTION;
     }
@@ -260,6 +324,7 @@ void hvm_init(HVM *vm)
     vm->pc = 0;
     vm->sp = 0;
     vm->ss = 0;
+    vm->halt = 0;
 }
 
 void hvm_module_init(HVM_Module *module)
@@ -268,12 +333,43 @@ void hvm_module_init(HVM_Module *module)
     module->items = UT_NULL;
     module->count = 0;
     module->capacity = 0;
+    module->tiering = UT_NULL;
+    module->verified = ut_false;
+    module->max_stack = 0;
+    module->base_sp = 0;
     buffer_init(&module->static_data);
+    module->mapping = UT_NULL;
+    module->mapping_size = 0;
+}
+
+// The items of a mapped module are owned once they've been copied, which leaves a capacity
+static ut_bool hvm_module_owns_items(const HVM_Module *module)
+{
+    return !module->mapping || module->capacity > 0;
+}
+
+// Copies the items of a mapped module to the heap so they can be modified
+static void hvm_module_own_items(HVM_Module *module)
+{
+    if(hvm_module_owns_items(module)) return;
+    HVM_Inst *items = UT_NULL;
+    if(module->count > 0) {
+        items = HVM_MALLOC(sizeof(HVM_Inst)*module->count);
+        HVM_ASSERT(items);
+        ut_memcpy(items, module->items, sizeof(HVM_Inst)*module->count);
+    }
+    module->items = items;
+    module->capacity = module->count;
 }
 
 void hvm_module_deinit(HVM_Module *module)
 {
-    HVM_FREE(module->items);
+    if(hvm_module_owns_items(module)) HVM_FREE(module->items);
+#ifdef HVM_HAS_MMAP
+    if(module->mapping) munmap((void *)module->mapping, module->mapping_size);
+#endif
+    module->mapping = UT_NULL;
+    module->mapping_size = 0;
     module->count = 0;
     module->capacity = 0;
     module->items = UT_NULL;
@@ -286,6 +382,11 @@ void hvm_module_dump(const HVM_Module module)
     for(uint32_t i = 0; i < module.count; ++i) {
         inst = module.items[i];
         info = _inst_infos[inst.type];
+        if(info.has_arg) {
+            printf("%u %s(%u, HVM_Word{ .as_u64=%lu, .as_i64=%ld, .as_f64=%f})\n", i, info.name, inst.arg,
+                    inst.op.as_u64, inst.op.as_i64, inst.op.as_f64);
+            continue;
+        }
         printf("%u %s(HVM_Word{ .as_u64=%lu, .as_i64=%ld, .as_f64=%f})\n", i, info.name, 
                 info.has_operand ? inst.op.as_u64 : 0,
                 info.has_operand ? inst.op.as_i64 : 0,
@@ -297,6 +398,7 @@ void hvm_module_dump(const HVM_Module module)
 void hvm_module_append(HVM_Module *module, HVM_Inst inst)
 {
     HVM_ASSERT(module);
+    hvm_module_own_items(module);
     if(module->count + 1 > module->capacity) {
         ut_size new_capacity = module->capacity * 2;
         if(new_capacity == 0) new_capacity = 32;
@@ -311,101 +413,1904 @@ void hvm_module_append(HVM_Module *module, HVM_Inst inst)
 
     module->items[module->count] = inst;
     module->count += 1;
+    module->verified = ut_false;
 }
 
-HVM_Trap hvm_exec_module(HVM *vm, const HVM_Module module)
+static HVM_InstType hvm_fused_jump(HVM_InstType cmp, HVM_InstType jump)
 {
-    HVM_ASSERT(vm);
-    HVM_Inst inst;
-    HVM_Trap res;
-    while(!vm->halt) {
-        inst = module.items[vm->pc];
-        res = hvm_exec(vm, inst);
-        if(res != HVM_TRAP_NONE) {
-            HVM_InstInfo info = _inst_infos[inst.type];
-            fprintf(stderr, "Trap %d is thrown while executing %s(ptr(%lu)|int(%ld)|float(%f)\n", res, info.name, 
-                    info.has_operand ? inst.op.as_u64 : 0,
-                    info.has_operand ? inst.op.as_i64 : 0,
-                    info.has_operand ? inst.op.as_f64 : 0.0);
-            hvm_dump(vm);
-            break;
+    // JZ jumps when the comparison fails so it gets the negated condition
+    ut_bool negate = jump == HVM_INST_JZ;
+    switch(cmp) {
+        case HVM_INST_EQ: return negate ? HVM_INST_JNEABSI : HVM_INST_JEQABSI;
+        case HVM_INST_NE: return negate ? HVM_INST_JEQABSI : HVM_INST_JNEABSI;
+        case HVM_INST_LT: return negate ? HVM_INST_JGEABSI : HVM_INST_JLTABSI;
+        case HVM_INST_GT: return negate ? HVM_INST_JLEABSI : HVM_INST_JGTABSI;
+        case HVM_INST_LE: return negate ? HVM_INST_JGTABSI : HVM_INST_JLEABSI;
+        case HVM_INST_GE: return negate ? HVM_INST_JLTABSI : HVM_INST_JGEABSI;
+        default: return HVM_INST_NONE;
+    }
+}
+
+// Try to match a fusable sequence at the start of `in`. On success returns the amount of
+// instructions replaced by `*out`, otherwise 0.
+static uint32_t hvm_fuse_at(const HVM_Inst *in, uint32_t n, HVM_Inst *out)
+{
+    if(n >= 5 && in[0].type == HVM_INST_COPYABS && in[3].type == HVM_INST_SWAPABS && in[4].type == HVM_INST_POP) {
+        uint64_t x = in[3].op.as_u64;
+        if(x <= UINT32_MAX) {
+            // x = x + k, x = x - k
+            if(in[0].op.as_u64 == x && in[1].type == HVM_INST_PUSH) {
+                if(in[2].type == HVM_INST_ADD) {
+                    *out = HVM_MAKE_INST_ARG(HVM_INST_ADDABSI, (uint32_t)x, in[1].op);
+                    return 5;
+                }
+                if(in[2].type == HVM_INST_SUB && in[1].op.as_i64 != INT64_MIN) {
+                    *out = HVM_MAKE_INST_ARG(HVM_INST_ADDABSI, (uint32_t)x, HVM_WORD_I64(-in[1].op.as_i64));
+                    return 5;
+                }
+            }
+            // x = x + y, x = y + x
+            if(in[1].type == HVM_INST_COPYABS && in[2].type == HVM_INST_ADD) {
+                if(in[0].op.as_u64 == x) {
+                    *out = HVM_MAKE_INST_ARG(HVM_INST_ADDABS, (uint32_t)x, in[1].op);
+                    return 5;
+                }
+                if(in[1].op.as_u64 == x) {
+                    *out = HVM_MAKE_INST_ARG(HVM_INST_ADDABS, (uint32_t)x, in[0].op);
+                    return 5;
+                }
+            }
         }
     }
-    return res;
+
+    // Comparing a variable with a constant and branching on it, i.e. loop conditions
+    if(n >= 4 && in[0].type == HVM_INST_COPYABS && in[1].type == HVM_INST_PUSH 
+            && (in[3].type == HVM_INST_JZ || in[3].type == HVM_INST_JN)) {
+        HVM_InstType type = hvm_fused_jump(in[2].type, in[3].type);
+        int64_t k = in[1].op.as_i64;
+        if(type != HVM_INST_NONE && in[0].op.as_u64 <= UINT32_MAX && in[3].op.as_u64 <= UINT32_MAX
+                && k >= INT32_MIN && k <= INT32_MAX) {
+            *out = HVM_MAKE_INST_ARG(type, (uint32_t)in[0].op.as_u64, HVM_WORD_JUMP_IMM(in[3].op.as_u64, k));
+            return 4;
+        }
+    }
+
+    if(n >= 3 && in[1].type == HVM_INST_SWAPABS && in[2].type == HVM_INST_POP && in[1].op.as_u64 <= UINT32_MAX) {
+        // x = k
+        if(in[0].type == HVM_INST_PUSH) {
+            *out = HVM_MAKE_INST_ARG(HVM_INST_SETABSI, (uint32_t)in[1].op.as_u64, in[0].op);
+            return 3;
+        }
+        // x = y
+        if(in[0].type == HVM_INST_COPYABS) {
+            *out = HVM_MAKE_INST_ARG(HVM_INST_MOVABS, (uint32_t)in[1].op.as_u64, in[0].op);
+            return 3;
+        }
+    }
+
+    return 0;
 }
 
-ut_bool hvm_module_save_to_file(const HVM_Module module, const char *file_path)
+// `out_map` is optional, when it's given it must hold `count + 1` items and receives the new
+// index of every old instruction
+void hvm_module_fuse_map(HVM_Module *module, uint32_t *out_map)
 {
-    Arena a;
-    HVM_ModuleFileHeader header;
-    Buffer tmp;
-    Buffer res;
-    ut_memset(&a, 0, sizeof(a));
+    HVM_ASSERT(module);
+    uint32_t count = module->count;
+    if(count == 0) {
+        if(out_map) out_map[0] = 0;
+        return;
+    }
 
-    header.version = HVM_VERSION;
-    header.magic_number = HVM_MAGIC_NUMBER;
-    header.insts_amount = module.count;
-    header.program_size = sizeof(HVM_Inst) * module.count;
+    uint8_t *is_target = HVM_MALLOC(count + 1);
+    uint32_t *map = out_map ? out_map : HVM_MALLOC(sizeof(uint32_t)*(count + 1));
+    HVM_ASSERT(is_target && map);
+    ut_memset(is_target, 0, count + 1);
+    for(uint32_t i = 0; i < count; ++i) {
+        HVM_Inst inst = module->items[i];
+        if(inst.type < COUNT_HVM_INSTS && _inst_infos[inst.type].is_jump && (uint32_t)inst.op.as_u64 <= count)
+            is_target[(uint32_t)inst.op.as_u64] = 1;
+    }
 
-    tmp.count = 0;
-    tmp.capacity = 0;
+    // The output never grows so it's done in place
+    uint32_t out = 0;
+    for(uint32_t i = 0; i < count;) {
+        // Don't fuse across a jump target since something jumps into the middle of the sequence
+        uint32_t window = 1;
+        while(window < 5 && i + window < count && !is_target[i + window]) window += 1;
 
-    for(ut_size i = 0; i < (ut_size)module.count; ++i) {
-        HVM_Inst inst = module.items[i];
-        buffer_append_with_arena(&tmp, (void *)&inst, sizeof(inst), &a);
+        HVM_Inst fused;
+        uint32_t n = hvm_fuse_at(&module->items[i], window, &fused);
+        if(n == 0) {
+            fused = module->items[i];
+            n = 1;
+        } else {
+            // A mapped module is only copied once something actually fuses
+            hvm_module_own_items(module);
+        }
+        for(uint32_t j = 0; j < n; ++j) map[i + j] = out;
+        if(hvm_module_owns_items(module)) module->items[out] = fused;
+        out += 1;
+        i += n;
     }
-    header.program_start = 0;
-    header.static_data_start = tmp.count;
-    header.static_data_size = module.static_data.count;
-    if(module.static_data.data) {
-        buffer_append_with_arena(&tmp, module.static_data.data, module.static_data.count, &a);
+    map[count] = out;
+    if(out == count) {
+        // Nothing was fused so the jumps are still right
+        HVM_FREE(is_target);
+        if(!out_map) HVM_FREE(map);
+        return;
     }
 
-    res.count = 0;
-    res.capacity = 0;
-    res.data = 0;
+    for(uint32_t i = 0; i < out; ++i) {
+        HVM_Inst *inst = &module->items[i];
+        if(inst->type >= COUNT_HVM_INSTS || !_inst_infos[inst->type].is_jump) continue;
+        uint32_t target = (uint32_t)inst->op.as_u64;
+        if(target > count) continue;
+        inst->op.as_u64 = (inst->op.as_u64 & 0xFFFFFFFF00000000ull) | map[target];
+    }
+    module->count = out;
+    module->verified = ut_false;
 
-    buffer_append_with_arena(&res, (void *)&header, sizeof(header), &a);
-    buffer_append_with_arena(&res, tmp.data, tmp.count, &a);
-    ut_bool retval = buffer_save_to_file(res, file_path);
-    arena_free(&a);
-    return retval;
+    HVM_FREE(is_target);
+    if(!out_map) HVM_FREE(map);
 }
 
-ut_bool hvm_module_load_from_file(HVM_Module *module, const char *file_path, Arena *a)
+void hvm_module_fuse(HVM_Module *module)
 {
-    UT_ASSERT(module->count == 0 && module->capacity == 0);
-    Buffer file;
-    Arena local;
-    ut_memset(&local, 0, sizeof(local));
-    if(!buffer_load_from_file_with_arena(&file, file_path, &local)) {
+    hvm_module_fuse_map(module, UT_NULL);
+}
+
+#define HVM_PEEPHOLE_MAX_PASSES 8
+#define HVM_PEEPHOLE_MAX_HOPS 16
+
+static ut_bool hvm_is_terminator(HVM_InstType type)
+{
+    return type == HVM_INST_JMP || type == HVM_INST_HALT || type == HVM_INST_EXIT;
+}
+
+static ut_bool hvm_is_jump_inst(HVM_Inst inst)
+{
+    return inst.type < COUNT_HVM_INSTS && _inst_infos[inst.type].is_jump;
+}
+
+// Where a jump to `target` really ends up after following the chain of unconditional jumps
+static uint32_t hvm_thread_jump(const HVM_Inst *items, uint32_t count, uint32_t target)
+{
+    for(uint32_t hop = 0; hop < HVM_PEEPHOLE_MAX_HOPS && target < count; ++hop) {
+        HVM_Inst next = items[target];
+        if(next.type != HVM_INST_JMP || next.op.as_u64 > count || (uint32_t)next.op.as_u64 == target) break;
+        target = (uint32_t)next.op.as_u64;
+    }
+    return target;
+}
+
+// Try to simplify the instructions at the start of `in`, the first `n` of them have no jump
+// target after the first one. Returns how many instructions at the start are dropped. Nothing is
+// written, `reuse` is set when the fourth one should become a copy of the first one.
+static uint32_t hvm_peephole_at(const HVM_Inst *in, uint32_t n, uint32_t index, ut_bool *reuse)
+{
+    // Jumping to the next instruction
+    if(in[0].type == HVM_INST_JMP && in[0].op.as_u64 == (uint64_t)index + 1) return 1;
+
+    // Values that are pushed and popped right away
+    if(n >= 2 && in[1].type == HVM_INST_POP && (in[0].type == HVM_INST_PUSH || in[0].type == HVM_INST_COPYABS)) return 2;
+
+    // x = x
+    if(n >= 3 && in[0].type == HVM_INST_COPYABS && in[1].type == HVM_INST_SWAPABS && in[2].type == HVM_INST_POP
+            && in[0].op.as_u64 == in[1].op.as_u64) return 3;
+
+    // Reading x back right after storing a constant or another variable in it uses the source
+    // instead. Storing and keeping the value on the stack would need a `COPY 0` in front of the
+    // store, which is not shorter and stops the store from being fused into SETABSI or MOVABS.
+    if(n >= 4 && (in[0].type == HVM_INST_PUSH || in[0].type == HVM_INST_COPYABS)
+            && in[1].type == HVM_INST_SWAPABS && in[2].type == HVM_INST_POP
+            && in[3].type == HVM_INST_COPYABS && in[3].op.as_u64 == in[1].op.as_u64) {
+        *reuse = ut_true;
+    }
+
+    return 0;
+}
+
+// The pass works on the items of the module until the first change, they're only copied then so
+// a mapped module that is already clean stays in the mapping
+static HVM_Inst *hvm_peephole_own(const HVM_Module *module, HVM_Inst *items, HVM_Inst **copy)
+{
+    if(*copy) return items;
+    *copy = HVM_MALLOC(sizeof(HVM_Inst)*module->count);
+    HVM_ASSERT(*copy);
+    ut_memcpy(*copy, items, sizeof(HVM_Inst)*module->count);
+    return *copy;
+}
+
+// Removes redundant instructions left by the code generator: jumps to jumps are threaded to their
+// final target, jumps to the next instruction and code that can't be reached are dropped, and a few
+// store/load patterns are simplified. Like hvm_module_fuse_map() `out_map` is optional and receives
+// the new index of every old instruction.
+void hvm_module_peephole_map(HVM_Module *module, uint32_t *out_map)
+{
+    HVM_ASSERT(module);
+    uint32_t count = module->count;
+    if(out_map) {
+        for(uint32_t i = 0; i <= count; ++i) out_map[i] = i;
+    }
+    if(count == 0) return;
+
+    uint8_t *is_target = HVM_MALLOC(count + 1);
+    uint32_t *map = HVM_MALLOC(sizeof(uint32_t)*(count + 1));
+    HVM_ASSERT(is_target && map);
+    HVM_Inst *items = module->items;
+    HVM_Inst *copy = UT_NULL;
+
+    ut_bool changed = ut_false;
+    for(uint32_t pass = 0; pass < HVM_PEEPHOLE_MAX_PASSES; ++pass) {
+        ut_bool pass_changed = ut_false;
+        for(uint32_t i = 0; i < count; ++i) {
+            if(!hvm_is_jump_inst(items[i]) || items[i].op.as_u64 > count) continue;
+            uint32_t target = (uint32_t)items[i].op.as_u64;
+            uint32_t threaded = hvm_thread_jump(items, count, target);
+            if(threaded == target) continue;
+            items = hvm_peephole_own(module, items, &copy);
+            items[i].op.as_u64 = (items[i].op.as_u64 & 0xFFFFFFFF00000000ull) | threaded;
+            pass_changed = ut_true;
+        }
+
+        ut_memset(is_target, 0, count + 1);
+        for(uint32_t i = 0; i < count; ++i) {
+            HVM_Inst inst = items[i];
+            if(hvm_is_jump_inst(inst) && (uint32_t)inst.op.as_u64 <= count) is_target[(uint32_t)inst.op.as_u64] = 1;
+        }
+
+        // Like fusing the output never grows so it's done in place
+        uint32_t out = 0;
+        ut_bool reachable = ut_true;
+        for(uint32_t i = 0; i < count;) {
+            if(is_target[i]) reachable = ut_true;
+            if(!reachable) {
+                map[i] = out;
+                i += 1;
+                continue;
+            }
+
+            uint32_t window = 1;
+            while(window < 4 && i + window < count && !is_target[i + window]) window += 1;
+            ut_bool reuse = ut_false;
+            uint32_t dropped = hvm_peephole_at(&items[i], window, i, &reuse);
+            if(reuse) {
+                items = hvm_peephole_own(module, items, &copy);
+                items[i + 3] = items[i];
+                pass_changed = ut_true;
+            }
+            for(uint32_t j = 0; j < dropped; ++j) map[i + j] = out;
+            if(dropped > 0) {
+                i += dropped;
+                continue;
+            }
+
+            reachable = !hvm_is_terminator(items[i].type);
+            map[i] = out;
+            if(out != i) {
+                items = hvm_peephole_own(module, items, &copy);
+                items[out] = items[i];
+            }
+            out += 1;
+            i += 1;
+        }
+        map[count] = out;
+        if(out != count) pass_changed = ut_true;
+
+        for(uint32_t i = 0; i < out; ++i) {
+            if(!hvm_is_jump_inst(items[i]) || items[i].op.as_u64 > count) continue;
+            uint64_t op = (items[i].op.as_u64 & 0xFFFFFFFF00000000ull) | map[(uint32_t)items[i].op.as_u64];
+            if(op == items[i].op.as_u64) continue;
+            items = hvm_peephole_own(module, items, &copy);
+            items[i].op.as_u64 = op;
+        }
+        if(out_map) {
+            for(uint32_t i = 0; i <= module->count; ++i) out_map[i] = map[out_map[i]];
+        }
+        count = out;
+
+        if(!pass_changed) break;
+        changed = ut_true;
+    }
+
+    if(copy) {
+        if(hvm_module_owns_items(module)) HVM_FREE(module->items);
+        module->items = copy;
+        module->capacity = module->count;
+    }
+    if(changed) {
+        // Dropping the end of a mapped module doesn't need a copy either
+        module->count = count;
+        module->verified = ut_false;
+    }
+    HVM_FREE(is_target);
+    HVM_FREE(map);
+}
+
+void hvm_module_peephole(HVM_Module *module)
+{
+    hvm_module_peephole_map(module, UT_NULL);
+}
+
+static void hvm_verify_error(const HVM_Module module, uint32_t pc, const char *reason)
+{
+    HVM_Inst inst = module.items[pc];
+    HVM_InstInfo info = _inst_infos[inst.type < COUNT_HVM_INSTS ? inst.type : HVM_INST_NONE];
+    fprintf(stderr, "ERROR: Verification failed at instruction %u %s(%lu): %s\n", pc, info.name, 
+            info.has_operand ? inst.op.as_u64 : 0, reason);
+}
+
+// Whether writing to the absolute stack index `index` would clobber the saved stack
+// start of one of the scopes that are open in `state`
+static ut_bool hvm_is_scope_link(const HVM_StackState *states, HVM_StackState state, uint64_t index)
+{
+    while(state.scope != 0) {
+        if(index == (uint64_t)state.ss - 1) return ut_true;
+        state = states[state.scope - 1];
+    }
+    return ut_false;
+}
+
+static ut_bool hvm_verify_merge(const HVM_Module module, HVM_StackState *states, uint32_t *work, uint32_t *work_count,
+        uint32_t from, uint32_t to, HVM_StackState state)
+{
+    if(to >= module.count) {
+        hvm_verify_error(module, from, to == module.count ? "execution runs past the end of the module" 
+                : "jump target is outside of the module");
         return ut_false;
     }
+    if(!states[to].reachable) {
+        state.reachable = ut_true;
+        states[to] = state;
+        work[(*work_count)++] = to;
+        return ut_true;
+    }
+    if(states[to].ss != state.ss || states[to].sp != state.sp || states[to].scope != state.scope) {
+        char reason[128];
+        snprintf(reason, sizeof(reason), "stack is (ss=%u, sp=%u) from one path and (ss=%u, sp=%u) from another at %u", 
+                states[to].ss, states[to].sp, state.ss, state.sp, to);
+        hvm_verify_error(module, from, reason);
+        return ut_false;
+    }
+    return ut_true;
+}
 
-    HVM_ModuleFileHeader header;
-    BufferView header_buffer = buffer_slice(file, 0, sizeof(HVM_ModuleFileHeader));
-    ut_memcpy((void *)&header, header_buffer.data, header_buffer.count);
+// Abstract interpretation of the stack shape over every control flow path starting from
+// a fresh VM at pc 0. `states` must hold `module.count` items and receives the state
+// before each instruction, unreachable instructions are left with `reachable` unset.
+ut_bool hvm_module_analyze(const HVM_Module module, HVM_StackState *states, uint32_t *max_stack)
+{
+    return hvm_module_analyze_from(module, 0, states, max_stack);
+}
 
-    TRACE_PRINTF("Loaded module with following information\n");
-    TRACE_PRINTF("Magic Number: 0x%X\n", header.magic_number);
-    TRACE_PRINTF("HVM Module Version\n");
-    TRACE_PRINTF("    - major: %u\n", UT_VERSION_MAJOR(header.version));
-    TRACE_PRINTF("    - minor: %u\n", UT_VERSION_MINOR(header.version));
-    TRACE_PRINTF("    - revision: %u\n", UT_VERSION_REVISION(header.version));
-    TRACE_PRINTF("Instruction amount: %u\n", header.insts_amount);
-    TRACE_PRINTF("Program Size: %lu\n", header.program_size);
-    TRACE_PRINTF("Program Start: %lu\n", header.program_start);
-    TRACE_PRINTF("Static Data Size: %lu\n", header.static_data_size);
-    TRACE_PRINTF("Static Data Start: %lu\n", header.static_data_start);
-
-    BufferView insts_buffer = buffer_slice(file, header_buffer.count + header.program_start, header.program_start);
-    BufferView static_data_buffer = buffer_slice(file, header_buffer.count + header.static_data_start, header.static_data_size);
-    for(uint32_t i = 0; i < header.insts_amount; ++i) {
-        HVM_Inst inst = ((HVM_Inst*)insts_buffer.data)[i];
-        hvm_module_append(module, inst);
+// Same as hvm_module_analyze() for a module that starts at pc 0 with `base_sp` values already on
+// the stack and no scope open, like the statements that are run one at a time
+ut_bool hvm_module_analyze_from(const HVM_Module module, uint32_t base_sp, HVM_StackState *states, uint32_t *max_stack)
+{
+    HVM_ASSERT(states);
+    ut_memset(states, 0, sizeof(HVM_StackState)*module.count);
+    if(max_stack) *max_stack = 0;
+    if(module.count == 0) {
+        fprintf(stderr, "ERROR: Verification failed: the module is empty\n");
+        return ut_false;
     }
-    buffer_append_with_arena(&module->static_data, static_data_buffer.data, static_data_buffer.count, a);
-    arena_free(&local);
+
+    // Each instruction enters the work list at most once, when it first becomes reachable
+    uint32_t *work = HVM_MALLOC(sizeof(uint32_t)*module.count);
+    HVM_ASSERT(work);
+    uint32_t work_count = 0;
+    uint32_t max = 0;
+    ut_bool ok = ut_true;
+
+    states[0].sp = base_sp;
+    states[0].reachable = ut_true;
+    work[work_count++] = 0;
+    while(ok && work_count > 0) {
+        uint32_t pc = work[--work_count];
+        HVM_Inst inst = module.items[pc];
+        HVM_StackState st = states[pc];
+        HVM_StackState next = st;
+        uint32_t abs = st.ss + st.sp;
+        uint64_t op = inst.op.as_u64;
+        uint32_t target = (uint32_t)op;
+        ut_bool falls_through = ut_true;
+        ut_bool jumps = ut_false;
+        const char *error = UT_NULL;
+
+        if(inst.type >= COUNT_HVM_INSTS) {
+            hvm_verify_error(module, pc, "unknown instruction");
+            ok = ut_false;
+            break;
+        }
+        if(st.sp < (uint32_t)_inst_infos[inst.type].min_sp) {
+            hvm_verify_error(module, pc, "stack underflow");
+            ok = ut_false;
+            break;
+        }
+
+        switch(inst.type) {
+            case HVM_INST_HALT:
+                {
+                    if(st.scope != 0) error = "halt inside of a scope that is never ended";
+                    falls_through = ut_false;
+                } break;
+
+            case HVM_INST_BEGIN_SCOPE:
+                {
+                    if(abs + 1 > HVM_STACK_CAPACITY) error = "stack overflow";
+                    next.ss = abs + 1;
+                    next.sp = 0;
+                    next.scope = pc + 1;
+                } break;
+
+            case HVM_INST_END_SCOPE:
+                {
+                    if(st.scope == 0) {
+                        error = "end_scope without a matching begin_scope";
+                        break;
+                    }
+                    next = states[st.scope - 1];
+                } break;
+
+            case HVM_INST_POP:
+            case HVM_INST_DUMP:
+                next.sp -= 1;
+                break;
+
+            case HVM_INST_PUSH:
+                {
+                    if(abs + 1 > HVM_STACK_CAPACITY) error = "stack overflow";
+                    next.sp += 1;
+                } break;
+
+            case HVM_INST_COPY:
+            case HVM_INST_BCOPY:
+                {
+                    if(op >= st.sp) error = "operand is outside of the current scope";
+                    else if(abs + 1 > HVM_STACK_CAPACITY) error = "stack overflow";
+                    next.sp += 1;
+                } break;
+
+            case HVM_INST_COPYABS:
+                {
+                    if(op >= abs) error = "operand is above the top of the stack";
+                    else if(abs + 1 > HVM_STACK_CAPACITY) error = "stack overflow";
+                    next.sp += 1;
+                } break;
+
+            case HVM_INST_SWAP:
+                {
+                    // Swaps with the slot right above the top of the stack
+                    if(op >= st.sp) error = "operand is outside of the current scope";
+                    else if(abs + 1 > HVM_STACK_CAPACITY) error = "stack overflow";
+                } break;
+
+            case HVM_INST_BSWAP:
+                {
+                    if(st.sp == 0) error = "stack underflow";
+                    else if(op >= st.sp) error = "operand is outside of the current scope";
+                } break;
+
+            case HVM_INST_SWAPABS:
+                {
+                    if(st.sp == 0) error = "stack underflow";
+                    else if(op >= abs) error = "operand is above the top of the stack";
+                    else if(hvm_is_scope_link(states, st, op)) error = "operand overwrites the link of a scope";
+                } break;
+
+            case HVM_INST_ADD: case HVM_INST_SUB: case HVM_INST_MUL:
+            case HVM_INST_EQ: case HVM_INST_NE: case HVM_INST_LT:
+            case HVM_INST_GT: case HVM_INST_LE: case HVM_INST_GE:
+                next.sp -= 1;
+                break;
+
+            case HVM_INST_JMP:
+                {
+                    falls_through = ut_false;
+                    jumps = ut_true;
+                } break;
+
+            case HVM_INST_JZ:
+            case HVM_INST_JN:
+                {
+                    next.sp -= 1;
+                    jumps = ut_true;
+                } break;
+
+            case HVM_INST_ADDABS:
+            case HVM_INST_MOVABS:
+                {
+                    if(op >= abs) error = "operand is above the top of the stack";
+                } // fallthrough
+            case HVM_INST_ADDABSI:
+            case HVM_INST_SETABSI:
+                {
+                    if(inst.arg >= abs) error = "argument is above the top of the stack";
+                    else if(hvm_is_scope_link(states, st, inst.arg)) error = "argument overwrites the link of a scope";
+                } break;
+
+            case HVM_INST_JEQABSI: case HVM_INST_JNEABSI: case HVM_INST_JLTABSI:
+            case HVM_INST_JGTABSI: case HVM_INST_JLEABSI: case HVM_INST_JGEABSI:
+                {
+                    if(inst.arg >= abs) error = "argument is above the top of the stack";
+                    jumps = ut_true;
+                } break;
+
+            default:
+                error = "instruction is not supported by the VM";
+                break;
+        }
+
+        if(error) {
+            hvm_verify_error(module, pc, error);
+            ok = ut_false;
+            break;
+        }
+        if(abs > max) max = abs;
+        if(next.ss + next.sp > max) max = next.ss + next.sp;
+        if(jumps && !hvm_verify_merge(module, states, work, &work_count, pc, target, next)) ok = ut_false;
+        if(ok && falls_through && !hvm_verify_merge(module, states, work, &work_count, pc, pc + 1, next)) ok = ut_false;
+    }
+
+    HVM_FREE(work);
+    if(ok && max_stack) *max_stack = max;
+    return ok;
+}
+
+// Check that `module` can't trap because of the stack when it runs from a fresh VM so
+// it can be executed without any runtime bounds checks
+ut_bool hvm_module_verify(HVM_Module *module)
+{
+    return hvm_module_verify_from(module, 0);
+}
+
+ut_bool hvm_module_verify_from(HVM_Module *module, uint32_t base_sp)
+{
+    HVM_ASSERT(module);
+    module->verified = ut_false;
+    if(module->count == 0) {
+        fprintf(stderr, "ERROR: Verification failed: the module is empty\n");
+        return ut_false;
+    }
+    HVM_StackState *states = HVM_MALLOC(sizeof(HVM_StackState)*module->count);
+    HVM_ASSERT(states);
+    uint32_t max_stack = 0;
+    ut_bool ok = hvm_module_analyze_from(*module, base_sp, states, &max_stack);
+    HVM_FREE(states);
+    if(!ok) return ut_false;
+    module->verified = ut_true;
+    module->max_stack = max_stack;
+    module->base_sp = base_sp;
+    return ut_true;
+}
+
+// The compact decoder runs on every dispatch, the compiler won't inline it on its own in -Os builds
+#if defined(__GNUC__) || defined(__clang__)
+#define HVM_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define HVM_ALWAYS_INLINE inline
+#endif
+
+// The widest encoding is the wide prefix, the opcode, a 4 byte arg, a jump target and its immediate.
+// The decoder reads up to 8 bytes past the start of the operands so that's also the code padding.
+#define HVM_COMPACT_MAX_INST_SIZE 16
+UT_STATIC_ASSERT(COUNT_HVM_INSTS < HVM_COMPACT_TYPE_MASK);
+
+static const uint8_t _compact_width_sizes[4] = { 0, 1, 2, 4 };
+
+static void hvm_write_le(uint8_t *at, uint64_t value, uint32_t size)
+{
+    for(uint32_t i = 0; i < size; ++i) at[i] = (uint8_t)(value >> (8*i));
+}
+
+// Reads `size` bytes stored in little endian, the byte loop isn't merged into a single load when the
+// offset isn't constant so little endian hosts copy the bytes as is
+static HVM_ALWAYS_INLINE uint64_t hvm_read_le(const uint8_t *at, uint32_t size)
+{
+    uint64_t value = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&value, at, size);
+#else
+    for(uint32_t i = 0; i < size; ++i) value |= (uint64_t)at[i] << (8*i);
+#endif
+    return value;
+}
+
+// The smallest width class that holds `value` once sign extended, -1 when it needs HVM_COMPACT_WIDE
+static int hvm_compact_width(int64_t value)
+{
+    if(value == 0) return 0;
+    if(value >= INT8_MIN && value <= INT8_MAX) return 1;
+    if(value >= INT16_MIN && value <= INT16_MAX) return 2;
+    if(value >= INT32_MIN && value <= INT32_MAX) return 3;
+    return -1;
+}
+
+// Writes `inst` with its jump target, if any, replaced by the byte offset `target` and returns
+// its size. The size doesn't depend on `target`.
+static uint32_t hvm_compact_encode(uint8_t *out, HVM_Inst inst, uint32_t target)
+{
+    HVM_InstType type = inst.type < COUNT_HVM_INSTS ? inst.type : HVM_INST_NONE;
+    HVM_InstInfo info = _inst_infos[type];
+    int width = info.has_operand && !info.is_jump ? hvm_compact_width(inst.op.as_i64) : 0;
+    ut_bool wide = width < 0 || (info.has_arg && inst.arg > UINT16_MAX);
+    uint32_t n = 0;
+
+    if(wide) out[n++] = HVM_COMPACT_WIDE;
+    out[n++] = (uint8_t)(type | ((wide ? 0 : width) << 6));
+    if(info.has_arg) {
+        uint32_t size = wide ? 4 : 2;
+        hvm_write_le(out + n, inst.arg, size);
+        n += size;
+    }
+    if(info.is_jump) {
+        hvm_write_le(out + n, target, 4);
+        n += 4;
+        if(info.has_arg) {
+            hvm_write_le(out + n, inst.op.as_u64 >> 32, 4);
+            n += 4;
+        }
+    } else if(info.has_operand) {
+        uint32_t size = wide ? 8 : _compact_width_sizes[width];
+        hvm_write_le(out + n, inst.op.as_u64, size);
+        n += size;
+    }
+    return n;
+}
+
+// Where the operands of an encoded instruction are, so they can be read without branching. There's
+// one entry per opcode byte followed by one per type behind the HVM_COMPACT_WIDE prefix. The reads
+// may run past the instruction, the code is padded so they stay inside the allocation.
+typedef struct HVM_CompactShape {
+    uint8_t type;
+    uint8_t size;
+    uint8_t arg_at;
+    uint8_t op_at;
+    uint8_t op_shift; // sign extends operands narrower than 8 bytes
+    uint32_t arg_mask;
+    uint64_t op_mask;
+} HVM_CompactShape;
+
+static HVM_CompactShape _compact_shapes[256 + HVM_COMPACT_TYPE_MASK + 1];
+static ut_bool _compact_shapes_ready = ut_false;
+
+static void hvm_compact_shapes_init(void)
+{
+    if(_compact_shapes_ready) return;
+    for(uint32_t key = 0; key < UT_ARRAY_LEN(_compact_shapes); ++key) {
+        ut_bool wide = key >= 256;
+        uint8_t byte = (uint8_t)(wide ? key - 256 : key);
+        HVM_InstType type = byte & HVM_COMPACT_TYPE_MASK;
+        if(type >= COUNT_HVM_INSTS) type = HVM_INST_NONE;
+        HVM_InstInfo info = _inst_infos[type];
+        HVM_CompactShape *shape = &_compact_shapes[key];
+        ut_memset(shape, 0, sizeof(*shape));
+        uint32_t n = wide ? 2 : 1;
+
+        shape->type = type;
+        shape->arg_at = n;
+        if(info.has_arg) {
+            shape->arg_mask = wide ? UINT32_MAX : UINT16_MAX;
+            n += wide ? 4 : 2;
+        }
+        shape->op_at = n;
+        if(info.is_jump) {
+            // The immediate of the compare-and-jumps follows the target, like in HVM_WORD_JUMP_IMM
+            shape->op_mask = info.has_arg ? UINT64_MAX : UINT32_MAX;
+            n += info.has_arg ? 8 : 4;
+        } else if(info.has_operand) {
+            uint32_t size = wide ? 8 : _compact_width_sizes[byte >> 6];
+            shape->op_mask = size > 0 ? UINT64_MAX : 0;
+            shape->op_shift = size > 0 ? 64 - 8*size : 0;
+            n += size;
+        }
+        shape->size = n;
+    }
+    _compact_shapes_ready = ut_true;
+}
+
+// Expands the instruction at `at` into `inst` and returns its size. The jump target stays a byte
+// offset. Reads at most HVM_COMPACT_MAX_INST_SIZE bytes.
+static HVM_ALWAYS_INLINE uint32_t hvm_compact_decode(const uint8_t *at, HVM_Inst *inst)
+{
+    uint32_t key = at[0] == HVM_COMPACT_WIDE ? 256 + (at[1] & HVM_COMPACT_TYPE_MASK) : at[0];
+    const HVM_CompactShape *shape = &_compact_shapes[key];
+    uint64_t op = hvm_read_le(at + shape->op_at, 8) << shape->op_shift;
+    inst->type = shape->type;
+    inst->arg = (uint32_t)hvm_read_le(at + shape->arg_at, 4) & shape->arg_mask;
+    inst->op.as_u64 = (uint64_t)((int64_t)op >> shape->op_shift) & shape->op_mask;
+    return shape->size;
+}
+
+// Labels-as-values is a GNU extension, fall back to a plain switch when it's not available
+#if !defined(HVM_NO_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define HVM_COMPUTED_GOTO
+#endif
+
+#ifdef HVM_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+#define HVM_INTERP_NAME hvm_run_insts
+#define HVM_INTERP_DIRECT 0
+#define HVM_INTERP_CHECKED 1
+#include "hvm_interp.h"
+
+#define HVM_INTERP_NAME hvm_run_insts_unchecked
+#define HVM_INTERP_DIRECT 0
+#define HVM_INTERP_CHECKED 0
+#include "hvm_interp.h"
+
+#define HVM_INTERP_NAME hvm_run_insts_profiled
+#define HVM_INTERP_DIRECT 0
+#define HVM_INTERP_CHECKED 1
+#define HVM_INTERP_PROFILE 1
+#include "hvm_interp.h"
+
+#define HVM_INTERP_NAME hvm_run_compact
+#define HVM_INTERP_DIRECT 0
+#define HVM_INTERP_CHECKED 1
+#define HVM_INTERP_COMPACT 1
+#include "hvm_interp.h"
+
+#define HVM_INTERP_NAME hvm_run_threaded
+#define HVM_INTERP_DIRECT 1
+#define HVM_INTERP_CHECKED 1
+#include "hvm_interp.h"
+
+#define HVM_INTERP_NAME hvm_run_threaded_unchecked
+#define HVM_INTERP_DIRECT 1
+#define HVM_INTERP_CHECKED 0
+#include "hvm_interp.h"
+
+#ifdef HVM_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+static void hvm_report_trap(const HVM *vm, HVM_Trap trap, const HVM_Inst inst)
+{
+    HVM_InstInfo info = _inst_infos[inst.type < COUNT_HVM_INSTS ? inst.type : HVM_INST_NONE];
+    fprintf(stderr, "Trap %d is thrown while executing %s(ptr(%lu)|int(%ld)|float(%f)\n", trap, info.name, 
+            info.has_operand ? inst.op.as_u64 : 0,
+            info.has_operand ? inst.op.as_i64 : 0,
+            info.has_operand ? inst.op.as_f64 : 0.0);
+    hvm_dump(vm);
+}
+
+static HVM_Trap hvm_exec_tiered(HVM *vm, const HVM_Module module);
+
+// What the verifier proved only holds when the module starts from the stack it was verified with
+static ut_bool hvm_module_fits(const HVM *vm, const HVM_Module module)
+{
+    return module.verified && vm->pc == 0 && vm->ss == 0 && vm->sp == module.base_sp;
+}
+
+HVM_Trap hvm_exec_module(HVM *vm, const HVM_Module module)
+{
+    HVM_ASSERT(vm);
+    // Neither the profiling core nor the promoted regions check jump targets, only a verified module
+    // is safe to tier
+    if(module.tiering && hvm_module_fits(vm, module)) return hvm_exec_tiered(vm, module);
+    uint32_t fault_pc = 0;
+    HVM_Trap res;
+    if(hvm_module_fits(vm, module))
+        res = hvm_run_insts_unchecked(vm, module.items, &fault_pc, UT_NULL);
+    else
+        res = hvm_run_insts(vm, module.items, &fault_pc, UT_NULL);
+    if(res != HVM_TRAP_NONE) {
+        hvm_report_trap(vm, res, module.items[fault_pc]);
+    }
+    return res;
+}
+
+ut_bool hvm_module_prepare(HVM_Prepared *prepared, const HVM_Module module)
+{
+    HVM_ASSERT(prepared);
+    const void **handlers;
+    if(module.verified)
+        hvm_run_threaded_unchecked(UT_NULL, UT_NULL, UT_NULL, &handlers);
+    else
+        hvm_run_threaded(UT_NULL, UT_NULL, UT_NULL, &handlers);
+
+    // One extra slot at the end so running off the end of the program traps instead of reading garbage
+    HVM_ThreadedInst *items = HVM_MALLOC(sizeof(HVM_ThreadedInst)*(module.count + 1));
+    HVM_ASSERT(items);
+    for(uint32_t i = 0; i <= module.count; ++i) {
+        HVM_InstType type = i < module.count ? module.items[i].type : HVM_INST_NONE;
+        if(type >= COUNT_HVM_INSTS) type = HVM_INST_NONE;
+        HVM_ThreadedInst *it = &items[i];
+#ifdef HVM_COMPUTED_GOTO
+        it->handler = handlers[type];
+#else
+        it->handler = (const void *)(uintptr_t)type;
+#endif
+        it->as.op = i < module.count ? module.items[i].op : HVM_NULL_WORD;
+        it->arg = i < module.count ? module.items[i].arg : 0;
+        it->imm = (int32_t)(it->as.op.as_u64 >> 32);
+
+        if(_inst_infos[type].is_jump) {
+            uint64_t target = (uint32_t)module.items[i].op.as_u64;
+            if(target >= module.count) {
+                fprintf(stderr, "ERROR: Instruction %u jumps to %lu which is outside of the module\n", i, target);
+                HVM_FREE(items);
+                return ut_false;
+            }
+            it->as.target = &items[target];
+        }
+    }
+
+    prepared->items = items;
+    prepared->count = module.count;
+    prepared->module = module;
     return ut_true;
 }
 
+void hvm_prepared_deinit(HVM_Prepared *prepared)
+{
+    HVM_ASSERT(prepared);
+    HVM_FREE(prepared->items);
+    prepared->items = UT_NULL;
+    prepared->count = 0;
+}
+
+HVM_Trap hvm_exec_prepared(HVM *vm, const HVM_Prepared prepared)
+{
+    HVM_ASSERT(vm);
+    uint32_t fault_pc = 0;
+    HVM_Trap res;
+    if(prepared.module.verified) {
+        // The handlers were taken from the unchecked core so it can't run anywhere else
+        if(!hvm_module_fits(vm, prepared.module)) {
+            fprintf(stderr, "ERROR: A verified module can only be executed on the stack it was verified with\n");
+            return HVM_TRAP_INVALID_INSTRUCTION;
+        }
+        res = hvm_run_threaded_unchecked(vm, prepared.items, &fault_pc, UT_NULL);
+    } else {
+        res = hvm_run_threaded(vm, prepared.items, &fault_pc, UT_NULL);
+    }
+    if(res != HVM_TRAP_NONE) {
+        HVM_Inst inst = fault_pc < prepared.module.count ? prepared.module.items[fault_pc] : HVM_MAKE_INST(HVM_INST_NONE, HVM_NULL_WORD);
+        hvm_report_trap(vm, res, inst);
+    }
+    return res;
+}
+
+ut_bool hvm_module_compact(HVM_CompactModule *compact, const HVM_Module module)
+{
+    HVM_ASSERT(compact);
+    hvm_compact_shapes_init();
+    uint8_t scratch[HVM_COMPACT_MAX_INST_SIZE];
+    // The sizes don't depend on the jump targets so every offset is known before encoding
+    uint32_t *offsets = HVM_MALLOC(sizeof(uint32_t)*(module.count + 1));
+    HVM_ASSERT(offsets);
+    uint32_t size = 0;
+    for(uint32_t i = 0; i < module.count; ++i) {
+        offsets[i] = size;
+        size += hvm_compact_encode(scratch, module.items[i], 0);
+    }
+    offsets[module.count] = size;
+
+    // Zero padding so decoding never reads past the allocation, it also decodes as HVM_INST_NONE
+    uint8_t *code = HVM_MALLOC(size + HVM_COMPACT_MAX_INST_SIZE);
+    HVM_ASSERT(code);
+    ut_memset(code + size, 0, HVM_COMPACT_MAX_INST_SIZE);
+    for(uint32_t i = 0; i < module.count; ++i) {
+        HVM_Inst inst = module.items[i];
+        uint32_t target = 0;
+        if(inst.type < COUNT_HVM_INSTS && _inst_infos[inst.type].is_jump) {
+            uint32_t index = (uint32_t)inst.op.as_u64;
+            if(index > module.count) {
+                fprintf(stderr, "ERROR: Instruction %u jumps to %u which is outside of the module\n", i, index);
+                HVM_FREE(offsets);
+                HVM_FREE(code);
+                return ut_false;
+            }
+            target = offsets[index];
+        }
+        hvm_compact_encode(code + offsets[i], inst, target);
+    }
+    HVM_FREE(offsets);
+
+    compact->code = code;
+    compact->size = size;
+    compact->count = module.count;
+    compact->static_data = module.static_data;
+    return ut_true;
+}
+
+// Decodes the whole stream checking that it ends on an instruction boundary and that every jump
+// lands on one. When `module` is not NULL the instructions are appended to it with their jump
+// targets turned back into instruction indices.
+static ut_bool hvm_compact_module_walk(const HVM_CompactModule compact, HVM_Module *module)
+{
+    hvm_compact_shapes_init();
+    // Instruction index of every byte offset, UINT32_MAX where no instruction starts
+    uint32_t *indices = HVM_MALLOC(sizeof(uint32_t)*(compact.size + 1));
+    HVM_ASSERT(indices);
+    ut_memset(indices, 0xFF, sizeof(uint32_t)*(compact.size + 1));
+    HVM_Inst inst;
+    uint32_t count = 0;
+    for(uint32_t offset = 0; offset < compact.size; offset += hvm_compact_decode(compact.code + offset, &inst)) {
+        indices[offset] = count++;
+    }
+    indices[compact.size] = count;
+    ut_bool ok = ut_true;
+    if(count != compact.count) {
+        fprintf(stderr, "ERROR: Compact module has %u instructions instead of %u\n", count, compact.count);
+        ok = ut_false;
+    }
+
+    for(uint32_t offset = 0, i = 0; ok && offset < compact.size; ++i) {
+        uint32_t len = hvm_compact_decode(compact.code + offset, &inst);
+        if(len > compact.size - offset) {
+            fprintf(stderr, "ERROR: Instruction %u is truncated\n", i);
+            ok = ut_false;
+            break;
+        }
+        if(_inst_infos[inst.type].is_jump) {
+            uint32_t target = (uint32_t)inst.op.as_u64;
+            if(target > compact.size || indices[target] == UINT32_MAX) {
+                fprintf(stderr, "ERROR: Instruction %u jumps into the middle of an instruction\n", i);
+                ok = ut_false;
+                break;
+            }
+            inst.op.as_u64 = (inst.op.as_u64 & 0xFFFFFFFF00000000) | indices[target];
+        }
+        if(module) hvm_module_append(module, inst);
+        offset += len;
+    }
+    HVM_FREE(indices);
+    return ok;
+}
+
+ut_bool hvm_compact_module_expand(const HVM_CompactModule compact, HVM_Module *module)
+{
+    HVM_ASSERT(module);
+    UT_ASSERT(module->count == 0 && module->capacity == 0);
+    if(!hvm_compact_module_walk(compact, module)) {
+        hvm_module_deinit(module);
+        return ut_false;
+    }
+    module->static_data = compact.static_data;
+    return ut_true;
+}
+
+void hvm_compact_module_deinit(HVM_CompactModule *compact)
+{
+    HVM_ASSERT(compact);
+    HVM_FREE(compact->code);
+    compact->code = UT_NULL;
+    compact->size = 0;
+    compact->count = 0;
+}
+
+HVM_Trap hvm_exec_compact(HVM *vm, const HVM_CompactModule compact)
+{
+    HVM_ASSERT(vm);
+    hvm_compact_shapes_init();
+    uint32_t fault_pc = 0;
+    HVM_Trap res = hvm_run_compact(vm, compact.code, &fault_pc, UT_NULL);
+    if(res != HVM_TRAP_NONE) {
+        HVM_Inst inst;
+        hvm_compact_decode(compact.code + fault_pc, &inst);
+        hvm_report_trap(vm, res, inst);
+    }
+    return res;
+}
+
+void hvm_tiering_init(HVM_Tiering *tiering, const HVM_Module module, uint32_t threshold)
+{
+    HVM_ASSERT(tiering);
+    ut_memset(tiering, 0, sizeof(*tiering));
+    tiering->threshold = threshold > 0 ? threshold : 1;
+    tiering->count = module.count;
+    tiering->counters = HVM_MALLOC(sizeof(uint32_t)*(module.count + 1));
+    HVM_ASSERT(tiering->counters);
+    ut_memset(tiering->counters, 0, sizeof(uint32_t)*(module.count + 1));
+}
+
+void hvm_tiering_deinit(HVM_Tiering *tiering)
+{
+    HVM_ASSERT(tiering);
+    for(uint32_t i = 0; i < tiering->region_count; ++i) {
+        HVM_TierRegion *region = &tiering->regions[i];
+        hvm_prepared_deinit(&region->prepared);
+        hvm_module_deinit(&region->module);
+        HVM_FREE(region->origin);
+    }
+    HVM_FREE(tiering->regions);
+    HVM_FREE(tiering->counters);
+    ut_memset(tiering, 0, sizeof(*tiering));
+}
+
+// The loop whose header is `start` ends at the furthest backward JMP to it
+static uint32_t hvm_loop_end(const HVM_Module module, uint32_t start)
+{
+    uint32_t end = start;
+    for(uint32_t i = start; i < module.count; ++i) {
+        HVM_Inst inst = module.items[i];
+        if(inst.type == HVM_INST_JMP && (uint32_t)inst.op.as_u64 == start) end = i;
+    }
+    return end;
+}
+
+static HVM_TierRegion *hvm_tiering_promote(HVM_Tiering *tiering, const HVM_Module module, uint32_t start)
+{
+    for(uint32_t i = 0; i < tiering->region_count; ++i) {
+        if(tiering->regions[i].start == start) return &tiering->regions[i];
+    }
+
+    HVM_TierRegion region;
+    ut_memset(&region, 0, sizeof(region));
+    region.start = start;
+    region.end = hvm_loop_end(module, start);
+    hvm_module_init(&region.module);
+
+    // Copy the loop with jumps retargeted to the copy. Leaving the loop, by a jump or by
+    // falling off its end, goes through an exit stub placed right after the body.
+    uint32_t length = region.end - region.start + 1;
+    uint32_t *exits = HVM_MALLOC(sizeof(uint32_t)*(length + 1));
+    HVM_ASSERT(exits);
+    uint32_t exit_count = 0;
+    exits[exit_count++] = region.end + 1;
+    for(uint32_t i = region.start; i <= region.end; ++i) {
+        HVM_Inst inst = module.items[i];
+        if(inst.type < COUNT_HVM_INSTS && _inst_infos[inst.type].is_jump) {
+            uint32_t target = (uint32_t)inst.op.as_u64;
+            uint32_t local = target - region.start;
+            if(target < region.start || target > region.end) {
+                uint32_t k = 0;
+                while(k < exit_count && exits[k] != target) k += 1;
+                if(k == exit_count) exits[exit_count++] = target;
+                local = length + k;
+            }
+            inst.op.as_u64 = (inst.op.as_u64 & 0xFFFFFFFF00000000ull) | local;
+        }
+        hvm_module_append(&region.module, inst);
+    }
+    for(uint32_t k = 0; k < exit_count; ++k) {
+        hvm_module_append(&region.module, HVM_MAKE_INST(HVM_INST_EXIT, HVM_WORD_U64(exits[k])));
+    }
+
+    uint32_t unfused = region.module.count;
+    uint32_t *map = HVM_MALLOC(sizeof(uint32_t)*(unfused + 1));
+    HVM_ASSERT(map);
+    hvm_module_fuse_map(&region.module, map);
+    region.origin = HVM_MALLOC(sizeof(uint32_t)*region.module.count);
+    HVM_ASSERT(region.origin);
+    for(uint32_t i = unfused; i > 0; --i) {
+        uint32_t old = i - 1;
+        region.origin[map[old]] = old < length ? region.start + old : exits[old - length];
+    }
+    HVM_FREE(map);
+    HVM_FREE(exits);
+
+    if(!hvm_module_prepare(&region.prepared, region.module)) {
+        hvm_module_deinit(&region.module);
+        HVM_FREE(region.origin);
+        return UT_NULL;
+    }
+
+    if(tiering->region_count + 1 > tiering->region_capacity) {
+        uint32_t new_capacity = tiering->region_capacity == 0 ? 4 : tiering->region_capacity * 2;
+        HVM_TierRegion *new_regions = HVM_MALLOC(sizeof(HVM_TierRegion)*new_capacity);
+        HVM_ASSERT(new_regions);
+        if(tiering->regions) ut_memcpy(new_regions, tiering->regions, sizeof(HVM_TierRegion)*tiering->region_count);
+        HVM_FREE(tiering->regions);
+        tiering->regions = new_regions;
+        tiering->region_capacity = new_capacity;
+    }
+    tiering->regions[tiering->region_count] = region;
+    tiering->region_count += 1;
+    return &tiering->regions[tiering->region_count - 1];
+}
+
+// Interpret the module while counting the backward jumps of every loop. A loop that gets hot is
+// promoted and the execution moves into it at the loop header with the stack left as it is, it
+// comes back to the interpreter when it leaves the loop.
+static HVM_Trap hvm_exec_tiered(HVM *vm, const HVM_Module module)
+{
+    HVM_Tiering *tiering = module.tiering;
+    HVM_ASSERT(tiering->count == module.count && "The tiering state was made for another module");
+    uint32_t fault_pc = 0;
+    for(;;) {
+        HVM_Trap res = hvm_run_insts_profiled(vm, module.items, &fault_pc, UT_NULL, tiering);
+        if(res != HVM_TRAP_NONE) {
+            hvm_report_trap(vm, res, module.items[fault_pc]);
+            return res;
+        }
+        if(vm->halt) return HVM_TRAP_NONE;
+
+        uint32_t start = vm->pc;
+        HVM_TierRegion *region = hvm_tiering_promote(tiering, module, start);
+        if(!region) {
+            // Keep interpreting the loop, the counter is reset so it's not retried right away
+            tiering->counters[start] = 0;
+            continue;
+        }
+
+        vm->pc = 0;
+        res = hvm_run_threaded(vm, region->prepared.items, &fault_pc, UT_NULL);
+        if(res != HVM_TRAP_NONE) {
+            HVM_Inst inst = fault_pc < region->module.count ? region->module.items[fault_pc] : HVM_MAKE_INST(HVM_INST_NONE, HVM_NULL_WORD);
+            hvm_report_trap(vm, res, inst);
+            vm->pc = (fault_pc < region->module.count ? region->origin[fault_pc] : region->end) + 1;
+            return res;
+        }
+        if(vm->halt) {
+            vm->pc = region->origin[vm->pc - 1] + 1;
+            return HVM_TRAP_NONE;
+        }
+        vm->pc = (uint32_t)region->module.items[vm->pc].op.as_u64;
+    }
+}
+
+static const char *_section_names[COUNT_HVM_SECTIONS] = {
+    [HVM_SECTION_CODE] = "code",
+    [HVM_SECTION_CONSTANTS] = "constants",
+    [HVM_SECTION_SYMBOLS] = "symbols",
+    [HVM_SECTION_DEBUG_LINES] = "debug_lines",
+    [HVM_SECTION_PROFILE] = "profile",
+};
+
+static ut_bool hvm_file_save(HVM_ModuleFileHeader header, const HVM_Section *sections, uint32_t section_count,
+        const char *file_path)
+{
+    static const uint8_t padding[8] = {0};
+    Arena a;
+    Buffer res;
+    ut_memset(&a, 0, sizeof(a));
+    buffer_init(&res);
+    HVM_ASSERT(section_count <= HVM_MAX_SECTIONS);
+
+    header.version = HVM_VERSION;
+    header.magic_number = HVM_MAGIC_NUMBER;
+    HVM_SectionTable table;
+    ut_memset(&table, 0, sizeof(table));
+    table.count = section_count;
+    HVM_SectionEntry entries[HVM_MAX_SECTIONS];
+    ut_memset(entries, 0, sizeof(entries));
+
+    // Every section starts 8 byte aligned so a mapped code section can be used in place
+    uint64_t at = sizeof(table) + sizeof(HVM_SectionEntry)*section_count;
+    for(uint32_t i = 0; i < section_count; ++i) {
+        at = (at + 7) & ~(uint64_t)7;
+        entries[i].kind = sections[i].kind;
+        entries[i].start = at;
+        entries[i].size = sections[i].size;
+        at += sections[i].size;
+        if(sections[i].kind == HVM_SECTION_CODE) {
+            header.program_start = entries[i].start;
+            header.program_size = entries[i].size;
+        } else if(sections[i].kind == HVM_SECTION_CONSTANTS) {
+            header.static_data_start = entries[i].start;
+            header.static_data_size = entries[i].size;
+        }
+    }
+
+    buffer_append_with_arena(&res, (void *)&header, sizeof(header), &a);
+    buffer_append_with_arena(&res, (void *)&table, sizeof(table), &a);
+    if(section_count > 0) {
+        buffer_append_with_arena(&res, (void *)entries, sizeof(HVM_SectionEntry)*section_count, &a);
+    }
+    for(uint32_t i = 0; i < section_count; ++i) {
+        ut_size pad = sizeof(header) + entries[i].start - res.count;
+        if(pad > 0) buffer_append_with_arena(&res, (void *)padding, pad, &a);
+        if(sections[i].data && sections[i].size > 0) {
+            buffer_append_with_arena(&res, sections[i].data, sections[i].size, &a);
+        }
+    }
+    ut_bool retval = buffer_save_to_file(res, file_path);
+    arena_free(&a);
+    return retval;
+}
+
+// Checks the header of a module file of `file_size` bytes
+static ut_bool hvm_file_check_header(HVM_ModuleFileHeader *header, ut_size file_size, const char *file_path)
+{
+    if(file_size < sizeof(HVM_ModuleFileHeader)) {
+        fprintf(stderr, "ERROR: %s is too small to be a HVM module\n", file_path);
+        return ut_false;
+    }
+    if(header->magic_number != HVM_MAGIC_NUMBER) {
+        fprintf(stderr, "ERROR: %s is not a HVM module\n", file_path);
+        return ut_false;
+    }
+    if(header->version > HVM_VERSION) {
+        fprintf(stderr, "ERROR: %s was written by a newer version of HVM\n", file_path);
+        return ut_false;
+    }
+    // Before 0.2.0 the kind field was uninitialized padding
+    if(header->version < UT_MAKE_VERSION(0, 2, 0)) {
+        header->kind = HVM_MODULE_KIND_STACK;
+    }
+
+    ut_size body_size = file_size - sizeof(HVM_ModuleFileHeader);
+    if(header->program_start > body_size || header->program_size > body_size - header->program_start
+            || header->static_data_start > body_size || header->static_data_size > body_size - header->static_data_start) {
+        fprintf(stderr, "ERROR: %s is truncated\n", file_path);
+        return ut_false;
+    }
+
+    TRACE_PRINTF("Loaded module with following information\n");
+    TRACE_PRINTF("Magic Number: 0x%X\n", header->magic_number);
+    TRACE_PRINTF("HVM Module Version\n");
+    TRACE_PRINTF("    - major: %u\n", UT_VERSION_MAJOR(header->version));
+    TRACE_PRINTF("    - minor: %u\n", UT_VERSION_MINOR(header->version));
+    TRACE_PRINTF("    - revision: %u\n", UT_VERSION_REVISION(header->version));
+    TRACE_PRINTF("Module Kind: %u\n", header->kind);
+    TRACE_PRINTF("Instruction amount: %u\n", header->insts_amount);
+    TRACE_PRINTF("Program Size: %lu\n", header->program_size);
+    TRACE_PRINTF("Program Start: %lu\n", header->program_start);
+    TRACE_PRINTF("Static Data Size: %lu\n", header->static_data_size);
+    TRACE_PRINTF("Static Data Start: %lu\n", header->static_data_start);
+    return ut_true;
+}
+
+static ut_bool hvm_file_has_section_table(const HVM_ModuleFileHeader header)
+{
+    return header.version >= UT_MAKE_VERSION(0, 3, 0);
+}
+
+// Fills `sections`, indexed by kind, from the section table that was read from a module file of
+// `file_size` bytes. Absent sections are left with a size of 0. Files from before the section table
+// only have the code and the constant pool described by the header.
+static ut_bool hvm_file_check_sections(const HVM_ModuleFileHeader header, const HVM_SectionTable table,
+        const HVM_SectionEntry *entries, ut_size file_size, HVM_SectionEntry *sections, const char *file_path)
+{
+    ut_memset(sections, 0, sizeof(HVM_SectionEntry)*COUNT_HVM_SECTIONS);
+    for(uint32_t kind = 0; kind < COUNT_HVM_SECTIONS; ++kind) sections[kind].kind = kind;
+    sections[HVM_SECTION_CODE].start = header.program_start;
+    sections[HVM_SECTION_CODE].size = header.program_size;
+    sections[HVM_SECTION_CONSTANTS].start = header.static_data_start;
+    sections[HVM_SECTION_CONSTANTS].size = header.static_data_size;
+    if(!hvm_file_has_section_table(header)) return ut_true;
+
+    ut_size body_size = file_size - sizeof(HVM_ModuleFileHeader);
+    for(uint32_t i = 0; i < table.count; ++i) {
+        HVM_SectionEntry entry = entries[i];
+        if(entry.start > body_size || entry.size > body_size - entry.start) {
+            fprintf(stderr, "ERROR: %s is truncated\n", file_path);
+            return ut_false;
+        }
+        // Sections added by later versions are skipped
+        if(entry.kind >= COUNT_HVM_SECTIONS) continue;
+        if((entry.kind == HVM_SECTION_CODE || entry.kind == HVM_SECTION_CONSTANTS)
+                && (entry.start != sections[entry.kind].start || entry.size != sections[entry.kind].size)) {
+            fprintf(stderr, "ERROR: The %s section of %s doesn't match its header\n", _section_names[entry.kind], file_path);
+            return ut_false;
+        }
+        sections[entry.kind] = entry;
+    }
+    return ut_true;
+}
+
+// Checks the module file contents `file` and fills `sections` like hvm_file_check_sections()
+static ut_bool hvm_file_check(const Buffer file, HVM_ModuleFileHeader *header, HVM_SectionEntry *sections,
+        const char *file_path)
+{
+    ut_memset(header, 0, sizeof(*header));
+    if(file.count >= sizeof(HVM_ModuleFileHeader)) ut_memcpy((void *)header, file.data, sizeof(HVM_ModuleFileHeader));
+    if(!hvm_file_check_header(header, file.count, file_path)) return ut_false;
+
+    HVM_SectionTable table;
+    ut_memset(&table, 0, sizeof(table));
+    const HVM_SectionEntry *entries = UT_NULL;
+    if(hvm_file_has_section_table(*header)) {
+        ut_size at = sizeof(HVM_ModuleFileHeader);
+        if(file.count - at < sizeof(table)) {
+            fprintf(stderr, "ERROR: %s is truncated\n", file_path);
+            return ut_false;
+        }
+        ut_memcpy(&table, buffer_slice(file, at, sizeof(table)).data, sizeof(table));
+        at += sizeof(table);
+        if(table.count > HVM_MAX_SECTIONS || file.count - at < sizeof(HVM_SectionEntry)*table.count) {
+            fprintf(stderr, "ERROR: %s has a broken section table\n", file_path);
+            return ut_false;
+        }
+        entries = buffer_slice(file, at, 0).data;
+    }
+    return hvm_file_check_sections(*header, table, entries, file.count, sections, file_path);
+}
+
+// Opens a module file and reads only its header and section table, the sections are read on demand
+// with hvm_file_read_section()
+static FILE *hvm_file_open(const char *file_path, HVM_ModuleFileHeader *header, HVM_SectionEntry *sections)
+{
+    FILE *f = fopen(file_path, "rb");
+    if(!f) return UT_NULL;
+    fseek(f, 0, SEEK_END);
+    long file_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    ut_memset(header, 0, sizeof(*header));
+    if(file_size < 0 || fread(header, 1, sizeof(*header), f) != sizeof(*header)) file_size = 0;
+    if(!hvm_file_check_header(header, (ut_size)file_size, file_path)) {
+        fclose(f);
+        return UT_NULL;
+    }
+
+    HVM_SectionTable table;
+    HVM_SectionEntry entries[HVM_MAX_SECTIONS];
+    ut_memset(&table, 0, sizeof(table));
+    if(hvm_file_has_section_table(*header)) {
+        if(fread(&table, 1, sizeof(table), f) != sizeof(table) || table.count > HVM_MAX_SECTIONS
+                || fread(entries, sizeof(HVM_SectionEntry), table.count, f) != table.count) {
+            fprintf(stderr, "ERROR: %s has a broken section table\n", file_path);
+            fclose(f);
+            return UT_NULL;
+        }
+    }
+    if(!hvm_file_check_sections(*header, table, entries, (ut_size)file_size, sections, file_path)) {
+        fclose(f);
+        return UT_NULL;
+    }
+    return f;
+}
+
+static ut_bool hvm_file_read_section(FILE *f, const HVM_SectionEntry section, Buffer *out, Arena *a, const char *file_path)
+{
+    buffer_init(out);
+    if(section.size == 0) return ut_true;
+    void *data = arena_malloc(a, section.size);
+    HVM_ASSERT(data);
+    if(fseek(f, (long)(sizeof(HVM_ModuleFileHeader) + section.start), SEEK_SET) != 0 
+            || fread(data, 1, section.size, f) != section.size) {
+        fprintf(stderr, "ERROR: Could not read the %s section of %s\n", _section_names[section.kind], file_path);
+        return ut_false;
+    }
+    out->data = data;
+    out->count = section.size;
+    out->capacity = section.size;
+    return ut_true;
+}
+
+// Reads the code and the constant pool of a module file into `local`, the other sections aren't touched
+static ut_bool hvm_file_load(const char *file_path, Buffer *program, Buffer *static_data, HVM_ModuleFileHeader *header, Arena *local)
+{
+    HVM_SectionEntry sections[COUNT_HVM_SECTIONS];
+    FILE *f = hvm_file_open(file_path, header, sections);
+    if(!f) return ut_false;
+    ut_bool ok = hvm_file_read_section(f, sections[HVM_SECTION_CODE], program, local, file_path)
+        && hvm_file_read_section(f, sections[HVM_SECTION_CONSTANTS], static_data, local, file_path);
+    fclose(f);
+    return ok;
+}
+
+ut_bool hvm_module_file_read_section(const char *file_path, HVM_SectionKind kind, Buffer *section, Arena *a)
+{
+    HVM_ASSERT(kind < COUNT_HVM_SECTIONS);
+    HVM_ModuleFileHeader header;
+    HVM_SectionEntry sections[COUNT_HVM_SECTIONS];
+    FILE *f = hvm_file_open(file_path, &header, sections);
+    if(!f) return ut_false;
+    ut_bool ok = sections[kind].size > 0 && hvm_file_read_section(f, sections[kind], section, a, file_path);
+    fclose(f);
+    return ok;
+}
+
+void hvm_module_file_dump_sections(const char *file_path)
+{
+    HVM_ModuleFileHeader header;
+    HVM_SectionEntry sections[COUNT_HVM_SECTIONS];
+    FILE *f = hvm_file_open(file_path, &header, sections);
+    if(!f) return;
+    Arena a;
+    ut_memset(&a, 0, sizeof(a));
+    for(uint32_t kind = 0; kind < COUNT_HVM_SECTIONS; ++kind) {
+        if(sections[kind].size == 0) continue;
+        printf("section %s: start=%lu size=%lu\n", _section_names[kind], sections[kind].start, sections[kind].size);
+    }
+
+    Buffer data;
+    if(sections[HVM_SECTION_SYMBOLS].size > 0 && hvm_file_read_section(f, sections[HVM_SECTION_SYMBOLS], &data, &a, file_path)) {
+        for(ut_size at = 0; at + sizeof(HVM_SymbolEntry) <= data.count;) {
+            HVM_SymbolEntry symbol;
+            ut_memcpy(&symbol, buffer_slice(data, at, 0).data, sizeof(symbol));
+            at += sizeof(symbol);
+            if(symbol.name_size > data.count - at) break;
+            printf("symbol %s %.*s = %u\n", symbol.kind == HVM_SYMBOL_FUNCTION ? "function" : "variable",
+                    (int)symbol.name_size, (const char *)buffer_slice(data, at, 0).data, symbol.value);
+            at += symbol.name_size;
+        }
+    }
+    if(sections[HVM_SECTION_DEBUG_LINES].size > 0 && hvm_file_read_section(f, sections[HVM_SECTION_DEBUG_LINES], &data, &a, file_path)) {
+        for(ut_size at = 0; at + sizeof(HVM_LineEntry) <= data.count; at += sizeof(HVM_LineEntry)) {
+            HVM_LineEntry line;
+            ut_memcpy(&line, buffer_slice(data, at, 0).data, sizeof(line));
+            printf("line %u -> %u:%u\n", line.pc, line.row, line.col);
+        }
+    }
+    arena_free(&a);
+    fclose(f);
+}
+
+HVM_ModuleKind hvm_module_file_kind(const char *file_path)
+{
+    HVM_ModuleFileHeader header;
+    ut_memset(&header, 0, sizeof(header));
+    FILE *f = fopen(file_path, "rb");
+    if(!f) return HVM_MODULE_KIND_STACK;
+    ut_size n = fread(&header, 1, sizeof(header), f);
+    fclose(f);
+    if(n != sizeof(header) || header.version < UT_MAKE_VERSION(0, 2, 0)) 
+        return HVM_MODULE_KIND_STACK;
+    return (HVM_ModuleKind)header.kind;
+}
+
+ut_bool hvm_module_save_to_file(const HVM_Module module, const char *file_path)
+{
+    return hvm_module_save_to_file_with_sections(module, file_path, UT_NULL, 0);
+}
+
+ut_bool hvm_module_save_to_file_with_sections(const HVM_Module module, const char *file_path, 
+        const HVM_Section *sections, uint32_t section_count)
+{
+    HVM_ModuleFileHeader header;
+    ut_memset(&header, 0, sizeof(header));
+    header.kind = HVM_MODULE_KIND_STACK;
+    header.insts_amount = module.count;
+    HVM_Section all[HVM_MAX_SECTIONS];
+    HVM_ASSERT(section_count + 2 <= HVM_MAX_SECTIONS);
+    all[0] = UT_LITERAL(HVM_Section){ .kind = HVM_SECTION_CODE, .data = module.items, .size = sizeof(HVM_Inst) * module.count };
+    all[1] = UT_LITERAL(HVM_Section){ .kind = HVM_SECTION_CONSTANTS, .data = module.static_data.data, .size = module.static_data.count };
+    for(uint32_t i = 0; i < section_count; ++i) all[2 + i] = sections[i];
+    return hvm_file_save(header, all, section_count + 2, file_path);
+}
+
+ut_bool hvm_module_load_from_file(HVM_Module *module, const char *file_path, Arena *a)
+{
+    UT_ASSERT(module->count == 0 && module->capacity == 0);
+    if(hvm_module_file_kind(file_path) == HVM_MODULE_KIND_COMPACT) {
+        HVM_CompactModule compact = {0};
+        if(!hvm_compact_module_load_from_file(&compact, file_path, a)) return ut_false;
+        ut_bool ok = hvm_compact_module_expand(compact, module);
+        hvm_compact_module_deinit(&compact);
+        return ok;
+    }
+
+    Buffer program, static_data;
+    HVM_ModuleFileHeader header;
+    Arena local;
+    ut_memset(&local, 0, sizeof(local));
+    if(!hvm_file_load(file_path, &program, &static_data, &header, &local)) {
+        arena_free(&local);
+        return ut_false;
+    }
+    if(header.kind != HVM_MODULE_KIND_STACK || (ut_size)header.insts_amount * sizeof(HVM_Inst) > header.program_size) {
+        fprintf(stderr, "ERROR: %s is not a stack machine module\n", file_path);
+        arena_free(&local);
+        return ut_false;
+    }
+
+    for(uint32_t i = 0; i < header.insts_amount; ++i) {
+        HVM_Inst inst = ((HVM_Inst*)program.data)[i];
+        hvm_module_append(module, inst);
+    }
+    if(static_data.count > 0) buffer_append_with_arena(&module->static_data, static_data.data, static_data.count, a);
+    arena_free(&local);
+    return ut_true;
+}
+
+ut_bool hvm_module_map_file(HVM_Module *module, const char *file_path)
+{
+    UT_ASSERT(module->count == 0 && module->capacity == 0);
+#ifdef HVM_HAS_MMAP
+    int fd = open(file_path, O_RDONLY);
+    if(fd < 0) return ut_false;
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size <= 0) {
+        fprintf(stderr, "ERROR: %s is too small to be a HVM module\n", file_path);
+        close(fd);
+        return ut_false;
+    }
+    // Private and read-only so every process running the module shares the page cache
+    void *data = mmap(UT_NULL, (ut_size)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Could not map %s\n", file_path);
+        return ut_false;
+    }
+
+    Buffer file;
+    file.data = data;
+    file.count = (ut_size)st.st_size;
+    file.capacity = file.count;
+    HVM_ModuleFileHeader header;
+    HVM_SectionEntry sections[COUNT_HVM_SECTIONS];
+    if(!hvm_file_check(file, &header, sections, file_path)) {
+        munmap(data, file.count);
+        return ut_false;
+    }
+    // Only the pages of the code and the constant pool are ever touched, the other sections stay on disk
+    ut_size program_at = sizeof(HVM_ModuleFileHeader) + sections[HVM_SECTION_CODE].start;
+    if(header.kind != HVM_MODULE_KIND_STACK || (ut_size)header.insts_amount * sizeof(HVM_Inst) > header.program_size
+            || program_at % _Alignof(HVM_Inst) != 0) {
+        fprintf(stderr, "ERROR: %s is not a stack machine module that can be mapped\n", file_path);
+        munmap(data, file.count);
+        return ut_false;
+    }
+
+    hvm_module_init(module);
+    module->items = (HVM_Inst *)buffer_slice(file, program_at, 0).data;
+    module->count = header.insts_amount;
+    HVM_SectionEntry constants = sections[HVM_SECTION_CONSTANTS];
+    module->static_data.data = (void *)buffer_slice(file, sizeof(HVM_ModuleFileHeader) + constants.start, 0).data;
+    module->static_data.count = constants.size;
+    // Appending to the static data then copies it out of the mapping
+    module->static_data.capacity = constants.size;
+    module->mapping = data;
+    module->mapping_size = file.count;
+    return ut_true;
+#else
+    fprintf(stderr, "ERROR: Could not map %s, memory mapped files are not supported on this platform\n", file_path);
+    return ut_false;
+#endif
+}
+
+ut_bool hvm_compact_module_save_to_file(const HVM_CompactModule compact, const char *file_path)
+{
+    HVM_ModuleFileHeader header;
+    ut_memset(&header, 0, sizeof(header));
+    header.kind = HVM_MODULE_KIND_COMPACT;
+    header.insts_amount = compact.count;
+    HVM_Section sections[] = {
+        { .kind = HVM_SECTION_CODE, .data = compact.code, .size = compact.size },
+        { .kind = HVM_SECTION_CONSTANTS, .data = compact.static_data.data, .size = compact.static_data.count },
+    };
+    return hvm_file_save(header, sections, UT_ARRAY_LEN(sections), file_path);
+}
+
+ut_bool hvm_compact_module_load_from_file(HVM_CompactModule *compact, const char *file_path, Arena *a)
+{
+    UT_ASSERT(compact->code == UT_NULL);
+    Buffer program, static_data;
+    HVM_ModuleFileHeader header;
+    Arena local;
+    ut_memset(&local, 0, sizeof(local));
+    if(!hvm_file_load(file_path, &program, &static_data, &header, &local)) {
+        arena_free(&local);
+        return ut_false;
+    }
+    if(header.kind != HVM_MODULE_KIND_COMPACT || header.program_size > UINT32_MAX - HVM_COMPACT_MAX_INST_SIZE) {
+        fprintf(stderr, "ERROR: %s is not a compact stack machine module\n", file_path);
+        arena_free(&local);
+        return ut_false;
+    }
+
+    compact->size = (uint32_t)header.program_size;
+    compact->count = header.insts_amount;
+    compact->code = HVM_MALLOC(compact->size + HVM_COMPACT_MAX_INST_SIZE);
+    HVM_ASSERT(compact->code);
+    if(compact->size > 0) ut_memcpy(compact->code, program.data, compact->size);
+    ut_memset(compact->code + compact->size, 0, HVM_COMPACT_MAX_INST_SIZE);
+    if(static_data.count > 0) buffer_append_with_arena(&compact->static_data, static_data.data, static_data.count, a);
+    arena_free(&local);
+
+    if(!hvm_compact_module_walk(*compact, UT_NULL)) {
+        hvm_compact_module_deinit(compact);
+        return ut_false;
+    }
+    return ut_true;
+}
+
+static const char *_rinst_names[COUNT_HVM_RINSTS] = {
+    [HVM_RINST_NONE] = "(none)",
+    [HVM_RINST_HALT] = "halt",
+    [HVM_RINST_LOADI] = "loadi",
+    [HVM_RINST_MOV] = "mov",
+    [HVM_RINST_ADD] = "add",
+    [HVM_RINST_SUB] = "sub",
+    [HVM_RINST_MUL] = "mul",
+    [HVM_RINST_EQ] = "eq",
+    [HVM_RINST_NE] = "ne",
+    [HVM_RINST_LT] = "lt",
+    [HVM_RINST_GT] = "gt",
+    [HVM_RINST_LE] = "le",
+    [HVM_RINST_GE] = "ge",
+    [HVM_RINST_ADDI] = "addi",
+    [HVM_RINST_SUBI] = "subi",
+    [HVM_RINST_MULI] = "muli",
+    [HVM_RINST_EQI] = "eqi",
+    [HVM_RINST_NEI] = "nei",
+    [HVM_RINST_LTI] = "lti",
+    [HVM_RINST_GTI] = "gti",
+    [HVM_RINST_LEI] = "lei",
+    [HVM_RINST_GEI] = "gei",
+    [HVM_RINST_JMP] = "jmp",
+    [HVM_RINST_JZ] = "jz",
+    [HVM_RINST_JN] = "jn",
+    [HVM_RINST_DUMP] = "dump",
+};
+
+void hvm_reg_module_init(HVM_RegModule *module)
+{
+    HVM_ASSERT(module);
+    module->items = UT_NULL;
+    module->count = 0;
+    module->capacity = 0;
+    module->reg_count = 0;
+    buffer_init(&module->static_data);
+}
+
+void hvm_reg_module_deinit(HVM_RegModule *module)
+{
+    HVM_FREE(module->items);
+    module->items = UT_NULL;
+    module->count = 0;
+    module->capacity = 0;
+    module->reg_count = 0;
+}
+
+void hvm_reg_module_dump(const HVM_RegModule module)
+{
+    printf("registers: %u\n", module.reg_count);
+    for(uint32_t i = 0; i < module.count; ++i) {
+        HVM_RegInst inst = module.items[i];
+        const char *name = inst.type < COUNT_HVM_RINSTS ? _rinst_names[inst.type] : "(invalid)";
+        switch(inst.type) {
+            case HVM_RINST_HALT:
+                printf("%u %s\n", i, name);
+                break;
+            case HVM_RINST_LOADI:
+                printf("%u %s r%u, %ld\n", i, name, inst.dst, inst.imm.as_i64);
+                break;
+            case HVM_RINST_MOV:
+                printf("%u %s r%u, r%u\n", i, name, inst.dst, inst.a);
+                break;
+            case HVM_RINST_JMP:
+                printf("%u %s %lu\n", i, name, inst.imm.as_u64);
+                break;
+            case HVM_RINST_JZ:
+            case HVM_RINST_JN:
+                printf("%u %s r%u, %lu\n", i, name, inst.a, inst.imm.as_u64);
+                break;
+            case HVM_RINST_DUMP:
+                printf("%u %s r%u\n", i, name, inst.a);
+                break;
+            default:
+                if(inst.type >= HVM_RINST_ADDI && inst.type <= HVM_RINST_GEI) {
+                    printf("%u %s r%u, r%u, %ld\n", i, name, inst.dst, inst.a, inst.imm.as_i64);
+                } else {
+                    printf("%u %s r%u, r%u, r%u\n", i, name, inst.dst, inst.a, inst.b);
+                }
+                break;
+        }
+    }
+}
+
+void hvm_reg_module_append(HVM_RegModule *module, HVM_RegInst inst)
+{
+    HVM_ASSERT(module);
+    if(module->count + 1 > module->capacity) {
+        ut_size new_capacity = module->capacity * 2;
+        if(new_capacity == 0) new_capacity = 32;
+
+        HVM_RegInst *new_items = HVM_MALLOC(sizeof(inst)*new_capacity);
+        HVM_ASSERT(new_items);
+        if(module->items) ut_memcpy(new_items, module->items, module->count * sizeof(inst));
+        HVM_FREE(module->items);
+        module->items = new_items;
+        module->capacity = new_capacity;
+    }
+
+    module->items[module->count] = inst;
+    module->count += 1;
+}
+
+ut_bool hvm_reg_module_validate(HVM_RegModule *module)
+{
+    HVM_ASSERT(module);
+    uint32_t reg_count = module->reg_count;
+    for(uint32_t i = 0; i < module->count; ++i) {
+        HVM_RegInst inst = module->items[i];
+        if(inst.type == HVM_RINST_NONE || inst.type >= COUNT_HVM_RINSTS) {
+            fprintf(stderr, "ERROR: Invalid register instruction %u at %u\n", inst.type, i);
+            return ut_false;
+        }
+        if((inst.type == HVM_RINST_JMP || inst.type == HVM_RINST_JZ || inst.type == HVM_RINST_JN) 
+                && inst.imm.as_u64 >= module->count) {
+            fprintf(stderr, "ERROR: Instruction %u jumps to %lu which is outside of the module\n", i, inst.imm.as_u64);
+            return ut_false;
+        }
+        if(inst.dst + 1u > reg_count) reg_count = inst.dst + 1u;
+        if(inst.a + 1u > reg_count) reg_count = inst.a + 1u;
+        if(inst.b + 1u > reg_count) reg_count = inst.b + 1u;
+    }
+    if(module->count == 0 || module->items[module->count - 1].type != HVM_RINST_HALT) {
+        fprintf(stderr, "ERROR: Register module must end with halt\n");
+        return ut_false;
+    }
+    if(reg_count > HVM_STACK_CAPACITY) {
+        fprintf(stderr, "ERROR: Register module uses %u registers but the stack only has %u words\n", 
+                reg_count, HVM_STACK_CAPACITY);
+        return ut_false;
+    }
+    module->reg_count = reg_count;
+    return ut_true;
+}
+
+#ifdef HVM_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+// Expects a module that passed hvm_reg_module_validate(), operands are not checked here
+HVM_Trap hvm_exec_reg_module(HVM *vm, const HVM_RegModule module)
+{
+#define HVM_R(I) regs[(I)]
+#define HVM_RBINOP(OP) { HVM_R(ip->dst).as_i64 = HVM_R(ip->a).as_i64 OP HVM_R(ip->b).as_i64; HVM_NEXT(); }
+#define HVM_RBINOPI(OP) { HVM_R(ip->dst).as_i64 = HVM_R(ip->a).as_i64 OP ip->imm.as_i64; HVM_NEXT(); }
+// Wraps around like the stack VM
+#define HVM_RWRAPOP(OP) { HVM_R(ip->dst).as_u64 = HVM_R(ip->a).as_u64 OP HVM_R(ip->b).as_u64; HVM_NEXT(); }
+#define HVM_RWRAPOPI(OP) { HVM_R(ip->dst).as_u64 = HVM_R(ip->a).as_u64 OP ip->imm.as_u64; HVM_NEXT(); }
+#define HVM_NEXT() { ip += 1; HVM_DISPATCH(); }
+#define HVM_JUMP() { ip = code + ip->imm.as_u64; HVM_DISPATCH(); }
+
+#ifdef HVM_COMPUTED_GOTO
+#define HVM_CASE(T) do_##T
+#define HVM_DISPATCH() goto *handlers[ip->type < COUNT_HVM_RINSTS ? ip->type : HVM_RINST_NONE]
+    static const void *handlers[COUNT_HVM_RINSTS] = {
+        [HVM_RINST_NONE] = &&do_NONE,
+        [HVM_RINST_HALT] = &&do_HALT,
+        [HVM_RINST_LOADI] = &&do_LOADI,
+        [HVM_RINST_MOV] = &&do_MOV,
+        [HVM_RINST_ADD] = &&do_ADD,
+        [HVM_RINST_SUB] = &&do_SUB,
+        [HVM_RINST_MUL] = &&do_MUL,
+        [HVM_RINST_EQ] = &&do_EQ,
+        [HVM_RINST_NE] = &&do_NE,
+        [HVM_RINST_LT] = &&do_LT,
+        [HVM_RINST_GT] = &&do_GT,
+        [HVM_RINST_LE] = &&do_LE,
+        [HVM_RINST_GE] = &&do_GE,
+        [HVM_RINST_ADDI] = &&do_ADDI,
+        [HVM_RINST_SUBI] = &&do_SUBI,
+        [HVM_RINST_MULI] = &&do_MULI,
+        [HVM_RINST_EQI] = &&do_EQI,
+        [HVM_RINST_NEI] = &&do_NEI,
+        [HVM_RINST_LTI] = &&do_LTI,
+        [HVM_RINST_GTI] = &&do_GTI,
+        [HVM_RINST_LEI] = &&do_LEI,
+        [HVM_RINST_GEI] = &&do_GEI,
+        [HVM_RINST_JMP] = &&do_JMP,
+        [HVM_RINST_JZ] = &&do_JZ,
+        [HVM_RINST_JN] = &&do_JN,
+        [HVM_RINST_DUMP] = &&do_DUMP,
+    };
+#else
+#define HVM_CASE(T) case HVM_RINST_##T
+#define HVM_DISPATCH() continue
+#endif
+
+    HVM_ASSERT(vm);
+    HVM_ASSERT(module.reg_count <= HVM_STACK_CAPACITY);
+    const HVM_RegInst *code = module.items;
+    const HVM_RegInst *ip = code + vm->pc;
+    HVM_Word *regs = vm->stack;
+    HVM_Trap res = HVM_TRAP_NONE;
+
+    if(vm->halt) return HVM_TRAP_NONE;
+    if(vm->sp < module.reg_count) {
+        ut_memset(&regs[vm->sp], 0, (module.reg_count - vm->sp) * sizeof(HVM_Word));
+    }
+
+#ifdef HVM_COMPUTED_GOTO
+    HVM_DISPATCH();
+#endif
+    for(;;) {
+        switch(ip->type) {
+            HVM_CASE(HALT): {
+                vm->halt = 1;
+                ip += 1;
+                goto done;
+            }
+
+            HVM_CASE(LOADI): { HVM_R(ip->dst) = ip->imm; } HVM_NEXT();
+            HVM_CASE(MOV): { HVM_R(ip->dst) = HVM_R(ip->a); } HVM_NEXT();
+
+            HVM_CASE(ADD): HVM_RWRAPOP(+);
+            HVM_CASE(SUB): HVM_RWRAPOP(-);
+            HVM_CASE(MUL): HVM_RWRAPOP(*);
+            HVM_CASE(EQ): HVM_RBINOP(==);
+            HVM_CASE(NE): HVM_RBINOP(!=);
+            HVM_CASE(LT): HVM_RBINOP(<);
+            HVM_CASE(GT): HVM_RBINOP(>);
+            HVM_CASE(LE): HVM_RBINOP(<=);
+            HVM_CASE(GE): HVM_RBINOP(>=);
+
+            HVM_CASE(ADDI): HVM_RWRAPOPI(+);
+            HVM_CASE(SUBI): HVM_RWRAPOPI(-);
+            HVM_CASE(MULI): HVM_RWRAPOPI(*);
+            HVM_CASE(EQI): HVM_RBINOPI(==);
+            HVM_CASE(NEI): HVM_RBINOPI(!=);
+            HVM_CASE(LTI): HVM_RBINOPI(<);
+            HVM_CASE(GTI): HVM_RBINOPI(>);
+            HVM_CASE(LEI): HVM_RBINOPI(<=);
+            HVM_CASE(GEI): HVM_RBINOPI(>=);
+
+            HVM_CASE(JMP): HVM_JUMP();
+            HVM_CASE(JZ): { if(HVM_R(ip->a).as_i64 == 0) HVM_JUMP(); } HVM_NEXT();
+            HVM_CASE(JN): { if(HVM_R(ip->a).as_i64 != 0) HVM_JUMP(); } HVM_NEXT();
+
+            HVM_CASE(DUMP): {
+                HVM_Word val = HVM_R(ip->a);
+                printf("HVM_Word{ .as_u64=%lu, .as_i64=%ld, .as_f64=%f }\n", val.as_u64, val.as_i64, val.as_f64);
+            } HVM_NEXT();
+
+            HVM_CASE(NONE):
+            default: {
+                res = HVM_TRAP_INVALID_INSTRUCTION;
+                fprintf(stderr, "Trap %d is thrown while executing register instruction %u at %u\n", 
+                        res, ip->type, (uint32_t)(ip - code));
+                ip += 1;
+                goto done;
+            }
+        }
+    }
+
+done:
+    vm->pc = (uint32_t)(ip - code);
+    vm->ss = 0;
+    vm->sp = module.reg_count;
+    return res;
+
+#undef HVM_R
+#undef HVM_RBINOP
+#undef HVM_RBINOPI
+#undef HVM_RWRAPOP
+#undef HVM_RWRAPOPI
+#undef HVM_NEXT
+#undef HVM_JUMP
+#undef HVM_CASE
+#undef HVM_DISPATCH
+}
+
+#ifdef HVM_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+ut_bool hvm_reg_module_save_to_file(const HVM_RegModule module, const char *file_path)
+{
+    HVM_ModuleFileHeader header;
+    ut_memset(&header, 0, sizeof(header));
+    header.kind = HVM_MODULE_KIND_REGISTER;
+    header.insts_amount = module.count;
+    HVM_Section sections[] = {
+        { .kind = HVM_SECTION_CODE, .data = module.items, .size = sizeof(HVM_RegInst) * module.count },
+        { .kind = HVM_SECTION_CONSTANTS, .data = module.static_data.data, .size = module.static_data.count },
+    };
+    return hvm_file_save(header, sections, UT_ARRAY_LEN(sections), file_path);
+}
+
+ut_bool hvm_reg_module_load_from_file(HVM_RegModule *module, const char *file_path, Arena *a)
+{
+    UT_ASSERT(module->count == 0 && module->capacity == 0);
+    Buffer program, static_data;
+    HVM_ModuleFileHeader header;
+    Arena local;
+    ut_memset(&local, 0, sizeof(local));
+    if(!hvm_file_load(file_path, &program, &static_data, &header, &local)) {
+        arena_free(&local);
+        return ut_false;
+    }
+    if(header.kind != HVM_MODULE_KIND_REGISTER || (ut_size)header.insts_amount * sizeof(HVM_RegInst) > header.program_size) {
+        fprintf(stderr, "ERROR: %s is not a register machine module\n", file_path);
+        arena_free(&local);
+        return ut_false;
+    }
+
+    for(uint32_t i = 0; i < header.insts_amount; ++i) {
+        HVM_RegInst inst = ((HVM_RegInst*)program.data)[i];
+        hvm_reg_module_append(module, inst);
+    }
+    if(static_data.count > 0) buffer_append_with_arena(&module->static_data, static_data.data, static_data.count, a);
+    arena_free(&local);
+
+    if(!hvm_reg_module_validate(module)) {
+        hvm_reg_module_deinit(module);
+        return ut_false;
+    }
+    return ut_true;
+}
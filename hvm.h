@@ -1,7 +1,7 @@
 #ifndef HVM_H_
 #define HVM_H_
 
-#define HVM_VERSION UT_MAKE_VERSION(0, 1, 0)
+#define HVM_VERSION UT_MAKE_VERSION(0, 3, 0)
 #define HVM_MAGIC_NUMBER 0xFBADF00D
 
 #define HVM_STATIC_MEMORY_REGION_START
@@ -35,6 +35,11 @@
 #define HVM_HEAP_CAPACITY (100*1024)
 #endif
 
+// Default amount of backward jumps to a loop header before the loop is promoted, see hvm_tiering_init()
+#ifndef HVM_TIER_THRESHOLD
+#define HVM_TIER_THRESHOLD 1000
+#endif
+
 typedef struct HVM HVM;
 
 typedef union HVM_Word {
@@ -104,20 +109,47 @@ typedef enum HVM_InstType {
 
     HVM_INST_DUMP,
 
+    // Superinstructions produced by hvm_module_fuse(). `arg` is an absolute stack index.
+    // stack[arg] += op
+    HVM_INST_ADDABSI,
+    // stack[arg] += stack[op]
+    HVM_INST_ADDABS,
+    // stack[arg] = op
+    HVM_INST_SETABSI,
+    // stack[arg] = stack[op]
+    HVM_INST_MOVABS,
+    // Jump to the low 32 bits of op if stack[arg] compared with the high 32 bits of op holds
+    HVM_INST_JEQABSI,
+    HVM_INST_JNEABSI,
+    HVM_INST_JLTABSI,
+    HVM_INST_JGTABSI,
+    HVM_INST_JLEABSI,
+    HVM_INST_JGEABSI,
+
+    // Only used inside of promoted loop regions, leaves the region and continues at op in the
+    // original module
+    HVM_INST_EXIT,
+
     COUNT_HVM_INSTS,
 } HVM_InstType;
 
 typedef struct HVM_Inst {
     HVM_InstType type;
+    uint32_t arg; // Only used by superinstructions, it lives in what used to be padding
     HVM_Word op;
 } HVM_Inst;
 
 #define HVM_MAKE_INST(T, O) UT_LITERAL(HVM_Inst){ .type=(T), .op=(O), }
+#define HVM_MAKE_INST_ARG(T, A, O) UT_LITERAL(HVM_Inst){ .type=(T), .arg=(A), .op=(O), }
+// Operand of the compare-and-jump superinstructions
+#define HVM_WORD_JUMP_IMM(TARGET, IMM) HVM_WORD_U64(((uint64_t)(uint32_t)(IMM) << 32) | (uint32_t)(TARGET))
 
 typedef struct HVM_InstInfo {
     HVM_InstType type;
     const char *name;
     ut_bool has_operand;
+    ut_bool has_arg;
+    ut_bool is_jump; // the low 32 bits of the operand is the target
     int8_t min_sp;
     int8_t chg_sp;
 } HVM_InstInfo;
@@ -132,14 +164,171 @@ typedef struct HVM_NativeInfo {
     HVM_NativeWrapperFn wrapper;
 } HVM_NativeInfo;
 
+typedef struct HVM_Tiering HVM_Tiering;
+
 typedef struct HVM_Module {
     HVM_Inst *items;
     uint32_t count;
     uint32_t capacity;
 
+    // Optional, hvm_exec_module() promotes hot loops when it's set
+    HVM_Tiering *tiering;
+
+    // Set by hvm_module_verify(), any change to the items clears `verified`
+    ut_bool verified;
+    uint32_t max_stack;
+    uint32_t base_sp; // values on the stack below the module when it was verified
+
     Buffer static_data;
+
+    // Set by hvm_module_map_file(), `items` and `static_data` point into this read-only mapping
+    // of the file. The items are copied to the heap the first time they're modified.
+    const void *mapping;
+    ut_size mapping_size;
 } HVM_Module;
 
+// The abstract state of the stack before an instruction. `scope` is the index of the
+// BEGIN_SCOPE that opened the current scope plus one, or 0 for the outermost scope.
+typedef struct HVM_StackState {
+    uint32_t ss;
+    uint32_t sp;
+    uint32_t scope;
+    ut_bool reachable;
+} HVM_StackState;
+
+// Three-address instruction set of the register machine. Registers are the bottom
+// `reg_count` words of the VM stack so a register index is also an absolute stack index.
+typedef enum HVM_RegInstType {
+    HVM_RINST_NONE = 0,
+
+    HVM_RINST_HALT,
+    // r[dst] = imm
+    HVM_RINST_LOADI,
+    // r[dst] = r[a]
+    HVM_RINST_MOV,
+
+    // r[dst] = r[a] op r[b]
+    HVM_RINST_ADD,
+    HVM_RINST_SUB,
+    HVM_RINST_MUL,
+    HVM_RINST_EQ,
+    HVM_RINST_NE,
+    HVM_RINST_LT,
+    HVM_RINST_GT,
+    HVM_RINST_LE,
+    HVM_RINST_GE,
+
+    // r[dst] = r[a] op imm
+    HVM_RINST_ADDI,
+    HVM_RINST_SUBI,
+    HVM_RINST_MULI,
+    HVM_RINST_EQI,
+    HVM_RINST_NEI,
+    HVM_RINST_LTI,
+    HVM_RINST_GTI,
+    HVM_RINST_LEI,
+    HVM_RINST_GEI,
+
+    // pc = imm
+    HVM_RINST_JMP,
+    // if(r[a] == 0) pc = imm
+    HVM_RINST_JZ,
+    // if(r[a] != 0) pc = imm
+    HVM_RINST_JN,
+
+    // dump r[a]
+    HVM_RINST_DUMP,
+
+    COUNT_HVM_RINSTS,
+} HVM_RegInstType;
+
+typedef struct HVM_RegInst {
+    uint16_t type;
+    uint16_t dst;
+    uint16_t a;
+    uint16_t b;
+    HVM_Word imm;
+} HVM_RegInst;
+
+#define HVM_MAKE_RINST(T, D, A, B, I) UT_LITERAL(HVM_RegInst){ .type=(T), .dst=(D), .a=(A), .b=(B), .imm=(I), }
+
+typedef struct HVM_RegModule {
+    HVM_RegInst *items;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t reg_count;
+
+    Buffer static_data;
+} HVM_RegModule;
+
+typedef enum HVM_ModuleKind {
+    HVM_MODULE_KIND_STACK = 0,
+    HVM_MODULE_KIND_REGISTER,
+    HVM_MODULE_KIND_COMPACT,
+} HVM_ModuleKind;
+
+// Variable length encoding of a stack module built by hvm_module_compact(). Every instruction
+// starts with an opcode byte holding the type in the low 6 bits and the width class of the
+// immediate in the high 2 bits (0, 1, 2 or 4 bytes, sign extended), followed by the operands in
+// little endian. Instructions whose operands don't fit are prefixed with HVM_COMPACT_WIDE which
+// makes the immediate 8 bytes and the arg 4. Jump targets are 4 byte offsets into `code`.
+// `code` ends with an extra HVM_INST_NONE byte so running off the end traps.
+typedef struct HVM_CompactModule {
+    uint8_t *code;
+    uint32_t size; // in bytes, without the trailing HVM_INST_NONE
+    uint32_t count; // in instructions
+
+    Buffer static_data;
+} HVM_CompactModule;
+
+#define HVM_COMPACT_WIDE 0xFF
+#define HVM_COMPACT_TYPE_MASK 0x3F
+
+// Direct threaded form of a module built by hvm_module_prepare. Every instruction carries
+// the address of its handler and jumps point straight at their target instruction.
+typedef struct HVM_ThreadedInst {
+    const void *handler;
+    union {
+        HVM_Word op;
+        const struct HVM_ThreadedInst *target;
+    } as;
+    uint32_t arg;
+    int32_t imm; // the immediate of compare-and-jump superinstructions
+} HVM_ThreadedInst;
+
+typedef struct HVM_Prepared {
+    HVM_ThreadedInst *items;
+    uint32_t count;
+
+    HVM_Module module; // The source module, it must outlive the prepared one
+} HVM_Prepared;
+
+// A hot loop, the instructions in [start, end] of the original module, promoted to a fused
+// and pre-decoded copy. Jumps that leave the loop go to HVM_INST_EXIT stubs at the end.
+typedef struct HVM_TierRegion {
+    uint32_t start;
+    uint32_t end;
+    HVM_Module module;
+    HVM_Prepared prepared;
+    uint32_t *origin; // the pc in the original module of each instruction in `module`
+} HVM_TierRegion;
+
+struct HVM_Tiering {
+    uint32_t threshold;
+    uint32_t *counters; // backward jumps to each pc of the original module
+    uint32_t count;
+
+    HVM_TierRegion *regions;
+    uint32_t region_count;
+    uint32_t region_capacity;
+};
+
+// Native code generated from a module by hvm_jit_compile()
+typedef struct HVM_Jit {
+    void *code;
+    ut_size size;
+} HVM_Jit;
+
 typedef struct HVM {
     HVM_Word stack[HVM_STACK_CAPACITY];
     uint32_t sp;
@@ -154,12 +343,66 @@ typedef struct HVM_ModuleFileHeader {
     uint32_t magic_number;
     uint32_t version;
     uint32_t insts_amount;
+    uint32_t kind; // HVM_ModuleKind, this was padding before version 0.2.0
     uint64_t program_start;
     uint64_t program_size;
     uint64_t static_data_start;
     uint64_t static_data_size;
 } HVM_ModuleFileHeader;
 
+typedef enum HVM_SectionKind {
+    HVM_SECTION_CODE = 0,
+    HVM_SECTION_CONSTANTS, // the static data
+    HVM_SECTION_SYMBOLS,
+    HVM_SECTION_DEBUG_LINES,
+    HVM_SECTION_PROFILE,
+    COUNT_HVM_SECTIONS,
+} HVM_SectionKind;
+
+// Since version 0.3.0 the header is followed by a HVM_SectionTable and `count` entries. The program
+// and static data fields of the header still describe the code and constant pool sections so readers
+// that only know about those keep working. Offsets are relative to the end of the header.
+typedef struct HVM_SectionTable {
+    uint32_t count;
+    uint32_t reserved;
+} HVM_SectionTable;
+
+typedef struct HVM_SectionEntry {
+    uint32_t kind; // HVM_SectionKind
+    uint32_t reserved;
+    uint64_t start;
+    uint64_t size;
+} HVM_SectionEntry;
+
+#define HVM_MAX_SECTIONS 64
+
+// A section to be written by hvm_module_save_to_file_with_sections()
+typedef struct HVM_Section {
+    HVM_SectionKind kind;
+    const void *data;
+    uint64_t size;
+} HVM_Section;
+
+typedef enum HVM_SymbolKind {
+    HVM_SYMBOL_VARIABLE = 0, // `value` is the absolute stack index of the variable
+    HVM_SYMBOL_FUNCTION, // `value` is the pc of the function
+} HVM_SymbolKind;
+
+// HVM_SECTION_SYMBOLS is a sequence of these, each one followed by `name_size` bytes of name
+typedef struct HVM_SymbolEntry {
+    uint32_t kind; // HVM_SymbolKind
+    uint32_t value;
+    uint32_t name_size;
+} HVM_SymbolEntry;
+
+// HVM_SECTION_DEBUG_LINES is an array of these sorted by pc, the instructions from `pc` up to the
+// pc of the next entry come from the statement at `row` and `col` of the source, both 1 based
+typedef struct HVM_LineEntry {
+    uint32_t pc;
+    uint32_t row;
+    uint32_t col;
+} HVM_LineEntry;
+
 void hvm_init(HVM *vm);
 HVM_Trap hvm_exec(HVM *vm, HVM_Inst inst);
 void hvm_dump(const HVM *vm);
@@ -168,8 +411,50 @@ void hvm_module_init(HVM_Module *module);
 void hvm_module_deinit(HVM_Module *module);
 void hvm_module_dump(const HVM_Module module);
 void hvm_module_append(HVM_Module *module, HVM_Inst inst);
+void hvm_module_fuse(HVM_Module *module);
+void hvm_module_fuse_map(HVM_Module *module, uint32_t *out_map);
+void hvm_module_peephole(HVM_Module *module);
+void hvm_module_peephole_map(HVM_Module *module, uint32_t *out_map);
+ut_bool hvm_module_analyze(const HVM_Module module, HVM_StackState *states, uint32_t *max_stack);
+ut_bool hvm_module_analyze_from(const HVM_Module module, uint32_t base_sp, HVM_StackState *states, uint32_t *max_stack);
+ut_bool hvm_module_verify(HVM_Module *module);
+ut_bool hvm_module_verify_from(HVM_Module *module, uint32_t base_sp);
 HVM_Trap hvm_exec_module(HVM *vm, const HVM_Module module);
 ut_bool hvm_module_save_to_file(const HVM_Module module, const char *file_path);
+ut_bool hvm_module_save_to_file_with_sections(const HVM_Module module, const char *file_path, 
+        const HVM_Section *sections, uint32_t section_count);
 ut_bool hvm_module_load_from_file(HVM_Module *module, const char *file_path, Arena *a);
+ut_bool hvm_module_map_file(HVM_Module *module, const char *file_path);
+
+ut_bool hvm_module_prepare(HVM_Prepared *prepared, const HVM_Module module);
+void hvm_prepared_deinit(HVM_Prepared *prepared);
+HVM_Trap hvm_exec_prepared(HVM *vm, const HVM_Prepared prepared);
+
+void hvm_tiering_init(HVM_Tiering *tiering, const HVM_Module module, uint32_t threshold);
+void hvm_tiering_deinit(HVM_Tiering *tiering);
+
+HVM_ModuleKind hvm_module_file_kind(const char *file_path);
+ut_bool hvm_module_file_read_section(const char *file_path, HVM_SectionKind kind, Buffer *section, Arena *a);
+void hvm_module_file_dump_sections(const char *file_path);
+
+ut_bool hvm_module_compact(HVM_CompactModule *compact, const HVM_Module module);
+ut_bool hvm_compact_module_expand(const HVM_CompactModule compact, HVM_Module *module);
+void hvm_compact_module_deinit(HVM_CompactModule *compact);
+HVM_Trap hvm_exec_compact(HVM *vm, const HVM_CompactModule compact);
+ut_bool hvm_compact_module_save_to_file(const HVM_CompactModule compact, const char *file_path);
+ut_bool hvm_compact_module_load_from_file(HVM_CompactModule *compact, const char *file_path, Arena *a);
+
+ut_bool hvm_jit_compile(HVM_Jit *jit, const HVM_Module module);
+HVM_Trap hvm_jit_run(HVM *vm, const HVM_Jit jit);
+void hvm_jit_free(HVM_Jit *jit);
+
+void hvm_reg_module_init(HVM_RegModule *module);
+void hvm_reg_module_deinit(HVM_RegModule *module);
+void hvm_reg_module_dump(const HVM_RegModule module);
+void hvm_reg_module_append(HVM_RegModule *module, HVM_RegInst inst);
+ut_bool hvm_reg_module_validate(HVM_RegModule *module);
+HVM_Trap hvm_exec_reg_module(HVM *vm, const HVM_RegModule module);
+ut_bool hvm_reg_module_save_to_file(const HVM_RegModule module, const char *file_path);
+ut_bool hvm_reg_module_load_from_file(HVM_RegModule *module, const char *file_path, Arena *a);
 
 #endif // HVM_H_
@@ -0,0 +1,442 @@
+/*
+
+   `hvm_interp.h` - The HVM interpreter core
+
+   This file is a template and is included by hvm.c once per interpreter flavour. The includer defines:
+       HVM_INTERP_NAME    name of the generated static function
+       HVM_INTERP_DIRECT  0 to run `HVM_Inst` records (token threaded), 1 to run the
+                          `HVM_ThreadedInst` stream built by hvm_module_prepare (direct threaded)
+       HVM_INTERP_CHECKED 1 to check the stack bounds on every instruction, 0 to trust that
+                          the code passed hvm_module_verify()
+       HVM_INTERP_PROFILE optional, 1 to count backward jumps for tiering (token threaded only)
+       HVM_INTERP_COMPACT optional, 1 to decode the variable length stream of a HVM_CompactModule
+                          at every dispatch instead of running `HVM_Inst` records (token threaded only)
+
+   Building with HVM_TOS_CACHE keeps the top of the stack in a local across dispatches instead of
+   in `vm->stack`. It's off by default because the extra aliasing checks in the instructions that
+   address absolute slots cost more than the saved memory traffic on the code the compiler emits.
+
+   The generated function has the following signature:
+       static HVM_Trap HVM_INTERP_NAME(HVM *vm, const CODE *code, uint32_t *fault_pc, const void ***labels);
+   When `labels` is not NULL it only stores the handler table and returns. On a trap `fault_pc` is set
+   to the index of the faulting instruction, reporting is left to the caller. For the compact flavour
+   `CODE` is `uint8_t` and every pc, including `vm->pc` and `fault_pc`, is a byte offset. The profiling flavour
+   takes an extra `HVM_Tiering *tiering` and returns early, with `vm->pc` at the loop header, once a
+   loop reaches the tiering threshold. The direct threaded flavours return at HVM_INST_EXIT with
+   `vm->pc` pointing at it.
+
+*/
+
+#if !defined(HVM_INTERP_NAME) || !defined(HVM_INTERP_DIRECT) || !defined(HVM_INTERP_CHECKED)
+#error "Please define HVM_INTERP_NAME, HVM_INTERP_DIRECT and HVM_INTERP_CHECKED before including hvm_interp.h"
+#endif
+
+#ifndef HVM_INTERP_PROFILE
+#define HVM_INTERP_PROFILE 0
+#endif
+
+#ifndef HVM_INTERP_COMPACT
+#define HVM_INTERP_COMPACT 0
+#endif
+
+#if HVM_INTERP_COMPACT && (HVM_INTERP_DIRECT || HVM_INTERP_PROFILE)
+#error "The compact interpreter is token threaded and can't be profiled"
+#endif
+
+#if HVM_INTERP_PROFILE
+#if HVM_INTERP_DIRECT
+#error "Only the token threaded interpreter can be profiled"
+#endif
+#define HVM_PROFILE_PARAM , HVM_Tiering *tiering
+#else
+#define HVM_PROFILE_PARAM
+#endif
+
+#if HVM_INTERP_DIRECT
+#define HVM_CODE HVM_ThreadedInst
+#define HVM_DECODE()
+#define HVM_TYPE ((uintptr_t)ip->handler)
+#define HVM_LEN 1
+#define HVM_OP (ip->as.op)
+#define HVM_ARG (ip->arg)
+#define HVM_IMM (ip->imm)
+#define HVM_JUMP() { ip = ip->as.target; HVM_DISPATCH(); }
+#elif HVM_INTERP_COMPACT
+// The instruction at `ip` is expanded into `inst` and its size in bytes into `len` on dispatch
+#define HVM_CODE uint8_t
+#define HVM_DECODE() (len = hvm_compact_decode(ip, &inst))
+#define HVM_TYPE (inst.type)
+#define HVM_LEN len
+#define HVM_OP (inst.op)
+#define HVM_ARG (inst.arg)
+#define HVM_IMM ((int32_t)(inst.op.as_u64 >> 32))
+#define HVM_JUMP() { ip = code + (uint32_t)inst.op.as_u64; HVM_DISPATCH(); }
+#else
+#define HVM_CODE HVM_Inst
+#define HVM_DECODE()
+#define HVM_TYPE (ip->type)
+#define HVM_LEN 1
+#define HVM_OP (ip->op)
+#define HVM_ARG (ip->arg)
+#define HVM_IMM ((int32_t)(ip->op.as_u64 >> 32))
+#define HVM_JUMP() { ip = code + (uint32_t)ip->op.as_u64; HVM_DISPATCH(); }
+#endif
+
+#ifdef HVM_TOS_CACHE
+// The highest used slot of the stack, `ss + sp - 1`, lives in `tos` and its copy in `stack` is
+// stale. When the scope is empty that's the saved stack start of the scope. It's spilled before
+// a push makes another slot the highest one and before leaving the core.
+#define HVM_TOP tos
+#define HVM_SPILL() do { if(ss + sp > 0) stack[ss + sp - 1] = tos; } while(0)
+#define HVM_FILL() do { if(ss + sp > 0) tos = stack[ss + sp - 1]; } while(0)
+#define HVM_IS_TOP(I) ((I) + 1 == (uint64_t)ss + sp)
+#define HVM_LOAD(I) (HVM_IS_TOP(I) ? tos : stack[I])
+#define HVM_STORE(I, V) do { if(HVM_IS_TOP(I)) tos = (V); else stack[I] = (V); } while(0)
+#else
+#define HVM_TOP stack[ss + sp - 1]
+#define HVM_SPILL() do { } while(0)
+#define HVM_FILL() do { } while(0)
+#define HVM_LOAD(I) stack[I]
+#define HVM_STORE(I, V) do { stack[I] = (V); } while(0)
+#endif
+// These end in `continue` when there's no computed goto, so they can't be wrapped in do-while
+#define HVM_NEXT() { ip += HVM_LEN; HVM_DISPATCH(); }
+#if HVM_INTERP_CHECKED
+#define HVM_CHECK(COND, T) do { if(COND) { res = (T); advance = HVM_LEN; goto trap; } } while(0)
+#define HVM_NEED(N) do { if(sp < (N)) { res = HVM_TRAP_STACK_UNDERFLOW; goto trap; } } while(0)
+#else
+#define HVM_CHECK(COND, T) do { } while(0)
+#define HVM_NEED(N) do { } while(0)
+#endif
+#define HVM_BINOP(OP) { HVM_NEED(2); HVM_Word x = HVM_TOP; sp -= 1; HVM_Word y = stack[ss + sp - 1]; HVM_TOP.as_i64 = y.as_i64 OP x.as_i64; HVM_NEXT(); }
+// Arithmetic wraps around like the JIT and the constant folder, it's done unsigned since signed overflow is undefined
+#define HVM_WRAPOP(OP) { HVM_NEED(2); HVM_Word x = HVM_TOP; sp -= 1; HVM_Word y = stack[ss + sp - 1]; HVM_TOP.as_u64 = y.as_u64 OP x.as_u64; HVM_NEXT(); }
+#define HVM_ABS(I) HVM_CHECK((I) >= ss + sp, HVM_TRAP_STACK_UNDERFLOW)
+#define HVM_JUMP_IF_ABSI(OP) { HVM_ABS(HVM_ARG); if(HVM_LOAD(HVM_ARG).as_i64 OP HVM_IMM) HVM_JUMP(); HVM_NEXT(); }
+
+#ifdef HVM_COMPUTED_GOTO
+#define HVM_CASE(T) do_##T
+#if HVM_INTERP_DIRECT
+#define HVM_DISPATCH() goto *ip->handler
+#elif HVM_INTERP_COMPACT
+#define HVM_DISPATCH() { HVM_DECODE(); goto *handlers[inst.type]; }
+#else
+#define HVM_DISPATCH() goto *handlers[ip->type < COUNT_HVM_INSTS ? ip->type : HVM_INST_NONE]
+#endif
+#else
+#define HVM_CASE(T) case HVM_INST_##T
+#define HVM_DISPATCH() continue
+#endif
+
+static HVM_Trap HVM_INTERP_NAME(HVM *vm, const HVM_CODE *code, uint32_t *fault_pc, const void ***labels HVM_PROFILE_PARAM)
+{
+#ifdef HVM_COMPUTED_GOTO
+    static const void *handlers[COUNT_HVM_INSTS] = {
+        [HVM_INST_NONE] = &&do_NONE,
+        [HVM_INST_HALT] = &&do_HALT,
+        [HVM_INST_BEGIN_SCOPE] = &&do_BEGIN_SCOPE,
+        [HVM_INST_END_SCOPE] = &&do_END_SCOPE,
+        [HVM_INST_COPY] = &&do_COPY,
+        [HVM_INST_SWAP] = &&do_SWAP,
+        [HVM_INST_BCOPY] = &&do_BCOPY,
+        [HVM_INST_BSWAP] = &&do_BSWAP,
+        [HVM_INST_COPYABS] = &&do_COPYABS,
+        [HVM_INST_SWAPABS] = &&do_SWAPABS,
+        [HVM_INST_POP] = &&do_POP,
+        [HVM_INST_PUSH] = &&do_PUSH,
+        [HVM_INST_ADD] = &&do_ADD,
+        [HVM_INST_SUB] = &&do_SUB,
+        [HVM_INST_MUL] = &&do_MUL,
+        [HVM_INST_EQ] = &&do_EQ,
+        [HVM_INST_NE] = &&do_NE,
+        [HVM_INST_LT] = &&do_LT,
+        [HVM_INST_GT] = &&do_GT,
+        [HVM_INST_LE] = &&do_LE,
+        [HVM_INST_GE] = &&do_GE,
+        [HVM_INST_FPUSH] = &&do_NONE,
+        [HVM_INST_FADD] = &&do_NONE,
+        [HVM_INST_FSUB] = &&do_NONE,
+        [HVM_INST_FMUL] = &&do_NONE,
+        [HVM_INST_FEQ] = &&do_NONE,
+        [HVM_INST_FNE] = &&do_NONE,
+        [HVM_INST_FGT] = &&do_NONE,
+        [HVM_INST_FGE] = &&do_NONE,
+        [HVM_INST_FLT] = &&do_NONE,
+        [HVM_INST_FLE] = &&do_NONE,
+        [HVM_INST_JMP] = &&do_JMP,
+        [HVM_INST_JZ] = &&do_JZ,
+        [HVM_INST_JN] = &&do_JN,
+        [HVM_INST_DUMP] = &&do_DUMP,
+        [HVM_INST_ADDABSI] = &&do_ADDABSI,
+        [HVM_INST_ADDABS] = &&do_ADDABS,
+        [HVM_INST_SETABSI] = &&do_SETABSI,
+        [HVM_INST_MOVABS] = &&do_MOVABS,
+        [HVM_INST_JEQABSI] = &&do_JEQABSI,
+        [HVM_INST_JNEABSI] = &&do_JNEABSI,
+        [HVM_INST_JLTABSI] = &&do_JLTABSI,
+        [HVM_INST_JGTABSI] = &&do_JGTABSI,
+        [HVM_INST_JLEABSI] = &&do_JLEABSI,
+        [HVM_INST_JGEABSI] = &&do_JGEABSI,
+#if HVM_INTERP_DIRECT
+        [HVM_INST_EXIT] = &&do_EXIT,
+#else
+        [HVM_INST_EXIT] = &&do_NONE,
+#endif
+    };
+    if(labels) {
+        *labels = handlers;
+        return HVM_TRAP_NONE;
+    }
+#else
+    if(labels) {
+        *labels = UT_NULL;
+        return HVM_TRAP_NONE;
+    }
+#endif
+
+    HVM_ASSERT(vm);
+    HVM_ASSERT(code);
+    const HVM_CODE *ip = code + vm->pc;
+    HVM_Word *stack = vm->stack;
+    uint32_t sp = vm->sp;
+    uint32_t ss = vm->ss;
+    uint32_t advance = 0;
+    HVM_Trap res = HVM_TRAP_NONE;
+#ifdef HVM_TOS_CACHE
+    HVM_Word tos = HVM_NULL_WORD;
+#endif
+#if HVM_INTERP_COMPACT
+    HVM_Inst inst;
+    uint32_t len = 0;
+#endif
+
+    if(vm->halt) return HVM_TRAP_NONE;
+    HVM_FILL();
+
+#ifdef HVM_COMPUTED_GOTO
+    HVM_DISPATCH();
+#endif
+    for(;;) {
+        HVM_DECODE();
+        switch(HVM_TYPE) {
+            HVM_CASE(HALT): {
+                vm->halt = 1;
+                advance = HVM_LEN;
+                goto done;
+            }
+
+            HVM_CASE(POP): {
+                HVM_NEED(1);
+                sp -= 1;
+                HVM_FILL();
+            } HVM_NEXT();
+
+            HVM_CASE(COPY): {
+                HVM_CHECK((ss + sp) + 1 > HVM_STACK_CAPACITY, HVM_TRAP_STACK_OVERFLOW);
+                HVM_CHECK(sp < (uint32_t)HVM_OP.as_u64, HVM_TRAP_STACK_UNDERFLOW);
+                HVM_Word val = HVM_LOAD((ss + sp) - 1 - HVM_OP.as_u64);
+                HVM_SPILL();
+                sp += 1;
+                HVM_TOP = val;
+            } HVM_NEXT();
+
+            HVM_CASE(BCOPY): {
+                HVM_CHECK((ss + sp) + 1 > HVM_STACK_CAPACITY, HVM_TRAP_STACK_OVERFLOW);
+                HVM_CHECK(sp < (uint32_t)HVM_OP.as_u64, HVM_TRAP_STACK_UNDERFLOW);
+                HVM_Word val = HVM_LOAD(ss + HVM_OP.as_u64);
+                HVM_SPILL();
+                sp += 1;
+                HVM_TOP = val;
+            } HVM_NEXT();
+
+            HVM_CASE(SWAP): {
+                HVM_CHECK(sp < (uint32_t)HVM_OP.as_u64, HVM_TRAP_STACK_UNDERFLOW);
+                HVM_Word tmp = HVM_LOAD((ss + sp) - 1 - HVM_OP.as_u64);
+                HVM_STORE((ss + sp) - 1 - HVM_OP.as_u64, stack[ss + sp]);
+                stack[ss + sp] = tmp;
+            } HVM_NEXT();
+
+            HVM_CASE(BSWAP): {
+                HVM_NEED(1);
+                HVM_CHECK(sp < (uint32_t)HVM_OP.as_u64, HVM_TRAP_STACK_UNDERFLOW);
+                HVM_Word tmp = HVM_LOAD(ss + HVM_OP.as_u64);
+                HVM_STORE(ss + HVM_OP.as_u64, HVM_TOP);
+                HVM_TOP = tmp;
+            } HVM_NEXT();
+
+            HVM_CASE(COPYABS): {
+                HVM_CHECK((ss + sp) + 1 > HVM_STACK_CAPACITY, HVM_TRAP_STACK_OVERFLOW);
+                HVM_CHECK((ss + sp) < (uint32_t)HVM_OP.as_u64, HVM_TRAP_STACK_UNDERFLOW);
+                HVM_Word val = HVM_LOAD(HVM_OP.as_u64);
+                HVM_SPILL();
+                sp += 1;
+                HVM_TOP = val;
+            } HVM_NEXT();
+
+            HVM_CASE(SWAPABS): {
+                HVM_NEED(1);
+                HVM_CHECK(ss + sp < (uint32_t)HVM_OP.as_u64, HVM_TRAP_STACK_UNDERFLOW);
+                HVM_Word tmp = HVM_LOAD(HVM_OP.as_u64);
+                HVM_STORE(HVM_OP.as_u64, HVM_TOP);
+                HVM_TOP = tmp;
+            } HVM_NEXT();
+
+            HVM_CASE(BEGIN_SCOPE): {
+                HVM_CHECK(ss + sp + 1 > HVM_STACK_CAPACITY, HVM_TRAP_STACK_OVERFLOW);
+                HVM_SPILL();
+                stack[ss + sp] = HVM_WORD_U64(ss);
+                ss = ss + sp + 1;
+                sp = 0;
+                HVM_FILL();
+            } HVM_NEXT();
+
+            HVM_CASE(END_SCOPE): {
+                HVM_CHECK(ss == 0, HVM_TRAP_STACK_UNDERFLOW);
+                HVM_SPILL();
+                uint32_t prev_ss = (uint32_t)stack[ss - 1].as_u64;
+                sp = ss - 1 - prev_ss;
+                ss = prev_ss;
+                HVM_FILL();
+            } HVM_NEXT();
+
+            HVM_CASE(PUSH): {
+                HVM_CHECK(ss + sp + 1 > HVM_STACK_CAPACITY, HVM_TRAP_STACK_OVERFLOW);
+                HVM_SPILL();
+                sp += 1;
+                HVM_TOP = HVM_OP;
+            } HVM_NEXT();
+
+            HVM_CASE(JMP): {
+#if HVM_INTERP_PROFILE
+                uint32_t target = (uint32_t)HVM_OP.as_u64;
+                if(target <= (uint32_t)(ip - code)) {
+                    if(tiering->counters[target] < tiering->threshold) tiering->counters[target] += 1;
+                    if(tiering->counters[target] >= tiering->threshold) {
+                        // Stop at the loop header so the caller can switch to the promoted loop
+                        ip = code + target;
+                        goto done;
+                    }
+                }
+#endif
+            } HVM_JUMP();
+
+            HVM_CASE(JZ): {
+                HVM_NEED(1);
+                HVM_Word cond = HVM_TOP;
+                sp -= 1;
+                HVM_FILL();
+                if(cond.as_i64 == 0) HVM_JUMP();
+            } HVM_NEXT();
+
+            HVM_CASE(JN): {
+                HVM_NEED(1);
+                HVM_Word cond = HVM_TOP;
+                sp -= 1;
+                HVM_FILL();
+                if(cond.as_i64 != 0) HVM_JUMP();
+            } HVM_NEXT();
+
+            HVM_CASE(ADD): HVM_WRAPOP(+);
+            HVM_CASE(SUB): HVM_WRAPOP(-);
+            HVM_CASE(MUL): HVM_WRAPOP(*);
+            HVM_CASE(EQ):  HVM_BINOP(==);
+            HVM_CASE(NE):  HVM_BINOP(!=);
+            HVM_CASE(GT):  HVM_BINOP(>);
+            HVM_CASE(GE):  HVM_BINOP(>=);
+            HVM_CASE(LT):  HVM_BINOP(<);
+            HVM_CASE(LE):  HVM_BINOP(<=);
+
+            HVM_CASE(DUMP): {
+                HVM_NEED(1);
+                HVM_Word val = HVM_TOP;
+                printf("HVM_Word{ .as_u64=%lu, .as_i64=%ld, .as_f64=%f }\n", val.as_u64, val.as_i64, val.as_f64);
+                sp -= 1;
+                HVM_FILL();
+            } HVM_NEXT();
+
+            HVM_CASE(ADDABSI): {
+                HVM_ABS(HVM_ARG);
+                HVM_Word val = HVM_LOAD(HVM_ARG);
+                val.as_u64 += HVM_OP.as_u64;
+                HVM_STORE(HVM_ARG, val);
+            } HVM_NEXT();
+
+            HVM_CASE(ADDABS): {
+                HVM_ABS(HVM_ARG);
+                HVM_ABS(HVM_OP.as_u64);
+                HVM_Word val = HVM_LOAD(HVM_ARG);
+                val.as_u64 += HVM_LOAD(HVM_OP.as_u64).as_u64;
+                HVM_STORE(HVM_ARG, val);
+            } HVM_NEXT();
+
+            HVM_CASE(SETABSI): {
+                HVM_ABS(HVM_ARG);
+                HVM_STORE(HVM_ARG, HVM_OP);
+            } HVM_NEXT();
+
+            HVM_CASE(MOVABS): {
+                HVM_ABS(HVM_ARG);
+                HVM_ABS(HVM_OP.as_u64);
+                HVM_STORE(HVM_ARG, HVM_LOAD(HVM_OP.as_u64));
+            } HVM_NEXT();
+
+            HVM_CASE(JEQABSI): HVM_JUMP_IF_ABSI(==);
+            HVM_CASE(JNEABSI): HVM_JUMP_IF_ABSI(!=);
+            HVM_CASE(JLTABSI): HVM_JUMP_IF_ABSI(<);
+            HVM_CASE(JGTABSI): HVM_JUMP_IF_ABSI(>);
+            HVM_CASE(JLEABSI): HVM_JUMP_IF_ABSI(<=);
+            HVM_CASE(JGEABSI): HVM_JUMP_IF_ABSI(>=);
+
+#if HVM_INTERP_DIRECT
+            HVM_CASE(EXIT):
+                goto done;
+#endif
+
+            HVM_CASE(NONE):
+            default: {
+                res = HVM_TRAP_INVALID_INSTRUCTION;
+                advance = HVM_LEN;
+                goto trap;
+            }
+        }
+    }
+
+trap:
+    *fault_pc = (uint32_t)(ip - code);
+done:
+    HVM_SPILL();
+    vm->pc = (uint32_t)(ip - code) + advance;
+    vm->sp = sp;
+    vm->ss = ss;
+    return res;
+}
+
+#undef HVM_CODE
+#undef HVM_DECODE
+#undef HVM_TYPE
+#undef HVM_LEN
+#undef HVM_OP
+#undef HVM_ARG
+#undef HVM_IMM
+#undef HVM_JUMP
+#undef HVM_TOP
+#undef HVM_SPILL
+#undef HVM_FILL
+#undef HVM_IS_TOP
+#undef HVM_LOAD
+#undef HVM_STORE
+#undef HVM_NEXT
+#undef HVM_CHECK
+#undef HVM_NEED
+#undef HVM_BINOP
+#undef HVM_WRAPOP
+#undef HVM_ABS
+#undef HVM_JUMP_IF_ABSI
+#undef HVM_CASE
+#undef HVM_DISPATCH
+#undef HVM_INTERP_NAME
+#undef HVM_INTERP_DIRECT
+#undef HVM_INTERP_CHECKED
+#undef HVM_INTERP_PROFILE
+#undef HVM_INTERP_COMPACT
+#undef HVM_PROFILE_PARAM
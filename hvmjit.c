@@ -0,0 +1,481 @@
+#include "hvm.h"
+
+#include "utils.h"
+
+#include <stdio.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+
+/*
+   Baseline JIT for x86-64 Linux
+
+   Every instruction is translated with a fixed machine code template. The module has to
+   pass hvm_module_analyze() so the stack shape before each instruction is known at compile
+   time, which turns every stack access into a load or store at a constant offset from the
+   VM and makes the bounds checks unnecessary.
+
+   Register usage:
+       rbx  the VM, callee saved so it survives the calls to the dump helper
+       rax  a cache of one stack slot, usually the top of the stack
+       rcx  scratch
+
+   The cached slot is only written back when it has to be, for example before a jump or when
+   another slot needs rax. Every instruction that is the target of a jump starts with nothing
+   cached so all the paths that meet there agree on where the values live.
+*/
+
+#define HVM_JIT_RAX 0
+#define HVM_JIT_RCX 1
+#define HVM_JIT_NO_SLOT UINT32_MAX
+
+// Condition codes as encoded in jcc and setcc
+#define HVM_JIT_CC_E  0x4
+#define HVM_JIT_CC_NE 0x5
+#define HVM_JIT_CC_L  0xC
+#define HVM_JIT_CC_GE 0xD
+#define HVM_JIT_CC_LE 0xE
+#define HVM_JIT_CC_G  0xF
+
+typedef HVM_Trap (*HVM_JitFn)(HVM *vm);
+
+typedef struct HVM_JitFixup {
+    uint32_t at; // offset of the rel32 to patch
+    uint32_t target_pc;
+} HVM_JitFixup;
+
+typedef struct HVM_JitCompiler {
+    uint8_t *items;
+    ut_size count;
+    ut_size capacity;
+
+    HVM_JitFixup *fixups;
+    uint32_t fixup_count;
+    uint32_t *offsets; // the native offset of every instruction
+
+    uint32_t cached; // the stack slot that lives in rax or HVM_JIT_NO_SLOT
+    ut_bool dirty; // whether the stack slot in memory is older than rax
+} HVM_JitCompiler;
+
+static void hvm_jit_dump(uint64_t value)
+{
+    HVM_Word val = HVM_WORD_U64(value);
+    printf("HVM_Word{ .as_u64=%lu, .as_i64=%ld, .as_f64=%f }\n", val.as_u64, val.as_i64, val.as_f64);
+}
+
+static void hvm_jit_emit(HVM_JitCompiler *c, const void *data, ut_size size)
+{
+    if(c->count + size > c->capacity) {
+        ut_size new_capacity = c->capacity * 2;
+        if(new_capacity == 0) new_capacity = 4096;
+        while(new_capacity < c->count + size) new_capacity *= 2;
+
+        uint8_t *new_items = HVM_MALLOC(new_capacity);
+        HVM_ASSERT(new_items);
+        if(c->items) ut_memcpy(new_items, c->items, c->count);
+        HVM_FREE(c->items);
+        c->items = new_items;
+        c->capacity = new_capacity;
+    }
+    ut_memcpy(&c->items[c->count], data, size);
+    c->count += size;
+}
+
+static void hvm_jit_u8(HVM_JitCompiler *c, uint8_t v) { hvm_jit_emit(c, &v, 1); }
+static void hvm_jit_u32(HVM_JitCompiler *c, uint32_t v) { hvm_jit_emit(c, &v, 4); }
+static void hvm_jit_u64(HVM_JitCompiler *c, uint64_t v) { hvm_jit_emit(c, &v, 8); }
+
+static uint32_t hvm_jit_slot(uint64_t index)
+{
+    return (uint32_t)(offsetof(HVM, stack) + index * sizeof(HVM_Word));
+}
+
+// <REX.W> <opcode> [rbx + disp32] with `reg` in the reg field of ModRM
+static void hvm_jit_mem(HVM_JitCompiler *c, uint8_t opcode, uint8_t reg, uint32_t disp)
+{
+    hvm_jit_u8(c, 0x48);
+    hvm_jit_u8(c, opcode);
+    hvm_jit_u8(c, 0x80 | (reg << 3) | 0x3);
+    hvm_jit_u32(c, disp);
+}
+
+static void hvm_jit_load(HVM_JitCompiler *c, uint8_t reg, uint64_t index)  { hvm_jit_mem(c, 0x8B, reg, hvm_jit_slot(index)); }
+static void hvm_jit_store(HVM_JitCompiler *c, uint8_t reg, uint64_t index) { hvm_jit_mem(c, 0x89, reg, hvm_jit_slot(index)); }
+
+static void hvm_jit_mov_imm(HVM_JitCompiler *c, uint8_t reg, uint64_t imm)
+{
+    hvm_jit_u8(c, 0x48);
+    hvm_jit_u8(c, 0xB8 + reg);
+    hvm_jit_u64(c, imm);
+}
+
+static ut_bool hvm_jit_fits_i32(int64_t v)
+{
+    return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+static void hvm_jit_jump(HVM_JitCompiler *c, int cc, uint32_t target_pc)
+{
+    if(cc < 0) {
+        hvm_jit_u8(c, 0xE9);
+    } else {
+        hvm_jit_u8(c, 0x0F);
+        hvm_jit_u8(c, 0x80 | cc);
+    }
+    c->fixups[c->fixup_count].at = (uint32_t)c->count;
+    c->fixups[c->fixup_count].target_pc = target_pc;
+    c->fixup_count += 1;
+    hvm_jit_u32(c, 0);
+}
+
+static void hvm_jit_flush(HVM_JitCompiler *c)
+{
+    if(c->cached != HVM_JIT_NO_SLOT && c->dirty)
+        hvm_jit_store(c, HVM_JIT_RAX, c->cached);
+    c->dirty = ut_false;
+}
+
+static void hvm_jit_forget(HVM_JitCompiler *c)
+{
+    hvm_jit_flush(c);
+    c->cached = HVM_JIT_NO_SLOT;
+}
+
+// Drop the cached slot without writing it back because it's no longer on the stack
+static void hvm_jit_drop(HVM_JitCompiler *c)
+{
+    c->cached = HVM_JIT_NO_SLOT;
+    c->dirty = ut_false;
+}
+
+static void hvm_jit_fetch(HVM_JitCompiler *c, uint32_t index)
+{
+    if(c->cached == index) return;
+    hvm_jit_forget(c);
+    hvm_jit_load(c, HVM_JIT_RAX, index);
+    c->cached = index;
+}
+
+// rax holds the new value of `index`, the previous cached slot must have been written back
+static void hvm_jit_produce(HVM_JitCompiler *c, uint32_t index)
+{
+    c->cached = index;
+    c->dirty = ut_true;
+}
+
+static void hvm_jit_swap(HVM_JitCompiler *c, uint64_t a, uint64_t b)
+{
+    hvm_jit_forget(c);
+    hvm_jit_load(c, HVM_JIT_RAX, a);
+    hvm_jit_load(c, HVM_JIT_RCX, b);
+    hvm_jit_store(c, HVM_JIT_RCX, a);
+    hvm_jit_store(c, HVM_JIT_RAX, b);
+}
+
+static void hvm_jit_copy(HVM_JitCompiler *c, uint64_t from, uint32_t to)
+{
+    if(c->cached == from) {
+        hvm_jit_flush(c);
+    } else {
+        hvm_jit_forget(c);
+        hvm_jit_load(c, HVM_JIT_RAX, from);
+    }
+    hvm_jit_produce(c, to);
+}
+
+static void hvm_jit_binop(HVM_JitCompiler *c, HVM_InstType type, uint32_t abs)
+{
+    static const uint8_t setcc[COUNT_HVM_INSTS] = {
+        [HVM_INST_EQ] = HVM_JIT_CC_E, [HVM_INST_NE] = HVM_JIT_CC_NE,
+        [HVM_INST_LT] = HVM_JIT_CC_L, [HVM_INST_GT] = HVM_JIT_CC_G,
+        [HVM_INST_LE] = HVM_JIT_CC_LE, [HVM_INST_GE] = HVM_JIT_CC_GE,
+    };
+
+    hvm_jit_fetch(c, abs - 1);
+    hvm_jit_emit(c, "\x48\x89\xC1", 3); // mov rcx, rax
+    hvm_jit_drop(c);
+    hvm_jit_load(c, HVM_JIT_RAX, abs - 2);
+    switch(type) {
+        case HVM_INST_ADD: hvm_jit_emit(c, "\x48\x01\xC8", 3); break; // add rax, rcx
+        case HVM_INST_SUB: hvm_jit_emit(c, "\x48\x29\xC8", 3); break; // sub rax, rcx
+        case HVM_INST_MUL: hvm_jit_emit(c, "\x48\x0F\xAF\xC1", 4); break; // imul rax, rcx
+        default:
+            {
+                hvm_jit_emit(c, "\x48\x39\xC8", 3); // cmp rax, rcx
+                hvm_jit_u8(c, 0x0F);
+                hvm_jit_u8(c, 0x90 | setcc[type]); // setcc al
+                hvm_jit_u8(c, 0xC0);
+                hvm_jit_emit(c, "\x48\x0F\xB6\xC0", 4); // movzx rax, al
+            } break;
+    }
+    hvm_jit_produce(c, abs - 2);
+}
+
+// Emit `op [rbx + slot], imm` using the imm32 form when the immediate fits in it
+static void hvm_jit_mem_imm(HVM_JitCompiler *c, uint8_t op_imm, uint8_t ext, uint8_t op_reg, uint32_t index, int64_t imm)
+{
+    if(hvm_jit_fits_i32(imm)) {
+        hvm_jit_mem(c, op_imm, ext, hvm_jit_slot(index));
+        hvm_jit_u32(c, (uint32_t)(int32_t)imm);
+        return;
+    }
+    hvm_jit_mov_imm(c, HVM_JIT_RCX, (uint64_t)imm);
+    hvm_jit_mem(c, op_reg, HVM_JIT_RCX, hvm_jit_slot(index));
+}
+
+static int hvm_jit_absi_cc(HVM_InstType type)
+{
+    switch(type) {
+        case HVM_INST_JEQABSI: return HVM_JIT_CC_E;
+        case HVM_INST_JNEABSI: return HVM_JIT_CC_NE;
+        case HVM_INST_JLTABSI: return HVM_JIT_CC_L;
+        case HVM_INST_JGTABSI: return HVM_JIT_CC_G;
+        case HVM_INST_JLEABSI: return HVM_JIT_CC_LE;
+        case HVM_INST_JGEABSI: return HVM_JIT_CC_GE;
+        default: return -1;
+    }
+}
+
+static ut_bool hvm_jit_is_jump(HVM_InstType type)
+{
+    return type == HVM_INST_JMP || type == HVM_INST_JZ || type == HVM_INST_JN || hvm_jit_absi_cc(type) >= 0;
+}
+
+static void hvm_jit_compile_inst(HVM_JitCompiler *c, const HVM_Inst inst, uint32_t pc, HVM_StackState st)
+{
+    uint32_t abs = st.ss + st.sp;
+    uint64_t op = inst.op.as_u64;
+    switch(inst.type) {
+        case HVM_INST_HALT:
+            {
+                hvm_jit_forget(c);
+                hvm_jit_u8(c, 0xC7); hvm_jit_u8(c, 0x83); // mov dword [rbx + pc], imm32
+                hvm_jit_u32(c, offsetof(HVM, pc)); hvm_jit_u32(c, pc + 1);
+                hvm_jit_u8(c, 0xC7); hvm_jit_u8(c, 0x83);
+                hvm_jit_u32(c, offsetof(HVM, sp)); hvm_jit_u32(c, st.sp);
+                hvm_jit_u8(c, 0xC7); hvm_jit_u8(c, 0x83);
+                hvm_jit_u32(c, offsetof(HVM, ss)); hvm_jit_u32(c, st.ss);
+                hvm_jit_u8(c, 0xC6); hvm_jit_u8(c, 0x83); // mov byte [rbx + halt], 1
+                hvm_jit_u32(c, offsetof(HVM, halt)); hvm_jit_u8(c, 1);
+                hvm_jit_emit(c, "\x31\xC0", 2); // xor eax, eax
+                hvm_jit_emit(c, "\x48\x83\xC4\x08\x5B\x5D\xC3", 7); // add rsp, 8; pop rbx; pop rbp; ret
+            } break;
+
+        case HVM_INST_BEGIN_SCOPE:
+            {
+                hvm_jit_forget(c);
+                hvm_jit_mem(c, 0xC7, 0, hvm_jit_slot(abs)); // mov qword [slot], imm32
+                hvm_jit_u32(c, st.ss);
+            } break;
+
+        case HVM_INST_END_SCOPE:
+            hvm_jit_drop(c);
+            break;
+
+        case HVM_INST_POP:
+            {
+                if(c->cached == abs - 1) hvm_jit_drop(c);
+            } break;
+
+        case HVM_INST_PUSH:
+            {
+                hvm_jit_forget(c);
+                hvm_jit_mov_imm(c, HVM_JIT_RAX, op);
+                hvm_jit_produce(c, abs);
+            } break;
+
+        case HVM_INST_COPY:    hvm_jit_copy(c, abs - 1 - op, abs); break;
+        case HVM_INST_BCOPY:   hvm_jit_copy(c, st.ss + op, abs); break;
+        case HVM_INST_COPYABS: hvm_jit_copy(c, op, abs); break;
+        case HVM_INST_SWAP:    hvm_jit_swap(c, abs - 1 - op, abs); break;
+        case HVM_INST_BSWAP:   hvm_jit_swap(c, st.ss + op, abs - 1); break;
+        case HVM_INST_SWAPABS: hvm_jit_swap(c, op, abs - 1); break;
+
+        case HVM_INST_ADD: case HVM_INST_SUB: case HVM_INST_MUL:
+        case HVM_INST_EQ: case HVM_INST_NE: case HVM_INST_LT:
+        case HVM_INST_GT: case HVM_INST_LE: case HVM_INST_GE:
+            hvm_jit_binop(c, inst.type, abs);
+            break;
+
+        case HVM_INST_JMP:
+            {
+                hvm_jit_forget(c);
+                hvm_jit_jump(c, -1, (uint32_t)op);
+            } break;
+
+        case HVM_INST_JZ:
+        case HVM_INST_JN:
+            {
+                hvm_jit_fetch(c, abs - 1);
+                hvm_jit_drop(c);
+                hvm_jit_emit(c, "\x48\x85\xC0", 3); // test rax, rax
+                hvm_jit_jump(c, inst.type == HVM_INST_JZ ? HVM_JIT_CC_E : HVM_JIT_CC_NE, (uint32_t)op);
+            } break;
+
+        case HVM_INST_DUMP:
+            {
+                hvm_jit_fetch(c, abs - 1);
+                hvm_jit_drop(c);
+                hvm_jit_emit(c, "\x48\x89\xC7", 3); // mov rdi, rax
+                hvm_jit_mov_imm(c, HVM_JIT_RAX, (uint64_t)(uintptr_t)&hvm_jit_dump);
+                hvm_jit_emit(c, "\xFF\xD0", 2); // call rax
+            } break;
+
+        case HVM_INST_ADDABSI:
+            {
+                hvm_jit_forget(c);
+                hvm_jit_mem_imm(c, 0x81, 0, 0x01, inst.arg, inst.op.as_i64);
+            } break;
+
+        case HVM_INST_SETABSI:
+            {
+                hvm_jit_forget(c);
+                hvm_jit_mem_imm(c, 0xC7, 0, 0x89, inst.arg, inst.op.as_i64);
+            } break;
+
+        case HVM_INST_ADDABS:
+        case HVM_INST_MOVABS:
+            {
+                hvm_jit_forget(c);
+                hvm_jit_load(c, HVM_JIT_RCX, op);
+                hvm_jit_mem(c, inst.type == HVM_INST_ADDABS ? 0x01 : 0x89, HVM_JIT_RCX, hvm_jit_slot(inst.arg));
+            } break;
+
+        case HVM_INST_JEQABSI: case HVM_INST_JNEABSI: case HVM_INST_JLTABSI:
+        case HVM_INST_JGTABSI: case HVM_INST_JLEABSI: case HVM_INST_JGEABSI:
+            {
+                hvm_jit_forget(c);
+                hvm_jit_mem(c, 0x81, 7, hvm_jit_slot(inst.arg)); // cmp qword [slot], imm32
+                hvm_jit_u32(c, (uint32_t)(op >> 32));
+                hvm_jit_jump(c, hvm_jit_absi_cc(inst.type), (uint32_t)op);
+            } break;
+
+        default:
+            UT_ASSERT(0 && "The verifier let an unsupported instruction through");
+            break;
+    }
+}
+
+ut_bool hvm_jit_compile(HVM_Jit *jit, const HVM_Module module)
+{
+    HVM_ASSERT(jit);
+    jit->code = UT_NULL;
+    jit->size = 0;
+    if(module.count == 0) {
+        fprintf(stderr, "ERROR: Could not JIT compile an empty module\n");
+        return ut_false;
+    }
+
+    HVM_StackState *states = HVM_MALLOC(sizeof(HVM_StackState)*module.count);
+    HVM_ASSERT(states);
+    if(!hvm_module_analyze(module, states, UT_NULL)) {
+        fprintf(stderr, "ERROR: Could not JIT compile the module because it failed verification\n");
+        HVM_FREE(states);
+        return ut_false;
+    }
+
+    HVM_JitCompiler c;
+    ut_memset(&c, 0, sizeof(c));
+    c.cached = HVM_JIT_NO_SLOT;
+    c.offsets = HVM_MALLOC(sizeof(uint32_t)*module.count);
+    c.fixups = HVM_MALLOC(sizeof(HVM_JitFixup)*module.count);
+    uint8_t *is_target = HVM_MALLOC(module.count);
+    HVM_ASSERT(c.offsets && c.fixups && is_target);
+    ut_memset(is_target, 0, module.count);
+    for(uint32_t i = 0; i < module.count; ++i) {
+        HVM_Inst inst = module.items[i];
+        if(states[i].reachable && hvm_jit_is_jump(inst.type))
+            is_target[(uint32_t)inst.op.as_u64] = 1;
+    }
+
+    // push rbp; push rbx; sub rsp, 8 (keeps the stack 16 byte aligned for calls); mov rbx, rdi
+    hvm_jit_emit(&c, "\x55\x53\x48\x83\xEC\x08\x48\x89\xFB", 9);
+    for(uint32_t pc = 0; pc < module.count; ++pc) {
+        if(is_target[pc]) hvm_jit_forget(&c);
+        c.offsets[pc] = (uint32_t)c.count;
+        if(!states[pc].reachable) {
+            hvm_jit_emit(&c, "\x0F\x0B", 2); // ud2
+            continue;
+        }
+        hvm_jit_compile_inst(&c, module.items[pc], pc, states[pc]);
+    }
+    for(uint32_t i = 0; i < c.fixup_count; ++i) {
+        HVM_JitFixup fixup = c.fixups[i];
+        int32_t rel = (int32_t)(c.offsets[fixup.target_pc] - (fixup.at + 4));
+        ut_memcpy(&c.items[fixup.at], &rel, 4);
+    }
+    HVM_FREE(is_target);
+    HVM_FREE(c.fixups);
+    HVM_FREE(c.offsets);
+    HVM_FREE(states);
+
+    void *code = mmap(UT_NULL, c.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(code == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Could not allocate memory for the JIT compiled code\n");
+        HVM_FREE(c.items);
+        return ut_false;
+    }
+    ut_memcpy(code, c.items, c.count);
+    HVM_FREE(c.items);
+    if(mprotect(code, c.count, PROT_READ | PROT_EXEC) != 0) {
+        fprintf(stderr, "ERROR: Could not make the JIT compiled code executable\n");
+        munmap(code, c.count);
+        return ut_false;
+    }
+
+    jit->code = code;
+    jit->size = c.count;
+    return ut_true;
+}
+
+HVM_Trap hvm_jit_run(HVM *vm, const HVM_Jit jit)
+{
+    HVM_ASSERT(vm);
+    HVM_ASSERT(jit.code);
+    if(vm->halt) return HVM_TRAP_NONE;
+    // The compiled code has the stack shape of a fresh VM baked in
+    if(vm->pc != 0 || vm->sp != 0 || vm->ss != 0) {
+        fprintf(stderr, "ERROR: JIT compiled code can only be executed from a fresh VM\n");
+        return HVM_TRAP_INVALID_INSTRUCTION;
+    }
+    HVM_JitFn fn;
+    ut_memcpy(&fn, &jit.code, sizeof(fn));
+    return fn(vm);
+}
+
+void hvm_jit_free(HVM_Jit *jit)
+{
+    HVM_ASSERT(jit);
+    if(jit->code) munmap(jit->code, jit->size);
+    jit->code = UT_NULL;
+    jit->size = 0;
+}
+
+#else
+
+ut_bool hvm_jit_compile(HVM_Jit *jit, const HVM_Module module)
+{
+    (void)module;
+    HVM_ASSERT(jit);
+    jit->code = UT_NULL;
+    jit->size = 0;
+    fprintf(stderr, "ERROR: The JIT is only supported on x86-64 Linux\n");
+    return ut_false;
+}
+
+HVM_Trap hvm_jit_run(HVM *vm, const HVM_Jit jit)
+{
+    (void)vm;
+    (void)jit;
+    return HVM_TRAP_INVALID_INSTRUCTION;
+}
+
+void hvm_jit_free(HVM_Jit *jit)
+{
+    HVM_ASSERT(jit);
+    jit->code = UT_NULL;
+    jit->size = 0;
+}
+
+#endif
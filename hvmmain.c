@@ -1,24 +1,131 @@
 #include "hvm.h"
 #include <stdio.h>
+#include <stdlib.h>
 
 int main(int argc, const char **argv)
 {
-    if(argc < 2) {
+    const char *file_path = UT_NULL;
+    ut_bool use_jit = ut_false;
+    uint32_t tier_threshold = 0;
+    for(int i = 1; i < argc; ++i) {
+        if(sv_eq(sv_from_cstr(argv[i]), SV("--jit"))) {
+            use_jit = ut_true;
+        } else if(sv_eq(sv_from_cstr(argv[i]), SV("--tier")) && i + 1 < argc) {
+            i += 1;
+            tier_threshold = (uint32_t)atoi(argv[i]);
+        } else {
+            file_path = argv[i];
+        }
+    }
+    if(!file_path) {
         fprintf(stderr, "ERROR: Please provide a hvm bytecode file as an argument\n");
-        fprintf(stderr, "USAGE: %s <program.hbc>\n", argv[0]);
+        fprintf(stderr, "USAGE: %s <program.hbc> [--jit | --tier <threshold>]\n", argv[0]);
         return -1;
     }
 
     Arena a = {0};
+    if(hvm_module_file_kind(file_path) == HVM_MODULE_KIND_REGISTER) {
+        // The register machine only has an interpreter, don't run something else than what was asked
+        if(use_jit || tier_threshold > 0) {
+            fprintf(stderr, "ERROR: %s only supports stack machine modules\n", use_jit ? "--jit" : "--tier");
+            return -1;
+        }
+        HVM_RegModule rmod = {0};
+        if(!hvm_reg_module_load_from_file(&rmod, file_path, &a)) {
+            fprintf(stderr, "ERROR: Could not load file %s\n", file_path);
+            fprintf(stderr, "USAGE: %s <program.hbc> [--jit | --tier <threshold>]\n", argv[0]);
+            return -1;
+        }
+
+        HVM vm;
+        hvm_init(&vm);
+        HVM_Trap trap = hvm_exec_reg_module(&vm, rmod);
+        hvm_reg_module_deinit(&rmod);
+        arena_free(&a);
+        return trap;
+    }
+
+    if(hvm_module_file_kind(file_path) == HVM_MODULE_KIND_COMPACT && !use_jit && tier_threshold == 0) {
+        // Run the variable length encoding as is, the other modes load the expanded form
+        HVM_CompactModule cmod = {0};
+        if(!hvm_compact_module_load_from_file(&cmod, file_path, &a)) {
+            fprintf(stderr, "ERROR: Could not load file %s\n", file_path);
+            fprintf(stderr, "USAGE: %s <program.hbc> [--jit | --tier <threshold>]\n", argv[0]);
+            return -1;
+        }
+
+        HVM vm;
+        hvm_init(&vm);
+        HVM_Trap trap = hvm_exec_compact(&vm, cmod);
+        hvm_compact_module_deinit(&cmod);
+        arena_free(&a);
+        return trap;
+    }
+
+    // Stack modules are used straight from the mapped file, compact ones have to be expanded
     HVM_Module mod = {0};
-    if(!hvm_module_load_from_file(&mod, argv[1], &a)) {
-        fprintf(stderr, "ERROR: Could not load file %s\n", argv[1]);
-        fprintf(stderr, "USAGE: %s <program.hbc>\n", argv[0]);
+    ut_bool loaded = hvm_module_file_kind(file_path) == HVM_MODULE_KIND_STACK
+        ? hvm_module_map_file(&mod, file_path)
+        : hvm_module_load_from_file(&mod, file_path, &a);
+    if(!loaded) {
+        fprintf(stderr, "ERROR: Could not load file %s\n", file_path);
+        fprintf(stderr, "USAGE: %s <program.hbc> [--jit | --tier <threshold>]\n", argv[0]);
+        return -1;
+    }
+    // Modules from other compilers may not have been cleaned up
+    hvm_module_peephole(&mod);
+    // Promoted regions are fused when they're made, the interpreter counts the plain backward jumps
+    if(tier_threshold == 0) hvm_module_fuse(&mod);
+    if(!hvm_module_verify(&mod)) {
+        fprintf(stderr, "ERROR: Module %s is rejected by the verifier\n", file_path);
+        hvm_module_deinit(&mod);
+        arena_free(&a);
+        return -1;
+    }
+
+    if(tier_threshold > 0) {
+        // Start in the plain interpreter and only optimize the loops that get hot
+        HVM_Tiering tiering;
+        hvm_tiering_init(&tiering, mod, tier_threshold);
+        mod.tiering = &tiering;
+        HVM vm;
+        hvm_init(&vm);
+        HVM_Trap trap = hvm_exec_module(&vm, mod);
+        hvm_tiering_deinit(&tiering);
+        hvm_module_deinit(&mod);
+        arena_free(&a);
+        return trap;
+    }
+
+    if(use_jit) {
+        HVM_Jit jit;
+        if(!hvm_jit_compile(&jit, mod)) {
+            fprintf(stderr, "ERROR: Could not JIT compile module %s\n", file_path);
+            hvm_module_deinit(&mod);
+            arena_free(&a);
+            return -1;
+        }
+        HVM vm;
+        hvm_init(&vm);
+        HVM_Trap trap = hvm_jit_run(&vm, jit);
+        hvm_jit_free(&jit);
+        hvm_module_deinit(&mod);
+        arena_free(&a);
+        return trap;
+    }
+
+    HVM_Prepared prepared;
+    if(!hvm_module_prepare(&prepared, mod)) {
+        fprintf(stderr, "ERROR: Could not prepare module %s\n", file_path);
+        hvm_module_deinit(&mod);
+        arena_free(&a);
         return -1;
     }
 
     HVM vm;
-    HVM_Trap trap = hvm_exec_module(&vm, mod);
+    hvm_init(&vm);
+    HVM_Trap trap = hvm_exec_prepared(&vm, prepared);
+    hvm_prepared_deinit(&prepared);
     hvm_module_deinit(&mod);
     arena_free(&a);
     return trap;
@@ -1,16 +1,32 @@
 #include "hotaru.h"
 #include "hvm.h"
 #include "utils.h"
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Cache entries are named `<hotaru version><hvm version>-<key>.hbc`
+#define CACHE_VERSION_FMT "%08" PRIx32 "%08" PRIx32
+#define CACHE_ENTRY_FMT CACHE_VERSION_FMT "-%016" PRIx64 ".hbc"
+#define CACHE_ENTRY_LEN (8 + 8 + 1 + 16 + 4)
 
 void usage(FILE *f, const char *program)
 {
     fprintf(f, "USAGE: %s SUBCOMMAND <ARGS> [FLAGS]\n", program);
     fprintf(f, "Available subcommand:\n");
-    fprintf(f, "    com  <file.ht> -o <output.hbc>\n");
-    fprintf(f, "    run  <file.ht>\n");
+    fprintf(f, "    com  <file.ht> -o <output.hbc> [--regvm | [--compact] [--opt [--unroll <n>]]] [--lex-threads <n>]\n");
+    fprintf(f, "    run  <file.ht> [--jit] [--tier-threshold <n>] [--cache-dir <dir>] [--lex-threads <n>]\n");
     fprintf(f, "    dump <file.hbc>\n");
+    fprintf(f, "    lexbench <file.ht> [--repeat <n>] [--lex-threads <n>] [--simd <scalar|sse2|avx2>]\n");
+    fprintf(f, "    simdbench <file.ht> [--repeat <n>]\n");
     fprintf(f, "    help\n");
+    fprintf(f, "A <file.ht> of - reads the program from stdin as it arrives, com and run only.\n");
 }
 
 typedef struct Args {
@@ -31,10 +47,191 @@ const char *shift_args(Args *args, const char *on_empty_message)
     return result;
 }
 
+// Maps the file when it can, reading it whole is the fallback
+static const char *load_source(const char *file_path, MappedFile *mapped, Arena *a)
+{
+    if(map_file_text(mapped, file_path)) return mapped->data;
+    return load_file_text_with_arena(file_path, a);
+}
+
+// FNV-1a of the source mixed with the versions of everything that shapes the compiled module
+static uint64_t cache_key(const char *source)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    uint32_t versions[] = { HOTARU_VERSION, HVM_VERSION };
+    for(ut_size i = 0; i < sizeof(versions); ++i) {
+        hash ^= ((const uint8_t *)versions)[i];
+        hash *= 0x100000001b3ull;
+    }
+    for(const char *c = source; *c; ++c) {
+        hash ^= (uint8_t)*c;
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Removes the entries of `cache_dir` that were written by other versions, they can never be hit again
+static void cache_prune(const char *cache_dir)
+{
+#if defined(__unix__) || defined(__APPLE__)
+    char current[17];
+    char path[1024];
+    snprintf(current, sizeof(current), CACHE_VERSION_FMT, (uint32_t)HOTARU_VERSION, (uint32_t)HVM_VERSION);
+    DIR *dir = opendir(cache_dir);
+    if(!dir) return;
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL) {
+        StringView name = sv_from_cstr(entry->d_name);
+        if(name.count != CACHE_ENTRY_LEN || name.data[16] != '-' || !sv_has_suffix(name, SV(".hbc"))) continue;
+        if(sv_has_prefix(name, sv_from_cstr(current))) continue;
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, entry->d_name);
+        remove(path);
+    }
+    closedir(dir);
+#else
+    (void)cache_dir;
+#endif
+}
+
+// Runs `source` as a single module that's taken from `cache_dir` when it was compiled before. On a
+// miss the module is compiled and stored for the next run, and the entries of older versions are
+// pruned. Entries of the current version are never evicted.
+static ut_bool run_cached(hState *state, const char *source, const char *cache_dir)
+{
+    char path[1024];
+    char tmp_path[1100];
+    snprintf(path, sizeof(path), "%s/" CACHE_ENTRY_FMT, cache_dir,
+            (uint32_t)HOTARU_VERSION, (uint32_t)HVM_VERSION, cache_key(source));
+
+    HVM_Module cached = {0};
+    HVM_Module *mod = &cached;
+    ut_bool hit = hvm_module_file_kind(path) == HVM_MODULE_KIND_STACK && hvm_module_map_file(&cached, path);
+    if(hit && !hvm_module_verify(&cached)) {
+        fprintf(stderr, "WARNING: Discarding the broken cache entry %s\n", path);
+        hvm_module_deinit(&cached);
+        hit = ut_false;
+    }
+
+    if(!hit) {
+        hstate_compile_source(state, source);
+        hvm_module_peephole(&state->mod);
+        hvm_module_fuse(&state->mod);
+        if(!hvm_module_verify(&state->mod)) {
+            fprintf(stderr, "ERROR: The generated bytecode failed verification\n");
+            return ut_false;
+        }
+        mod = &state->mod;
+
+        // Written under another name and renamed over the entry so concurrent runs never see a partial module
+#if defined(__unix__) || defined(__APPLE__)
+        mkdir(cache_dir, 0755);
+        snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+#else
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+#endif
+        if(!hvm_module_save_to_file(state->mod, tmp_path) || rename(tmp_path, path) != 0) {
+            fprintf(stderr, "WARNING: Could not write the cache entry %s\n", path);
+            remove(tmp_path);
+        }
+        cache_prune(cache_dir);
+    }
+
+    HVM_Tiering tiering;
+    if(state->tier_threshold > 0) {
+        hvm_tiering_init(&tiering, *mod, state->tier_threshold);
+        mod->tiering = &tiering;
+    }
+    hvm_exec_module(&state->vm, *mod);
+    if(mod->tiering) hvm_tiering_deinit(&tiering);
+    mod->tiering = UT_NULL;
+    hvm_module_deinit(&cached);
+    return ut_true;
+}
+
+// Wall clock time since the processor time of every lexing thread would add up
+static double seconds_now(void)
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (double)now.tv_sec + (double)now.tv_nsec/1e9;
+}
+
+static ut_bool parse_simd_level(const char *name, SimdLevel *level)
+{
+    for(SimdLevel i = UT_SIMD_SCALAR; i <= UT_SIMD_AVX2; ++i) {
+        if(sv_eq(sv_from_cstr(name), sv_from_cstr(ut_simd_level_name(i)))) {
+            *level = i;
+            return ut_true;
+        }
+    }
+    return ut_false;
+}
+
+static void simd_bench_report(const char *name, SimdLevel level, ut_size bytes, double seconds)
+{
+    double megabytes = (double)bytes/(1024.0*1024.0);
+    printf("    %-10s %-6s %10.2f MB/s\n", name, ut_simd_level_name(level), seconds > 0 ? megabytes/seconds : 0.0);
+}
+
+// Runs every SIMD routine of utils at every level the CPU has, over the source and over runs of the
+// same length that are all spaces, all identifier and all digits
+static void simd_bench(const char *source, int repeat, Arena *a)
+{
+    ut_size bytes = ut_strlen(source);
+    char *copy = arena_malloc(a, bytes + 1);
+    char *spaces = arena_malloc(a, bytes + 1);
+    char *ident = arena_malloc(a, bytes + 1);
+    char *digits = arena_malloc(a, bytes + 1);
+    for(ut_size i = 0; i < bytes; ++i) {
+        spaces[i] = " \t \n"[i%4];
+        ident[i] = "hotaru_42"[i%9];
+        digits[i] = (char)('0' + i%10);
+    }
+    StringView needle = SV("not in the source");
+    printf("%zu bytes, %d times, the CPU supports %s\n", (size_t)bytes, repeat, ut_simd_level_name(ut_simd_supported_level()));
+
+    for(SimdLevel level = UT_SIMD_SCALAR; level <= ut_simd_supported_level(); ++level) {
+        ut_simd_force_level(level);
+        ut_size total = bytes*(ut_size)repeat;
+        ut_size sink = 0;
+        double start = seconds_now();
+        for(int i = 0; i < repeat; ++i) ut_memcpy(copy, source, bytes);
+        simd_bench_report("memcpy", level, total, seconds_now() - start);
+        start = seconds_now();
+        for(int i = 0; i < repeat; ++i) sink += sv_eq(sv_from(source, bytes), sv_from(copy, bytes));
+        simd_bench_report("sv_eq", level, total, seconds_now() - start);
+        start = seconds_now();
+        for(int i = 0; i < repeat; ++i) sink += (ut_size)sv_find(sv_from(source, bytes), needle, 0);
+        simd_bench_report("sv_find", level, total, seconds_now() - start);
+        start = seconds_now();
+        for(int i = 0; i < repeat; ++i) {
+            ut_size newlines = 0, line_start = 0;
+            sink += ut_span_space(spaces, bytes, &newlines, &line_start) + newlines;
+        }
+        simd_bench_report("span_space", level, total, seconds_now() - start);
+        start = seconds_now();
+        for(int i = 0; i < repeat; ++i) sink += ut_span_ident(ident, bytes);
+        simd_bench_report("span_ident", level, total, seconds_now() - start);
+        start = seconds_now();
+        for(int i = 0; i < repeat; ++i) sink += ut_span_digit(digits, bytes);
+        simd_bench_report("span_digit", level, total, seconds_now() - start);
+        start = seconds_now();
+        for(int i = 0; i < repeat; ++i) ut_memset(copy, i, bytes);
+        simd_bench_report("memset", level, total, seconds_now() - start);
+        start = seconds_now();
+        for(int i = 0; i < repeat; ++i) sink += hlexer_count_tokens(source, 0);
+        simd_bench_report("lexer", level, total, seconds_now() - start);
+        if(sink == 0) printf("    (nothing found)\n"); // keeps the results used
+    }
+    ut_simd_force_level(ut_simd_supported_level());
+}
+
 enum cli_mode {
     cli_mode_run,
     cli_mode_compile,
     cli_mode_dump,
+    cli_mode_lexbench,
+    cli_mode_simdbench,
 };
 
 int main(int argc, const char **argv)
@@ -53,6 +250,10 @@ int main(int argc, const char **argv)
         mode = cli_mode_run;
     } else if(sv_eq(subcommand, SV("bcdump"))) {
         mode = cli_mode_dump;
+    } else if(sv_eq(subcommand, SV("lexbench"))) {
+        mode = cli_mode_lexbench;
+    } else if(sv_eq(subcommand, SV("simdbench"))) {
+        mode = cli_mode_simdbench;
     } else {
         fprintf(stderr, "ERROR: Invalid subcommand %s\n", subcommand.data);
         usage(stderr, program_name);
@@ -62,34 +263,162 @@ int main(int argc, const char **argv)
     const char *source_file = shift_args(&args, "Provide the source file path");
     const char *output_file = "output.hbc";
 
-    if(mode == cli_mode_compile && args.count > 0) {
+    ut_bool regvm = ut_false;
+    ut_bool compact = ut_false;
+    ut_bool optimize = ut_false;
+    int unroll_factor = HIR_DEFAULT_UNROLL_FACTOR;
+    ut_bool use_jit = ut_false;
+    int tier_threshold = HVM_TIER_THRESHOLD;
+    const char *cache_dir = getenv("HOTARU_CACHE_DIR");
+    int repeat = 20;
+    int lex_threads = 0;
+
+    while(mode == cli_mode_compile && args.count > 0) {
+        StringView flag = sv_from_cstr(shift_args(&args, "Unreachable"));
+        if(sv_eq(flag, SV("-o"))) {
+            output_file = shift_args(&args, "Expecting output file path");
+        } else if(sv_eq(flag, SV("--regvm"))) {
+            regvm = ut_true;
+        } else if(sv_eq(flag, SV("--compact"))) {
+            compact = ut_true;
+        } else if(sv_eq(flag, SV("--opt"))) {
+            optimize = ut_true;
+        } else if(sv_eq(flag, SV("--unroll"))) {
+            unroll_factor = atoi(shift_args(&args, "Expecting how many times small loops are unrolled, 1 disables unrolling"));
+        } else if(sv_eq(flag, SV("--lex-threads"))) {
+            lex_threads = atoi(shift_args(&args, "Expecting how many threads tokenize the source, 0 lexes while parsing"));
+        } else {
+            fprintf(stderr, "ERROR: Invalid flag %s\n", flag.data);
+            usage(stderr, program_name);
+            return -1;
+        }
+    }
+    // The register VM has its own compiler and module format, neither the SSA passes nor the compact
+    // encoding apply to it
+    if(regvm && (optimize || compact)) {
+        fprintf(stderr, "ERROR: --regvm can't be combined with %s\n", optimize ? "--opt" : "--compact");
+        usage(stderr, program_name);
+        return -1;
+    }
+
+    while(mode == cli_mode_run && args.count > 0) {
+        StringView flag = sv_from_cstr(shift_args(&args, "Unreachable"));
+        if(sv_eq(flag, SV("--jit"))) {
+            use_jit = ut_true;
+        } else if(sv_eq(flag, SV("--tier-threshold"))) {
+            tier_threshold = atoi(shift_args(&args, "Expecting the amount of backward jumps, 0 disables tiering"));
+        } else if(sv_eq(flag, SV("--cache-dir"))) {
+            cache_dir = shift_args(&args, "Expecting the directory of the compiled module cache");
+        } else if(sv_eq(flag, SV("--lex-threads"))) {
+            lex_threads = atoi(shift_args(&args, "Expecting how many threads tokenize the source, 0 lexes while parsing"));
+        } else {
+            fprintf(stderr, "ERROR: Invalid flag %s\n", flag.data);
+            usage(stderr, program_name);
+            return -1;
+        }
+    }
+
+    while((mode == cli_mode_lexbench || mode == cli_mode_simdbench) && args.count > 0) {
         StringView flag = sv_from_cstr(shift_args(&args, "Unreachable"));
-        if(!sv_eq(flag, SV("-o"))) {
+        if(sv_eq(flag, SV("--repeat"))) {
+            repeat = atoi(shift_args(&args, "Expecting how many times the file is lexed"));
+        } else if(mode == cli_mode_lexbench && sv_eq(flag, SV("--lex-threads"))) {
+            lex_threads = atoi(shift_args(&args, "Expecting how many threads tokenize the source, 0 lexes while parsing"));
+        } else if(mode == cli_mode_lexbench && sv_eq(flag, SV("--simd"))) {
+            const char *name = shift_args(&args, "Expecting the SIMD level, scalar, sse2 or avx2");
+            SimdLevel level;
+            if(!parse_simd_level(name, &level)) {
+                fprintf(stderr, "ERROR: Unknown SIMD level %s\n", name);
+                return -1;
+            }
+            ut_simd_force_level(level);
+        } else {
             fprintf(stderr, "ERROR: Invalid flag %s\n", flag.data);
             usage(stderr, program_name);
             return -1;
         }
-        output_file = shift_args(&args, "Expecting output file path");
     }
 
     Arena a = {0};
+    MappedFile mapped = {0};
+    // Streamed so a pipe is compiled while it's still being written and never held whole
+    ut_bool from_stdin = (mode == cli_mode_run || mode == cli_mode_compile) && sv_eq(sv_from_cstr(source_file), SV("-"));
     hState state;
     hstate_init(&state);
+    state.tier_threshold = tier_threshold > 0 ? (uint32_t)tier_threshold : 0;
+    state.unroll_factor = unroll_factor > 0 ? (uint32_t)unroll_factor : 0;
+    state.lex_threads = lex_threads > 0 ? (uint32_t)lex_threads : 0;
 
     switch(mode) {
         case cli_mode_run:
             {
-                char *source = load_file_text_with_arena(source_file, &a);
+                const char *source = from_stdin ? "" : load_source(source_file, &mapped, &a);
                 if(!source) {
                     fprintf(stderr, "ERROR: Could not load file %s\n", argv[1]);
                     usage(stderr, argv[0]);
                     return -1;
                 }
-                hstate_exec_source(&state, source);
+                if(use_jit) {
+                    // The JIT needs the whole program up front instead of one statement at a time
+                    if(from_stdin) hstate_compile_stream(&state, stdin);
+                    else hstate_compile_source(&state, source);
+                    hvm_module_peephole(&state.mod);
+                    hvm_module_fuse(&state.mod);
+                    HVM_Jit jit;
+                    if(!hvm_jit_compile(&jit, state.mod)) {
+                        fprintf(stderr, "ERROR: Could not JIT compile %s\n", source_file);
+                        return -1;
+                    }
+                    hvm_jit_run(&state.vm, jit);
+                    hvm_jit_free(&jit);
+                } else if(from_stdin) {
+                    // There's no key for the cache without the whole source
+                    hstate_exec_stream(&state, stdin);
+                } else if(cache_dir && *cache_dir) {
+                    if(!run_cached(&state, source, cache_dir)) return -1;
+                } else {
+                    hstate_exec_source(&state, source);
+                }
                 hvm_dump(&state.vm);
             } break;
+        case cli_mode_lexbench:
+            {
+                const char *source = load_source(source_file, &mapped, &a);
+                if(!source) {
+                    fprintf(stderr, "ERROR: Could not load file %s\n", source_file);
+                    return -1;
+                }
+                if(repeat < 1) repeat = 1;
+                ut_size bytes = ut_strlen(source);
+                ut_size tokens = 0;
+                double start = seconds_now();
+                for(int i = 0; i < repeat; ++i) tokens = hlexer_count_tokens(source, state.lex_threads);
+                double seconds = seconds_now() - start;
+                double megabytes = (double)bytes*repeat/(1024.0*1024.0);
+                printf("%zu tokens in %zu bytes, lexed %d times in %.3fs: %.2f MB/s\n",
+                        (size_t)tokens, (size_t)bytes, repeat, seconds, seconds > 0 ? megabytes/seconds : 0.0);
+            } break;
+        case cli_mode_simdbench:
+            {
+                const char *source = load_source(source_file, &mapped, &a);
+                if(!source) {
+                    fprintf(stderr, "ERROR: Could not load file %s\n", source_file);
+                    return -1;
+                }
+                simd_bench(source, repeat < 1 ? 1 : repeat, &a);
+            } break;
         case cli_mode_dump:
             {
+                if(hvm_module_file_kind(source_file) == HVM_MODULE_KIND_REGISTER) {
+                    HVM_RegModule rmod = {0};
+                    if(!hvm_reg_module_load_from_file(&rmod, source_file, &a)) {
+                        fprintf(stderr, "ERROR: Could not load file %s\n", source_file);
+                        return -1;
+                    }
+                    hvm_reg_module_dump(rmod);
+                    hvm_reg_module_deinit(&rmod);
+                    break;
+                }
                 HVM_Module mod = {0};
                 if(!hvm_module_load_from_file(&mod, source_file, &a)) {
                     fprintf(stderr, "ERROR: Could not load file %s\n", argv[1]);
@@ -98,20 +427,73 @@ int main(int argc, const char **argv)
                 }
                 hvm_module_dump(mod);
                 hvm_module_deinit(&mod);
+                hvm_module_file_dump_sections(source_file);
             } break;
         case cli_mode_compile:
             {
-                char *source = load_file_text_with_arena(source_file, &a);
+                const char *source = from_stdin ? "" : load_source(source_file, &mapped, &a);
                 if(!source) {
                     fprintf(stderr, "ERROR: Could not load file %s\n", argv[1]);
                     usage(stderr, argv[0]);
                     return -1;
                 }
-                hstate_compile_source(&state, source);
-                hvm_module_save_to_file(state.mod, output_file);
+                if(regvm) {
+                    hResult res = from_stdin ? hstate_compile_reg_stream(&state, stdin) : hstate_compile_reg_source(&state, source);
+                    if(res != HRES_OK) {
+                        fprintf(stderr, "ERROR: Could not compile %s\n", source_file);
+                        return -1;
+                    }
+                    if(!hvm_reg_module_save_to_file(state.rmod, output_file)) {
+                        fprintf(stderr, "ERROR: Could not write %s\n", output_file);
+                        return -1;
+                    }
+                    break;
+                }
+                if(optimize) {
+                    // Goes through the SSA form, the result has no line table
+                    hResult res = from_stdin ? hstate_compile_ir_stream(&state, stdin) : hstate_compile_ir_source(&state, source);
+                    if(res != HRES_OK) {
+                        fprintf(stderr, "ERROR: Could not compile %s\n", source_file);
+                        return -1;
+                    }
+                } else if(from_stdin) {
+                    hstate_compile_stream(&state, stdin);
+                } else {
+                    hstate_compile_source(&state, source);
+                }
+                // Both passes shrink the module, the line table needs where every original instruction ended up
+                uint32_t compiled = state.mod.count;
+                uint32_t *line_map = arena_malloc(&a, sizeof(uint32_t)*(compiled + 1));
+                hvm_module_peephole_map(&state.mod, line_map);
+                uint32_t *fuse_map = arena_malloc(&a, sizeof(uint32_t)*(state.mod.count + 1));
+                hvm_module_fuse_map(&state.mod, fuse_map);
+                for(uint32_t i = 0; i <= compiled; ++i) line_map[i] = fuse_map[line_map[i]];
+                if(!hvm_module_verify(&state.mod)) {
+                    fprintf(stderr, "ERROR: Could not compile %s, the generated bytecode failed verification\n", source_file);
+                    return -1;
+                }
+                if(compact) {
+                    HVM_CompactModule cmod = {0};
+                    if(!hvm_module_compact(&cmod, state.mod)) {
+                        fprintf(stderr, "ERROR: Could not encode %s as a compact module\n", source_file);
+                        return -1;
+                    }
+                    ut_bool saved = hvm_compact_module_save_to_file(cmod, output_file);
+                    hvm_compact_module_deinit(&cmod);
+                    if(!saved) {
+                        fprintf(stderr, "ERROR: Could not write %s\n", output_file);
+                        return -1;
+                    }
+                    break;
+                }
+                if(!hstate_save_module(&state, output_file, line_map)) {
+                    fprintf(stderr, "ERROR: Could not write %s\n", output_file);
+                    return -1;
+                }
             } break;
     }
 
+    unmap_file_text(&mapped);
     arena_free(&a);
     hstate_deinit(&state);
     return 0;
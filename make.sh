@@ -6,12 +6,16 @@ CC="clang"
 
 CORE_CFLAGS="-Wall -Wextra -pedantic"
 DEBUG_CFLAGS="-ggdb -fsanitize=address"
+THREAD_FLAGS="-pthread"
 
 LIBS=(
     "./utils.c"
     "./hvm.c"
+    "./hvmjit.c"
     "./hotaru.c"
     "./hparser.c"
+    "./hopt.c"
+    "./hir.c"
 )
 
 if [ ! -d $BUILD_DIR ]; then
@@ -19,10 +23,10 @@ if [ ! -d $BUILD_DIR ]; then
 fi
 
 echo "Building $BUILD_DIR/hotaru"
-$CC $CORE_CFLAGS $DEBUG_CFLAGS -o $BUILD_DIR/hotaru "${LIBS[@]}" ./main.c
+$CC $CORE_CFLAGS $DEBUG_CFLAGS $THREAD_FLAGS -o $BUILD_DIR/hotaru "${LIBS[@]}" ./main.c
 
 echo "Building $BUILD_DIR/test"
-$CC $CORE_CFLAGS $DEBUG_CFLAGS -o $BUILD_DIR/test "${LIBS[@]}" ./test.c
+$CC $CORE_CFLAGS $DEBUG_CFLAGS $THREAD_FLAGS -o $BUILD_DIR/test "${LIBS[@]}" ./test.c
 
 echo "Building $BUILD_DIR/hvm"
-$CC $CORE_CFLAGS -Os -o $BUILD_DIR/hvm ./hvmmain.c ./hvm.c ./utils.c
+$CC $CORE_CFLAGS -Os -o $BUILD_DIR/hvm ./hvmmain.c ./hvm.c ./hvmjit.c ./utils.c
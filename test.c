@@ -1,6 +1,17 @@
+#include "hotaru.h"
+#include "hvm.h"
 #include "utils.h"
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+// Run from the root of the repo after make.sh, the command line tests use the binaries it builds
+#define HOTARU_BIN "./build/hotaru"
+#define HVM_BIN "./build/hvm"
+#define TEST_CACHE_DIR "./build/test-cache"
+#define TEST_DIR "./build/test-programs"
 
 typedef struct Numbers {
     int *items;
@@ -8,7 +19,231 @@ typedef struct Numbers {
     uint32_t capacity;
 } Numbers;
 
-int main(void)
+typedef struct Output {
+    char *items;
+    uint32_t count;
+    uint32_t capacity;
+} Output;
+
+typedef struct Dumps {
+    int64_t *items;
+    uint32_t count;
+    uint32_t capacity;
+} Dumps;
+
+typedef struct Program {
+    const char *name;
+    const char *source;
+    // What the dump statements print, in order
+    int64_t expected[16];
+    uint32_t expected_count;
+} Program;
+
+// The ways a program can be run, all of them have to dump the same as `hotaru run`
+typedef struct Mode {
+    const char *name;
+    const char *com_flags; // NULL runs the source with `hotaru run`, otherwise compiled then run by hvm
+    const char *run_flags;
+} Mode;
+
+static const Mode modes[] = {
+    { "interpreter",         UT_NULL,             "--tier-threshold 0" },
+    { "tiered",              UT_NULL,             "--tier-threshold 1" },
+    { "jit",                 UT_NULL,             "--jit" },
+    { "threaded lexer",      UT_NULL,             "--lex-threads 4" },
+    { "bytecode",            "",                  "" },
+    { "bytecode jit",        "",                  "--jit" },
+    { "bytecode tiered",     "",                  "--tier 1" },
+    { "optimized",           "--opt",             "" },
+    { "optimized unrolled",  "--opt --unroll 8",  "" },
+    { "optimized no unroll", "--opt --unroll 1",  "" },
+    { "optimized jit",       "--opt",             "--jit" },
+    { "compact",             "--compact",         "" },
+    { "compact jit",         "--compact",         "--jit" },
+    { "register",            "--regvm",           "" },
+};
+
+static Program programs[] = {
+    {
+        .name = "precedence",
+        .source =
+            "var a = 10 - 4 - 3;\n"
+            "var b = 2 * 3 + 4;\n"
+            "var c = 2 + 3 * 4;\n"
+            "var d = (2 + 3) * 4;\n"
+            "var e = 20 - 2 * 3 - 1;\n"
+            "var f = 1 + 2 < 4;\n"
+            "var g = 3 < 2 == 0;\n"
+            "var h = a * b - c * d + e;\n"
+            "dump a;\ndump b;\ndump c;\ndump d;\ndump e;\ndump f;\ndump g;\ndump h;\n",
+        .expected = { 3, 10, 14, 20, 13, 1, 1, -237 },
+        .expected_count = 8,
+    },
+    {
+        // Counted loops the optimizer computes the trip count of, and one it has to simulate
+        .name = "loops",
+        .source =
+            "var n = 0;\n"
+            "var i = 0;\n"
+            "while(i <= 7) { n = n + 1; i = i + 1; }\n"
+            "dump n;\n"
+            "i = 10;\n"
+            "while(i > 0 - 5) { n = n + 1; i = i - 3; }\n"
+            "dump n;\n"
+            "i = 0;\n"
+            "while(i < 0) { n = n + 100; i = i + 1; }\n"
+            "dump n;\n"
+            "i = 1;\n"
+            "while(5 > i) { n = n + i; i = i + 2; }\n"
+            "dump n;\n"
+            "i = 0;\n"
+            "while(i != 9) { i = i + 3; n = n + 1; }\n"
+            "dump n;\n"
+            "i = 3;\n"
+            "while(i >= 1) { n = n + i; i = i - 1; }\n"
+            "dump n;\n"
+            "var sum = 0;\n"
+            "i = 0;\n"
+            "while(i < 4) {\n"
+            "    var j = 0;\n"
+            "    var k = i * 10;\n"
+            "    while(j < 3) { sum = sum + k + j; j = j + 1; }\n"
+            "    i = i + 1;\n"
+            "}\n"
+            "dump sum;\n",
+        .expected = { 8, 13, 13, 17, 20, 26, 192 },
+        .expected_count = 7,
+    },
+    {
+        .name = "scopes",
+        .source =
+            "var x = 3;\n"
+            "if(x == 1) {\n"
+            "    dump 1;\n"
+            "} else {\n"
+            "    if(x == 3) { var y = x * 10; dump y; } else { dump 0; }\n"
+            "}\n"
+            "if(x == 3) {\n"
+            "    var x = 7;\n"
+            "    dump x;\n"
+            "    while(x < 9) { var z = x + 1; dump z; x = z; }\n"
+            "    dump x;\n"
+            "}\n"
+            "dump x;\n"
+            "if(x > 100) {\n"
+            "    dump 100;\n"
+            "} else {\n"
+            "    var w = x + x;\n"
+            "    if(w == 6) { dump w; }\n"
+            "    dump 1;\n"
+            "}\n"
+            "dump x;\n",
+        .expected = { 30, 7, 8, 9, 9, 3, 6, 1, 3 },
+        .expected_count = 9,
+    },
+    {
+        // Filled in by main(), integers wrap around
+        .name = "arithmetic",
+        .source =
+            "var w = 2000000000;\n"
+            "w = w * w;\n"
+            "w = w * w;\n"
+            "dump w;\n"
+            "w = w * w * w;\n"
+            "dump w;\n"
+            "var z = 0 - 2000000000;\n"
+            "z = z * 2000000000 * 4;\n"
+            "dump z;\n"
+            "var p = 6;\n"
+            "var q = p * 7 + p * 7;\n"
+            "var r = q;\n"
+            "dump r - q + p * 7;\n"
+            "dump p * 1 + 0 - p * 0;\n",
+        .expected_count = 5,
+    },
+};
+
+static int failures = 0;
+
+#define TEST_CHECK(cond, ...) do {                                  \
+        if(!(cond)) {                                               \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);    \
+            fprintf(stderr, __VA_ARGS__);                           \
+            fprintf(stderr, "\n");                                  \
+            failures += 1;                                          \
+        }                                                           \
+    } while(0)
+
+// Everything `command` writes to stdout, NULL terminated
+static ut_bool run_command(Arena *a, const char *command, Output *out)
+{
+    ut_memset(out, 0, sizeof(*out));
+    FILE *f = popen(command, "r");
+    if(!f) return ut_false;
+    char buffer[4096];
+    ut_size n;
+    while((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        arena_da_append_many(a, out, buffer, n);
+    }
+    arena_da_append(a, out, '\0');
+    return pclose(f) == 0;
+}
+
+// The values printed by the dump statements, the VM state printed after them is left out
+static Dumps parse_dumps(Arena *a, const char *output)
+{
+    Dumps dumps = {0};
+    StringView rest = sv_from_cstr(output);
+    while(rest.count > 0 && !sv_has_prefix(rest, SV("VM ("))) {
+        int at = sv_find(rest, SV(".as_i64="), 0);
+        int end = sv_find(rest, SV("\n"), 0);
+        if(end < 0) end = (int)rest.count;
+        if(sv_has_prefix(rest, SV("HVM_Word")) && at >= 0 && at < end) {
+            arena_da_append(a, &dumps, strtoll(rest.data + at + 8, UT_NULL, 10));
+        }
+        rest = sv_slice(rest, UT_MIN((ut_size)end + 1, rest.count), rest.count);
+    }
+    return dumps;
+}
+
+static ut_bool same_dumps(Dumps a, Dumps b)
+{
+    if(a.count != b.count) return ut_false;
+    for(uint32_t i = 0; i < a.count; ++i) {
+        if(a.items[i] != b.items[i]) return ut_false;
+    }
+    return ut_true;
+}
+
+static ut_bool same_insts(const HVM_Module a, const HVM_Module b)
+{
+    if(a.count != b.count) return ut_false;
+    for(uint32_t i = 0; i < a.count; ++i) {
+        if(a.items[i].type != b.items[i].type || a.items[i].arg != b.items[i].arg
+                || a.items[i].op.as_u64 != b.items[i].op.as_u64) return ut_false;
+    }
+    return ut_true;
+}
+
+static ut_bool same_stack(const HVM *a, const HVM *b)
+{
+    if(a->sp != b->sp) return ut_false;
+    for(uint32_t i = 0; i < a->sp; ++i) {
+        if(a->stack[i].as_u64 != b->stack[i].as_u64) return ut_false;
+    }
+    return ut_true;
+}
+
+static void write_file(const char *path, const char *text)
+{
+    FILE *f = fopen(path, "wb");
+    TEST_CHECK(f != UT_NULL, "could not create %s", path);
+    if(!f) return;
+    fputs(text, f);
+    fclose(f);
+}
+
+static void test_arena_da(void)
 {
     Arena a;
     Numbers nums;
@@ -20,8 +255,540 @@ int main(void)
     int nums2[] = { 129,2,1,23,133123,3123,124 };
     arena_da_append_many(&a, &nums, nums2, UT_ARRAY_LEN(nums2));
 
-    for(uint32_t i = 0; i < nums.count; ++i) {
-        fprintf(stderr, "%u] %d\n", i, nums.items[i]);
+    TEST_CHECK(nums.count == 1 + UT_ARRAY_LEN(nums2), "expected %zu numbers, got %u", 1 + UT_ARRAY_LEN(nums2), nums.count);
+    TEST_CHECK(nums.items[0] == 69, "expected 69 first, got %d", nums.items[0]);
+    for(uint32_t i = 1; i < nums.count; ++i) {
+        TEST_CHECK(nums.items[i] == nums2[i - 1], "expected %d at %u, got %d", nums2[i - 1], i, nums.items[i]);
     }
+    arena_free(&a);
 }
 
+static void test_arena_rewind(void)
+{
+    Arena a = {0};
+    void *kept = arena_malloc(&a, 64);
+    ArenaMark mark = arena_mark(&a);
+    void *first = arena_malloc(&a, 128);
+    for(int i = 0; i < 1000; ++i) arena_malloc(&a, 1024);
+    arena_rewind(&a, mark);
+    void *again = arena_malloc(&a, 128);
+    TEST_CHECK(again == first, "rewinding didn't give back what was allocated after the mark");
+    TEST_CHECK(kept != again, "rewinding gave back what was allocated before the mark");
+    arena_free(&a);
+}
+
+static void test_scope_lookup(void)
+{
+    Arena a = {0};
+    hScope global = {0};
+    hScope block = {0};
+    block.prev = &global;
+    // Enough bindings for the table to grow a few times
+    for(uint32_t i = 0; i < 200; ++i) {
+        hVarBinding binding = { .symbol = i, .pos = i };
+        hscope_append(&global, binding, &a);
+    }
+    hVarBinding shadow = { .symbol = 7, .pos = 1000 };
+    hscope_append(&global, shadow, &a);
+    hVarBinding inner = { .symbol = 9, .pos = 2000 };
+    hscope_append(&block, inner, &a);
+
+    for(uint32_t i = 0; i < 200; ++i) {
+        hVarBinding *found = hscope_find(&global, i);
+        uint32_t expected = i == 7 ? 1000 : i;
+        TEST_CHECK(found && found->pos == expected, "symbol %u resolved to %u instead of %u", i, found ? found->pos : 0, expected);
+    }
+    TEST_CHECK(hscope_find(&global, 200) == UT_NULL, "found a symbol that was never declared");
+    hVarBinding *found = hscope_find(&block, 9);
+    TEST_CHECK(found && found->pos == 2000, "the block didn't shadow the global");
+    found = hscope_find(&block, 150);
+    TEST_CHECK(found && found->pos == 150, "the block didn't see the global");
+    arena_free(&a);
+}
+
+// Operators of the same precedence associate to the left, also once they're folded
+static void test_precedence(void)
+{
+    static const struct { const char *expr; int64_t expected; } cases[] = {
+        { "a - b - c", 3 },          { "10 - 4 - 3", 3 },
+        { "a * d + c", 23 },         { "10 * 2 + 3", 23 },
+        { "c + a * d", 23 },         { "3 + 10 * 2", 23 },
+        { "(c + a) * d", 26 },       { "(3 + 10) * 2", 26 },
+        { "a - b * c + d", 0 },      { "10 - 4 * 3 + 2", 0 },
+        { "a - (b - c)", 9 },        { "10 - (4 - 3)", 9 },
+        { "a * b * c - a", 110 },    { "10 * 4 * 3 - 10", 110 },
+        { "b + c < a", 1 },          { "4 + 3 < 10", 1 },
+        { "a < b == 0", 1 },         { "10 < 4 == 0", 1 },
+        { "a - a", 0 },              { "a * 1 + 0", 10 },
+        { "0 * a + b * 0 - c", -3 }, { "a - b - c - d - 1", 0 },
+    };
+    for(ut_size i = 0; i < UT_ARRAY_LEN(cases); ++i) {
+        char source[256];
+        snprintf(source, sizeof(source), "var a = 10;\nvar b = 4;\nvar c = 3;\nvar d = 2;\nvar r = %s;\n", cases[i].expr);
+        hState state;
+        hstate_init(&state);
+        hResult res = hstate_exec_source(&state, source);
+        TEST_CHECK(res == HRES_OK && state.vm.sp == 5, "`%s` didn't run", cases[i].expr);
+        if(res == HRES_OK && state.vm.sp == 5) {
+            int64_t got = state.vm.stack[4].as_i64;
+            TEST_CHECK(got == cases[i].expected, "`%s` is %" PRId64 " instead of %" PRId64, cases[i].expr, got, cases[i].expected);
+        }
+        hstate_deinit(&state);
+    }
+}
+
+static void test_verifier(void)
+{
+    HVM_Module mod;
+    hvm_module_init(&mod);
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_PUSH, HVM_WORD_I64(1)));
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_PUSH, HVM_WORD_I64(2)));
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_ADD, HVM_NULL_WORD));
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_HALT, HVM_NULL_WORD));
+    TEST_CHECK(hvm_module_verify(&mod), "a well formed module was rejected");
+    hvm_module_deinit(&mod);
+
+    // Adds with a single value on the stack
+    hvm_module_init(&mod);
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_PUSH, HVM_WORD_I64(1)));
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_ADD, HVM_NULL_WORD));
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_HALT, HVM_NULL_WORD));
+    TEST_CHECK(!hvm_module_verify(&mod), "a stack underflow was accepted");
+    hvm_module_deinit(&mod);
+
+    hvm_module_init(&mod);
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_JMP, HVM_WORD_U64(100)));
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_HALT, HVM_NULL_WORD));
+    TEST_CHECK(!hvm_module_verify(&mod), "a jump out of the module was accepted");
+    hvm_module_deinit(&mod);
+
+    // Every iteration leaves one more value on the stack
+    hvm_module_init(&mod);
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_PUSH, HVM_WORD_I64(1)));
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_PUSH, HVM_WORD_I64(1)));
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_JZ, HVM_WORD_U64(0)));
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_HALT, HVM_NULL_WORD));
+    TEST_CHECK(!hvm_module_verify(&mod), "a loop that grows the stack was accepted");
+    hvm_module_deinit(&mod);
+
+    // Only valid on top of what an earlier statement left on the stack
+    hvm_module_init(&mod);
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_POP, HVM_NULL_WORD));
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_HALT, HVM_NULL_WORD));
+    TEST_CHECK(!hvm_module_verify(&mod), "a pop from the empty stack was accepted");
+    TEST_CHECK(hvm_module_verify_from(&mod, 1), "a pop of a value below the module was rejected");
+    hvm_module_deinit(&mod);
+}
+
+static void test_peephole(void)
+{
+    // Jump to a jump, a jump to the next instruction and code that can't be reached
+    HVM_Module mod;
+    hvm_module_init(&mod);
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_PUSH, HVM_WORD_I64(1)));
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_JMP, HVM_WORD_U64(2)));
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_JMP, HVM_WORD_U64(4)));
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_PUSH, HVM_WORD_I64(9)));
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_PUSH, HVM_WORD_I64(2)));
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_ADD, HVM_NULL_WORD));
+    hvm_module_append(&mod, HVM_MAKE_INST(HVM_INST_HALT, HVM_NULL_WORD));
+    uint32_t count = mod.count;
+    uint32_t map[8];
+    hvm_module_peephole_map(&mod, map);
+    TEST_CHECK(mod.count < count, "nothing was removed, %u instructions are left", mod.count);
+    TEST_CHECK(map[count] == mod.count, "the end maps to %u instead of %u", map[count], mod.count);
+    for(uint32_t i = 0; i < count; ++i) {
+        TEST_CHECK(map[i] <= map[i + 1], "instruction %u moved before the one after it", i);
+    }
+    TEST_CHECK(mod.items[map[4]].type == HVM_INST_PUSH && mod.items[map[4]].op.as_i64 == 2,
+            "instruction 4 doesn't map to where it ended up");
+    TEST_CHECK(hvm_module_verify(&mod), "the result was rejected by the verifier");
+    HVM vm;
+    hvm_init(&vm);
+    hvm_exec_module(&vm, mod);
+    TEST_CHECK(vm.sp == 1 && vm.stack[0].as_i64 == 3, "the result computes something else");
+    hvm_module_deinit(&mod);
+}
+
+// Compiles the counting loops of a program with no dumps so running it prints nothing
+static const char *quiet_source =
+    "var i = 0;\n"
+    "var n = 0;\n"
+    "while(i < 50) {\n"
+    "    var j = 0;\n"
+    "    while(j < i) { n = n + j * 3 - 1; j = j + 1; }\n"
+    "    i = i + 1;\n"
+    "}\n"
+    "var m = n * 2;\n";
+
+static void compile_quiet(HVM_Module *mod)
+{
+    hState state;
+    hstate_init(&state);
+    TEST_CHECK(hstate_compile_source(&state, quiet_source) == HRES_OK, "could not compile the test program");
+    *mod = state.mod;
+    hvm_module_init(&state.mod);
+    hstate_deinit(&state);
+}
+
+static void test_fuse(void)
+{
+    HVM_Module mod, fused;
+    compile_quiet(&mod);
+    compile_quiet(&fused);
+    hvm_module_peephole(&mod);
+    hvm_module_peephole(&fused);
+    uint32_t count = fused.count;
+    uint32_t *map = malloc(sizeof(uint32_t)*(count + 1));
+    hvm_module_fuse_map(&fused, map);
+    TEST_CHECK(fused.count < count, "nothing was fused");
+    TEST_CHECK(map[count] == fused.count, "the end maps to %u instead of %u", map[count], fused.count);
+    for(uint32_t i = 0; i < count; ++i) {
+        TEST_CHECK(map[i] <= map[i + 1], "instruction %u moved before the one after it", i);
+    }
+    free(map);
+    TEST_CHECK(hvm_module_verify(&mod) && hvm_module_verify(&fused), "the modules were rejected by the verifier");
+
+    HVM plain, superinsts;
+    hvm_init(&plain);
+    hvm_init(&superinsts);
+    hvm_exec_module(&plain, mod);
+    hvm_exec_module(&superinsts, fused);
+    TEST_CHECK(same_stack(&plain, &superinsts), "fusing changed what the program computes");
+
+    // Promoted loops and the pre-decoded form compute the same
+    HVM tiered, prepared;
+    hvm_init(&tiered);
+    HVM_Tiering tiering;
+    hvm_tiering_init(&tiering, mod, 1);
+    mod.tiering = &tiering;
+    hvm_exec_module(&tiered, mod);
+    mod.tiering = UT_NULL;
+    hvm_tiering_deinit(&tiering);
+    TEST_CHECK(same_stack(&plain, &tiered), "tiering changed what the program computes");
+
+    hvm_init(&prepared);
+    HVM_Prepared pre;
+    TEST_CHECK(hvm_module_prepare(&pre, fused), "could not prepare the module");
+    hvm_exec_prepared(&prepared, pre);
+    hvm_prepared_deinit(&pre);
+    TEST_CHECK(same_stack(&plain, &prepared), "the pre-decoded module computes something else");
+
+    HVM_Jit jit;
+    if(hvm_jit_compile(&jit, mod)) {
+        HVM native;
+        hvm_init(&native);
+        hvm_jit_run(&native, jit);
+        hvm_jit_free(&jit);
+        TEST_CHECK(same_stack(&plain, &native), "the JIT computes something else");
+    }
+    hvm_module_deinit(&mod);
+    hvm_module_deinit(&fused);
+}
+
+static void test_compact(void)
+{
+    HVM_Module mod;
+    compile_quiet(&mod);
+    hvm_module_peephole(&mod);
+    hvm_module_fuse(&mod);
+    TEST_CHECK(hvm_module_verify(&mod), "the module was rejected by the verifier");
+
+    HVM_CompactModule compact = {0};
+    TEST_CHECK(hvm_module_compact(&compact, mod), "could not encode the module");
+    TEST_CHECK(compact.count == mod.count, "%u instructions were encoded out of %u", compact.count, mod.count);
+    TEST_CHECK(compact.size < sizeof(HVM_Inst)*mod.count, "the encoding is %u bytes, no smaller than the module", compact.size);
+    HVM_Module expanded = {0};
+    TEST_CHECK(hvm_compact_module_expand(compact, &expanded), "could not decode the module");
+    TEST_CHECK(same_insts(mod, expanded), "decoding didn't give back the module");
+
+    HVM plain, compacted;
+    hvm_init(&plain);
+    hvm_init(&compacted);
+    hvm_exec_module(&plain, mod);
+    hvm_exec_compact(&compacted, compact);
+    TEST_CHECK(same_stack(&plain, &compacted), "the compact module computes something else");
+
+    Arena a = {0};
+    HVM_CompactModule loaded = {0};
+    TEST_CHECK(hvm_compact_module_save_to_file(compact, TEST_DIR "/compact.hbc"), "could not save the compact module");
+    TEST_CHECK(hvm_compact_module_load_from_file(&loaded, TEST_DIR "/compact.hbc", &a), "could not load the compact module");
+    TEST_CHECK(loaded.size == compact.size && loaded.count == compact.count
+            && sv_eq(sv_from(loaded.code, loaded.size), sv_from(compact.code, compact.size)),
+            "the compact module changed on the way through the file");
+    TEST_CHECK(hvm_module_file_kind(TEST_DIR "/compact.hbc") == HVM_MODULE_KIND_COMPACT, "the file isn't marked compact");
+
+    hvm_compact_module_deinit(&compact);
+    hvm_compact_module_deinit(&loaded);
+    hvm_module_deinit(&expanded);
+    hvm_module_deinit(&mod);
+    arena_free(&a);
+}
+
+static void test_register_module(void)
+{
+    hState state;
+    hstate_init(&state);
+    TEST_CHECK(hstate_compile_reg_source(&state, quiet_source) == HRES_OK, "could not compile for the register VM");
+    TEST_CHECK(hvm_reg_module_save_to_file(state.rmod, TEST_DIR "/register.hbc"), "could not save the register module");
+    TEST_CHECK(hvm_module_file_kind(TEST_DIR "/register.hbc") == HVM_MODULE_KIND_REGISTER, "the file isn't marked as a register module");
+
+    Arena a = {0};
+    HVM_RegModule loaded = {0};
+    TEST_CHECK(hvm_reg_module_load_from_file(&loaded, TEST_DIR "/register.hbc", &a), "could not load the register module");
+    TEST_CHECK(loaded.count == state.rmod.count && loaded.reg_count == state.rmod.reg_count
+            && sv_eq(sv_from(loaded.items, sizeof(HVM_RegInst)*loaded.count), sv_from(state.rmod.items, sizeof(HVM_RegInst)*loaded.count)),
+            "the register module changed on the way through the file");
+
+    // The variables are in the same registers as the stack machine keeps them
+    HVM regs, stack;
+    hvm_init(&regs);
+    hvm_exec_reg_module(&regs, loaded);
+    HVM_Module mod;
+    compile_quiet(&mod);
+    hvm_init(&stack);
+    hvm_exec_module(&stack, mod);
+    TEST_CHECK(regs.stack[1].as_i64 == stack.stack[1].as_i64 && regs.stack[2].as_i64 == stack.stack[2].as_i64,
+            "the register VM computes something else");
+    hvm_module_deinit(&mod);
+    hvm_reg_module_deinit(&loaded);
+    hstate_deinit(&state);
+    arena_free(&a);
+}
+
+static void test_sections(void)
+{
+    const char *path = TEST_DIR "/sections.hbc";
+    hState state;
+    hstate_init(&state);
+    TEST_CHECK(hstate_compile_source(&state, "var hello = 34;\nvar world = 35;\nhello = hello + world;\n") == HRES_OK,
+            "could not compile the test program");
+    hvm_module_peephole(&state.mod);
+    TEST_CHECK(hstate_save_module(&state, path, UT_NULL), "could not save the module");
+    TEST_CHECK(hvm_module_file_kind(path) == HVM_MODULE_KIND_STACK, "the file isn't marked as a stack module");
+
+    Arena a = {0};
+    Buffer symbols, lines;
+    TEST_CHECK(hvm_module_file_read_section(path, HVM_SECTION_SYMBOLS, &symbols, &a), "there are no symbols");
+    const char *names[] = { "hello", "world" };
+    ut_size at = 0;
+    for(uint32_t i = 0; i < UT_ARRAY_LEN(names); ++i) {
+        HVM_SymbolEntry symbol;
+        TEST_CHECK(at + sizeof(symbol) <= symbols.count, "symbol %u is missing", i);
+        if(at + sizeof(symbol) > symbols.count) break;
+        ut_memcpy(&symbol, (const uint8_t *)symbols.data + at, sizeof(symbol));
+        at += sizeof(symbol);
+        StringView name = sv_from((const uint8_t *)symbols.data + at, symbol.name_size);
+        at += symbol.name_size;
+        TEST_CHECK(symbol.kind == HVM_SYMBOL_VARIABLE && symbol.value == i && sv_eq(name, sv_from_cstr(names[i])),
+                "symbol %u isn't the variable %s", i, names[i]);
+    }
+    TEST_CHECK(at == symbols.count, "there are more symbols than variables");
+
+    TEST_CHECK(hvm_module_file_read_section(path, HVM_SECTION_DEBUG_LINES, &lines, &a), "there's no line table");
+    TEST_CHECK(lines.count == 3*sizeof(HVM_LineEntry), "expected a line entry for each of the 3 statements");
+    for(uint32_t i = 0; i < lines.count/sizeof(HVM_LineEntry); ++i) {
+        HVM_LineEntry line;
+        ut_memcpy(&line, (const uint8_t *)lines.data + i*sizeof(line), sizeof(line));
+        TEST_CHECK(line.row == i + 1 && line.col == 1, "line entry %u is at %u:%u", i, line.row, line.col);
+    }
+    Buffer profile;
+    TEST_CHECK(!hvm_module_file_read_section(path, HVM_SECTION_PROFILE, &profile, &a), "found a section that was never written");
+
+    HVM_Module loaded = {0};
+    TEST_CHECK(hvm_module_load_from_file(&loaded, path, &a), "could not load the module");
+    TEST_CHECK(same_insts(state.mod, loaded), "loading changed the module");
+    hvm_module_deinit(&loaded);
+
+    // A module that's already clean is used from the mapping, the peephole pass doesn't copy it
+    HVM_Module mapped = {0};
+    TEST_CHECK(hvm_module_map_file(&mapped, path), "could not map the module");
+    TEST_CHECK(same_insts(state.mod, mapped), "mapping changed the module");
+    const HVM_Inst *items = mapped.items;
+    hvm_module_peephole(&mapped);
+    TEST_CHECK(mapped.items == items && mapped.capacity == 0, "the peephole pass copied a clean mapped module");
+    hvm_module_deinit(&mapped);
+
+    hstate_deinit(&state);
+    arena_free(&a);
+}
+
+// Enough source for several lexing threads, with names and numbers that can straddle the chunks
+static char *make_big_source(Arena *a)
+{
+    Output source = {0};
+    const char *head = "var alpha = 1;\nvar beta_2 = 22;\nvar gamma = 0;\n";
+    arena_da_append_many(a, &source, head, ut_strlen(head));
+    char line[256];
+    for(uint32_t i = 0; source.count < 1200*1024; ++i) {
+        int n = snprintf(line, sizeof(line),
+                "alpha = alpha * 3 + beta_2 - %u;\nif(alpha < %u)   {\n\tgamma = alpha;\n} else { gamma = 0; }\nwhile(gamma > 1000) { gamma = gamma - 1000; }\n",
+                i % 977, 1000 + i % 13);
+        arena_da_append_many(a, &source, line, (ut_size)n);
+    }
+    arena_da_append(a, &source, '\0');
+    return source.items;
+}
+
+static void test_lexer(void)
+{
+    Arena a = {0};
+    const char *source = make_big_source(&a);
+    ut_size tokens = hlexer_count_tokens(source, 1);
+    TEST_CHECK(tokens > 0, "no tokens");
+    const uint32_t threads[] = { 2, 3, 4, 8 };
+    for(ut_size i = 0; i < UT_ARRAY_LEN(threads); ++i) {
+        ut_size got = hlexer_count_tokens(source, threads[i]);
+        TEST_CHECK(got == tokens, "%u threads found %llu tokens instead of %llu", threads[i], got, tokens);
+    }
+
+    hState single, threaded, streamed;
+    hstate_init(&single);
+    hstate_init(&threaded);
+    hstate_init(&streamed);
+    threaded.lex_threads = 4;
+    TEST_CHECK(hstate_compile_source(&single, source) == HRES_OK, "could not compile the source");
+    TEST_CHECK(hstate_compile_source(&threaded, source) == HRES_OK, "could not compile the source on several threads");
+    TEST_CHECK(same_insts(single.mod, threaded.mod), "lexing on several threads changed the module");
+
+    FILE *stream = tmpfile();
+    TEST_CHECK(stream != UT_NULL, "could not create a temporary file");
+    if(stream) {
+        fputs(source, stream);
+        rewind(stream);
+        TEST_CHECK(hstate_compile_stream(&streamed, stream) == HRES_OK, "could not compile the stream");
+        TEST_CHECK(same_insts(single.mod, streamed.mod), "streaming the source changed the module");
+        fclose(stream);
+    }
+    hstate_deinit(&single);
+    hstate_deinit(&threaded);
+    hstate_deinit(&streamed);
+    arena_free(&a);
+}
+
+// Every SIMD level scans the same as the scalar code
+static void test_simd(void)
+{
+    Arena a = {0};
+    const char *source = make_big_source(&a);
+    ut_size count = 64*1024;
+    SimdLevel supported = ut_simd_supported_level();
+    for(SimdLevel level = UT_SIMD_SSE2; level <= supported; ++level) {
+        for(ut_size at = 0; at < count; at += 7) {
+            ut_size rest = count - at;
+            ut_size newlines[2] = {0}, line_start[2] = {0}, space[2], ident[2], digit[2];
+            for(int i = 0; i < 2; ++i) {
+                ut_simd_force_level(i == 0 ? UT_SIMD_SCALAR : level);
+                space[i] = ut_span_space(source + at, rest, &newlines[i], &line_start[i]);
+                ident[i] = ut_span_ident(source + at, rest);
+                digit[i] = ut_span_digit(source + at, rest);
+            }
+            TEST_CHECK(space[0] == space[1] && newlines[0] == newlines[1] && line_start[0] == line_start[1],
+                    "%s scans the spaces at %llu differently", ut_simd_level_name(level), at);
+            TEST_CHECK(ident[0] == ident[1], "%s scans the name at %llu differently", ut_simd_level_name(level), at);
+            TEST_CHECK(digit[0] == digit[1], "%s scans the number at %llu differently", ut_simd_level_name(level), at);
+        }
+    }
+    ut_simd_force_level(supported);
+    arena_free(&a);
+}
+
+// The command that runs `path` in `mode`, compiling it to `module` first when the mode needs it
+static void mode_command(char *command, ut_size size, const Mode *mode, const char *path, const char *module)
+{
+    if(!mode->com_flags) {
+        snprintf(command, size, HOTARU_BIN " run %s %s 2>/dev/null", path, mode->run_flags);
+    } else {
+        snprintf(command, size, HOTARU_BIN " com %s -o %s %s >/dev/null 2>&1 && " HVM_BIN " %s %s 2>/dev/null",
+                path, module, mode->com_flags, module, mode->run_flags);
+    }
+}
+
+// Every mode dumps the same as the interpreter, and the programs with known results dump those
+static void test_modes(const char *path, const Program *program)
+{
+    Arena a = {0};
+    char command[2048];
+    char module[1024];
+    snprintf(module, sizeof(module), TEST_DIR "/mode.hbc");
+    snprintf(command, sizeof(command), HOTARU_BIN " run %s 2>/dev/null", path);
+    Output out;
+    TEST_CHECK(run_command(&a, command, &out), "%s failed", command);
+    Dumps reference = parse_dumps(&a, out.items);
+    TEST_CHECK(reference.count > 0, "%s dumped nothing", path);
+    if(program) {
+        Dumps expected = { (int64_t *)program->expected, program->expected_count, program->expected_count };
+        TEST_CHECK(same_dumps(reference, expected), "%s dumped something else than expected:\n%s", path, out.items);
+    }
+
+    for(ut_size i = 0; i < UT_ARRAY_LEN(modes); ++i) {
+        mode_command(command, sizeof(command), &modes[i], path, module);
+        TEST_CHECK(run_command(&a, command, &out), "%s failed", command);
+        TEST_CHECK(same_dumps(reference, parse_dumps(&a, out.items)), "%s: %s dumped\n%s", path, modes[i].name, out.items);
+    }
+    arena_free(&a);
+}
+
+// The first run fills the cache and the second one is served from it, both print the same
+static void test_cache_hit(const char *example)
+{
+    Arena a = {0};
+    char command[1024];
+    Output miss, hit;
+    TEST_CHECK(system("rm -rf " TEST_CACHE_DIR) == 0, "could not clear " TEST_CACHE_DIR);
+    snprintf(command, sizeof(command), HOTARU_BIN " run %s --cache-dir " TEST_CACHE_DIR " 2>/dev/null", example);
+    TEST_CHECK(run_command(&a, command, &miss), "%s failed", command);
+    TEST_CHECK(run_command(&a, command, &hit), "%s failed", command);
+    TEST_CHECK(sv_eq(sv_from_cstr(miss.items), sv_from_cstr(hit.items)), "%s: a cache hit printed\n%s\ninstead of\n%s", example, hit.items, miss.items);
+    arena_free(&a);
+}
+
+int main(void)
+{
+    // example/function.htr is left out, functions can't be compiled yet
+    const char *examples[] = { "example/main.htr", "example/loop.htr" };
+
+    mkdir(TEST_DIR, 0755);
+    uint64_t w = 2000000000;
+    w = w*w;
+    w = w*w;
+    uint64_t z = (uint64_t)0 - 2000000000;
+    z = z*2000000000*4;
+    Program *arithmetic = &programs[UT_ARRAY_LEN(programs) - 1];
+    arithmetic->expected[0] = (int64_t)w;
+    arithmetic->expected[1] = (int64_t)(w*w*w);
+    arithmetic->expected[2] = (int64_t)z;
+    arithmetic->expected[3] = 42;
+    arithmetic->expected[4] = 6;
+
+    test_arena_da();
+    test_arena_rewind();
+    test_scope_lookup();
+    test_precedence();
+    test_verifier();
+    test_peephole();
+    test_fuse();
+    test_compact();
+    test_register_module();
+    test_sections();
+    test_lexer();
+    test_simd();
+    for(ut_size i = 0; i < UT_ARRAY_LEN(examples); ++i) {
+        test_modes(examples[i], UT_NULL);
+        test_cache_hit(examples[i]);
+    }
+    for(ut_size i = 0; i < UT_ARRAY_LEN(programs); ++i) {
+        char path[512];
+        snprintf(path, sizeof(path), TEST_DIR "/%s.htr", programs[i].name);
+        write_file(path, programs[i].source);
+        test_modes(path, &programs[i]);
+        test_cache_hit(path);
+    }
+
+    if(failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    fprintf(stderr, "All tests passed\n");
+    return 0;
+}
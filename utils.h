@@ -50,6 +50,14 @@
     } while(0)
 #endif
 
+#ifndef UT_MIN
+#define UT_MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef UT_MAX
+#define UT_MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
 #ifndef UT_MAKE_VERSION
 #define UT_MAKE_VERSION(major, minor, rev) ((ut_uint32)(((major) << 22) | ((minor) << 12) | (rev)))
 #endif
@@ -133,6 +141,14 @@ typedef struct BufferView {
     ut_size count;
 } BufferView;
 
+// A text file mapped into memory, `data[count]` is always 0 so it can be used as a C string
+typedef struct MappedFile {
+    const char *data;
+    ut_size count;
+    void *mapping;
+    ut_size mapping_size;
+} MappedFile;
+
 typedef struct ArenaRegion ArenaRegion;
 struct ArenaRegion {
     ArenaRegion *next;
@@ -147,6 +163,12 @@ typedef struct Arena {
     ArenaRegion *end;
 } Arena;
 
+// Where the arena was at some point, everything allocated after it can be given back at once
+typedef struct ArenaMark {
+    ArenaRegion *region;
+    ut_size count;
+} ArenaMark;
+
 typedef struct StringView {
     const char *data;
     ut_size count;
@@ -205,6 +227,9 @@ UTDEF void destroy_arena_region(ArenaRegion *region);
 UTDEF void *arena_malloc(Arena *a, ut_size size);
 UTDEF void  arena_free(Arena *a);
 UTDEF void  arena_reset(Arena *a);
+UTDEF ArenaMark arena_mark(Arena *a);
+// Allocations made since `mark` must not be used anymore, the regions are kept for the next ones
+UTDEF void  arena_rewind(Arena *a, ArenaMark mark);
 
 UTDEF ut_bool ut_isalpha(char ch);
 UTDEF ut_bool ut_isspace(char ch);
@@ -214,6 +239,28 @@ UTDEF ut_size ut_strlen(const char *cstr);
 UTDEF void *ut_memcpy(void *dst, const void *src, ut_size size);
 UTDEF void *ut_memset(void *dst, const int val, ut_size size);
 
+// The bulk routines (memory, string views and the span scanners below) use SIMD when the CPU supports
+// it. The level is picked at runtime, every kernel has a scalar fallback that gives the same result.
+typedef enum SimdLevel {
+    UT_SIMD_SCALAR = 0,
+    UT_SIMD_SSE2,
+    UT_SIMD_AVX2,
+} SimdLevel;
+
+UTDEF SimdLevel ut_simd_level(void);
+UTDEF SimdLevel ut_simd_supported_level(void);
+// Caps the level used from now on, mostly to compare them. Can't go above what the CPU supports.
+UTDEF void ut_simd_force_level(SimdLevel level);
+UTDEF const char *ut_simd_level_name(SimdLevel level);
+
+// Length of the run of `data` made of ' ', '\t', '\n' and '\r'. Also counts the newlines in it and
+// sets `line_start` to the index right after the last one, which is left alone if there's none.
+UTDEF ut_size ut_span_space(const char *data, ut_size count, ut_size *newlines, ut_size *line_start);
+// Length of the run of `data` made of [A-Za-z0-9_]
+UTDEF ut_size ut_span_ident(const char *data, ut_size count);
+// Length of the run of `data` made of [0-9]
+UTDEF ut_size ut_span_digit(const char *data, ut_size count);
+
 UTDEF void buffer_init(Buffer *buf);
 UTDEF void buffer_append_with_arena(Buffer *buf, const void *data, ut_size datasz, Arena *a);
 UTDEF BufferView buffer_slice(Buffer buf, ut_size start, ut_size size);
@@ -222,12 +269,23 @@ UTDEF BufferView buffer_slice(Buffer buf, ut_size start, ut_size size);
 UTDEF ut_bool buffer_save_to_file(const Buffer buf, const char *file_path);
 UTDEF ut_bool buffer_load_from_file_with_arena(Buffer *buf, const char *file_path, Arena *a);
 UTDEF char *load_file_text_with_arena(const char *file_path, Arena *a);
+// Maps the file instead of reading it so its pages are loaded as they're touched and can be dropped
+// again under memory pressure. Fails on anything that isn't a regular file, or where it isn't supported.
+UTDEF ut_bool map_file_text(MappedFile *file, const char *file_path);
+UTDEF void unmap_file_text(MappedFile *file);
 #endif
 
 #endif // UTILS_H_
 
 #ifdef UTILS_IMPLEMENTATION
 
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define UT_SIMD_X86
+#include <immintrin.h>
+// Only the AVX2 kernels are built for AVX2 so the rest still runs on any x86-64
+#define UT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
 #if ARENA_REGION_BACKEND == ARENA_REGION_BACKEND_LINUX_MMAP
 #include <sys/mman.h>
 
@@ -301,8 +359,192 @@ void arena_reset(Arena *a)
     a->end = a->begin;
 }
 
+ArenaMark arena_mark(Arena *a)
+{
+    ArenaMark mark;
+    mark.region = a->end;
+    mark.count = a->end ? a->end->count : 0;
+    return mark;
+}
+
+void arena_rewind(Arena *a, ArenaMark mark)
+{
+    if(mark.region == UT_NULL) {
+        arena_reset(a);
+        return;
+    }
+
+    mark.region->count = mark.count;
+    for(ArenaRegion *r = mark.region->next; r != UT_NULL; r = r->next) {
+        r->count = 0;
+    }
+    a->end = mark.region;
+}
+
+static int ut__simd_forced = -1;
+
+SimdLevel ut_simd_supported_level(void)
+{
+#ifdef UT_SIMD_X86
+    // Reads what libgcc found out about the CPU at startup, cheap enough to ask on every call
+    if(__builtin_cpu_supports("avx2")) return UT_SIMD_AVX2;
+    return UT_SIMD_SSE2; // part of x86-64
+#else
+    return UT_SIMD_SCALAR;
+#endif
+}
+
+SimdLevel ut_simd_level(void)
+{
+    SimdLevel level = ut_simd_supported_level();
+    if(ut__simd_forced >= 0 && (SimdLevel)ut__simd_forced < level) level = (SimdLevel)ut__simd_forced;
+    return level;
+}
+
+void ut_simd_force_level(SimdLevel level)
+{
+    ut__simd_forced = (int)level;
+}
+
+const char *ut_simd_level_name(SimdLevel level)
+{
+    switch(level) {
+        case UT_SIMD_SCALAR: return "scalar";
+        case UT_SIMD_SSE2: return "sse2";
+        case UT_SIMD_AVX2: return "avx2";
+    }
+    return "unknown";
+}
+
+#ifdef UT_SIMD_X86
+
+static inline __m128i ut__ge_le_sse2(__m128i x, char lo, char hi)
+{
+    // x - lo <= hi - lo as unsigned bytes, there's no unsigned compare so min does it
+    __m128i d = _mm_sub_epi8(x, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8((char)(hi - lo))), d);
+}
+
+static inline __m128i ut__space_sse2(__m128i x)
+{
+    __m128i a = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(x, _mm_set1_epi8('\t')));
+    __m128i b = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(x, _mm_set1_epi8('\r')));
+    return _mm_or_si128(a, b);
+}
+
+static inline __m128i ut__ident_sse2(__m128i x)
+{
+    __m128i alpha = ut__ge_le_sse2(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a', 'z');
+    __m128i digit = ut__ge_le_sse2(x, '0', '9');
+    return _mm_or_si128(_mm_or_si128(alpha, digit), _mm_cmpeq_epi8(x, _mm_set1_epi8('_')));
+}
+
+UT_TARGET_AVX2 static inline __m256i ut__ge_le_avx2(__m256i x, char lo, char hi)
+{
+    __m256i d = _mm256_sub_epi8(x, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8((char)(hi - lo))), d);
+}
+
+UT_TARGET_AVX2 static inline __m256i ut__space_avx2(__m256i x)
+{
+    __m256i a = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\t')));
+    __m256i b = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\r')));
+    return _mm256_or_si256(a, b);
+}
+
+UT_TARGET_AVX2 static inline __m256i ut__ident_avx2(__m256i x)
+{
+    __m256i alpha = ut__ge_le_avx2(_mm256_or_si256(x, _mm256_set1_epi8(0x20)), 'a', 'z');
+    __m256i digit = ut__ge_le_avx2(x, '0', '9');
+    return _mm256_or_si256(_mm256_or_si256(alpha, digit), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('_')));
+}
+
+static void ut__memcpy_sse2(ut_uint8 *dst, const ut_uint8 *src, ut_size size)
+{
+    ut_size i = 0;
+    for(; i + 64 <= size; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + i + 48));
+        _mm_storeu_si128((__m128i *)(dst + i), a);
+        _mm_storeu_si128((__m128i *)(dst + i + 16), b);
+        _mm_storeu_si128((__m128i *)(dst + i + 32), c);
+        _mm_storeu_si128((__m128i *)(dst + i + 48), d);
+    }
+    for(; i + 16 <= size; i += 16) {
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_loadu_si128((const __m128i *)(src + i)));
+    }
+    // The last 16 bytes again, overlapping what's already copied, instead of a byte loop
+    if(i < size) {
+        _mm_storeu_si128((__m128i *)(dst + size - 16), _mm_loadu_si128((const __m128i *)(src + size - 16)));
+    }
+}
+
+UT_TARGET_AVX2 static void ut__memcpy_avx2(ut_uint8 *dst, const ut_uint8 *src, ut_size size)
+{
+    ut_size i = 0;
+    for(; i + 128 <= size; i += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(src + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(src + i + 96));
+        _mm256_storeu_si256((__m256i *)(dst + i), a);
+        _mm256_storeu_si256((__m256i *)(dst + i + 32), b);
+        _mm256_storeu_si256((__m256i *)(dst + i + 64), c);
+        _mm256_storeu_si256((__m256i *)(dst + i + 96), d);
+    }
+    for(; i + 32 <= size; i += 32) {
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+    }
+    if(i < size) {
+        _mm256_storeu_si256((__m256i *)(dst + size - 32), _mm256_loadu_si256((const __m256i *)(src + size - 32)));
+    }
+}
+
+static void ut__memset_sse2(ut_uint8 *dst, ut_uint8 val, ut_size size)
+{
+    __m128i v = _mm_set1_epi8((char)val);
+    ut_size i = 0;
+    for(; i + 64 <= size; i += 64) {
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+        _mm_storeu_si128((__m128i *)(dst + i + 16), v);
+        _mm_storeu_si128((__m128i *)(dst + i + 32), v);
+        _mm_storeu_si128((__m128i *)(dst + i + 48), v);
+    }
+    for(; i + 16 <= size; i += 16) _mm_storeu_si128((__m128i *)(dst + i), v);
+    if(i < size) _mm_storeu_si128((__m128i *)(dst + size - 16), v);
+}
+
+UT_TARGET_AVX2 static void ut__memset_avx2(ut_uint8 *dst, ut_uint8 val, ut_size size)
+{
+    __m256i v = _mm256_set1_epi8((char)val);
+    ut_size i = 0;
+    for(; i + 128 <= size; i += 128) {
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+        _mm256_storeu_si256((__m256i *)(dst + i + 32), v);
+        _mm256_storeu_si256((__m256i *)(dst + i + 64), v);
+        _mm256_storeu_si256((__m256i *)(dst + i + 96), v);
+    }
+    for(; i + 32 <= size; i += 32) _mm256_storeu_si256((__m256i *)(dst + i), v);
+    if(i < size) _mm256_storeu_si256((__m256i *)(dst + size - 32), v);
+}
+
+#endif // UT_SIMD_X86
+
 void *ut_memcpy(void *dst, const void *src, ut_size size)
 {
+#ifdef UT_SIMD_X86
+    // Every kernel finishes with one overlapping store, so they need at least a whole register
+    if(size >= 32 && ut_simd_level() == UT_SIMD_AVX2) {
+        ut__memcpy_avx2(dst, src, size);
+        return dst;
+    }
+    if(size >= 16 && ut_simd_level() >= UT_SIMD_SSE2) {
+        ut__memcpy_sse2(dst, src, size);
+        return dst;
+    }
+#endif
     for(ut_size i = 0; i < size; ++i) {
         ((ut_uint8 *)dst)[i] = ((const ut_uint8 *)src)[i];
     }
@@ -311,12 +553,150 @@ void *ut_memcpy(void *dst, const void *src, ut_size size)
 
 void *ut_memset(void *dst, const int val, ut_size size)
 {
+#ifdef UT_SIMD_X86
+    if(size >= 32 && ut_simd_level() == UT_SIMD_AVX2) {
+        ut__memset_avx2(dst, (ut_uint8)val, size);
+        return dst;
+    }
+    if(size >= 16 && ut_simd_level() >= UT_SIMD_SSE2) {
+        ut__memset_sse2(dst, (ut_uint8)val, size);
+        return dst;
+    }
+#endif
     for(ut_size i = 0; i < size; ++i) {
         ((ut_uint8 *)dst)[i] = ((const ut_uint8)val);
     }
     return dst;
 }
 
+#ifdef UT_SIMD_X86
+
+// The SIMD scanners go a register at a time while a whole one fits and leave the rest to the scalar
+// loops, so nothing past `count` is ever read. When they stop early the scalar loop stops right away.
+
+static ut_size ut__span_space_sse2(const char *data, ut_size count, ut_size *newlines, ut_size *line_start)
+{
+    ut_size i = 0;
+    for(; i + 16 <= count; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(data + i));
+        ut_uint32 stop = ~(ut_uint32)_mm_movemask_epi8(ut__space_sse2(x)) & 0xFFFF;
+        ut_uint32 lines = (ut_uint32)_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')));
+        if(stop) lines &= ((ut_uint32)1 << __builtin_ctz(stop)) - 1;
+        if(lines) {
+            *newlines += __builtin_popcount(lines);
+            *line_start = i + 32 - __builtin_clz(lines);
+        }
+        if(stop) return i + __builtin_ctz(stop);
+    }
+    return i;
+}
+
+UT_TARGET_AVX2 static ut_size ut__span_space_avx2(const char *data, ut_size count, ut_size *newlines, ut_size *line_start)
+{
+    ut_size i = 0;
+    for(; i + 32 <= count; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(data + i));
+        ut_uint32 stop = ~(ut_uint32)_mm256_movemask_epi8(ut__space_avx2(x));
+        ut_uint32 lines = (ut_uint32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')));
+        if(stop) lines &= ((ut_uint32)1 << __builtin_ctz(stop)) - 1;
+        if(lines) {
+            *newlines += __builtin_popcount(lines);
+            *line_start = i + 32 - __builtin_clz(lines);
+        }
+        if(stop) return i + __builtin_ctz(stop);
+    }
+    return i;
+}
+
+static ut_size ut__span_ident_sse2(const char *data, ut_size count)
+{
+    ut_size i = 0;
+    for(; i + 16 <= count; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(data + i));
+        ut_uint32 stop = ~(ut_uint32)_mm_movemask_epi8(ut__ident_sse2(x)) & 0xFFFF;
+        if(stop) return i + __builtin_ctz(stop);
+    }
+    return i;
+}
+
+UT_TARGET_AVX2 static ut_size ut__span_ident_avx2(const char *data, ut_size count)
+{
+    ut_size i = 0;
+    for(; i + 32 <= count; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(data + i));
+        ut_uint32 stop = ~(ut_uint32)_mm256_movemask_epi8(ut__ident_avx2(x));
+        if(stop) return i + __builtin_ctz(stop);
+    }
+    return i;
+}
+
+static ut_size ut__span_digit_sse2(const char *data, ut_size count)
+{
+    ut_size i = 0;
+    for(; i + 16 <= count; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(data + i));
+        ut_uint32 stop = ~(ut_uint32)_mm_movemask_epi8(ut__ge_le_sse2(x, '0', '9')) & 0xFFFF;
+        if(stop) return i + __builtin_ctz(stop);
+    }
+    return i;
+}
+
+UT_TARGET_AVX2 static ut_size ut__span_digit_avx2(const char *data, ut_size count)
+{
+    ut_size i = 0;
+    for(; i + 32 <= count; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(data + i));
+        ut_uint32 stop = ~(ut_uint32)_mm256_movemask_epi8(ut__ge_le_avx2(x, '0', '9'));
+        if(stop) return i + __builtin_ctz(stop);
+    }
+    return i;
+}
+
+#endif // UT_SIMD_X86
+
+ut_size ut_span_space(const char *data, ut_size count, ut_size *newlines, ut_size *line_start)
+{
+    UT_ASSERT(newlines);
+    UT_ASSERT(line_start);
+    ut_size i = 0;
+#ifdef UT_SIMD_X86
+    SimdLevel level = ut_simd_level();
+    if(level == UT_SIMD_AVX2) i = ut__span_space_avx2(data, count, newlines, line_start);
+    else if(level == UT_SIMD_SSE2) i = ut__span_space_sse2(data, count, newlines, line_start);
+#endif
+    for(; i < count && ut_isspace(data[i]); ++i) {
+        if(data[i] == '\n') {
+            *newlines += 1;
+            *line_start = i + 1;
+        }
+    }
+    return i;
+}
+
+ut_size ut_span_ident(const char *data, ut_size count)
+{
+    ut_size i = 0;
+#ifdef UT_SIMD_X86
+    SimdLevel level = ut_simd_level();
+    if(level == UT_SIMD_AVX2) i = ut__span_ident_avx2(data, count);
+    else if(level == UT_SIMD_SSE2) i = ut__span_ident_sse2(data, count);
+#endif
+    while(i < count && (ut_isalnum(data[i]) || data[i] == '_')) i += 1;
+    return i;
+}
+
+ut_size ut_span_digit(const char *data, ut_size count)
+{
+    ut_size i = 0;
+#ifdef UT_SIMD_X86
+    SimdLevel level = ut_simd_level();
+    if(level == UT_SIMD_AVX2) i = ut__span_digit_avx2(data, count);
+    else if(level == UT_SIMD_SSE2) i = ut__span_digit_sse2(data, count);
+#endif
+    while(i < count && ut_isdigit(data[i])) i += 1;
+    return i;
+}
+
 ut_bool ut_isspace(char ch)
 {
     return (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r');
@@ -395,13 +775,66 @@ int sv_to_int(StringView view)
     return result;
 }
 
+#ifdef UT_SIMD_X86
+
+static ut_size ut__mismatch_sse2(const char *a, const char *b, ut_size count)
+{
+    ut_size i = 0;
+    for(; i + 16 <= count; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        ut_uint32 diff = ~(ut_uint32)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFF;
+        if(diff) return i + __builtin_ctz(diff);
+    }
+    return i;
+}
+
+UT_TARGET_AVX2 static ut_size ut__mismatch_avx2(const char *a, const char *b, ut_size count)
+{
+    ut_size i = 0;
+    for(; i + 32 <= count; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        ut_uint32 diff = ~(ut_uint32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if(diff) return i + __builtin_ctz(diff);
+    }
+    return i;
+}
+
+// Bit n is set when data[i + n] is `first` and data[i + n + distance] is `last`
+static ut_uint32 ut__candidates_sse2(const char *data, ut_size i, char first, char last, ut_size distance)
+{
+    __m128i f = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), _mm_set1_epi8(first));
+    __m128i l = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + distance)), _mm_set1_epi8(last));
+    return (ut_uint32)_mm_movemask_epi8(_mm_and_si128(f, l));
+}
+
+UT_TARGET_AVX2 static ut_uint32 ut__candidates_avx2(const char *data, ut_size i, char first, char last, ut_size distance)
+{
+    __m256i f = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), _mm256_set1_epi8(first));
+    __m256i l = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + distance)), _mm256_set1_epi8(last));
+    return (ut_uint32)_mm256_movemask_epi8(_mm256_and_si256(f, l));
+}
+
+#endif // UT_SIMD_X86
+
+// Index of the first byte where `a` and `b` differ, or `count` if they don't
+static ut_size ut__mismatch(const char *a, const char *b, ut_size count)
+{
+    ut_size i = 0;
+#ifdef UT_SIMD_X86
+    SimdLevel level = ut_simd_level();
+    if(level == UT_SIMD_AVX2) i = ut__mismatch_avx2(a, b, count);
+    else if(level == UT_SIMD_SSE2) i = ut__mismatch_sse2(a, b, count);
+#endif
+    while(i < count && a[i] == b[i]) i += 1;
+    return i;
+}
+
 ut_bool sv_eq(StringView a, StringView b)
 {
     if(a.count != b.count) return ut_false;
-    for(ut_size i = 0; i < a.count; ++i) {
-        if(a.data[i] != b.data[i]) return ut_false;
-    }
-    return ut_true;
+    return ut__mismatch(a.data, b.data, a.count) == a.count;
 }
 
 ut_bool sv_has_prefix(StringView sv, StringView prefix)
@@ -428,21 +861,48 @@ ut_bool sv_has_suffix(StringView sv, StringView suffix)
     return ut_true;
 }
 
+// Start of the `index`th occurrence of `needle` in `sv`, occurrences don't overlap. Only the places
+// where both the first and the last byte of the needle match are compared in full, SIMD finds them
+// a register at a time.
 int sv_find(StringView sv, StringView needle, ut_size index)
 {
+    if(needle.count == 0) return index == 0 ? 0 : -1;
     if(sv.count < needle.count) return -1;
 
-    ut_size j = 0;
+    ut_size end = sv.count - needle.count + 1; // past the last place the needle can start
+    ut_size distance = needle.count - 1;
+    char first = needle.data[0];
+    char last = needle.data[distance];
     ut_size found = 0;
-    for(ut_size i = 0; i < sv.count; ++i) {
-        if(sv.data[i] == needle.data[j]) {
-            j += 1;
-            if(j >= needle.count) {
-                if(found == index) return i - j + 1;
-                found += 1;
-            }
-        } else if(j > 0) {
-            j = 0;
+    ut_size i = 0;
+#ifdef UT_SIMD_X86
+    SimdLevel level = ut_simd_level();
+    ut_size width = level == UT_SIMD_AVX2 ? 32 : level == UT_SIMD_SSE2 ? 16 : 0;
+    while(width > 0 && i + width <= end) {
+        ut_uint32 candidates = level == UT_SIMD_AVX2
+            ? ut__candidates_avx2(sv.data, i, first, last, distance)
+            : ut__candidates_sse2(sv.data, i, first, last, distance);
+        ut_size next = i + width;
+        while(candidates) {
+            ut_size at = i + __builtin_ctz(candidates);
+            candidates &= candidates - 1;
+            if(ut__mismatch(sv.data + at, needle.data, needle.count) != needle.count) continue;
+            if(found == index) return (int)at;
+            found += 1;
+            // Candidates inside the match don't count
+            next = at + needle.count;
+            break;
+        }
+        i = next;
+    }
+#endif
+    while(i < end) {
+        if(sv.data[i] == first && ut__mismatch(sv.data + i, needle.data, needle.count) == needle.count) {
+            if(found == index) return (int)i;
+            found += 1;
+            i += needle.count;
+        } else {
+            i += 1;
         }
     }
 
@@ -491,9 +951,10 @@ ut_bool buffer_save_to_file(const Buffer buf, const char *file_path)
 {
     FILE *f = fopen(file_path, "wb");
     if(!f) return ut_false;
-    fwrite(buf.data, buf.count, 1, f);
-    fclose(f);
-    return ut_true;
+    // A full disk may only show up when the file is flushed
+    ut_bool written = buf.count == 0 || fwrite(buf.data, buf.count, 1, f) == 1;
+    if(fclose(f) != 0) written = ut_false;
+    return written;
 }
 
 ut_bool buffer_load_from_file_with_arena(Buffer *buf, const char *file_path, Arena *a)
@@ -524,27 +985,92 @@ ut_bool buffer_load_from_file_with_arena(Buffer *buf, const char *file_path, Are
 
 char *load_file_text_with_arena(const char *file_path, Arena *a)
 {
-    FILE *f = fopen(file_path, "r");
+    FILE *f = fopen(file_path, "rb");
     if(!f) return UT_NULL;
     ut_size fsz;
     fseek(f, 0, SEEK_END);
     fsz = ftell(f);
     fseek(f, 0, SEEK_SET);
-    void *data = arena_malloc(a, fsz);
+    char *data = arena_malloc(a, fsz + 1);
     if(!data) {
         fclose(f);
         return UT_NULL;
     }
 
     ut_size rsz = fread(data, 1, fsz, f);
+    fclose(f);
     if(rsz != fsz) {
-        fclose(f);
         return UT_NULL;
     }
 
+    data[fsz] = '\0';
     return data;
 }
 
+#if defined(UT_TARGET_LINUX)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+ut_bool map_file_text(MappedFile *file, const char *file_path)
+{
+    int fd = open(file_path, O_RDONLY);
+    if(fd < 0) return ut_false;
+    struct stat st;
+    if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return ut_false;
+    }
+
+    // One page more than the file is reserved first and the file is mapped over the start of it,
+    // so there's always a zeroed page right after the file for the terminating 0. Even when the
+    // file ends right on a page boundary.
+    ut_size size = (ut_size)st.st_size;
+    ut_size page = (ut_size)sysconf(_SC_PAGESIZE);
+    ut_size mapping_size = (size/page + 1)*page;
+    void *mapping = mmap(UT_NULL, mapping_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mapping == MAP_FAILED) {
+        close(fd);
+        return ut_false;
+    }
+    if(size > 0 && mmap(mapping, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(mapping, mapping_size);
+        close(fd);
+        return ut_false;
+    }
+    close(fd);
+    if(size > 0) madvise(mapping, size, MADV_SEQUENTIAL);
+
+    file->data = mapping;
+    file->count = size;
+    file->mapping = mapping;
+    file->mapping_size = mapping_size;
+    return ut_true;
+}
+
+void unmap_file_text(MappedFile *file)
+{
+    if(file->mapping) munmap(file->mapping, file->mapping_size);
+    file->data = UT_NULL;
+    file->count = 0;
+    file->mapping = UT_NULL;
+    file->mapping_size = 0;
+}
+#else
+ut_bool map_file_text(MappedFile *file, const char *file_path)
+{
+    (void)file;
+    (void)file_path;
+    return ut_false;
+}
+
+void unmap_file_text(MappedFile *file)
+{
+    (void)file;
+}
+#endif
+
 #endif
 
 #endif // UTILS_IMPLEMENTATION